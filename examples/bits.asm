@@ -0,0 +1,34 @@
+; Sums the population counts of 1..#r7 into #r6 and mixes the numbers into a hash in #r5
+; Bitwise operations
+
+mov #r7, 100000 ; upper bound
+mov #r6, 0      ; popcount sum
+mov #r5, 0      ; hash
+mov #r1, 1
+
+%outer
+  mov #r0, #r1
+
+%count
+  cmp #r0, #r0
+  jz %mix
+  and #r2, #r0, 1
+  add #r6, #r6, #r2
+  shr #r0, #r0, 1
+  jmp %count
+
+%mix
+  xor #r5, #r5, #r1
+  shl #r4, #r5, 5
+  shr #r3, #r5, 2
+  or #r4, #r4, #r3
+  and #r5, #r4, 65535
+  not #r3, #r5
+
+  cmp #r1, #r7
+  je %finish
+  inc #r1
+  jmp %outer
+
+%finish
+  exit 0
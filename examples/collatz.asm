@@ -0,0 +1,36 @@
+; Sums the Collatz stopping times of all numbers below #r7 into #r6
+; Data dependent branches, multiplication and shifts
+
+mov #r7, 30000 ; upper bound
+mov #r6, 0     ; total steps
+mov #r5, 1
+mov #r1, 1     ; current start value
+
+%outer
+  cmp #r1, #r7
+  je %finish
+  mov #r0, #r1
+
+%inner
+  cmp #r0, #r5
+  je %next
+  inc #r6
+
+  and #r2, #r0, 1
+  cmp #r2, #r2
+  jz %even
+
+  mul #r0, #r0, 3
+  inc #r0
+  jmp %inner
+
+%even
+  shr #r0, #r0, 1
+  jmp %inner
+
+%next
+  inc #r1
+  jmp %outer
+
+%finish
+  exit 0
@@ -0,0 +1,27 @@
+; Calculates the 90th fibonacci number 20000 times, the result ends up in #r0
+; Mostly moves, adds and the count down loop pattern
+
+mov #r6, 20000 ; repetitions
+
+%repeat
+  cmp #r6, #r6
+  jz %finish
+  dec #r6
+
+  mov #r0, 0
+  mov #r1, 1
+  mov #r7, 90 ; nth fib to calculate
+
+%loop
+  cmp #r7, #r7
+  jz %repeat
+  dec #r7
+
+  mov #r3, #r1
+  add #r1, #r0, #r1
+  mov #r0, #r3
+
+  jmp %loop
+
+%finish
+  exit 0
@@ -0,0 +1,40 @@
+; Sums gcd(a, b) for all 1 <= a, b <= #r7 into #r6 using repeated subtraction
+; Short blocks with hard to predict jg/je chains
+
+mov #r7, 300 ; upper bound
+mov #r6, 0   ; sum
+mov #r1, 1   ; a
+
+%outer
+  mov #r2, 1 ; b
+
+%inner
+  mov #r3, #r1
+  mov #r4, #r2
+
+%gcd
+  cmp #r3, #r4
+  je %found
+  jg %sub_a
+  sub #r4, #r4, #r3
+  jmp %gcd
+
+%sub_a
+  sub #r3, #r3, #r4
+  jmp %gcd
+
+%found
+  add #r6, #r6, #r3
+  cmp #r2, #r7
+  je %next_a
+  inc #r2
+  jmp %inner
+
+%next_a
+  cmp #r1, #r7
+  je %finish
+  inc #r1
+  jmp %outer
+
+%finish
+  exit 0
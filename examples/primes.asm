@@ -0,0 +1,34 @@
+; Counts the primes below #r7 by trial division, the count ends up in #r6 (669)
+; Division heavy
+
+mov #r7, 5000 ; upper bound
+mov #r6, 0    ; number of primes
+mov #r1, 2    ; candidate
+
+%candidate
+  cmp #r1, #r7
+  je %finish
+  mov #r2, 2  ; divisor
+
+%trial
+  mul #r3, #r2, #r2
+  cmp #r3, #r1
+  jg %prime
+
+  div #r4, #r1, #r2
+  mul #r4, #r4, #r2
+  cmp #r4, #r1
+  je %composite
+
+  inc #r2
+  jmp %trial
+
+%prime
+  inc #r6
+
+%composite
+  inc #r1
+  jmp %candidate
+
+%finish
+  exit 0
@@ -1,9 +1,7 @@
 #include "assembler.h"
 
-#include <assert.h>
-#include <ctype.h>
 #include <limits.h>
-#include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -11,11 +9,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "compress.h"
 #include "error.h"
+#include "labels.h"
+#include "optimizer.h"
+#include "scan.h"
 #include "vm.h"
 
-#define ARR_SIZE 1024
+// sources smaller than this per available core are not split into more chunks
+#define ASM_MIN_CHUNK_SIZE (1 << 20)
+#define ASM_MAX_THREADS 64
+// macro invocations and `.rept` blocks nested deeper than this are reported as errors
+#define ASM_MAX_EXPANSION_DEPTH 64
+#define ASM_MAX_MACRO_PARAMS 16
+
+// largest positive immediate of a signed field
+#define IMM_MAX(_field) (((VmWord)1 << ((_field).bit_count - 1)) - 1)
 
 #define SYNTAX_ERR_IF(_ctx, _cond, _err_loc_first_char, _err_loc_last_char, _fmt, ...)      \
   do {                                                                                      \
@@ -28,8 +39,8 @@
 #define EXPECT_TOK(_ctx, _expected_ty, _allow_comma_before, _tok_out, _fmt, ...)              \
   do {                                                                                        \
     int tmp_ret_code;                                                                         \
-    if ((tmp_ret_code = get_next_tok(_ctx, &_tok_out, _allow_comma_before)) != 0) {           \
-      char *last_char = _ctx->file_first_char + strlen(_ctx->file_first_char) - 1;            \
+    if ((tmp_ret_code = get_next_operand(_ctx, &_tok_out, _allow_comma_before)) != 0) {       \
+      char *last_char = _ctx->file_end - 1;                                                   \
       SYNTAX_ERR_IF(_ctx, tmp_ret_code == RET_CODE_NORET, last_char, last_char, _fmt,         \
                     ##__VA_ARGS__);                                                           \
       return tmp_ret_code;                                                                    \
@@ -38,11 +49,23 @@
                   _fmt, ##__VA_ARGS__);                                                       \
   } while (0)
 
+// any token, for operands whose type is checked later
+#define EXPECT_TOK_ANY(_ctx, _allow_comma_before, _tok_out, _fmt, ...)                  \
+  do {                                                                                  \
+    int tmp_ret_code;                                                                   \
+    if ((tmp_ret_code = get_next_operand(_ctx, &_tok_out, _allow_comma_before)) != 0) { \
+      char *last_char = _ctx->file_end - 1;                                             \
+      SYNTAX_ERR_IF(_ctx, tmp_ret_code == RET_CODE_NORET, last_char, last_char, _fmt,   \
+                    ##__VA_ARGS__);                                                     \
+      return tmp_ret_code;                                                              \
+    }                                                                                   \
+  } while (0)
+
 #define EXPECT_IMM_OR_REG(_ctx, _name, _max_size, _tok_out)                                       \
   do {                                                                                            \
     int tmp_ret_code;                                                                             \
-    if ((tmp_ret_code = get_next_tok(_ctx, &_tok_out, true)) != 0) {                              \
-      char *last_char = _ctx->file_first_char + strlen(_ctx->file_first_char) - 1;                \
+    if ((tmp_ret_code = get_next_operand(_ctx, &_tok_out, true)) != 0) {                          \
+      char *last_char = _ctx->file_end - 1;                                                       \
       SYNTAX_ERR_IF(_ctx, tmp_ret_code == RET_CODE_NORET, last_char, last_char,                   \
                     "Expected an immidiate or source register");                                  \
       return tmp_ret_code;                                                                        \
@@ -59,8 +82,8 @@
 #define EXPECT_ADDR_OR_LABEL(_ctx, _name, _max_size, _tok_out)                                   \
   do {                                                                                           \
     int tmp_ret_code;                                                                            \
-    if ((tmp_ret_code = get_next_tok(_ctx, &_tok_out, true)) != 0) {                             \
-      char *last_char = _ctx->file_first_char + strlen(_ctx->file_first_char) - 1;               \
+    if ((tmp_ret_code = get_next_operand(_ctx, &_tok_out, true)) != 0) {                         \
+      char *last_char = _ctx->file_end - 1;                                                      \
       SYNTAX_ERR_IF(_ctx, tmp_ret_code == RET_CODE_NORET, last_char, last_char,                  \
                     "Expected an address or label");                                             \
       return tmp_ret_code;                                                                       \
@@ -78,7 +101,9 @@ enum TokenType {
   TT_IDENT,
   TT_NUM,
   TT_REGISTER,
+  TT_VREGISTER,
   TT_LABEL,
+  TT_DIRECTIVE,
 };
 
 typedef struct {
@@ -86,20 +111,10 @@ typedef struct {
   char *last_char;
   int ty;
   VmWord i64;
+  // label name, only differs from the source text for labels local to an expansion
+  StrSlice name;
 } Token;
 
-typedef struct {
-  char *first_char;
-  char *last_char;
-} StrSlice;
-
-typedef struct {
-  char *curr_pos;
-  char *file_first_char;
-  char *filename;
-  InstsOut *insts_out;
-} CompileCtx;
-
 typedef struct {
   // field to put the address diff
   InstField field_to_patch;
@@ -107,37 +122,108 @@ typedef struct {
   size_t inst_off_to_patch;
 } LabelPatch;
 
-static StrSlice label_names[ARR_SIZE];
-static VmWord label_locs[ARR_SIZE];
-static int label_count;
+typedef struct {
+  StrSlice name;
+  // operand in the source, for diagnostics
+  StrSlice src;
+  LabelPatch patch;
+} LabelRef;
 
-static StrSlice unresolved_label_names[ARR_SIZE];
-static LabelPatch unresolved_label_patches[ARR_SIZE];
-static int unresolved_label_count;
+typedef struct {
+  StrSlice name;
+  StrSlice params[ASM_MAX_MACRO_PARAMS];
+  int param_count;
+  char *body_first;
+  char *body_end;
+} Macro;
+
+// macro invocation (`macro` set) or `.rept` block being assembled
+typedef struct {
+  Macro *macro;
+  Token args[ASM_MAX_MACRO_PARAMS];
+  StrSlice counter_name;  // empty if the `.rept` has no counter
+  VmWord counter;
+  VmWord count;
+
+  char *body_first;
+  char *body_end;
+  // where assembling continues once the expansion is done
+  char *return_pos;
+  char *return_end;
+  // numbers labels local to the expansion, every `.rept` iteration gets a new one
+  size_t id;
+} Expansion;
 
-void add_label(CompileCtx *ctx, StrSlice label_name) {
-  assert(label_count < ARR_SIZE);
-  label_names[label_count] = label_name;
-  label_locs[label_count++] = ctx->insts_out->size;
-}
+typedef struct {
+  char *curr_pos;
+  // start of the whole source, diagnostics count lines from here
+  char *file_first_char;
+  // end of the part to assemble, the terminating null character unless assembling a chunk
+  char *file_end;
+  char *filename;
+  InstsOut *insts_out;
+  // names `hcall` resolves against, may be NULL
+  const VmHostFns *host_fns;
+
+  LabelTable labels;
+  // label operands are all patched once every label is known
+  LabelRef *label_refs;
+  size_t label_ref_count;
+  size_t label_ref_capacity;
+
+  // `get_next_tok` ran into `file_end`
+  bool reached_end;
+
+  // directives change how the rest of the source assembles, so only the serial assembler takes
+  // them; chunks stop at the first one
+  bool allow_directives;
+  bool found_directive;
+  LabelTable consts;
+  // macro names to indices into `macros`
+  LabelTable macro_names;
+  Macro *macros;
+  size_t macro_count;
+  size_t macro_capacity;
+
+  // innermost last, `curr_pos` and `file_end` point into the body of the innermost one
+  Expansion *expansions;
+  size_t expansion_depth;
+  size_t expansion_count;
+  // bodies are only tokenized while they are recorded, nothing is substituted or evaluated
+  bool skipping;
+  // names of labels local to an expansion, the label tables point into them
+  char **local_names;
+  size_t local_name_count;
+  size_t local_name_capacity;
+} CompileCtx;
 
-void add_unresolved_label(StrSlice label_name, LabelPatch patch) {
-  assert(unresolved_label_count < ARR_SIZE);
-  unresolved_label_names[unresolved_label_count] = label_name;
-  unresolved_label_patches[unresolved_label_count++] = patch;
+int add_label(CompileCtx *ctx, StrSlice label_name) {
+  return label_table_add(&ctx->labels, label_name, ctx->insts_out->size);
 }
 
-bool str_slice_eq(StrSlice s1, StrSlice s2) {
-  if (s1.last_char - s1.first_char != s2.last_char - s2.first_char) return false;
+int add_label_ref(CompileCtx *ctx, Token label, LabelPatch patch) {
+  if (ctx->label_ref_count == ctx->label_ref_capacity) {
+    size_t capacity = ctx->label_ref_capacity ? ctx->label_ref_capacity * 2 : 64;
+    LabelRef *label_refs = realloc(ctx->label_refs, capacity * sizeof(LabelRef));
+    ERR_IF(!label_refs, "Memory error: Could not allocate memory for labels");
+    ctx->label_refs = label_refs;
+    ctx->label_ref_capacity = capacity;
+  }
 
-  return strncmp(s1.first_char, s2.first_char, s1.last_char - s1.first_char) == 0;
+  ctx->label_refs[ctx->label_ref_count++] =
+      (LabelRef){.name = label.name, .src = {label.first_char, label.last_char}, .patch = patch};
+  return RET_CODE_OK;
 }
 
-VmWord get_label_loc(StrSlice label_name) {
-  for (int i = 0; i < label_count; i++)
-    if (str_slice_eq(label_names[i], label_name)) return label_locs[i];
-
-  return -1;
+void compile_ctx_free(CompileCtx *ctx) {
+  label_table_free(&ctx->labels);
+  free(ctx->label_refs);
+  label_table_free(&ctx->consts);
+  label_table_free(&ctx->macro_names);
+  free(ctx->macros);
+  free(ctx->expansions);
+  for (size_t i = 0; i < ctx->local_name_count; i++) free(ctx->local_names[i]);
+  free(ctx->local_names);
 }
 
 void get_curr_pos_loc(char *curr_pos, char *file_first_char, int *line_num_out, int *col_num_out) {
@@ -158,9 +244,9 @@ void get_curr_pos_loc(char *curr_pos, char *file_first_char, int *line_num_out,
 
 void vprint_syntax_err(CompileCtx *ctx, char *err_loc_first_char, char *err_loc_last_char,
                        char *fmt, va_list args) {
-  fprintf(stderr, "Assembler error: ");
-  vfprintf(stderr, fmt, args);
-  fputc('\n', stderr);
+  err_printf("Assembler error: ");
+  err_vprintf(fmt, args);
+  err_printf("\n");
 
   char *first_ln_char = err_loc_first_char;
   while (first_ln_char > ctx->file_first_char && first_ln_char[-1] != '\n') first_ln_char--;
@@ -170,16 +256,15 @@ void vprint_syntax_err(CompileCtx *ctx, char *err_loc_first_char, char *err_loc_
 
   int ln, col;
   get_curr_pos_loc(err_loc_first_char, ctx->file_first_char, &ln, &col);
-  int off = fprintf(stderr, "%s %d:%d: ", ctx->filename, ln, col);
-  fprintf(stderr, "%.*s\n", (int)(ln_end - first_ln_char), first_ln_char);
+  int off = err_printf("%s %d:%d: ", ctx->filename, ln, col);
+  err_printf("%.*s\n", (int)(ln_end - first_ln_char), first_ln_char);
 
-  for (int i = 0; i < off; i++) fputc(' ', stderr);
+  for (int i = 0; i < off; i++) err_printf(" ");
 
-  for (char *p = first_ln_char; p < err_loc_first_char; p++)
-    fputc((*p == '\t') ? '\t' : ' ', stderr);
-  fputc('^', stderr);
-  for (char *p = err_loc_first_char + 1; p <= err_loc_last_char; p++) fputc('~', stderr);
-  fprintf(stderr, "\n");
+  for (char *p = first_ln_char; p < err_loc_first_char; p++) err_printf((*p == '\t') ? "\t" : " ");
+  err_printf("^");
+  for (char *p = err_loc_first_char + 1; p <= err_loc_last_char; p++) err_printf("~");
+  err_printf("\n");
 }
 
 void print_syntax_err(CompileCtx *ctx, char *err_loc_first_char, char *err_loc_last_char, char *fmt,
@@ -190,10 +275,6 @@ void print_syntax_err(CompileCtx *ctx, char *err_loc_first_char, char *err_loc_l
   va_end(args);
 }
 
-bool is_ident(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
-
-bool is_hex(char c) { return isdigit(c) || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f'); }
-
 char *extend_num_err(char *curr_pos) {
   bool allow_hex = false;
 
@@ -204,105 +285,353 @@ char *extend_num_err(char *curr_pos) {
     curr_pos += 2;
   }
 
-  while (isdigit(*curr_pos) || (allow_hex && is_hex(*curr_pos))) curr_pos++;
+  while (CHAR_IS(*curr_pos, allow_hex ? CC_HEX : CC_DIGIT)) curr_pos++;
 
   return curr_pos - 1;
 }
 
+bool is_tok_end(char c) { return CHAR_IS(c, CC_SPACE) || c == ',' || c == ';' || c == '\0'; }
+
+// replaces a macro parameter by its argument and a `.rept` counter by its value; a macro body only
+// sees its own parameters, not the names of the expansion it was invoked from
+bool substitute_tok(CompileCtx *ctx, Token *tok) {
+  StrSlice name = {tok->first_char, tok->last_char};
+
+  for (size_t i = ctx->expansion_depth; i-- > 0;) {
+    Expansion *expansion = &ctx->expansions[i];
+
+    if (!expansion->macro) {
+      if (expansion->counter_name.first_char && str_slice_eq(expansion->counter_name, name)) {
+        tok->ty = TT_NUM;
+        tok->i64 = expansion->counter;
+        return true;
+      }
+      continue;
+    }
+
+    for (int p = 0; p < expansion->macro->param_count; p++) {
+      if (str_slice_eq(expansion->macro->params[p], name)) {
+        *tok = expansion->args[p];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  return false;
+}
+
+// `%name@` becomes `%name@<expansion id>`, so every expansion has its own copy of the label
+int local_label_name(CompileCtx *ctx, StrSlice name, StrSlice *local_out) {
+  if (ctx->local_name_count == ctx->local_name_capacity) {
+    size_t capacity = ctx->local_name_capacity ? ctx->local_name_capacity * 2 : 64;
+    char **local_names = realloc(ctx->local_names, capacity * sizeof(char *));
+    ERR_IF(!local_names, "Memory error: Could not allocate memory for labels");
+    ctx->local_names = local_names;
+    ctx->local_name_capacity = capacity;
+  }
+
+  size_t id = ctx->expansions[ctx->expansion_depth - 1].id;
+  int name_len = name.last_char - name.first_char + 1;
+  int len = snprintf(NULL, 0, "%.*s@%zu", name_len, name.first_char, id);
+  char *local = malloc(len + 1);
+  ERR_IF(!local, "Memory error: Could not allocate memory for labels");
+
+  snprintf(local, len + 1, "%.*s@%zu", name_len, name.first_char, id);
+  ctx->local_names[ctx->local_name_count++] = local;
+  *local_out = (StrSlice){local, local + len - 1};
+  return RET_CODE_OK;
+}
+
+// binding strength of the binary operator at `pos`, 0 if there is none
+int expr_binop_prec(char *pos, char *end, int *len_out) {
+  *len_out = 1;
+  if (pos == end) return 0;
+
+  if (end - pos >= 2 && (memcmp(pos, "<<", 2) == 0 || memcmp(pos, ">>", 2) == 0)) {
+    *len_out = 2;
+    return 4;
+  }
+
+  switch (*pos) {
+    case '*':
+    case '/':
+    case '%':
+      return 6;
+    case '+':
+    case '-':
+      return 5;
+    case '&':
+      return 3;
+    case '^':
+      return 2;
+    case '|':
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+int parse_expr(CompileCtx *ctx, char **pos, int min_prec, VmWord *value_out);
+
+int parse_expr_operand(CompileCtx *ctx, char **pos, VmWord *value_out) {
+  char *p = scan_space(*pos, ctx->file_end);
+  int tmp_ret_code;
+
+  SYNTAX_ERR_IF(ctx, p == ctx->file_end, ctx->file_end - 1, ctx->file_end - 1,
+                "Expected an operand in the expression");
+
+  if (*p == '(') {
+    *pos = p + 1;
+    if ((tmp_ret_code = parse_expr(ctx, pos, 1, value_out)) != 0) return tmp_ret_code;
+
+    p = scan_space(*pos, ctx->file_end);
+    SYNTAX_ERR_IF(ctx, p == ctx->file_end || *p != ')', p == ctx->file_end ? p - 1 : p,
+                  p == ctx->file_end ? p - 1 : p, "Expected ')'");
+    *pos = p + 1;
+    return RET_CODE_OK;
+  }
+
+  if (*p == '-' || *p == '~' || *p == '+') {
+    VmWord value;
+    *pos = p + 1;
+    if ((tmp_ret_code = parse_expr_operand(ctx, pos, &value)) != 0) return tmp_ret_code;
+
+    *value_out = *p == '-' ? (VmWord)(0 - (uint64_t)value) : *p == '~' ? ~value : value;
+    return RET_CODE_OK;
+  }
+
+  if (CHAR_IS(*p, CC_DIGIT)) {
+    char *num_end;
+    VmWord value = strtoll(p, &num_end, 0);
+    SYNTAX_ERR_IF(ctx, value == LLONG_MAX || value == LLONG_MIN, p, num_end - 1, "Number overflow");
+
+    *value_out = value;
+    *pos = num_end;
+    return RET_CODE_OK;
+  }
+
+  if (CHAR_IS(*p, CC_IDENT_START)) {
+    char *ident_end = scan_ident(p + 1, ctx->file_end);
+    Token tok = {.first_char = p, .last_char = ident_end - 1, .ty = TT_IDENT};
+    Label *constant = label_table_lookup(&ctx->consts, (StrSlice){p, ident_end - 1});
+
+    if (substitute_tok(ctx, &tok)) {
+      SYNTAX_ERR_IF(ctx, tok.ty != TT_NUM, p, ident_end - 1, "'%.*s' is not a number",
+                    (int)(ident_end - p), p);
+      *value_out = tok.i64;
+    }
+    else {
+      SYNTAX_ERR_IF(ctx, !constant, p, ident_end - 1, "Unknown constant '%.*s'",
+                    (int)(ident_end - p), p);
+      *value_out = constant->loc;
+    }
+
+    *pos = ident_end;
+    return RET_CODE_OK;
+  }
+
+  print_syntax_err(ctx, p, p, "Expected an operand in the expression");
+  return RET_CODE_ERR;
+}
+
+// precedence climbing over the C operators, all arithmetic wraps around at 64 bits
+int parse_expr(CompileCtx *ctx, char **pos, int min_prec, VmWord *value_out) {
+  VmWord lhs;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = parse_expr_operand(ctx, pos, &lhs)) != 0) return tmp_ret_code;
+
+  for (;;) {
+    char *op = scan_space(*pos, ctx->file_end);
+    int op_len;
+    int prec = expr_binop_prec(op, ctx->file_end, &op_len);
+    VmWord rhs;
+
+    if (!prec || prec < min_prec) break;
+
+    *pos = op + op_len;
+    if ((tmp_ret_code = parse_expr(ctx, pos, prec + 1, &rhs)) != 0) return tmp_ret_code;
+
+    if (*op == '/' || *op == '%') {
+      SYNTAX_ERR_IF(ctx, rhs == 0, op, op, "Division by zero in constant expression");
+      // the only quotient that does not fit
+      if (rhs == -1)
+        lhs = *op == '/' ? (VmWord)(0 - (uint64_t)lhs) : 0;
+      else
+        lhs = *op == '/' ? lhs / rhs : lhs % rhs;
+      continue;
+    }
+
+    if (op_len == 2) {
+      SYNTAX_ERR_IF(ctx, rhs < 0 || rhs > 63, op, op + 1, "Shift amount has to be between 0 and 63");
+      lhs = *op == '<' ? (VmWord)((uint64_t)lhs << rhs) : lhs >> rhs;
+      continue;
+    }
+
+    switch (*op) {
+      case '*':
+        lhs = (VmWord)((uint64_t)lhs * (uint64_t)rhs);
+        break;
+      case '+':
+        lhs = (VmWord)((uint64_t)lhs + (uint64_t)rhs);
+        break;
+      case '-':
+        lhs = (VmWord)((uint64_t)lhs - (uint64_t)rhs);
+        break;
+      case '&':
+        lhs &= rhs;
+        break;
+      case '^':
+        lhs ^= rhs;
+        break;
+      case '|':
+        lhs |= rhs;
+        break;
+    }
+  }
+
+  *value_out = lhs;
+  return RET_CODE_OK;
+}
+
+// end of the parenthesized expression at `pos` without evaluating it
+char *skip_expr(char *pos, char *end) {
+  int depth = 0;
+
+  for (; pos < end; pos++) {
+    if (*pos == '(') depth++;
+    if (*pos == ')' && --depth == 0) return pos + 1;
+  }
+  return NULL;
+}
+
 int get_next_tok(CompileCtx *ctx, Token *tok_out, bool allow_comma_before) {
   bool has_comma_before = false;
+  char *pos = ctx->curr_pos;
 
 skip:
-  while (isspace(*ctx->curr_pos) || *ctx->curr_pos == ',') {
-    if (*ctx->curr_pos == ',' && (!allow_comma_before || has_comma_before)) goto unexpected_tok;
-    if (*ctx->curr_pos == ',') has_comma_before = true;
-    ctx->curr_pos++;
+  pos = scan_space(pos, ctx->file_end);
+
+  // `file_end` is not null terminated when assembling a chunk or an expansion
+  if (pos == ctx->file_end) {
+    ctx->curr_pos = pos;
+    if (!ctx->expansion_depth) ctx->reached_end = true;
+    return RET_CODE_NORET;
   }
 
-  if (*ctx->curr_pos == ';') {
-    while (*ctx->curr_pos != '\n' && *ctx->curr_pos != 0) ctx->curr_pos++;
-    goto skip;  // skip again
+  if (*pos == ',') {
+    ctx->curr_pos = pos;
+    if (!allow_comma_before || has_comma_before) goto unexpected_tok;
+    has_comma_before = true;
+    pos++;
+    goto skip;
   }
 
-  if (!*ctx->curr_pos) return RET_CODE_NORET;
+  if (*pos == ';') {
+    pos = scan_line_end(pos, ctx->file_end);
+    goto skip;  // skip again
+  }
 
-  char *ident_first_char = ctx->curr_pos;
-  char *ident_last_char = NULL;
+  ctx->curr_pos = pos;
+  if (CHAR_IS(*pos, CC_IDENT_START)) {
+    char *ident_end = scan_ident(pos + 1, ctx->file_end);
+    *tok_out = (Token){.first_char = pos, .last_char = ident_end - 1, .ty = TT_IDENT};
+    if (!ctx->skipping) substitute_tok(ctx, tok_out);
+    ctx->curr_pos = ident_end;
+    return RET_CODE_OK;
+  }
 
-  while (is_ident(*ctx->curr_pos)) {
-    ident_last_char = ctx->curr_pos;
-    ctx->curr_pos++;
+  if (*pos == '.' && pos + 1 < ctx->file_end && CHAR_IS(pos[1], CC_IDENT_START)) {
+    char *directive_end = scan_ident(pos + 1, ctx->file_end);
+    *tok_out = (Token){.first_char = pos, .last_char = directive_end - 1, .ty = TT_DIRECTIVE};
+    ctx->curr_pos = directive_end;
+    return RET_CODE_OK;
   }
 
-  if (*ctx->curr_pos == '%') {
-    char *label_first_char = ctx->curr_pos;
-    char *label_last_char = NULL;
+  if (*pos == '%') {
+    char *label_end = scan_ident(pos + 1, ctx->file_end);
+    StrSlice name = {pos, label_end - 1};
 
-    ctx->curr_pos++;
+    SYNTAX_ERR_IF(ctx, label_end == pos + 1, label_end, label_end,
+                  "Expected label name after '%%'");
 
-    while (is_ident(*ctx->curr_pos)) {
-      label_last_char = ctx->curr_pos;
-      ctx->curr_pos++;
+    if (label_end < ctx->file_end && *label_end == '@') {
+      SYNTAX_ERR_IF(ctx, !ctx->expansion_depth && !ctx->skipping, pos, label_end,
+                    "Labels ending in '@' are only allowed in '.macro' and '.rept' bodies");
+      if (!ctx->skipping) {
+        int tmp_ret_code;
+        if ((tmp_ret_code = local_label_name(ctx, name, &name)) != 0) return tmp_ret_code;
+      }
+      label_end++;
     }
 
-    SYNTAX_ERR_IF(ctx, !label_last_char, ctx->curr_pos, ctx->curr_pos,
-                  "Expected label name after '%'");
     *tok_out = (Token){
-        .first_char = label_first_char,
-        .last_char = label_last_char,
+        .first_char = pos,
+        .last_char = label_end - 1,
         .ty = TT_LABEL,
+        .name = name,
     };
+    ctx->curr_pos = label_end;
     return RET_CODE_OK;
   }
 
-  if (ident_last_char) {
-    *tok_out =
-        (Token){.first_char = ident_first_char, .last_char = ident_last_char, .ty = TT_IDENT};
-    ctx->curr_pos = ident_last_char + 1;
+  if (*pos == '(') {
+    char *expr_end = skip_expr(pos, ctx->file_end);
+    VmWord value = 0;
+
+    SYNTAX_ERR_IF(ctx, !expr_end, pos, pos, "Missing ')' for '('");
+    SYNTAX_ERR_IF(ctx, expr_end < ctx->file_end && !is_tok_end(*expr_end), expr_end, expr_end,
+                  "Expected whitespace or comma after expression");
+
+    if (!ctx->skipping) {
+      int tmp_ret_code;
+      char *expr_pos = pos;
+      if ((tmp_ret_code = parse_expr(ctx, &expr_pos, 1, &value)) != 0) return tmp_ret_code;
+    }
+
+    *tok_out = (Token){.first_char = pos, .last_char = expr_end - 1, .ty = TT_NUM, .i64 = value};
+    ctx->curr_pos = expr_end;
     return RET_CODE_OK;
   }
 
-  if (*ctx->curr_pos == '#') {
-    size_t rem_len = strlen(ctx->curr_pos);
-    SYNTAX_ERR_IF(ctx, rem_len < 3, ctx->curr_pos, ctx->curr_pos, "Expected register after '#'");
-    SYNTAX_ERR_IF(ctx, ctx->curr_pos[1] != 'r', ctx->curr_pos + 1, ctx->curr_pos + 1,
+  if (*pos == '#') {
+    SYNTAX_ERR_IF(ctx, !pos[1] || !pos[2], pos, pos, "Expected register after '#'");
+    SYNTAX_ERR_IF(ctx, pos[1] != 'r' && pos[1] != 'v', pos + 1, pos + 1,
                   "Expected register after '#'");
-    SYNTAX_ERR_IF(ctx, !isdigit(ctx->curr_pos[2]), ctx->curr_pos + 2, ctx->curr_pos + 2,
-                  "Invalid register number '%c'", ctx->curr_pos[2]);
-    SYNTAX_ERR_IF(ctx, ctx->curr_pos[2] > '7', ctx->curr_pos + 2, ctx->curr_pos + 2,
-                  "Invalid register number '%c'", ctx->curr_pos[2]);
-    SYNTAX_ERR_IF(ctx, rem_len > 3 && !isspace(ctx->curr_pos[3]) && ctx->curr_pos[3] != ',',
-                  ctx->curr_pos + 3, ctx->curr_pos + 3,
+    SYNTAX_ERR_IF(ctx, !CHAR_IS(pos[2], CC_DIGIT) || pos[2] > '7', pos + 2, pos + 2,
+                  "Invalid register number '%c'", pos[2]);
+    SYNTAX_ERR_IF(ctx, !is_tok_end(pos[3]), pos + 3, pos + 3,
                   "Expected whitespace or comma after register");
-    *tok_out = (Token){.first_char = ctx->curr_pos,
-                       .last_char = ctx->curr_pos + 2,
-                       .ty = TT_REGISTER,
-                       .i64 = ctx->curr_pos[2] - '0'};
-    ctx->curr_pos += 3;
+    *tok_out = (Token){.first_char = pos,
+                       .last_char = pos + 2,
+                       .ty = pos[1] == 'v' ? TT_VREGISTER : TT_REGISTER,
+                       .i64 = pos[2] - '0'};
+    ctx->curr_pos = pos + 3;
     return RET_CODE_OK;
   }
 
-  if (isdigit(*ctx->curr_pos) || *ctx->curr_pos == '-') {
-    SYNTAX_ERR_IF(ctx, *ctx->curr_pos == '-' && !isdigit(ctx->curr_pos[1]), ctx->curr_pos,
-                  ctx->curr_pos, "Expected number after '-'");
+  if (CHAR_IS(*pos, CC_DIGIT) || *pos == '-') {
+    SYNTAX_ERR_IF(ctx, *pos == '-' && !CHAR_IS(pos[1], CC_DIGIT), pos, pos,
+                  "Expected number after '-'");
 
     char *num_end = NULL;
-    VmWord parsed_num = strtoll(ctx->curr_pos, &num_end, 0);
+    VmWord parsed_num = strtoll(pos, &num_end, 0);
 
-    SYNTAX_ERR_IF(ctx, num_end != 0 && !isspace(*num_end) && *num_end != ',', num_end, num_end,
+    SYNTAX_ERR_IF(ctx, !is_tok_end(*num_end), num_end, num_end,
                   "Expected whitespace or comma after number");
 
     if (parsed_num == LLONG_MAX) {
-      print_syntax_err(ctx, ctx->curr_pos, extend_num_err(ctx->curr_pos), "Number overflow");
+      print_syntax_err(ctx, pos, extend_num_err(pos), "Number overflow");
       return RET_CODE_ERR;
     }
     else if (parsed_num == LLONG_MIN) {
-      print_syntax_err(ctx, ctx->curr_pos, extend_num_err(ctx->curr_pos), "Number underflow");
+      print_syntax_err(ctx, pos, extend_num_err(pos), "Number underflow");
       return RET_CODE_ERR;
     }
 
-    *tok_out = (Token){
-        .first_char = ctx->curr_pos, .last_char = num_end - 1, .ty = TT_NUM, .i64 = parsed_num};
+    *tok_out =
+        (Token){.first_char = pos, .last_char = num_end - 1, .ty = TT_NUM, .i64 = parsed_num};
 
     ctx->curr_pos = num_end;
     return RET_CODE_OK;
@@ -313,32 +642,23 @@ unexpected_tok:
   return RET_CODE_ERR;
 }
 
-void insts_out_append_data(InstsOut *out, void *data, size_t data_size) {
-  assert(data_size % sizeof(inst_ty) == 0);
+// like `get_next_tok`, but names of constants become numbers
+int get_next_operand(CompileCtx *ctx, Token *tok_out, bool allow_comma_before) {
+  int tmp_ret_code = get_next_tok(ctx, tok_out, allow_comma_before);
+  if (tmp_ret_code != 0 || tok_out->ty != TT_IDENT) return tmp_ret_code;
 
-  if (out->size + data_size / sizeof(inst_ty) > out->capacity) {
-    size_t new_capacity = (out->size + data_size / sizeof(inst_ty)) * 2;
-    out->insts = realloc(out->insts, new_capacity * sizeof(inst_ty));
-    out->capacity = new_capacity;
+  Label *constant = label_table_lookup(&ctx->consts, (StrSlice){tok_out->first_char,
+                                                                tok_out->last_char});
+  if (constant) {
+    tok_out->ty = TT_NUM;
+    tok_out->i64 = constant->loc;
   }
-
-  // w
-  memcpy(out->insts + out->size, data, data_size);
-  out->size += data_size / sizeof(inst_ty);
-}
-
-void insts_out_append(InstsOut *out, inst_ty inst) {
-  insts_out_append_data(out, &inst, sizeof(inst_ty));
+  return RET_CODE_OK;
 }
 
-bool cmp_mnemonic(char *mnemonic, char *first_tok_char) {
-  if (strlen(first_tok_char) < strlen(mnemonic)) return false;
-
-  for (unsigned int i = 0; i < strlen(mnemonic); i++) {
-    if (mnemonic[i] != first_tok_char[i]) return false;
-  }
-
-  return true;
+bool cmp_mnemonic(char *mnemonic, Token tok) {
+  size_t len = tok.last_char - tok.first_char + 1;
+  return strlen(mnemonic) == len && memcmp(mnemonic, tok.first_char, len) == 0;
 }
 
 int compile_binop_inst(CompileCtx *ctx, char *name, int mnemonic) {
@@ -349,8 +669,10 @@ int compile_binop_inst(CompileCtx *ctx, char *name, int mnemonic) {
   EXPECT_TOK(ctx, TT_REGISTER, true, op1_reg,
              "Expected an operand register after destination register");
 
-  VmWord max_size = powl(2, FIELD_BINOP_IMM.bit_count - 1) - 1;
+  VmWord max_size = IMM_MAX(FIELD_BINOP_IMM);
   EXPECT_IMM_OR_REG(ctx, name, max_size, op2);
+  SYNTAX_ERR_IF(ctx, mnemonic == MNEMONIC_DIV && op2.ty == TT_NUM && op2.i64 == 0,
+                op2.first_char, op2.last_char, "Division by zero");
 
   if (op2.ty == TT_NUM && op2.i64 < 0) {
     op2.i64 &= (1 << (FIELD_BINOP_IMM.bit_count - 1)) - 1;
@@ -365,20 +687,437 @@ int compile_binop_inst(CompileCtx *ctx, char *name, int mnemonic) {
   return RET_CODE_OK;
 }
 
+int compile_in_inst(CompileCtx *ctx, char *name, int mnemonic) {
+  Token dst_reg;
+  EXPECT_TOK(ctx, TT_REGISTER, false, dst_reg, "Expected a destination register after '%s'", name);
+  insts_out_append(ctx->insts_out, mnemonic | (dst_reg.i64 << FIELD_IN_DST.start_bit));
+  return RET_CODE_OK;
+}
+
+// `send chan, #rS`, `recv #rD, chan` and `try_recv #rD, chan`
+int compile_channel_inst(CompileCtx *ctx, char *name, int mnemonic) {
+  Token reg;
+  Token chan;
+  VmWord max_chan = ((VmWord)1 << FIELD_CHAN_IDX.bit_count) - 1;
+
+  if (mnemonic == MNEMONIC_SEND) {
+    EXPECT_TOK(ctx, TT_NUM, false, chan, "Expected a channel index after '%s'", name);
+    EXPECT_TOK(ctx, TT_REGISTER, true, reg, "Expected a source register after the channel");
+  }
+  else {
+    EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected a destination register after '%s'", name);
+    EXPECT_TOK(ctx, TT_NUM, true, chan, "Expected a channel index after the register");
+  }
+
+  SYNTAX_ERR_IF(ctx, chan.i64 < 0 || chan.i64 > max_chan, chan.first_char, chan.last_char,
+                "Channel index for '%s' has to be between 0 and %lld", name, (long long)max_chan);
+
+  insts_out_append(ctx->insts_out, mnemonic | (reg.i64 << FIELD_CHAN_REG.start_bit) |
+                                       (chan.i64 << FIELD_CHAN_IDX.start_bit));
+  return RET_CODE_OK;
+}
+
+// `cas #rD, #rA, #rN`, `xadd #rD, #rA, #rS`, `xchg #rD, #rA, #rS`, `aload #rD, #rA` and
+// `astore #rA, #rS`, `#rA` holds the shared memory address
+int compile_atomic_inst(CompileCtx *ctx, char *name, int mnemonic) {
+  Token dst = {.i64 = 0};
+  Token addr;
+  Token src = {.i64 = 0};
+
+  if (mnemonic != MNEMONIC_ASTORE)
+    EXPECT_TOK(ctx, TT_REGISTER, false, dst, "Expected a destination register after '%s'", name);
+  EXPECT_TOK(ctx, TT_REGISTER, mnemonic != MNEMONIC_ASTORE, addr,
+             "Expected an address register for '%s'", name);
+  if (mnemonic != MNEMONIC_ALOAD)
+    EXPECT_TOK(ctx, TT_REGISTER, true, src, "Expected a source register for '%s'", name);
+
+  insts_out_append(ctx->insts_out, mnemonic | (dst.i64 << FIELD_ATOMIC_DST.start_bit) |
+                                       (addr.i64 << FIELD_ATOMIC_ADDR.start_bit) |
+                                       (src.i64 << FIELD_ATOMIC_SRC.start_bit));
+  return RET_CODE_OK;
+}
+
+// `fread #rD, #rA, #rL, #rO, file` and `fwrite #rD, #rA, #rL, #rO, file`, `#rA` holds the shared
+// memory address, `#rL` the byte count and `#rO` the file offset
+int compile_file_io_inst(CompileCtx *ctx, char *name, int mnemonic) {
+  Token dst;
+  Token addr;
+  Token len;
+  Token off;
+  Token file;
+  VmWord max_file = ((VmWord)1 << FIELD_IO_FILE.bit_count) - 1;
+
+  EXPECT_TOK(ctx, TT_REGISTER, false, dst, "Expected a destination register after '%s'", name);
+  EXPECT_TOK(ctx, TT_REGISTER, true, addr, "Expected an address register for '%s'", name);
+  EXPECT_TOK(ctx, TT_REGISTER, true, len, "Expected a length register for '%s'", name);
+  EXPECT_TOK(ctx, TT_REGISTER, true, off, "Expected an offset register for '%s'", name);
+  EXPECT_TOK(ctx, TT_NUM, true, file, "Expected a file index after the offset register");
+
+  SYNTAX_ERR_IF(ctx, file.i64 < 0 || file.i64 > max_file, file.first_char, file.last_char,
+                "File index for '%s' has to be between 0 and %lld", name, (long long)max_file);
+
+  insts_out_append(ctx->insts_out, mnemonic | (dst.i64 << FIELD_IO_DST.start_bit) |
+                                       (addr.i64 << FIELD_IO_ADDR.start_bit) |
+                                       (len.i64 << FIELD_IO_LEN.start_bit) |
+                                       (off.i64 << FIELD_IO_OFF.start_bit) |
+                                       (file.i64 << FIELD_IO_FILE.start_bit));
+  return RET_CODE_OK;
+}
+
+// vector mnemonics take the lane width in bits as suffix, e.g. `vadd32`
+bool cmp_vec_mnemonic(char *prefix, Token tok, int *lane_shift_out) {
+  static char *suffixes[] = {"8", "16", "32", "64"};
+  size_t len = tok.last_char - tok.first_char + 1;
+  size_t prefix_len = strlen(prefix);
+
+  if (len <= prefix_len || memcmp(prefix, tok.first_char, prefix_len) != 0) return false;
+
+  for (int i = 0; i < 4; i++) {
+    if (strlen(suffixes[i]) == len - prefix_len &&
+        memcmp(suffixes[i], tok.first_char + prefix_len, len - prefix_len) == 0) {
+      *lane_shift_out = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+inst_ty make_vec_inst(int mnemonic, int dst, int op1, int op2, int lane_shift, int imm) {
+  return mnemonic | dst << FIELD_VEC_DST.start_bit | op1 << FIELD_VEC_OP1.start_bit |
+         op2 << FIELD_VEC_OP2.start_bit | lane_shift << FIELD_VEC_LANE.start_bit |
+         imm << FIELD_VEC_IMM.start_bit;
+}
+
+int compile_vec_binop_inst(CompileCtx *ctx, char *name, int mnemonic, int lane_shift) {
+  Token dst_reg;
+  Token op1_reg;
+  Token op2_reg;
+  EXPECT_TOK(ctx, TT_VREGISTER, false, dst_reg, "Expected a destination vector register after '%s'",
+             name);
+  EXPECT_TOK(ctx, TT_VREGISTER, true, op1_reg, "Expected an operand vector register");
+  EXPECT_TOK(ctx, TT_VREGISTER, true, op2_reg, "Expected an operand vector register");
+  insts_out_append(ctx->insts_out,
+                   make_vec_inst(mnemonic, dst_reg.i64, op1_reg.i64, op2_reg.i64, lane_shift, 0));
+  return RET_CODE_OK;
+}
+
+int compile_vec_shift_inst(CompileCtx *ctx, char *name, int mnemonic, int lane_shift) {
+  Token dst_reg;
+  Token src_reg;
+  Token amount;
+  EXPECT_TOK(ctx, TT_VREGISTER, false, dst_reg, "Expected a destination vector register after '%s'",
+             name);
+  EXPECT_TOK(ctx, TT_VREGISTER, true, src_reg, "Expected a source vector register");
+  EXPECT_TOK(ctx, TT_NUM, true, amount, "Expected a shift amount");
+  int max_amount = (1 << FIELD_VEC_IMM.bit_count) - 1;
+  SYNTAX_ERR_IF(ctx, amount.i64 < 0 || amount.i64 > max_amount, amount.first_char,
+                amount.last_char, "Shift amount for '%s' has to be between 0 and %d", name,
+                max_amount);
+  insts_out_append(ctx->insts_out,
+                   make_vec_inst(mnemonic, dst_reg.i64, src_reg.i64, 0, lane_shift, amount.i64));
+  return RET_CODE_OK;
+}
+
+// `vbcst #vD, #rS`, `vins #vD, #rS, lane` and `vext #rD, #vS, lane`
+int compile_vec_lane_inst(CompileCtx *ctx, char *name, int mnemonic, int lane_shift) {
+  bool is_ext = mnemonic == MNEMONIC_VEXT;
+  Token dst_reg;
+  Token src_reg;
+  Token lane = {.i64 = 0};
+  int dst_ty = is_ext ? TT_REGISTER : TT_VREGISTER;
+  int src_ty = is_ext ? TT_VREGISTER : TT_REGISTER;
+  EXPECT_TOK(ctx, dst_ty, false, dst_reg, "Expected a destination %sregister after '%s'",
+             is_ext ? "" : "vector ", name);
+  EXPECT_TOK(ctx, src_ty, true, src_reg, "Expected a source %sregister", is_ext ? "vector " : "");
+
+  if (mnemonic != MNEMONIC_VBCST) {
+    int lanes = VEC_SIZE >> lane_shift;
+    EXPECT_TOK(ctx, TT_NUM, true, lane, "Expected a lane index");
+    SYNTAX_ERR_IF(ctx, lane.i64 < 0 || lane.i64 >= lanes, lane.first_char, lane.last_char,
+                  "Lane index for '%s' has to be between 0 and %d", name, lanes - 1);
+  }
+
+  insts_out_append(ctx->insts_out,
+                   make_vec_inst(mnemonic, dst_reg.i64, src_reg.i64, 0, lane_shift, lane.i64));
+  return RET_CODE_OK;
+}
+
+int compile_unop_inst(CompileCtx *ctx, char *name, int mnemonic) {
+  Token dst_reg;
+  Token src_reg;
+  EXPECT_TOK(ctx, TT_REGISTER, false, dst_reg, "Expected a destination register after '%s'", name);
+  EXPECT_TOK(ctx, TT_REGISTER, true, src_reg, "Expected source register");
+  insts_out_append(ctx->insts_out, mnemonic | (dst_reg.i64 << FIELD_UNOP_DST.start_bit) |
+                                       (src_reg.i64 << FIELD_UNOP_SRC.start_bit));
+  return RET_CODE_OK;
+}
+
+// first character after blanks on the current line, `file_end`, a newline or a comment if the line
+// has nothing more
+char *peek_on_line(CompileCtx *ctx) {
+  char *pos = ctx->curr_pos;
+  while (pos < ctx->file_end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) pos++;
+  return pos;
+}
+
+// name operand of a directive, taken literally
+int expect_directive_name(CompileCtx *ctx, Token directive, bool allow_comma_before,
+                          Token *name_out) {
+  bool skipping = ctx->skipping;
+  int tmp_ret_code;
+
+  ctx->skipping = true;
+  tmp_ret_code = get_next_tok(ctx, name_out, allow_comma_before);
+  ctx->skipping = skipping;
+
+  char *last_char = ctx->file_end - 1;
+  SYNTAX_ERR_IF(ctx, tmp_ret_code == RET_CODE_NORET, last_char, last_char,
+                "Expected a name after '%.*s'", (int)(directive.last_char - directive.first_char + 1),
+                directive.first_char);
+  if (tmp_ret_code != 0) return tmp_ret_code;
+
+  SYNTAX_ERR_IF(ctx, name_out->ty != TT_IDENT, name_out->first_char, name_out->last_char,
+                "Expected a name after '%.*s'", (int)(directive.last_char - directive.first_char + 1),
+                directive.first_char);
+  return RET_CODE_OK;
+}
+
+// tokenizes up to the `close` directive matching `open` without assembling anything
+int record_body(CompileCtx *ctx, Token directive, char *open, char *close, char **body_first_out,
+                char **body_end_out) {
+  int depth = 1;
+  int tmp_ret_code = RET_CODE_OK;
+  Token tok;
+
+  *body_first_out = ctx->curr_pos;
+  ctx->skipping = true;
+
+  while (depth > 0) {
+    if ((tmp_ret_code = get_next_tok(ctx, &tok, true)) != 0) break;
+    if (tok.ty != TT_DIRECTIVE) continue;
+
+    if (cmp_mnemonic(close, tok))
+      depth--;
+    else if (cmp_mnemonic(open, tok))
+      depth++;
+    else if (cmp_mnemonic(".macro", tok)) {
+      print_syntax_err(ctx, tok.first_char, tok.last_char, "'.macro' can not be nested");
+      tmp_ret_code = RET_CODE_ERR;
+      break;
+    }
+  }
+
+  ctx->skipping = false;
+  SYNTAX_ERR_IF(ctx, tmp_ret_code == RET_CODE_NORET, directive.first_char, directive.last_char,
+                "Missing '%s' for '%s'", close, open);
+  if (tmp_ret_code != 0) return tmp_ret_code;
+
+  *body_end_out = tok.first_char;
+  return RET_CODE_OK;
+}
+
+int push_expansion(CompileCtx *ctx, Token directive, Expansion expansion) {
+  SYNTAX_ERR_IF(ctx, ctx->expansion_depth == ASM_MAX_EXPANSION_DEPTH, directive.first_char,
+                directive.last_char, "Macros and '.rept' blocks are nested deeper than %d",
+                ASM_MAX_EXPANSION_DEPTH);
+
+  if (!ctx->expansions) {
+    ctx->expansions = malloc(ASM_MAX_EXPANSION_DEPTH * sizeof(Expansion));
+    ERR_IF(!ctx->expansions, "Memory error: Could not allocate memory for macros");
+  }
+
+  expansion.return_pos = ctx->curr_pos;
+  expansion.return_end = ctx->file_end;
+  expansion.id = ctx->expansion_count++;
+  ctx->expansions[ctx->expansion_depth++] = expansion;
+
+  ctx->curr_pos = expansion.body_first;
+  ctx->file_end = expansion.body_end;
+  return RET_CODE_OK;
+}
+
+// called once the innermost body is assembled, repeats it or returns to where it was expanded
+void end_expansion(CompileCtx *ctx) {
+  Expansion *expansion = &ctx->expansions[ctx->expansion_depth - 1];
+
+  if (!expansion->macro && ++expansion->counter < expansion->count) {
+    expansion->id = ctx->expansion_count++;
+    ctx->curr_pos = expansion->body_first;
+    return;
+  }
+
+  ctx->curr_pos = expansion->return_pos;
+  ctx->file_end = expansion->return_end;
+  ctx->expansion_depth--;
+}
+
+int compile_const(CompileCtx *ctx, Token directive) {
+  Token name;
+  Token value;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = expect_directive_name(ctx, directive, false, &name)) != 0)
+    return tmp_ret_code;
+  EXPECT_TOK(ctx, TT_NUM, true, value, "Expected a value after the constant name");
+
+  StrSlice name_slice = {name.first_char, name.last_char};
+  SYNTAX_ERR_IF(ctx, label_table_lookup(&ctx->consts, name_slice), name.first_char,
+                name.last_char, "Constant '%.*s' is already defined",
+                (int)(name.last_char - name.first_char + 1), name.first_char);
+  return label_table_add(&ctx->consts, name_slice, value.i64);
+}
+
+int define_macro(CompileCtx *ctx, Token directive) {
+  Macro macro = {0};
+  Token name;
+  int tmp_ret_code;
+
+  SYNTAX_ERR_IF(ctx, ctx->expansion_depth, directive.first_char, directive.last_char,
+                "'.macro' is not allowed inside a macro or '.rept' body");
+
+  if ((tmp_ret_code = expect_directive_name(ctx, directive, false, &name)) != 0)
+    return tmp_ret_code;
+  macro.name = (StrSlice){name.first_char, name.last_char};
+
+  SYNTAX_ERR_IF(ctx, label_table_lookup(&ctx->macro_names, macro.name), name.first_char,
+                name.last_char, "Macro '%.*s' is already defined",
+                (int)(name.last_char - name.first_char + 1), name.first_char);
+
+  // parameters end with the line
+  for (char *next = peek_on_line(ctx); next < ctx->file_end && CHAR_IS(*next, CC_IDENT_START);
+       next = peek_on_line(ctx)) {
+    Token param;
+
+    SYNTAX_ERR_IF(ctx, macro.param_count == ASM_MAX_MACRO_PARAMS, next, next,
+                  "Macros take at most %d parameters", ASM_MAX_MACRO_PARAMS);
+    if ((tmp_ret_code = expect_directive_name(ctx, directive, false, &param)) != 0)
+      return tmp_ret_code;
+    macro.params[macro.param_count++] = (StrSlice){param.first_char, param.last_char};
+
+    next = peek_on_line(ctx);
+    if (next == ctx->file_end || *next != ',') break;
+    ctx->curr_pos = next + 1;
+  }
+
+  if ((tmp_ret_code = record_body(ctx, directive, ".macro", ".endm", &macro.body_first,
+                                  &macro.body_end)) != 0)
+    return tmp_ret_code;
+
+  if (ctx->macro_count == ctx->macro_capacity) {
+    size_t capacity = ctx->macro_capacity ? ctx->macro_capacity * 2 : 16;
+    Macro *macros = realloc(ctx->macros, capacity * sizeof(Macro));
+    ERR_IF(!macros, "Memory error: Could not allocate memory for macros");
+    ctx->macros = macros;
+    ctx->macro_capacity = capacity;
+  }
+
+  // macros are only defined outside expansions, so no `Expansion` points into `macros` here
+  ctx->macros[ctx->macro_count] = macro;
+  return label_table_add(&ctx->macro_names, macro.name, ctx->macro_count++);
+}
+
+int compile_rept(CompileCtx *ctx, Token directive) {
+  Expansion expansion = {0};
+  Token count;
+  int tmp_ret_code;
+
+  EXPECT_TOK(ctx, TT_NUM, false, count, "Expected a repetition count after '.rept'");
+  SYNTAX_ERR_IF(ctx, count.i64 < 0, count.first_char, count.last_char,
+                "Repetition count for '.rept' can not be negative");
+
+  char *next = peek_on_line(ctx);
+  if (next < ctx->file_end && *next == ',') {
+    Token counter_name;
+    if ((tmp_ret_code = expect_directive_name(ctx, directive, true, &counter_name)) != 0)
+      return tmp_ret_code;
+    expansion.counter_name = (StrSlice){counter_name.first_char, counter_name.last_char};
+  }
+
+  if ((tmp_ret_code = record_body(ctx, directive, ".rept", ".endr", &expansion.body_first,
+                                  &expansion.body_end)) != 0)
+    return tmp_ret_code;
+
+  if (count.i64 == 0) return RET_CODE_OK;
+  expansion.count = count.i64;
+  return push_expansion(ctx, directive, expansion);
+}
+
+int expand_macro(CompileCtx *ctx, Token name, Macro *macro) {
+  Expansion expansion = {.macro = macro, .body_first = macro->body_first,
+                         .body_end = macro->body_end};
+
+  for (int i = 0; i < macro->param_count; i++) {
+    EXPECT_TOK_ANY(ctx, i > 0, expansion.args[i], "Macro '%.*s' expects %d arguments",
+                   (int)(name.last_char - name.first_char + 1), name.first_char,
+                   macro->param_count);
+  }
+
+  return push_expansion(ctx, name, expansion);
+}
+
+int compile_directive(CompileCtx *ctx, Token directive) {
+  // the caller assembles the source again with directives enabled
+  if (!ctx->allow_directives) {
+    ctx->found_directive = true;
+    return RET_CODE_ERR;
+  }
+
+  if (cmp_mnemonic(".equ", directive) || cmp_mnemonic(".const", directive))
+    return compile_const(ctx, directive);
+  else if (cmp_mnemonic(".macro", directive))
+    return define_macro(ctx, directive);
+  else if (cmp_mnemonic(".rept", directive))
+    return compile_rept(ctx, directive);
+  else if (cmp_mnemonic(".endm", directive) || cmp_mnemonic(".endr", directive)) {
+    print_syntax_err(ctx, directive.first_char, directive.last_char, "Unexpected '%.*s'",
+                     (int)(directive.last_char - directive.first_char + 1), directive.first_char);
+    return RET_CODE_ERR;
+  }
+
+  print_syntax_err(ctx, directive.first_char, directive.last_char, "Unknown directive '%.*s'",
+                   (int)(directive.last_char - directive.first_char + 1), directive.first_char);
+  return RET_CODE_ERR;
+}
+
+// turns the name in `fn` into the index of the host function
+int find_host_fn(CompileCtx *ctx, Token *fn) {
+  size_t len = fn->last_char - fn->first_char + 1;
+
+  for (size_t i = 0; ctx->host_fns && i < ctx->host_fns->count; i++) {
+    const char *name = ctx->host_fns->fns[i].name;
+
+    if (name && strlen(name) == len && memcmp(name, fn->first_char, len) == 0) {
+      fn->ty = TT_NUM;
+      fn->i64 = i;
+      return RET_CODE_OK;
+    }
+  }
+
+  print_syntax_err(ctx, fn->first_char, fn->last_char, "Unknown host function '%.*s'", (int)len,
+                   fn->first_char);
+  return RET_CODE_ERR;
+}
+
 int compile_inst(CompileCtx *ctx) {
   Token inst;
+  int lane_shift;
   int tmp_ret_code;
 
-  if ((tmp_ret_code = get_next_tok(ctx, &inst, false)) != 0) return tmp_ret_code;
+  while ((tmp_ret_code = get_next_tok(ctx, &inst, false)) == RET_CODE_NORET &&
+         ctx->expansion_depth > 0)
+    end_expansion(ctx);
+  if (tmp_ret_code != 0) return tmp_ret_code;
 
   if (inst.ty == TT_LABEL) {
-    add_label(ctx, (StrSlice){inst.first_char, inst.last_char});
-    return RET_CODE_OK;
+    return add_label(ctx, inst.name);
   }
 
+  if (inst.ty == TT_DIRECTIVE) return compile_directive(ctx, inst);
+
   if (inst.ty != TT_IDENT) goto unknown_inst;
 
-  if (cmp_mnemonic("exit", inst.first_char)) {
+  if (cmp_mnemonic("exit", inst)) {
     Token exit_code;
 
     EXPECT_TOK(ctx, TT_NUM, false, exit_code, "Expected an exit code immidiate after 'exit'");
@@ -389,52 +1128,52 @@ int compile_inst(CompileCtx *ctx) {
     insts_out_append(ctx->insts_out, exit_code.i64 << 8 | MNEMONIC_EXIT);
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("add", inst.first_char)) {
+  else if (cmp_mnemonic("add", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "add", MNEMONIC_ADD)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("sub", inst.first_char)) {
+  else if (cmp_mnemonic("sub", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "sub", MNEMONIC_SUB)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("mul", inst.first_char)) {
+  else if (cmp_mnemonic("mul", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "mul", MNEMONIC_MUL)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("div", inst.first_char)) {
+  else if (cmp_mnemonic("div", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "div", MNEMONIC_DIV)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("or", inst.first_char)) {
+  else if (cmp_mnemonic("or", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "or", MNEMONIC_OR)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("and", inst.first_char)) {
+  else if (cmp_mnemonic("and", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "and", MNEMONIC_AND)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("xor", inst.first_char)) {
+  else if (cmp_mnemonic("xor", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "xor", MNEMONIC_XOR)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("shr", inst.first_char)) {
+  else if (cmp_mnemonic("shr", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "shr", MNEMONIC_SHR)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("shl", inst.first_char)) {
+  else if (cmp_mnemonic("shl", inst)) {
     int tmp_ret_code;
     if ((tmp_ret_code = compile_binop_inst(ctx, "shl", MNEMONIC_SHL)) != 0) return tmp_ret_code;
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("not", inst.first_char)) {
+  else if (cmp_mnemonic("not", inst)) {
     Token dst_reg;
     Token src_reg;
     EXPECT_TOK(ctx, TT_REGISTER, false, dst_reg, "Expected destination register after 'not'");
@@ -442,13 +1181,163 @@ int compile_inst(CompileCtx *ctx) {
     insts_out_append(ctx->insts_out, MNEMONIC_NOT | (dst_reg.i64 << FIELD_NOT_DST.start_bit) | (src_reg.i64 << FIELD_NOT_SRC.start_bit));
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("mov", inst.first_char)) {
-    Token dst;
-    Token src;
-
-    EXPECT_TOK(ctx, TT_REGISTER, false, dst, "Expected an destination register after 'mov'");
-    VmWord max_size = powl(2, FIELD_MOV_IMM.bit_count - 1) - 1;
-    EXPECT_IMM_OR_REG(ctx, "mov", max_size, src);
+  else if (cmp_mnemonic("rol", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_binop_inst(ctx, "rol", MNEMONIC_ROL)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("ror", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_binop_inst(ctx, "ror", MNEMONIC_ROR)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("mulh", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_binop_inst(ctx, "mulh", MNEMONIC_MULH)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("mulhu", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_binop_inst(ctx, "mulhu", MNEMONIC_MULHU)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("divu", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_binop_inst(ctx, "divu", MNEMONIC_DIVU)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("remu", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_binop_inst(ctx, "remu", MNEMONIC_REMU)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("popcnt", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_unop_inst(ctx, "popcnt", MNEMONIC_POPCNT)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("clz", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_unop_inst(ctx, "clz", MNEMONIC_CLZ)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("ctz", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_unop_inst(ctx, "ctz", MNEMONIC_CTZ)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("bswap", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_unop_inst(ctx, "bswap", MNEMONIC_BSWAP)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("vand", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vand", MNEMONIC_VAND, 0)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("vor", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vor", MNEMONIC_VOR, 0)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("vxor", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vxor", MNEMONIC_VXOR, 0)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("vshuf", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vshuf", MNEMONIC_VSHUF, 0)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vadd", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vadd", MNEMONIC_VADD, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vsub", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vsub", MNEMONIC_VSUB, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vcmpeq", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vcmpeq", MNEMONIC_VCMPEQ, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vcmpgt", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_binop_inst(ctx, "vcmpgt", MNEMONIC_VCMPGT, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vshl", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_shift_inst(ctx, "vshl", MNEMONIC_VSHL, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vshr", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_shift_inst(ctx, "vshr", MNEMONIC_VSHR, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vbcst", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_lane_inst(ctx, "vbcst", MNEMONIC_VBCST, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vins", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_lane_inst(ctx, "vins", MNEMONIC_VINS, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_vec_mnemonic("vext", inst, &lane_shift)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_vec_lane_inst(ctx, "vext", MNEMONIC_VEXT, lane_shift)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("vin", inst)) {
+    Token reg;
+    EXPECT_TOK(ctx, TT_VREGISTER, false, reg, "Expected vector register after 'vin'");
+    insts_out_append(ctx->insts_out, make_vec_inst(MNEMONIC_VIN, reg.i64, 0, 0, 0, 0));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("vout", inst)) {
+    Token reg;
+    EXPECT_TOK(ctx, TT_VREGISTER, false, reg, "Expected vector register after 'vout'");
+    insts_out_append(ctx->insts_out, make_vec_inst(MNEMONIC_VOUT, reg.i64, 0, 0, 0, 0));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("mov", inst)) {
+    Token dst;
+    Token src;
+
+    EXPECT_TOK(ctx, TT_REGISTER, false, dst, "Expected an destination register after 'mov'");
+    VmWord max_size = IMM_MAX(FIELD_MOV_IMM);
+    EXPECT_IMM_OR_REG(ctx, "mov", max_size, src);
     insts_out_append(ctx->insts_out,
                      MNEMONIC_MOV | (dst.i64 << FIELD_MOV_DST.start_bit) |
                          ((src.ty == TT_REGISTER ? 0 : 1) << FIELD_MOV_IS_IMM.start_bit) |
@@ -456,34 +1345,29 @@ int compile_inst(CompileCtx *ctx) {
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("load", inst.first_char)) {
+  else if (cmp_mnemonic("load", inst)) {
     Token dst;
     Token imm;
 
     EXPECT_TOK(ctx, TT_REGISTER, false, dst, "Expected an destination register after 'load'");
     EXPECT_TOK(ctx, TT_NUM, true, imm, "Expected an immidiate");
 
-    insts_out_append(ctx->insts_out, MNEMONIC_LOAD | (dst.i64 >> FIELD_LOAD_DST.start_bit));
+    insts_out_append(ctx->insts_out, MNEMONIC_LOAD | (dst.i64 << FIELD_LOAD_DST.start_bit));
     insts_out_append(ctx->insts_out, imm.i64 & 0xFFFFFFFF);
     insts_out_append(ctx->insts_out, imm.i64 >> 32);
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("jmp", inst.first_char)) {
+  else if (cmp_mnemonic("jmp", inst)) {
     Token jmp_off;
-    VmWord max_size = powl(2, FIELD_JMP_OFF.bit_count - 1) - 1;
+    VmWord max_size = IMM_MAX(FIELD_JMP_OFF);
 
     EXPECT_ADDR_OR_LABEL(ctx, "jmp", max_size, jmp_off);
 
     if (jmp_off.ty == TT_LABEL) {
-      VmWord loc = get_label_loc((StrSlice){jmp_off.first_char, jmp_off.last_char});
-      if (loc == -1) {
-        insts_out_append(ctx->insts_out, MNEMONIC_JMP);
-        add_unresolved_label((StrSlice){jmp_off.first_char, jmp_off.last_char},
-                             (LabelPatch){FIELD_JMP_OFF, ctx->insts_out->size - 1});
-        return RET_CODE_OK;
-      }
-      jmp_off.i64 = loc - ctx->insts_out->size;
+      insts_out_append(ctx->insts_out, MNEMONIC_JMP);
+      return add_label_ref(ctx, jmp_off,
+                           (LabelPatch){FIELD_JMP_OFF, ctx->insts_out->size - 1});
     }
 
     if (jmp_off.i64 < 0) {
@@ -496,33 +1380,28 @@ int compile_inst(CompileCtx *ctx) {
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("inc", inst.first_char)) {
+  else if (cmp_mnemonic("inc", inst)) {
     Token reg;
     EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected register to increment");
     insts_out_append(ctx->insts_out, MNEMONIC_INC | (reg.i64 << FIELD_INC_REG.start_bit));
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("dec", inst.first_char)) {
+  else if (cmp_mnemonic("dec", inst)) {
     Token reg;
     EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected register to decrement");
     insts_out_append(ctx->insts_out, MNEMONIC_DEC | (reg.i64 << FIELD_DEC_REG.start_bit));
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("jz", inst.first_char)) {
+  else if (cmp_mnemonic("jz", inst)) {
     Token jmp_off;
-    VmWord max_size = powl(2, FIELD_COND_JMP_OFF.bit_count - 1) - 1;
+    VmWord max_size = IMM_MAX(FIELD_COND_JMP_OFF);
 
     EXPECT_ADDR_OR_LABEL(ctx, "jz", max_size, jmp_off);
 
     if (jmp_off.ty == TT_LABEL) {
-      VmWord loc = get_label_loc((StrSlice){jmp_off.first_char, jmp_off.last_char});
-      if (loc == -1) {
-        insts_out_append(ctx->insts_out, MNEMONIC_JMPZ);
-        add_unresolved_label((StrSlice){jmp_off.first_char, jmp_off.last_char},
-                             (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
-        return RET_CODE_OK;
-      }
-      jmp_off.i64 = loc - ctx->insts_out->size;
+      insts_out_append(ctx->insts_out, MNEMONIC_JMPZ);
+      return add_label_ref(ctx, jmp_off,
+                           (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
     }
 
     if (jmp_off.i64 < 0) {
@@ -535,21 +1414,16 @@ int compile_inst(CompileCtx *ctx) {
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("jg", inst.first_char)) {
+  else if (cmp_mnemonic("jg", inst)) {
     Token jmp_off;
-    VmWord max_size = powl(2, FIELD_COND_JMP_OFF.bit_count - 1) - 1;
+    VmWord max_size = IMM_MAX(FIELD_COND_JMP_OFF);
 
     EXPECT_ADDR_OR_LABEL(ctx, "jg", max_size, jmp_off);
 
     if (jmp_off.ty == TT_LABEL) {
-      VmWord loc = get_label_loc((StrSlice){jmp_off.first_char, jmp_off.last_char});
-      if (loc == -1) {
-        insts_out_append(ctx->insts_out, MNEMONIC_JMP_GREATER);
-        add_unresolved_label((StrSlice){jmp_off.first_char, jmp_off.last_char},
-                             (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
-        return RET_CODE_OK;
-      }
-      jmp_off.i64 = loc - ctx->insts_out->size;
+      insts_out_append(ctx->insts_out, MNEMONIC_JMP_GREATER);
+      return add_label_ref(ctx, jmp_off,
+                           (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
     }
 
     if (jmp_off.i64 < 0) {
@@ -562,21 +1436,16 @@ int compile_inst(CompileCtx *ctx) {
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("jl", inst.first_char)) {
+  else if (cmp_mnemonic("jl", inst)) {
     Token jmp_off;
-    VmWord max_size = powl(2, FIELD_COND_JMP_OFF.bit_count - 1) - 1;
+    VmWord max_size = IMM_MAX(FIELD_COND_JMP_OFF);
 
     EXPECT_ADDR_OR_LABEL(ctx, "jl", max_size, jmp_off);
 
     if (jmp_off.ty == TT_LABEL) {
-      VmWord loc = get_label_loc((StrSlice){jmp_off.first_char, jmp_off.last_char});
-      if (loc == -1) {
-        insts_out_append(ctx->insts_out, MNEMONIC_JMP_LOWER);
-        add_unresolved_label((StrSlice){jmp_off.first_char, jmp_off.last_char},
-                             (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
-        return RET_CODE_OK;
-      }
-      jmp_off.i64 = loc - ctx->insts_out->size;
+      insts_out_append(ctx->insts_out, MNEMONIC_JMP_LOWER);
+      return add_label_ref(ctx, jmp_off,
+                           (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
     }
 
     if (jmp_off.i64 < 0) {
@@ -589,21 +1458,16 @@ int compile_inst(CompileCtx *ctx) {
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("je", inst.first_char)) {
+  else if (cmp_mnemonic("je", inst)) {
     Token jmp_off;
-    VmWord max_size = powl(2, FIELD_COND_JMP_OFF.bit_count - 1) - 1;
+    VmWord max_size = IMM_MAX(FIELD_COND_JMP_OFF);
 
     EXPECT_ADDR_OR_LABEL(ctx, "je", max_size, jmp_off);
 
     if (jmp_off.ty == TT_LABEL) {
-      VmWord loc = get_label_loc((StrSlice){jmp_off.first_char, jmp_off.last_char});
-      if (loc == -1) {
-        insts_out_append(ctx->insts_out, MNEMONIC_JMP_EQ);
-        add_unresolved_label((StrSlice){jmp_off.first_char, jmp_off.last_char},
-                             (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
-        return RET_CODE_OK;
-      }
-      jmp_off.i64 = loc - ctx->insts_out->size;
+      insts_out_append(ctx->insts_out, MNEMONIC_JMP_EQ);
+      return add_label_ref(ctx, jmp_off,
+                           (LabelPatch){FIELD_COND_JMP_OFF, ctx->insts_out->size - 1});
     }
 
     if (jmp_off.i64 < 0) {
@@ -616,7 +1480,7 @@ int compile_inst(CompileCtx *ctx) {
 
     return RET_CODE_OK;
   }
-  else if (cmp_mnemonic("cmp", inst.first_char)) {
+  else if (cmp_mnemonic("cmp", inst)) {
     Token reg1;
     Token reg2;
 
@@ -627,51 +1491,366 @@ int compile_inst(CompileCtx *ctx) {
                                          (reg2.i64 << FIELD_CMP_REG2.start_bit));
     return RET_CODE_OK;
   }
+  else if (cmp_mnemonic("inlen", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_in_inst(ctx, "inlen", MNEMONIC_INLEN)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("inb", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_in_inst(ctx, "inb", MNEMONIC_INB)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("inw", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_in_inst(ctx, "inw", MNEMONIC_INW)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("inl", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_in_inst(ctx, "inl", MNEMONIC_INL)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("inq", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_in_inst(ctx, "inq", MNEMONIC_INQ)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("outb", inst)) {
+    Token reg;
+    EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected register after 'outb'");
+    insts_out_append(ctx->insts_out, MNEMONIC_OUTB | (reg.i64 << FIELD_OUT_REG.start_bit));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("out", inst)) {
+    Token reg;
+    EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected register after 'out'");
+    insts_out_append(ctx->insts_out, MNEMONIC_OUT | (reg.i64 << FIELD_OUT_REG.start_bit));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("fork", inst)) {
+    Token reg;
+    EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected register after 'fork'");
+    insts_out_append(ctx->insts_out, MNEMONIC_FORK | (reg.i64 << FIELD_FORK_DST.start_bit));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("send", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_channel_inst(ctx, "send", MNEMONIC_SEND)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("recv", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_channel_inst(ctx, "recv", MNEMONIC_RECV)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("try_recv", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_channel_inst(ctx, "try_recv", MNEMONIC_TRY_RECV)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("hcall", inst)) {
+    Token fn;
+    VmWord max_idx = ((VmWord)1 << FIELD_HCALL_IDX.bit_count) - 1;
+
+    EXPECT_TOK_ANY(ctx, false, fn, "Expected a host function after 'hcall'");
+    if (fn.ty == TT_IDENT && (tmp_ret_code = find_host_fn(ctx, &fn)) != 0) return tmp_ret_code;
+
+    SYNTAX_ERR_IF(ctx, fn.ty != TT_NUM, fn.first_char, fn.last_char,
+                  "Expected a host function name or index after 'hcall'");
+    SYNTAX_ERR_IF(ctx, fn.i64 < 0 || fn.i64 > max_idx, fn.first_char, fn.last_char,
+                  "Host function index for 'hcall' has to be between 0 and %lld",
+                  (long long)max_idx);
+
+    insts_out_append(ctx->insts_out, MNEMONIC_HCALL | (fn.i64 << FIELD_HCALL_IDX.start_bit));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("flush", inst)) {
+    insts_out_append(ctx->insts_out, MNEMONIC_FLUSH);
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("spawn", inst)) {
+    Token off;
+    Token reg;
+    VmWord max_size = IMM_MAX(FIELD_SPAWN_OFF);
+
+    EXPECT_ADDR_OR_LABEL(ctx, "spawn", max_size, off);
+    EXPECT_TOK(ctx, TT_REGISTER, true, reg, "Expected a register after the spawn location");
+
+    inst_ty spawn = MNEMONIC_SPAWN | (reg.i64 << FIELD_SPAWN_DST.start_bit);
+    if (off.ty == TT_LABEL) {
+      insts_out_append(ctx->insts_out, spawn);
+      return add_label_ref(ctx, off, (LabelPatch){FIELD_SPAWN_OFF, ctx->insts_out->size - 1});
+    }
+
+    insts_out_append(ctx->insts_out, inst_insert_bits(spawn, FIELD_SPAWN_OFF, off.i64));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("join", inst)) {
+    Token reg;
+    EXPECT_TOK(ctx, TT_REGISTER, false, reg, "Expected register after 'join'");
+    insts_out_append(ctx->insts_out, MNEMONIC_JOIN | (reg.i64 << FIELD_JOIN_REG.start_bit));
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("cas", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_atomic_inst(ctx, "cas", MNEMONIC_CAS)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("xadd", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_atomic_inst(ctx, "xadd", MNEMONIC_XADD)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("xchg", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_atomic_inst(ctx, "xchg", MNEMONIC_XCHG)) != 0) return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("aload", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_atomic_inst(ctx, "aload", MNEMONIC_ALOAD)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("astore", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_atomic_inst(ctx, "astore", MNEMONIC_ASTORE)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("fence", inst)) {
+    insts_out_append(ctx->insts_out, MNEMONIC_FENCE);
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("fread", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_file_io_inst(ctx, "fread", MNEMONIC_FREAD)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
+  else if (cmp_mnemonic("fwrite", inst)) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = compile_file_io_inst(ctx, "fwrite", MNEMONIC_FWRITE)) != 0)
+      return tmp_ret_code;
+    return RET_CODE_OK;
+  }
 
 unknown_inst:
+  if (inst.ty == TT_IDENT) {
+    Label *macro = label_table_lookup(&ctx->macro_names, (StrSlice){inst.first_char,
+                                                                    inst.last_char});
+    if (macro) return expand_macro(ctx, inst, &ctx->macros[macro->loc]);
+  }
+
   print_syntax_err(ctx, inst.first_char, inst.last_char, "Unknown instruction '%.*s'",
                    inst.last_char - inst.first_char + 1, inst.first_char);
   return RET_CODE_ERR;
 }
 
-int assembler_compile(char *filename, char *file_first_char, InstsOut *insts_out) {
-  InstsOut insts = {0};
-  CompileCtx ctx = {.curr_pos = file_first_char,
-                    .file_first_char = file_first_char,
-                    .insts_out = &insts,
-                    .filename = filename};
-
+// assembles from `ctx->curr_pos` up to `ctx->file_end`, labels are resolved separately
+int compile_insts(CompileCtx *ctx) {
   for (;;) {
-    int tmp_ret_code;
-    if ((tmp_ret_code = compile_inst(&ctx)) != 0) {
-      if (tmp_ret_code == RET_CODE_NORET) goto resolve_labels;
-      return tmp_ret_code;
+    int tmp_ret_code = compile_inst(ctx);
+    if (tmp_ret_code == RET_CODE_NORET) break;
+    if (tmp_ret_code != 0) return tmp_ret_code;
+  }
+
+  // the error was reported when growing failed
+  return ctx->insts_out->failed ? RET_CODE_ERR : RET_CODE_OK;
+}
+
+// `label_refs` were recorded `base` instructions before their place in the output of `ctx`
+int resolve_labels(CompileCtx *ctx, LabelRef *label_refs, size_t label_ref_count, size_t base) {
+  for (size_t i = 0; i < label_ref_count; i++) {
+    StrSlice name = label_refs[i].name;
+    StrSlice src = label_refs[i].src;
+    LabelPatch patch = label_refs[i].patch;
+    size_t inst_off = patch.inst_off_to_patch + base;
+    VmWord loc = label_table_find(&ctx->labels, name);
+
+    SYNTAX_ERR_IF(ctx, loc == -1, src.first_char, src.last_char, "Unknown label name '%.*s'",
+                  (int)(name.last_char - name.first_char + 1), name.first_char);
+
+    VmWord jmp_off = loc - (VmWord)inst_off;
+    VmWord max_off = IMM_MAX(patch.field_to_patch);
+    SYNTAX_ERR_IF(ctx, jmp_off > max_off || jmp_off < -max_off, src.first_char, src.last_char,
+                  "Label '%.*s' is too far away from the jump",
+                  (int)(name.last_char - name.first_char + 1), name.first_char);
+
+    ctx->insts_out->insts[inst_off] =
+        inst_insert_bits(ctx->insts_out->insts[inst_off], patch.field_to_patch, jmp_off);
+  }
+
+  return RET_CODE_OK;
+}
+
+typedef struct {
+  CompileCtx ctx;
+  InstsOut insts;
+  int ret_code;
+  // offset of the chunk in the merged output
+  size_t base;
+  // captured diagnostics of a failed chunk
+  char *errors;
+} AsmChunk;
+
+void *compile_chunk(void *arg) {
+  AsmChunk *chunk = arg;
+
+  err_capture_begin();
+  chunk->ret_code = compile_insts(&chunk->ctx);
+  if (chunk->ret_code != 0) chunk->errors = strdup(err_captured());
+  err_capture_end();
+
+  return NULL;
+}
+
+int assembler_chunk_count(size_t src_size) {
+  char *threads_env = getenv("TVM_ASM_THREADS");
+  long chunk_count;
+
+  if (threads_env)
+    chunk_count = atol(threads_env);
+  else {
+    size_t max_chunks = src_size / ASM_MIN_CHUNK_SIZE;
+    chunk_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if ((size_t)chunk_count > max_chunks) chunk_count = max_chunks;
+  }
+
+  if (chunk_count > ASM_MAX_THREADS) chunk_count = ASM_MAX_THREADS;
+  return chunk_count < 1 ? 1 : chunk_count;
+}
+
+// every chunk is tokenized and encoded on its own thread with its own labels, the results are
+// then concatenated and all label operands resolved against the merged labels; returns
+// RET_CODE_NORET without touching the output if a chunk boundary splits an instruction, the
+// caller then assembles the source in one piece
+int compile_parallel(CompileCtx *ctx, int chunk_count) {
+  AsmChunk *chunks = calloc(chunk_count, sizeof(AsmChunk));
+  pthread_t *threads = calloc(chunk_count, sizeof(pthread_t));
+  int started = 0;
+  int tmp_ret_code = RET_CODE_OK;
+
+  if (!chunks || !threads) {
+    free(chunks);
+    free(threads);
+    return RET_CODE_NORET;
+  }
+
+  // chunks start at line boundaries, so no token is split
+  size_t src_size = ctx->file_end - ctx->curr_pos;
+  char *chunk_first_char = ctx->curr_pos;
+
+  for (int i = 0; i < chunk_count; i++) {
+    char *chunk_end = ctx->file_end;
+
+    if (i + 1 < chunk_count) {
+      chunk_end = ctx->curr_pos + src_size / chunk_count * (i + 1);
+      if (chunk_end < chunk_first_char) chunk_end = chunk_first_char;
+      chunk_end = scan_line_end(chunk_end, ctx->file_end);
+      if (chunk_end < ctx->file_end) chunk_end++;
     }
+
+    chunks[i].ctx = (CompileCtx){.curr_pos = chunk_first_char,
+                                 .file_first_char = ctx->file_first_char,
+                                 .file_end = chunk_end,
+                                 .filename = ctx->filename,
+                                 .insts_out = &chunks[i].insts,
+                                 .host_fns = ctx->host_fns};
+    chunk_first_char = chunk_end;
   }
 
-resolve_labels:
-  for (int i = 0; i < unresolved_label_count; i++) {
-    StrSlice name = unresolved_label_names[i];
-    LabelPatch patch = unresolved_label_patches[i];
-    VmWord loc = get_label_loc(name);
+  for (; started < chunk_count; started++) {
+    if (pthread_create(&threads[started], NULL, compile_chunk, &chunks[started]) != 0) {
+      tmp_ret_code = RET_CODE_NORET;
+      break;
+    }
+  }
 
-    SYNTAX_ERR_IF(&ctx, loc == -1, name.first_char, name.last_char, "Unknown label name '%.*s'",
-                  name.last_char - name.first_char, name.first_char);
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
 
-    VmWord jmp_off = loc - patch.inst_off_to_patch;
-    if (jmp_off < 0) {
-      jmp_off &= (1 << (patch.field_to_patch.bit_count - 1)) - 1;
-      jmp_off |= 1 << (patch.field_to_patch.bit_count - 1);
+  // the first failed chunk has the error the serial assembler would report first, unless it only
+  // failed because the instruction at its end continues in the next chunk
+  for (int i = 0; i < chunk_count && tmp_ret_code == RET_CODE_OK; i++) {
+    if (chunks[i].ret_code == RET_CODE_OK) continue;
+
+    if ((chunks[i].ctx.reached_end && i + 1 < chunk_count) || chunks[i].ctx.found_directive ||
+        !chunks[i].errors)
+      tmp_ret_code = RET_CODE_NORET;
+    else {
+      err_printf("%s", chunks[i].errors);
+      tmp_ret_code = RET_CODE_ERR;
     }
+  }
 
-    ctx.insts_out->insts[patch.inst_off_to_patch] |= jmp_off << patch.field_to_patch.start_bit;
+  size_t insts_count = 0;
+  for (int i = 0; i < chunk_count; i++) insts_count += chunks[i].insts.size;
+
+  if (tmp_ret_code == RET_CODE_OK && !insts_out_reserve(ctx->insts_out, insts_count))
+    tmp_ret_code = RET_CODE_ERR;
+
+  // chunk outputs are freed as soon as they are copied to keep the peak memory down
+  size_t base = 0;
+  for (int i = 0; i < chunk_count && tmp_ret_code == RET_CODE_OK; i++) {
+    Label *labels = chunks[i].ctx.labels.labels;
+
+    memcpy(ctx->insts_out->insts + base, chunks[i].insts.insts,
+           chunks[i].insts.size * sizeof(inst_ty));
+
+    for (size_t j = 0; j < chunks[i].ctx.labels.count && tmp_ret_code == RET_CODE_OK; j++)
+      tmp_ret_code = label_table_add(&ctx->labels, labels[j].name, labels[j].loc + base);
+
+    chunks[i].base = base;
+    base += chunks[i].insts.size;
+    insts_out_free(&chunks[i].insts);
   }
+  if (tmp_ret_code == RET_CODE_OK) ctx->insts_out->size = insts_count;
 
-  *insts_out = insts;
-  return RET_CODE_OK;
+  for (int i = 0; i < chunk_count && tmp_ret_code == RET_CODE_OK; i++)
+    tmp_ret_code = resolve_labels(ctx, chunks[i].ctx.label_refs, chunks[i].ctx.label_ref_count,
+                                  chunks[i].base);
+
+  for (int i = 0; i < chunk_count; i++) {
+    compile_ctx_free(&chunks[i].ctx);
+    insts_out_free(&chunks[i].insts);
+    free(chunks[i].errors);
+  }
+
+  free(chunks);
+  free(threads);
+  return tmp_ret_code;
 }
 
-int read_file(char *file_path, char **contents_out) {
+int assembler_compile(char *filename, char *file_first_char, int opt_level,
+                      const VmHostFns *host_fns, InstsOut *insts_out) {
+  CompileCtx ctx = {.curr_pos = file_first_char,
+                    .file_first_char = file_first_char,
+                    .file_end = file_first_char + strlen(file_first_char),
+                    .insts_out = insts_out,
+                    .filename = filename,
+                    .host_fns = host_fns,
+                    .allow_directives = true};
+  int chunk_count = assembler_chunk_count(ctx.file_end - ctx.file_first_char);
+  int tmp_ret_code = RET_CODE_NORET;
+
+  if (chunk_count > 1) tmp_ret_code = compile_parallel(&ctx, chunk_count);
+
+  if (tmp_ret_code == RET_CODE_NORET) {
+    tmp_ret_code = compile_insts(&ctx);
+    if (tmp_ret_code == RET_CODE_OK)
+      tmp_ret_code = resolve_labels(&ctx, ctx.label_refs, ctx.label_ref_count, 0);
+  }
+
+  compile_ctx_free(&ctx);
+
+  if (tmp_ret_code == RET_CODE_OK) tmp_ret_code = optimizer_run(insts_out, opt_level);
+  if (tmp_ret_code != RET_CODE_OK) insts_out_free(insts_out);
+  return tmp_ret_code;
+}
+
+int read_file_sized(char *file_path, char **contents_out, long *size_out) {
   FILE *file = fopen(file_path, "rb");
 
   ERR_IF(!file, "File error: Could not open file '%s'", file_path);
@@ -692,6 +1871,12 @@ int read_file(char *file_path, char **contents_out) {
 
   rewind(file);
   char *buffer = malloc(filesize + 1);
+  if (!buffer) {
+    fclose(file);
+    print_err("Memory error: Could not allocate memory for '%s'", file_path);
+    return RET_CODE_ERR;
+  }
+
   size_t read_size = fread(buffer, 1, filesize, file);
 
   if (read_size != (unsigned long)filesize) {
@@ -705,77 +1890,108 @@ int read_file(char *file_path, char **contents_out) {
 
   fclose(file);
   *contents_out = buffer;
+  *size_out = filesize;
 
   return RET_CODE_OK;
 }
 
-int read_file_insts(char *file_path, inst_ty **contents_out, long *insts_count_out) {
-  FILE *file = fopen(file_path, "rb");
+int read_file(char *file_path, char **contents_out) {
+  long filesize;
+  return read_file_sized(file_path, contents_out, &filesize);
+}
 
-  ERR_IF(!file, "File error: Could not open file '%s'", file_path);
+int load_insts(char *name, void *bytes, size_t size, inst_ty **contents_out,
+               long *insts_count_out) {
+  ERR_IF(size < FILE_SIG_SIZE, "File error: File must have '%s' signature", FILE_SIG);
+  ERR_IF(memcmp(bytes, FILE_SIG, FILE_SIG_SIZE) != 0, "File error: Invalid file signature for '%s'",
+         name);
 
-  if (fseek(file, 0, SEEK_END) != 0) {
-    fclose(file);
-    print_err("File error: Could not obtain file size for '%s'", file_path);
-    return RET_CODE_ERR;
-  }
+  // files without the flags byte have 3 bytes left over after the instructions
+  size_t header_size = size % sizeof(inst_ty) == FILE_SIG_SIZE ? FILE_SIG_SIZE : FILE_HEADER_SIZE;
+  ERR_IF(size < header_size, "File error: File must have '%s' signature", FILE_SIG);
 
-  long filesize = ftell(file);
-  if (filesize < 0) {
-    fclose(file);
-    print_err("File error: Could not determine the file size for '%s'", file_path);
-    return RET_CODE_ERR;
-  }
+  size_t instruction_size = size - header_size;
 
-  if (filesize < FILE_SIG_SIZE) {
-    fclose(file);
-    fprintf(stderr, "File error: File must have '%s' signature\n", FILE_SIG);
-    return RET_CODE_ERR;
-  }
+  unsigned char flags = 0;
+  if (header_size == FILE_HEADER_SIZE) flags = ((unsigned char *)bytes)[FILE_SIG_SIZE];
+  ERR_IF(flags & ~FILE_FLAG_COMPRESSED, "File error: Unsupported file flags in '%s'", name);
 
-  long instruction_size = filesize - FILE_SIG_SIZE;
+  if (flags & FILE_FLAG_COMPRESSED) {
+    // every 16-bit unit expands to at most one instruction
+    inst_ty *buffer = malloc(instruction_size / 2 * sizeof(inst_ty) + 1);
+    size_t insts_count;
+    ERR_IF(!buffer, "Memory error: Could not allocate memory for instructions");
 
-  if (instruction_size % sizeof(inst_ty) != 0) {
-    fclose(file);
-    fprintf(stderr,
-            "File error: The number of instruction bytes must be a multiple of "
-            "%zu\n",
-            sizeof(inst_ty));
-    return RET_CODE_ERR;
+    if (!expand_insts((char *)bytes + header_size, instruction_size, buffer, &insts_count)) {
+      free(buffer);
+      print_err("File error: Invalid compressed instructions in '%s'", name);
+      return RET_CODE_ERR;
+    }
+
+    *contents_out = buffer;
+    *insts_count_out = insts_count;
+    return RET_CODE_OK;
   }
 
-  rewind(file);
+  ERR_IF(instruction_size % sizeof(inst_ty) != 0,
+         "File error: The number of instruction bytes must be a multiple of %zu",
+         sizeof(inst_ty));
 
-  char signature[FILE_SIG_SIZE];
-  if (fread(signature, 1, FILE_SIG_SIZE, file) != FILE_SIG_SIZE) {
-    fclose(file);
-    print_err("File error: Could not read the file signature from '%s'", file_path);
-    return RET_CODE_ERR;
-  }
+  inst_ty *buffer = malloc(instruction_size ? instruction_size : 1);
+  ERR_IF(!buffer, "Memory error: Could not allocate memory for instructions");
 
-  if (memcmp(signature, FILE_SIG, FILE_SIG_SIZE) != 0) {
-    fclose(file);
-    fprintf(stderr, "File error: Invalid file signature for '%s'\n", file_path);
-    return RET_CODE_ERR;
+  memcpy(buffer, (char *)bytes + header_size, instruction_size);
+  *contents_out = buffer;
+  *insts_count_out = instruction_size / sizeof(inst_ty);
+
+  return RET_CODE_OK;
+}
+
+int read_file_insts(char *file_path, inst_ty **contents_out, long *insts_count_out) {
+  char *contents;
+  long filesize;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = read_file_sized(file_path, &contents, &filesize)) != 0) return tmp_ret_code;
+
+  tmp_ret_code = load_insts(file_path, contents, filesize, contents_out, insts_count_out);
+  free(contents);
+  return tmp_ret_code;
+}
+
+// the compressed encoding is picked whenever it is smaller
+int write_insts_file(char *output_file, InstsOut *insts) {
+  FILE *file;
+  char header[FILE_HEADER_SIZE] = FILE_SIG;  // no flags
+  void *data = insts->insts;
+  size_t data_size = insts->size * sizeof(inst_ty);
+  void *compressed = malloc(data_size + 1);
+  size_t compressed_size;
+
+  if (compressed && compress_insts(insts->insts, insts->size, compressed, &compressed_size) &&
+      compressed_size < data_size) {
+    header[FILE_SIG_SIZE] = FILE_FLAG_COMPRESSED;
+    data = compressed;
+    data_size = compressed_size;
   }
 
-  inst_ty *buffer = malloc(instruction_size);
-  if (!buffer) {
-    fclose(file);
-    print_err("Memory error: Could not allocate memory for instructions");
+  file = fopen(output_file, "w+b");
+  if (!file) {
+    free(compressed);
+    print_err("File error: Could not open or create output file '%s'", output_file);
     return RET_CODE_ERR;
   }
 
-  if (fread(buffer, 1, instruction_size, file) != (size_t)instruction_size) {
-    free(buffer);
+  bool written = fwrite(header, 1, FILE_HEADER_SIZE, file) == FILE_HEADER_SIZE &&
+                 fwrite(data, 1, data_size, file) == data_size;
+  free(compressed);
+
+  if (!written) {
     fclose(file);
-    print_err("File error: Could not read instructions from '%s'", file_path);
+    print_err("File error: Could not write to file '%s'", output_file);
     return RET_CODE_ERR;
   }
 
-  fclose(file);
-  *contents_out = buffer;
-  *insts_count_out = instruction_size / sizeof(inst_ty);
-
+  ERR_IF(fclose(file) != 0, "File error: Could not write to file '%s'", output_file);
   return RET_CODE_OK;
 }
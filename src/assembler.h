@@ -2,15 +2,20 @@
 #define ASSEMBLER_H
 #include <stddef.h>
 
+#include "insts_out.h"
 #include "vm.h"
 
-typedef struct {
-  inst_ty *insts;
-  size_t size;
-  size_t capacity;
-} InstsOut;
+// part of the compile cache key, has to change whenever the same source assembles differently
+#define ASSEMBLER_VERSION 1
 
-int assembler_compile(char *filename, char *file_first_char, InstsOut *insts_out);
+// appends to `insts_out` which has to be empty, it is released if assembling fails; `hcall name`
+// is resolved against `host_fns`, which may be NULL
+int assembler_compile(char *filename, char *file_first_char, int opt_level,
+                      const VmHostFns *host_fns, InstsOut *insts_out);
 int read_file(char *file_path, char **contents_out);
+int read_file_sized(char *file_path, char **contents_out, long *size_out);
+int load_insts(char *name, void *bytes, size_t size, inst_ty **contents_out,
+               long *insts_count_out);
 int read_file_insts(char *file_path, inst_ty **contents_out, long *insts_count_out);
+int write_insts_file(char *output_file, InstsOut *insts);
 #endif  // ASSEMBLER_H
@@ -0,0 +1,75 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "hash.h"
+
+#define CACHE_PATH_MAX 4096
+
+CacheKey cache_key(const char *src, size_t src_size, int opt_level, const VmHostFns *host_fns) {
+  char salt[64];
+  int salt_len = snprintf(salt, sizeof(salt), "tvm assembler %d O%d", ASSEMBLER_VERSION, opt_level);
+  uint64_t seed = hash_bytes(salt, salt_len, 0);
+
+  // `hcall name` assembles to the index of the name
+  for (size_t i = 0; host_fns && i < host_fns->count; i++) {
+    const char *name = host_fns->fns[i].name ? host_fns->fns[i].name : "";
+    seed = hash_bytes(name, strlen(name) + 1, seed);
+  }
+
+  return (CacheKey){{hash_bytes(src, src_size, seed), hash_bytes(src, src_size, ~seed)}};
+}
+
+int cache_path(char *cache_dir, CacheKey key, char *suffix, char *path_out) {
+  int len = snprintf(path_out, CACHE_PATH_MAX, "%s/%016llx%016llx.tvm%s", cache_dir,
+                     (unsigned long long)key.hash[0], (unsigned long long)key.hash[1], suffix);
+  ERR_IF(len >= CACHE_PATH_MAX, "Cache error: Path of cache directory '%s' is too long", cache_dir);
+  return RET_CODE_OK;
+}
+
+int cache_lookup(char *cache_dir, CacheKey key, inst_ty **insts_out, long *insts_count_out) {
+  char path[CACHE_PATH_MAX];
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = cache_path(cache_dir, key, "", path)) != 0) return tmp_ret_code;
+
+  // missing or damaged entries are a miss, the program is assembled again and the entry replaced
+  err_capture_begin();
+  tmp_ret_code = read_file_insts(path, insts_out, insts_count_out);
+  err_capture_end();
+
+  return tmp_ret_code == RET_CODE_OK ? RET_CODE_OK : RET_CODE_NORET;
+}
+
+int cache_store(char *cache_dir, CacheKey key, InstsOut *insts) {
+  char path[CACHE_PATH_MAX];
+  char tmp_path[CACHE_PATH_MAX];
+  char tmp_suffix[32];
+  int tmp_ret_code;
+
+  ERR_IF(mkdir(cache_dir, 0777) != 0 && errno != EEXIST,
+         "Cache error: Could not create cache directory '%s' (%s)", cache_dir, strerror(errno));
+
+  // concurrent runs each write their own file, the rename makes the entry appear atomically
+  snprintf(tmp_suffix, sizeof(tmp_suffix), ".%ld.tmp", (long)getpid());
+  if ((tmp_ret_code = cache_path(cache_dir, key, "", path)) != 0) return tmp_ret_code;
+  if ((tmp_ret_code = cache_path(cache_dir, key, tmp_suffix, tmp_path)) != 0) return tmp_ret_code;
+
+  if ((tmp_ret_code = write_insts_file(tmp_path, insts)) != 0) {
+    unlink(tmp_path);
+    return tmp_ret_code;
+  }
+
+  if (rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    print_err("Cache error: Could not create cache entry '%s' (%s)", path, strerror(errno));
+    return RET_CODE_ERR;
+  }
+
+  return RET_CODE_OK;
+}
@@ -0,0 +1,20 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "assembler.h"
+#include "vm.h"
+
+// compiled programs are stored as regular `.tvm` files named after the key
+typedef struct {
+  uint64_t hash[2];
+} CacheKey;
+
+// the key covers the source, the optimization level, the host function names and
+// `ASSEMBLER_VERSION`
+CacheKey cache_key(const char *src, size_t src_size, int opt_level, const VmHostFns *host_fns);
+// RET_CODE_NORET if there is no usable entry
+int cache_lookup(char *cache_dir, CacheKey key, inst_ty **insts_out, long *insts_count_out);
+int cache_store(char *cache_dir, CacheKey key, InstsOut *insts);
+#endif  // CACHE_H
@@ -0,0 +1,331 @@
+#include "cfg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "ir.h"
+
+// reaching definitions are skipped for programs whose bit sets would not fit into this many words
+#define CFG_MAX_RD_WORDS (1 << 22)
+
+#define CFG_NO_BLOCK SIZE_MAX
+
+void cfg_add_succ(CfgBlock *block, size_t succ) {
+  for (int i = 0; i < block->succ_count; i++)
+    if (block->succs[i] == succ) return;
+  block->succs[block->succ_count++] = succ;
+}
+
+int cfg_build(IrProgram *ir, Cfg *cfg_out) {
+  Cfg cfg = {0};
+  bool *is_leader = calloc(ir->count + 1, sizeof(bool));
+  cfg.inst_block = malloc((ir->count + 1) * sizeof(size_t));
+  cfg.blocks = malloc((ir->count + 1) * sizeof(CfgBlock));
+
+  if (!is_leader || !cfg.inst_block || !cfg.blocks) {
+    free(is_leader);
+    cfg_free(&cfg);
+    print_err("Memory error: Could not allocate memory for the control flow graph");
+    return RET_CODE_ERR;
+  }
+
+  ir_mark_jump_targets(ir);
+
+  bool prev_ends_block = true;
+  for (size_t i = ir_next_live(ir, 0); i < ir->count; i = ir_next_live(ir, i + 1)) {
+    if (prev_ends_block || ir->insts[i].is_jump_target) is_leader[i] = true;
+    prev_ends_block = ir_is_jump(ir->insts[i].inst) || ir_is_terminator(ir->insts[i].inst);
+  }
+
+  for (size_t i = 0; i < ir->count; i++) {
+    cfg.inst_block[i] = CFG_NO_BLOCK;
+    if (ir->insts[i].removed) continue;
+
+    if (is_leader[i]) cfg.blocks[cfg.count++] = (CfgBlock){.first = i, .idom = CFG_NO_BLOCK};
+
+    cfg.blocks[cfg.count - 1].last = i;
+    cfg.inst_block[i] = cfg.count - 1;
+  }
+  free(is_leader);
+
+  for (size_t b = 0; b < cfg.count; b++) {
+    CfgBlock *block = &cfg.blocks[b];
+    IrInst *last = &ir->insts[block->last];
+    size_t fallthrough = ir_next_live(ir, block->last + 1);
+    size_t fallthrough_block = fallthrough < ir->count ? cfg.inst_block[fallthrough] : CFG_END;
+
+    if (ir_is_jump(last->inst)) {
+      size_t target = ir_next_live(ir, last->target);
+      cfg_add_succ(block, target < ir->count ? cfg.inst_block[target] : CFG_END);
+    }
+
+    if (!ir_is_terminator(last->inst)) cfg_add_succ(block, fallthrough_block);
+  }
+
+  size_t *pred_fill = calloc(cfg.count, sizeof(size_t));
+  for (size_t b = 0; b < cfg.count; b++)
+    for (int i = 0; i < cfg.blocks[b].succ_count; i++)
+      if (cfg.blocks[b].succs[i] != CFG_END) cfg.blocks[cfg.blocks[b].succs[i]].pred_count++;
+
+  for (size_t b = 0; b < cfg.count; b++)
+    cfg.blocks[b].preds = malloc((cfg.blocks[b].pred_count + 1) * sizeof(size_t));
+
+  for (size_t b = 0; b < cfg.count; b++) {
+    for (int i = 0; i < cfg.blocks[b].succ_count; i++) {
+      size_t succ = cfg.blocks[b].succs[i];
+      if (succ != CFG_END) cfg.blocks[succ].preds[pred_fill[succ]++] = b;
+    }
+  }
+  free(pred_fill);
+
+  // iterative depth first search for the reverse post order
+  cfg.rpo = malloc((cfg.count + 1) * sizeof(size_t));
+  size_t *stack = malloc((cfg.count + 1) * sizeof(size_t));
+  int *next_succ = calloc(cfg.count + 1, sizeof(int));
+  size_t stack_size = 0;
+  size_t post_count = 0;
+
+  if (cfg.count > 0) {
+    cfg.blocks[0].reachable = true;
+    stack[stack_size++] = 0;
+  }
+
+  while (stack_size > 0) {
+    size_t b = stack[stack_size - 1];
+    CfgBlock *block = &cfg.blocks[b];
+
+    if (next_succ[b] < block->succ_count) {
+      size_t succ = block->succs[next_succ[b]++];
+      if (succ != CFG_END && !cfg.blocks[succ].reachable) {
+        cfg.blocks[succ].reachable = true;
+        stack[stack_size++] = succ;
+      }
+      continue;
+    }
+
+    cfg.rpo[post_count++] = b;
+    stack_size--;
+  }
+
+  for (size_t i = 0; i < post_count / 2; i++) {
+    size_t tmp = cfg.rpo[i];
+    cfg.rpo[i] = cfg.rpo[post_count - 1 - i];
+    cfg.rpo[post_count - 1 - i] = tmp;
+  }
+
+  cfg.rpo_count = post_count;
+  for (size_t i = 0; i < post_count; i++) cfg.blocks[cfg.rpo[i]].rpo_idx = i;
+
+  free(stack);
+  free(next_succ);
+
+  *cfg_out = cfg;
+  return RET_CODE_OK;
+}
+
+void cfg_free(Cfg *cfg) {
+  if (cfg->blocks)
+    for (size_t b = 0; b < cfg->count; b++) free(cfg->blocks[b].preds);
+
+  free(cfg->blocks);
+  free(cfg->inst_block);
+  free(cfg->rpo);
+  *cfg = (Cfg){0};
+}
+
+// applies the instructions of `block` from `start_idx` to its end backwards
+unsigned cfg_transfer_liveness(IrProgram *ir, CfgBlock *block, size_t start_idx, unsigned live) {
+  for (size_t i = block->last + 1; i-- > start_idx;) {
+    if (ir->insts[i].removed) continue;
+    live = (live & ~ir_inst_defs(ir->insts[i].inst)) | ir_inst_uses(ir->insts[i].inst);
+  }
+  return live;
+}
+
+void cfg_compute_liveness(IrProgram *ir, Cfg *cfg) {
+  for (size_t b = 0; b < cfg->count; b++) cfg->blocks[b].live_in = cfg->blocks[b].live_out = 0;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (size_t b = cfg->count; b-- > 0;) {
+      CfgBlock *block = &cfg->blocks[b];
+      unsigned live_out = 0;
+
+      // falling off the end of the program is an error, nothing is observable there
+      for (int i = 0; i < block->succ_count; i++)
+        if (block->succs[i] != CFG_END) live_out |= cfg->blocks[block->succs[i]].live_in;
+
+      unsigned live_in = cfg_transfer_liveness(ir, block, block->first, live_out);
+      if (live_in != block->live_in || live_out != block->live_out) changed = true;
+
+      block->live_in = live_in;
+      block->live_out = live_out;
+    }
+  }
+}
+
+unsigned cfg_live_after(IrProgram *ir, Cfg *cfg, size_t inst_idx) {
+  CfgBlock *block = &cfg->blocks[cfg->inst_block[inst_idx]];
+  return cfg_transfer_liveness(ir, block, inst_idx + 1, block->live_out);
+}
+
+size_t cfg_intersect_doms(Cfg *cfg, size_t b1, size_t b2) {
+  while (b1 != b2) {
+    while (cfg->blocks[b1].rpo_idx > cfg->blocks[b2].rpo_idx) b1 = cfg->blocks[b1].idom;
+    while (cfg->blocks[b2].rpo_idx > cfg->blocks[b1].rpo_idx) b2 = cfg->blocks[b2].idom;
+  }
+  return b1;
+}
+
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy
+void cfg_compute_dominators(Cfg *cfg) {
+  if (cfg->rpo_count == 0) return;
+
+  for (size_t b = 0; b < cfg->count; b++) cfg->blocks[b].idom = CFG_NO_BLOCK;
+  cfg->blocks[cfg->rpo[0]].idom = cfg->rpo[0];
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (size_t i = 1; i < cfg->rpo_count; i++) {
+      CfgBlock *block = &cfg->blocks[cfg->rpo[i]];
+      size_t new_idom = CFG_NO_BLOCK;
+
+      for (size_t p = 0; p < block->pred_count; p++) {
+        size_t pred = block->preds[p];
+        if (cfg->blocks[pred].idom == CFG_NO_BLOCK) continue;
+        new_idom = new_idom == CFG_NO_BLOCK ? pred : cfg_intersect_doms(cfg, pred, new_idom);
+      }
+
+      if (new_idom != block->idom) {
+        block->idom = new_idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+bool cfg_dominates(Cfg *cfg, size_t dominator, size_t block) {
+  if (!cfg->blocks[block].reachable || !cfg->blocks[dominator].reachable) return false;
+
+  for (;;) {
+    if (block == dominator) return true;
+    if (cfg->blocks[block].idom == block) return false;
+    block = cfg->blocks[block].idom;
+  }
+}
+
+void cfg_reaching_defs_step(CfgReachingDefs *rd, size_t inst_idx, uint64_t *set) {
+  size_t def = rd->inst_def[inst_idx];
+  if (def == SIZE_MAX) return;
+
+  uint64_t *kill = &rd->reg_defs[rd->def_regs[def] * rd->words];
+  for (size_t w = 0; w < rd->words; w++) set[w] &= ~kill[w];
+  set[def / 64] |= 1ull << (def % 64);
+}
+
+// returns RET_CODE_NORET if the program is too large for the analysis
+int cfg_compute_reaching_defs(IrProgram *ir, Cfg *cfg, CfgReachingDefs *rd_out) {
+  CfgReachingDefs rd = {0};
+
+  rd.def_count = REGS_COUNT;
+  for (size_t i = 0; i < ir->count; i++)
+    if (!ir->insts[i].removed && (ir_inst_defs(ir->insts[i].inst) & IR_ALL_REGS)) rd.def_count++;
+
+  rd.words = (rd.def_count + 63) / 64;
+  if (rd.words * (cfg->count * 2 + REGS_COUNT) > CFG_MAX_RD_WORDS) return RET_CODE_NORET;
+
+  rd.def_insts = malloc(rd.def_count * sizeof(size_t));
+  rd.def_regs = malloc(rd.def_count * sizeof(int));
+  rd.inst_def = malloc((ir->count + 1) * sizeof(size_t));
+  rd.block_in = calloc(cfg->count * rd.words + 1, sizeof(uint64_t));
+  rd.block_out = calloc(cfg->count * rd.words + 1, sizeof(uint64_t));
+  rd.reg_defs = calloc(REGS_COUNT * rd.words, sizeof(uint64_t));
+  uint64_t *set = malloc(rd.words * sizeof(uint64_t));
+
+  if (!rd.def_insts || !rd.def_regs || !rd.inst_def || !rd.block_in || !rd.block_out ||
+      !rd.reg_defs || !set) {
+    free(set);
+    cfg_free_reaching_defs(&rd);
+    print_err("Memory error: Could not allocate memory for reaching definitions");
+    return RET_CODE_ERR;
+  }
+
+  size_t def = 0;
+  for (; def < REGS_COUNT; def++) {
+    rd.def_insts[def] = CFG_ENTRY_DEF;
+    rd.def_regs[def] = def;
+  }
+
+  for (size_t i = 0; i < ir->count; i++) {
+    unsigned defs = ir->insts[i].removed ? 0 : ir_inst_defs(ir->insts[i].inst) & IR_ALL_REGS;
+    rd.inst_def[i] = SIZE_MAX;
+    if (!defs) continue;
+
+    rd.def_insts[def] = i;
+    rd.def_regs[def] = __builtin_ctz(defs);
+    rd.inst_def[i] = def++;
+  }
+
+  for (def = 0; def < rd.def_count; def++)
+    rd.reg_defs[rd.def_regs[def] * rd.words + def / 64] |= 1ull << (def % 64);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    for (size_t r = 0; r < cfg->rpo_count; r++) {
+      size_t b = cfg->rpo[r];
+      CfgBlock *block = &cfg->blocks[b];
+      uint64_t *in = &rd.block_in[b * rd.words];
+      uint64_t *out = &rd.block_out[b * rd.words];
+
+      memset(in, 0, rd.words * sizeof(uint64_t));
+      if (r == 0)
+        for (def = 0; def < REGS_COUNT; def++) in[def / 64] |= 1ull << (def % 64);
+
+      for (size_t p = 0; p < block->pred_count; p++) {
+        uint64_t *pred_out = &rd.block_out[block->preds[p] * rd.words];
+        for (size_t w = 0; w < rd.words; w++) in[w] |= pred_out[w];
+      }
+
+      memcpy(set, in, rd.words * sizeof(uint64_t));
+      for (size_t i = block->first; i <= block->last; i++)
+        if (!ir->insts[i].removed) cfg_reaching_defs_step(&rd, i, set);
+
+      if (memcmp(set, out, rd.words * sizeof(uint64_t)) != 0) {
+        memcpy(out, set, rd.words * sizeof(uint64_t));
+        changed = true;
+      }
+    }
+  }
+
+  free(set);
+  *rd_out = rd;
+  return RET_CODE_OK;
+}
+
+void cfg_reaching_defs_at(IrProgram *ir, Cfg *cfg, CfgReachingDefs *rd, size_t inst_idx,
+                          uint64_t *set_out) {
+  size_t b = cfg->inst_block[inst_idx];
+  memcpy(set_out, &rd->block_in[b * rd->words], rd->words * sizeof(uint64_t));
+
+  for (size_t i = cfg->blocks[b].first; i < inst_idx; i++)
+    if (!ir->insts[i].removed) cfg_reaching_defs_step(rd, i, set_out);
+}
+
+void cfg_free_reaching_defs(CfgReachingDefs *rd) {
+  free(rd->def_insts);
+  free(rd->def_regs);
+  free(rd->inst_def);
+  free(rd->block_in);
+  free(rd->block_out);
+  free(rd->reg_defs);
+  *rd = (CfgReachingDefs){0};
+}
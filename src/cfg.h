@@ -0,0 +1,70 @@
+#ifndef CFG_H
+#define CFG_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir.h"
+
+// successor used for falling off the end of the program
+#define CFG_END SIZE_MAX
+
+typedef struct {
+  // first and last live instruction of the block (indices into `IrProgram.insts`)
+  size_t first;
+  size_t last;
+
+  size_t succs[2];
+  int succ_count;
+  size_t *preds;
+  size_t pred_count;
+
+  bool reachable;
+  size_t rpo_idx;
+  size_t idom;
+
+  // register masks including `IR_FLAGS_BIT`
+  unsigned live_in;
+  unsigned live_out;
+} CfgBlock;
+
+typedef struct {
+  CfgBlock *blocks;
+  size_t count;
+  // instruction index -> block index, SIZE_MAX for removed instructions
+  size_t *inst_block;
+  // reachable blocks in reverse post order
+  size_t *rpo;
+  size_t rpo_count;
+} Cfg;
+
+// definition sites, the first `REGS_COUNT` are the unknown register values at program entry
+typedef struct {
+  size_t *def_insts;
+  int *def_regs;
+  size_t def_count;
+  // instruction index -> definition index, SIZE_MAX if it defines no register
+  size_t *inst_def;
+  size_t words;  // uint64_t words per set
+  uint64_t *block_in;
+  uint64_t *block_out;
+  // definitions of every register, used as kill sets
+  uint64_t *reg_defs;
+} CfgReachingDefs;
+
+#define CFG_ENTRY_DEF SIZE_MAX
+
+int cfg_build(IrProgram *ir, Cfg *cfg_out);
+void cfg_free(Cfg *cfg);
+
+void cfg_compute_liveness(IrProgram *ir, Cfg *cfg);
+void cfg_compute_dominators(Cfg *cfg);
+bool cfg_dominates(Cfg *cfg, size_t dominator, size_t block);
+unsigned cfg_live_after(IrProgram *ir, Cfg *cfg, size_t inst_idx);
+
+int cfg_compute_reaching_defs(IrProgram *ir, Cfg *cfg, CfgReachingDefs *rd_out);
+void cfg_reaching_defs_step(CfgReachingDefs *rd, size_t inst_idx, uint64_t *set);
+void cfg_reaching_defs_at(IrProgram *ir, Cfg *cfg, CfgReachingDefs *rd, size_t inst_idx,
+                          uint64_t *set_out);
+void cfg_free_reaching_defs(CfgReachingDefs *rd);
+#endif  // CFG_H
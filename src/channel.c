@@ -0,0 +1,189 @@
+#include "channel.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+
+// failed attempts before a sender or receiver goes to sleep, a short burst catches the other side
+// catching up without paying for two syscalls; pointless with a single core
+#define CHANNEL_SPINS 1024
+
+static inline void channel_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+int channel_create(size_t capacity, int producers, int consumers, VmChannel **channel_out) {
+  size_t slot_count = 2;
+  while (slot_count < capacity) slot_count *= 2;
+
+  VmChannel *channel = aligned_alloc(_Alignof(VmChannel), sizeof(VmChannel));
+  ERR_IF(!channel, "Memory error: Could not allocate memory for the channel");
+
+  *channel = (VmChannel){.mask = slot_count - 1,
+                         .spsc = producers == 1 && consumers == 1,
+                         .spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? CHANNEL_SPINS : 0,
+                         .producers = producers,
+                         .consumers = consumers};
+  channel->slots = malloc(slot_count * sizeof(*channel->slots));
+  if (!channel->slots) {
+    free(channel);
+    print_err("Memory error: Could not allocate memory for the channel");
+    return RET_CODE_ERR;
+  }
+
+  for (size_t i = 0; i < slot_count; i++) channel->slots[i].seq = i;
+
+  *channel_out = channel;
+  return RET_CODE_OK;
+}
+
+void channel_free(VmChannel *channel) {
+  if (!channel) return;
+  free(channel->slots);
+  free(channel);
+}
+
+// a slot is free for position `pos` when its sequence number is `pos`, and filled when it is
+// `pos + 1`; a single producer or consumer owns its end and skips the compare and swap
+bool channel_try_push(VmChannel *channel, VmWord val) {
+  size_t pos = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+
+  for (;;) {
+    size_t seq = __atomic_load_n(&channel->slots[pos & channel->mask].seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)(seq - pos);
+
+    if (diff < 0) return false;
+
+    if (diff > 0)
+      pos = __atomic_load_n(&channel->tail, __ATOMIC_RELAXED);
+    else if (channel->spsc) {
+      __atomic_store_n(&channel->tail, pos + 1, __ATOMIC_RELAXED);
+      break;
+    }
+    else if (__atomic_compare_exchange_n(&channel->tail, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+      break;
+  }
+
+  channel->slots[pos & channel->mask].val = val;
+  __atomic_store_n(&channel->slots[pos & channel->mask].seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool channel_try_pop(VmChannel *channel, VmWord *val_out) {
+  size_t pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+
+  for (;;) {
+    size_t seq = __atomic_load_n(&channel->slots[pos & channel->mask].seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)(seq - (pos + 1));
+
+    if (diff < 0) return false;
+
+    if (diff > 0)
+      pos = __atomic_load_n(&channel->head, __ATOMIC_RELAXED);
+    else if (channel->spsc) {
+      __atomic_store_n(&channel->head, pos + 1, __ATOMIC_RELAXED);
+      break;
+    }
+    else if (__atomic_compare_exchange_n(&channel->head, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+      break;
+  }
+
+  *val_out = channel->slots[pos & channel->mask].val;
+  // frees the slot for the next lap
+  __atomic_store_n(&channel->slots[pos & channel->mask].seq, pos + channel->mask + 1,
+                   __ATOMIC_RELEASE);
+  return true;
+}
+
+// the fence orders the preceding send, receive or leave before the check for sleepers, which
+// raise `wake_needed` before they check the channel a last time, so no wakeup is lost; one wakeup
+// serves every sleeper until one raises the flag again
+void channel_wake(VmChannel *channel) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&channel->wake_needed, __ATOMIC_RELAXED) ||
+      !__atomic_exchange_n(&channel->wake_needed, false, __ATOMIC_RELAXED))
+    return;
+
+  __atomic_fetch_add(&channel->futex, 1, __ATOMIC_RELAXED);
+  syscall(SYS_futex, &channel->futex, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// returns right away if `futex` changed since `seen` was read
+void channel_sleep(VmChannel *channel, unsigned seen) {
+  syscall(SYS_futex, &channel->futex, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+void channel_send(VmChannel *channel, VmWord val) {
+  bool armed = false;
+  unsigned seen = 0;
+
+  for (int tries = 0;; tries++) {
+    if (channel_try_push(channel, val)) break;
+    if (!__atomic_load_n(&channel->consumers, __ATOMIC_SEQ_CST)) break;
+    if (tries < channel->spins) {
+      channel_pause();
+      continue;
+    }
+
+    // the channel is checked once more between raising the flag and sleeping
+    if (armed) channel_sleep(channel, seen);
+    __atomic_store_n(&channel->wake_needed, true, __ATOMIC_SEQ_CST);
+    seen = __atomic_load_n(&channel->futex, __ATOMIC_SEQ_CST);
+    armed = true;
+  }
+
+  channel_wake(channel);
+}
+
+bool channel_recv(VmChannel *channel, VmWord *val_out) {
+  bool armed = false;
+  bool received;
+  unsigned seen = 0;
+
+  for (int tries = 0;; tries++) {
+    if ((received = channel_try_pop(channel, val_out))) break;
+
+    // values sent before the last producer left are still delivered
+    if (!__atomic_load_n(&channel->producers, __ATOMIC_SEQ_CST)) {
+      received = channel_try_pop(channel, val_out);
+      break;
+    }
+    if (tries < channel->spins) {
+      channel_pause();
+      continue;
+    }
+
+    if (armed) channel_sleep(channel, seen);
+    __atomic_store_n(&channel->wake_needed, true, __ATOMIC_SEQ_CST);
+    seen = __atomic_load_n(&channel->futex, __ATOMIC_SEQ_CST);
+    armed = true;
+  }
+
+  if (received) channel_wake(channel);
+  return received;
+}
+
+bool channel_try_recv(VmChannel *channel, VmWord *val_out) {
+  if (!channel_try_pop(channel, val_out)) return false;
+  channel_wake(channel);
+  return true;
+}
+
+void channel_leave_producer(VmChannel *channel) {
+  __atomic_fetch_sub(&channel->producers, 1, __ATOMIC_SEQ_CST);
+  channel_wake(channel);
+}
+
+void channel_leave_consumer(VmChannel *channel) {
+  __atomic_fetch_sub(&channel->consumers, 1, __ATOMIC_SEQ_CST);
+  channel_wake(channel);
+}
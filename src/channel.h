@@ -0,0 +1,46 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// bounded queue of words between contexts running on different threads; lock-free ring buffer
+// (single producer/single consumer when created with one of each, Vyukov's MPMC queue otherwise),
+// blocked senders and receivers sleep on a futex instead of spinning
+struct VmChannel {
+  // slot sequence numbers tell whether a slot is free or filled for the current lap
+  struct {
+    size_t seq;
+    VmWord val;
+  } *slots;
+  size_t mask;
+  bool spsc;
+  int spins;
+
+  // the ends are written by different threads, so they live on separate cache lines
+  _Alignas(64) size_t head;
+  _Alignas(64) size_t tail;
+
+  _Alignas(64) int producers;
+  int consumers;
+  // bumped when sleepers are woken, they wait for it to change
+  unsigned futex;
+  bool wake_needed;
+};
+
+// `capacity` is rounded up to a power of two; `producers` and `consumers` count the contexts that
+// send and receive on the channel, each has to leave once it stopped
+int channel_create(size_t capacity, int producers, int consumers, VmChannel **channel_out);
+void channel_free(VmChannel *channel);
+
+// blocks while the channel is full, the value is dropped once every consumer left
+void channel_send(VmChannel *channel, VmWord val);
+// blocks while the channel is empty, false once it is empty and every producer left
+bool channel_recv(VmChannel *channel, VmWord *val_out);
+// false if the channel is empty
+bool channel_try_recv(VmChannel *channel, VmWord *val_out);
+
+void channel_leave_producer(VmChannel *channel);
+void channel_leave_consumer(VmChannel *channel);
+#endif  // CHANNEL_H
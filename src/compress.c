@@ -0,0 +1,244 @@
+#include "compress.h"
+
+#include <string.h>
+
+#define INST_MNEMONIC(inst) (inst_extract_bits(inst, FIELD_MNEMONIC, false))
+
+// binops (with `dst` equal to `op1`) and `mov` share one layout: bit 0 selects the immediate,
+// bits 1..3 are the destination, bits 4..7 the source register or a signed 4 bit immediate
+#define HALF_IS_IMM(ops) ((ops) & 1)
+#define HALF_DST(ops) (((ops) >> 1) & 7)
+#define HALF_SRC(ops) (((ops) >> 4) & 7)
+#define HALF_IMM(ops) ((int32_t)((ops) >> 4 ^ 8) - 8)
+#define HALF_IMM_MIN -8
+#define HALF_IMM_MAX 7
+#define HALF_JMP_OFF(ops) ((int32_t)((ops) ^ 0x80) - 0x80)
+
+bool expand_inst(uint16_t half, inst_ty *inst_out) {
+  inst_ty mnemonic = half & ~COMPRESSED_BIT & 0xff;
+  uint32_t ops = half >> 8;
+  inst_ty inst = mnemonic;
+
+  switch (mnemonic) {
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+    case MNEMONIC_OR:
+    case MNEMONIC_AND:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL:
+    case MNEMONIC_ROL:
+    case MNEMONIC_ROR:
+    case MNEMONIC_MULH:
+    case MNEMONIC_MULHU:
+    case MNEMONIC_DIVU:
+    case MNEMONIC_REMU:
+      inst = inst_insert_bits(inst, FIELD_BINOP_DST, HALF_DST(ops));
+      inst = inst_insert_bits(inst, FIELD_BINOP_OP1, HALF_DST(ops));
+      inst = inst_insert_bits(inst, FIELD_BINOP_IS_IMM, HALF_IS_IMM(ops));
+      if (HALF_IS_IMM(ops))
+        inst = inst_insert_bits(inst, FIELD_BINOP_IMM, HALF_IMM(ops));
+      else
+        inst = inst_insert_bits(inst, FIELD_BINOP_OP2, HALF_SRC(ops));
+      break;
+    case MNEMONIC_MOV:
+      inst = inst_insert_bits(inst, FIELD_MOV_DST, HALF_DST(ops));
+      inst = inst_insert_bits(inst, FIELD_MOV_IS_IMM, HALF_IS_IMM(ops));
+      if (HALF_IS_IMM(ops))
+        inst = inst_insert_bits(inst, FIELD_MOV_IMM, HALF_IMM(ops));
+      else
+        inst = inst_insert_bits(inst, FIELD_MOV_SRC, HALF_SRC(ops));
+      break;
+    case MNEMONIC_JMP:
+    case MNEMONIC_JMP_GREATER:
+    case MNEMONIC_JMP_LOWER:
+    case MNEMONIC_JMP_EQ:
+    case MNEMONIC_JMPZ:
+      inst = inst_insert_bits(inst, FIELD_JMP_OFF, HALF_JMP_OFF(ops));
+      break;
+    // all operands of these are in bits 8..15
+    case MNEMONIC_EXIT:
+    case MNEMONIC_INC:
+    case MNEMONIC_DEC:
+    case MNEMONIC_CMP:
+    case MNEMONIC_NOT:
+    case MNEMONIC_OUT:
+    case MNEMONIC_OUTB:
+    case MNEMONIC_FLUSH:
+    case MNEMONIC_INB:
+    case MNEMONIC_INW:
+    case MNEMONIC_INL:
+    case MNEMONIC_INQ:
+    case MNEMONIC_INLEN:
+    case MNEMONIC_POPCNT:
+    case MNEMONIC_CLZ:
+    case MNEMONIC_CTZ:
+    case MNEMONIC_BSWAP:
+    case MNEMONIC_FORK:
+    // only indices below 256 (32 for channels) fit
+    case MNEMONIC_HCALL:
+    case MNEMONIC_SEND:
+    case MNEMONIC_RECV:
+    case MNEMONIC_TRY_RECV:
+    case MNEMONIC_ALOAD:
+    case MNEMONIC_FENCE:
+    case MNEMONIC_JOIN:
+      inst |= ops << 8;
+      break;
+    default:
+      return false;
+  }
+
+  *inst_out = inst;
+  return true;
+}
+
+bool compress_inst(inst_ty inst, uint16_t *half_out) {
+  inst_ty mnemonic = INST_MNEMONIC(inst);
+  uint32_t ops;
+
+  switch (mnemonic) {
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+    case MNEMONIC_OR:
+    case MNEMONIC_AND:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL:
+    case MNEMONIC_ROL:
+    case MNEMONIC_ROR:
+    case MNEMONIC_MULH:
+    case MNEMONIC_MULHU:
+    case MNEMONIC_DIVU:
+    case MNEMONIC_REMU: {
+      int32_t imm = inst_extract_bits(inst, FIELD_BINOP_IMM, true);
+      bool is_imm = inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false);
+
+      if (is_imm && (imm < HALF_IMM_MIN || imm > HALF_IMM_MAX)) return false;
+      ops = is_imm | inst_extract_bits(inst, FIELD_BINOP_DST, false) << 1 |
+            (is_imm ? imm & 15 : inst_extract_bits(inst, FIELD_BINOP_OP2, false)) << 4;
+      break;
+    }
+    case MNEMONIC_MOV: {
+      int32_t imm = inst_extract_bits(inst, FIELD_MOV_IMM, true);
+      bool is_imm = inst_extract_bits(inst, FIELD_MOV_IS_IMM, false);
+
+      if (is_imm && (imm < HALF_IMM_MIN || imm > HALF_IMM_MAX)) return false;
+      ops = is_imm | inst_extract_bits(inst, FIELD_MOV_DST, false) << 1 |
+            (is_imm ? imm & 15 : inst_extract_bits(inst, FIELD_MOV_SRC, false)) << 4;
+      break;
+    }
+    case MNEMONIC_JMP:
+    case MNEMONIC_JMP_GREATER:
+    case MNEMONIC_JMP_LOWER:
+    case MNEMONIC_JMP_EQ:
+    case MNEMONIC_JMPZ: {
+      int32_t jmp_off = inst_extract_bits(inst, FIELD_JMP_OFF, true);
+      if (jmp_off < -0x80 || jmp_off > 0x7f) return false;
+      ops = jmp_off & 0xff;
+      break;
+    }
+    default:
+      ops = (inst >> 8) & 0xff;
+      break;
+  }
+
+  uint16_t half = COMPRESSED_BIT | mnemonic | ops << 8;
+  inst_ty expanded;
+
+  // anything the short form can not restore bit for bit, e.g. a binop with `dst` != `op1` or
+  // stray bits in unused fields, stays uncompressed
+  if (mnemonic & COMPRESSED_BIT || !expand_inst(half, &expanded) || expanded != inst) return false;
+
+  *half_out = half;
+  return true;
+}
+
+void write_half(unsigned char *out, size_t *pos, uint16_t half) {
+  if (out) memcpy(out + *pos, &half, sizeof(half));
+  *pos += sizeof(half);
+}
+
+void write_word(unsigned char *out, size_t *pos, inst_ty word) {
+  write_half(out, pos, word & 0xffff);
+  write_half(out, pos, word >> 16);
+}
+
+// every instruction is read before it is overwritten, the output never gets ahead of the input
+bool compress_insts(inst_ty *insts, size_t insts_count, void *out, size_t *size_out) {
+  size_t pos = 0;
+
+  for (size_t i = 0; i < insts_count; i++) {
+    inst_ty inst = insts[i];
+    uint16_t half;
+
+    if (compress_inst(inst, &half)) {
+      write_half(out, &pos, half);
+      continue;
+    }
+
+    // the loader would take the low half for a compressed instruction
+    if (INST_MNEMONIC(inst) & COMPRESSED_BIT) return false;
+
+    if (INST_MNEMONIC(inst) == MNEMONIC_LOAD) {
+      if (insts_count - i < 3) return false;
+
+      inst_ty payload[2] = {insts[i + 1], insts[i + 2]};
+      write_word(out, &pos, inst);
+      write_word(out, &pos, payload[0]);
+      write_word(out, &pos, payload[1]);
+      i += 2;
+      continue;
+    }
+
+    write_word(out, &pos, inst);
+  }
+
+  *size_out = pos;
+  return true;
+}
+
+bool read_word(const unsigned char *bytes, size_t size, size_t *pos, inst_ty *word_out) {
+  uint16_t halves[2];
+
+  if (size - *pos < sizeof(halves)) return false;
+  memcpy(halves, bytes + *pos, sizeof(halves));
+  *pos += sizeof(halves);
+
+  *word_out = halves[0] | (inst_ty)halves[1] << 16;
+  return true;
+}
+
+bool expand_insts(const void *bytes, size_t size, inst_ty *insts_out, size_t *insts_count_out) {
+  size_t pos = 0;
+  size_t insts_count = 0;
+
+  while (pos < size) {
+    uint16_t half;
+
+    if (size - pos < sizeof(half)) return false;
+    memcpy(&half, (const unsigned char *)bytes + pos, sizeof(half));
+
+    if (half & COMPRESSED_BIT) {
+      if (!expand_inst(half, &insts_out[insts_count++])) return false;
+      pos += sizeof(half);
+      continue;
+    }
+
+    inst_ty inst;
+    if (!read_word(bytes, size, &pos, &inst)) return false;
+    insts_out[insts_count++] = inst;
+
+    if (INST_MNEMONIC(inst) == MNEMONIC_LOAD) {
+      if (!read_word(bytes, size, &pos, &insts_out[insts_count++])) return false;
+      if (!read_word(bytes, size, &pos, &insts_out[insts_count++])) return false;
+    }
+  }
+
+  *insts_count_out = insts_count;
+  return true;
+}
@@ -0,0 +1,25 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// compressed programs are a stream of 16-bit units: a unit with bit 7 set is a whole instruction
+// (the mnemonic in bits 0..6, operands in bits 8..15), any other unit is the low half of an
+// uncompressed instruction followed by its high half; `load` payload words are always stored as
+// two halves each. Jump offsets keep counting words of the expanded program, so expanding
+// restores the original instructions exactly
+#define COMPRESSED_BIT 0x80
+
+bool compress_inst(inst_ty inst, uint16_t *half_out);
+bool expand_inst(uint16_t half, inst_ty *inst_out);
+
+// writes the stream to `out`, which may be `insts` itself, or with `out` NULL only computes its
+// size; false if the program can not be represented, e.g. because of a truncated `load`, in that
+// case `out` may be partially written
+bool compress_insts(inst_ty *insts, size_t insts_count, void *out, size_t *size_out);
+// `insts_out` needs room for `size / 2` instructions
+bool expand_insts(const void *bytes, size_t size, inst_ty *insts_out, size_t *insts_count_out);
+#endif  // COMPRESS_H
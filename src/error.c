@@ -1,12 +1,45 @@
 #include "error.h"
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 
+static _Thread_local bool err_capturing;
+static _Thread_local char err_capture_buf[ERR_CAPTURE_SIZE];
+static _Thread_local size_t err_capture_len;
+
+int err_vprintf(char *fmt, va_list args) {
+  if (!err_capturing) return vfprintf(stderr, fmt, args);
+
+  size_t rem = ERR_CAPTURE_SIZE - err_capture_len;
+  int written = vsnprintf(err_capture_buf + err_capture_len, rem, fmt, args);
+
+  if (written > 0) err_capture_len += (size_t)written < rem ? (size_t)written : rem - 1;
+  return written;
+}
+
+int err_printf(char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int written = err_vprintf(fmt, args);
+  va_end(args);
+  return written;
+}
+
 void print_err(char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
-  vfprintf(stderr, fmt, args);
+  err_vprintf(fmt, args);
   va_end(args);
-  fputc('\n', stderr);
+  err_printf("\n");
 }
+
+void err_capture_begin(void) {
+  err_capturing = true;
+  err_capture_len = 0;
+  err_capture_buf[0] = '\0';
+}
+
+void err_capture_end(void) { err_capturing = false; }
+
+const char *err_captured(void) { return err_capture_buf; }
@@ -1,22 +1,33 @@
 #ifndef ERROR_H
 #define ERROR_H
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 
+#define ERR_CAPTURE_SIZE 4096
+
 enum RetCode {
   RET_CODE_OK = 0,
   RET_CODE_ERR,
   RET_CODE_NORET,
+  // `vm_run` of a context waiting for a request of its executor, see executor.h
+  RET_CODE_SUSPENDED,
 };
 
-#define ERR_IF(_cond, _fmt, ...)            \
-  do {                                      \
-    if (_cond) {                            \
-      fprintf(stderr, _fmt, ##__VA_ARGS__); \
-      fputc('\n', stderr);                  \
-      return RET_CODE_ERR;                  \
-    }                                       \
+#define ERR_IF(_cond, _fmt, ...)      \
+  do {                                \
+    if (_cond) {                      \
+      print_err(_fmt, ##__VA_ARGS__); \
+      return RET_CODE_ERR;            \
+    }                                 \
   } while (0)
 
 void print_err(char *fmt, ...);
+int err_printf(char *fmt, ...);
+int err_vprintf(char *fmt, va_list args);
+
+// while capturing, errors of the calling thread are collected instead of written to stderr
+void err_capture_begin(void);
+void err_capture_end(void);
+const char *err_captured(void);
 #endif  // ERROR_H
@@ -0,0 +1,290 @@
+#include "executor.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+
+// there is no liburing, the rings are set up and driven with the raw system calls
+int ring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+void *ring_map(int ring_fd, size_t size, off_t off) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, off);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+void executor_init(VmExecutor *executor, unsigned entries) {
+  *executor = (VmExecutor){.ring_fd = -1};
+
+  struct io_uring_params params = {0};
+  int ring_fd = ring_setup(entries, &params);
+  if (ring_fd < 0) return;
+
+  // reads and writes at the current file position need IORING_FEAT_RW_CUR_POS
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(ring_fd);
+    return;
+  }
+
+  executor->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  executor->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  executor->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_map && executor->cq_map_size > executor->sq_map_size)
+    executor->sq_map_size = executor->cq_map_size;
+
+  executor->sq_map = ring_map(ring_fd, executor->sq_map_size, IORING_OFF_SQ_RING);
+  executor->cq_map = single_map ? executor->sq_map
+                                : ring_map(ring_fd, executor->cq_map_size, IORING_OFF_CQ_RING);
+  executor->sqes = ring_map(ring_fd, executor->sqes_size, IORING_OFF_SQES);
+  executor->waiting = malloc(params.cq_entries * sizeof(VmTask *));
+
+  if (!executor->sq_map || !executor->cq_map || !executor->sqes || !executor->waiting) {
+    free(executor->waiting);
+    if (executor->sq_map) munmap(executor->sq_map, executor->sq_map_size);
+    if (executor->cq_map && !single_map) munmap(executor->cq_map, executor->cq_map_size);
+    if (executor->sqes) munmap(executor->sqes, executor->sqes_size);
+    close(ring_fd);
+    *executor = (VmExecutor){.ring_fd = -1};
+    return;
+  }
+
+  char *sq = executor->sq_map;
+  char *cq = executor->cq_map;
+  executor->sq_head = (unsigned *)(sq + params.sq_off.head);
+  executor->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  executor->sq_array = (unsigned *)(sq + params.sq_off.array);
+  executor->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  executor->sq_entries = params.sq_entries;
+  executor->cq_head = (unsigned *)(cq + params.cq_off.head);
+  executor->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  executor->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  executor->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  executor->cq_entries = params.cq_entries;
+  executor->ring_fd = ring_fd;
+}
+
+void executor_push_ready(VmExecutor *executor, VmTask *task) {
+  task->next = NULL;
+  if (executor->ready_last)
+    executor->ready_last->next = task;
+  else
+    executor->ready_first = task;
+  executor->ready_last = task;
+}
+
+// hands the prepared requests to the kernel, waits for one completion if `wait` is set and
+// requests are in flight, then reaps every completion that arrived with one update of the head
+int executor_poll(VmExecutor *executor, bool wait) {
+  unsigned min_complete = wait && executor->in_flight ? 1 : 0;
+
+  if (executor->sq_pending || min_complete) {
+    int submitted = ring_enter(executor->ring_fd, executor->sq_pending, min_complete,
+                               min_complete ? IORING_ENTER_GETEVENTS : 0);
+    // interrupted waits are simply polled again
+    if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      print_err("VM error: Could not submit guest I/O (%s)", strerror(errno));
+      return RET_CODE_ERR;
+    }
+    if (submitted > 0) executor->sq_pending -= submitted;
+  }
+
+  unsigned head = *executor->cq_head;
+  unsigned tail = __atomic_load_n(executor->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &executor->cqes[head & executor->cq_mask];
+    VmTask *task = (VmTask *)(uintptr_t)cqe->user_data;
+
+    task->ctx->regs[task->dst_reg] = cqe->res;
+    executor->in_flight--;
+    VmTask *last = executor->waiting[executor->in_flight];
+    executor->waiting[task->waiting_idx] = last;
+    last->waiting_idx = task->waiting_idx;
+    executor_push_ready(executor, task);
+  }
+
+  __atomic_store_n(executor->cq_head, head, __ATOMIC_RELEASE);
+  return RET_CODE_OK;
+}
+
+// user data of the cancel request, tasks are never at this address
+#define EXECUTOR_CANCEL_DATA 0
+
+// cancels the requests still in flight and waits until the kernel is done with them, their
+// completions are dropped without touching the tasks, which the caller may free afterwards
+void executor_drain(VmExecutor *executor) {
+  if (executor->ring_fd < 0) return;
+
+  // requests the kernel has not seen yet are simply taken back
+  __atomic_store_n(executor->sq_tail, *executor->sq_tail - executor->sq_pending, __ATOMIC_RELEASE);
+  executor->in_flight -= executor->sq_pending;
+  executor->sq_pending = 0;
+  if (!executor->in_flight) return;
+
+  unsigned tail = *executor->sq_tail;
+  unsigned idx = tail & executor->sq_mask;
+  executor->sqes[idx] = (struct io_uring_sqe){.opcode = IORING_OP_ASYNC_CANCEL,
+                                              .cancel_flags = IORING_ASYNC_CANCEL_ANY,
+                                              .user_data = EXECUTOR_CANCEL_DATA};
+  executor->sq_array[idx] = idx;
+  __atomic_store_n(executor->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  unsigned to_submit = 1;
+
+  while (executor->in_flight) {
+    int submitted = ring_enter(executor->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+    if (submitted < 0 && errno != EINTR) {
+      print_err("VM error: Could not wait for guest I/O (%s)", strerror(errno));
+      return;
+    }
+    if (submitted > 0) to_submit = 0;
+
+    unsigned head = *executor->cq_head;
+    unsigned cq_tail = __atomic_load_n(executor->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++)
+      if (executor->cqes[head & executor->cq_mask].user_data != EXECUTOR_CANCEL_DATA)
+        executor->in_flight--;
+    __atomic_store_n(executor->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+void executor_free(VmExecutor *executor) {
+  if (executor->ring_fd >= 0) {
+    executor_drain(executor);
+
+    munmap(executor->sqes, executor->sqes_size);
+    if (executor->cq_map != executor->sq_map) munmap(executor->cq_map, executor->cq_map_size);
+    munmap(executor->sq_map, executor->sq_map_size);
+    close(executor->ring_fd);
+    free(executor->waiting);
+  }
+
+  *executor = (VmExecutor){.ring_fd = -1};
+}
+
+void executor_add(VmExecutor *executor, VmTask *task) {
+  task->ret_code = RET_CODE_ERR;
+  task->ctx->executor = executor;
+  executor_push_ready(executor, task);
+}
+
+int executor_run(VmExecutor *executor) {
+  while (executor->ready_first || executor->in_flight) {
+    // every ready context runs until it stops or waits, contexts woken or added meanwhile wait
+    // for the next round
+    VmTask *task = executor->ready_first;
+    executor->ready_first = executor->ready_last = NULL;
+
+    while (task) {
+      VmTask *next = task->next;
+
+      executor->current = task;
+      int tmp_ret_code = vm_run(task->ctx, &task->program_ret_code);
+      executor->current = NULL;
+
+      if (tmp_ret_code != RET_CODE_SUSPENDED) task->ret_code = tmp_ret_code;
+      task = next;
+    }
+
+    // the requests of a round go to the kernel together, waiting only if nothing can run
+    if (executor->ring_fd >= 0 && executor_poll(executor, !executor->ready_first) != 0) {
+      // the tasks still waiting never resume and may be freed once this returns
+      executor_drain(executor);
+      executor->ready_first = executor->ready_last = NULL;
+      return RET_CODE_ERR;
+    }
+  }
+
+  return RET_CODE_OK;
+}
+
+// whether the kernel could read memory while it writes it, contexts suspended together must never
+// share a buffer
+bool executor_overlaps(VmExecutor *executor, const VmIoRequest *req) {
+  char *begin = req->buf;
+
+  for (size_t i = 0; i < executor->in_flight; i++) {
+    const VmIoRequest *other = &executor->waiting[i]->req;
+    char *other_begin = other->buf;
+
+    if (begin < other_begin + other->len && other_begin < begin + req->len &&
+        (!req->write || !other->write))
+      return true;
+  }
+
+  return false;
+}
+
+int executor_submit(VmExecutor *executor, VmCtx *ctx, const VmIoRequest *req, int dst_reg) {
+  VmTask *task = executor->current;
+
+  // nothing would resume a context `executor_run` is not running
+  if (executor->ring_fd < 0 || !task || task->ctx != ctx) {
+    ctx->regs[dst_reg] = executor_io_sync(req);
+    return RET_CODE_OK;
+  }
+
+  // the completion queue must never overflow, so requests beyond its size wait for a slot
+  while (executor->in_flight == executor->cq_entries ||
+         *executor->sq_tail - __atomic_load_n(executor->sq_head, __ATOMIC_ACQUIRE) ==
+             executor->sq_entries) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = executor_poll(executor, executor->in_flight == executor->cq_entries)) != 0)
+      return tmp_ret_code;
+  }
+
+  ERR_IF(executor_overlaps(executor, req),
+         "VM error: Guest I/O of %zu bytes overlaps a request of another context in flight",
+         req->len);
+
+  unsigned tail = *executor->sq_tail;
+  unsigned idx = tail & executor->sq_mask;
+  struct io_uring_sqe *sqe = &executor->sqes[idx];
+
+  *sqe = (struct io_uring_sqe){
+      .opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ,
+      .fd = req->fd,
+      .off = req->off < 0 ? (uint64_t)-1 : (uint64_t)req->off,
+      .addr = (uint64_t)(uintptr_t)req->buf,
+      .len = req->len,
+      .user_data = (uint64_t)(uintptr_t)task,
+  };
+  executor->sq_array[idx] = idx;
+  __atomic_store_n(executor->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  task->dst_reg = dst_reg;
+  task->req = *req;
+  task->waiting_idx = executor->in_flight;
+  executor->waiting[executor->in_flight] = task;
+  executor->sq_pending++;
+  executor->in_flight++;
+  return RET_CODE_SUSPENDED;
+}
+
+VmWord executor_io_sync(const VmIoRequest *req) {
+  ssize_t done;
+
+  do {
+    if (req->write)
+      done = req->off < 0 ? write(req->fd, req->buf, req->len)
+                          : pwrite(req->fd, req->buf, req->len, req->off);
+    else
+      done = req->off < 0 ? read(req->fd, req->buf, req->len)
+                          : pread(req->fd, req->buf, req->len, req->off);
+  } while (done < 0 && errno == EINTR);
+
+  return done < 0 ? -errno : done;
+}
@@ -0,0 +1,88 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// requests in flight at once, `fread` and `fwrite` beyond that wait for a completion first
+#define EXECUTOR_DEFAULT_ENTRIES 64
+
+// a `fread` or `fwrite` of a context, `off` < 0 uses and moves the file position
+typedef struct {
+  bool write;
+  int fd;
+  void *buf;
+  size_t len;
+  VmWord off;
+} VmIoRequest;
+
+// a context run by an executor, owned by the caller and untouched by it until `executor_run`
+// returned
+typedef struct VmTask {
+  VmCtx *ctx;
+  // results of `vm_run` once the context stopped, RET_CODE_ERR if it never did
+  int ret_code;
+  int program_ret_code;
+  // receives the result of the pending request
+  int dst_reg;
+  // the pending request and where the task is in `waiting` of the executor
+  VmIoRequest req;
+  size_t waiting_idx;
+  struct VmTask *next;
+} VmTask;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// runs contexts on the calling thread; a context whose `fread` or `fwrite` went to the io_uring
+// instance is suspended until the completion arrives and the others run meanwhile
+struct VmExecutor {
+  // -1 without io_uring, requests then complete while they are submitted
+  int ring_fd;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;  // same as `sq_map` with IORING_FEAT_SINGLE_MMAP
+  size_t cq_map_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_head;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  struct io_uring_cqe *cqes;
+  unsigned cq_mask;
+  unsigned cq_entries;
+  // prepared but not yet handed to the kernel
+  unsigned sq_pending;
+  // prepared requests without a reaped completion
+  size_t in_flight;
+  // the tasks of those requests, `in_flight` of them
+  struct VmTask **waiting;
+
+  VmTask *ready_first;
+  VmTask *ready_last;
+  VmTask *current;
+};
+
+// falls back to running the requests synchronously if io_uring is not available
+void executor_init(VmExecutor *executor, unsigned entries);
+// cancels and waits for requests still in flight, so the kernel is done with the guest memory
+void executor_free(VmExecutor *executor);
+
+// queues the context of `task` to run, also while `executor_run` is running
+void executor_add(VmExecutor *executor, VmTask *task);
+// runs until every added context stopped, RET_CODE_ERR if the ring failed; either way no request
+// is in flight any more once it returns, so the tasks can be freed
+int executor_run(VmExecutor *executor);
+
+// called by the running context `ctx`, RET_CODE_SUSPENDED once the request is queued; the request
+// is done right away (RET_CODE_OK) without a ring or if `executor_run` is not running `ctx`.
+// RET_CODE_ERR if a request in flight reads or writes memory the new one writes or reads
+int executor_submit(VmExecutor *executor, VmCtx *ctx, const VmIoRequest *req, int dst_reg);
+// byte count or -errno like an io_uring completion
+VmWord executor_io_sync(const VmIoRequest *req);
+#endif  // EXECUTOR_H
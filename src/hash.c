@@ -0,0 +1,38 @@
+#include "hash.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_MUL 0x9e3779b97f4a7c15ull
+
+// murmur3 finalizer
+uint64_t hash_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+  const unsigned char *bytes = data;
+  uint64_t h = hash_mix(seed ^ (size * HASH_MUL));
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    uint64_t k;
+    memcpy(&k, bytes + i, 8);
+    h = (h ^ hash_mix(k)) * HASH_MUL;
+    h = h << 31 | h >> 33;
+  }
+
+  if (i < size) {
+    uint64_t k = 0;
+    memcpy(&k, bytes + i, size - i);
+    h = (h ^ hash_mix(k)) * HASH_MUL;
+  }
+
+  return hash_mix(h);
+}
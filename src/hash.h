@@ -0,0 +1,9 @@
+#ifndef HASH_H
+#define HASH_H
+#include <stddef.h>
+#include <stdint.h>
+
+// fast non-cryptographic hashes, different seeds give independent hashes of the same data
+uint64_t hash_mix(uint64_t x);
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed);
+#endif  // HASH_H
@@ -0,0 +1,47 @@
+#include "input.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+
+int input_map_file(char *file_path, VmInput *in_out) {
+  int fd = open(file_path, O_RDONLY);
+  ERR_IF(fd < 0, "File error: Could not open input file '%s' (%s)", file_path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    print_err("File error: Could not determine the size of input file '%s'", file_path);
+    return RET_CODE_ERR;
+  }
+
+  *in_out = (VmInput){0};
+
+  // empty files can not be mapped
+  if (st.st_size == 0) {
+    close(fd);
+    return RET_CODE_OK;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  ERR_IF(data == MAP_FAILED, "File error: Could not map input file '%s' (%s)", file_path,
+         strerror(errno));
+
+  // the guest reads front to back, let the kernel read ahead aggressively
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  in_out->data = data;
+  in_out->size = st.st_size;
+  return RET_CODE_OK;
+}
+
+void input_unmap(VmInput *in) {
+  if (in->data) munmap((void *)in->data, in->size);
+  *in = (VmInput){0};
+}
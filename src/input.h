@@ -0,0 +1,15 @@
+#ifndef INPUT_H
+#define INPUT_H
+#include <stddef.h>
+
+// read-only guest input, the VM only moves the cursor and never owns the memory
+typedef struct {
+  const unsigned char *data;
+  size_t size;
+  size_t pos;
+} VmInput;
+
+// maps the whole file read-only, `input_unmap` releases it
+int input_map_file(char *file_path, VmInput *in_out);
+void input_unmap(VmInput *in);
+#endif  // INPUT_H
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include "insts_out.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "error.h"
+
+#define INSTS_OUT_MIN_CAPACITY (1 << 14)
+
+size_t insts_out_map_size(size_t capacity) { return FILE_HEADER_SIZE + capacity * sizeof(inst_ty); }
+
+int insts_out_map_file(InstsOut *out, char *path) {
+  size_t tmp_path_size = strlen(path) + 32;
+  char *tmp_path = malloc(tmp_path_size);
+  ERR_IF(!tmp_path, "Memory error: Could not allocate memory for the output path");
+  snprintf(tmp_path, tmp_path_size, "%s.%ld.tmp", path, (long)getpid());
+
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    print_err("File error: Could not open or create output file '%s' (%s)", tmp_path,
+              strerror(errno));
+    free(tmp_path);
+    return RET_CODE_ERR;
+  }
+
+  size_t map_size = insts_out_map_size(INSTS_OUT_MIN_CAPACITY);
+  char *map = MAP_FAILED;
+  if (ftruncate(fd, map_size) == 0)
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED) {
+    print_err("File error: Could not map output file '%s' (%s)", tmp_path, strerror(errno));
+    close(fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    return RET_CODE_ERR;
+  }
+
+  memcpy(map, FILE_SIG, FILE_SIG_SIZE);
+  map[FILE_SIG_SIZE] = 0;  // flags
+
+  *out = (InstsOut){.insts = (inst_ty *)(map + FILE_HEADER_SIZE),
+                    .capacity = INSTS_OUT_MIN_CAPACITY,
+                    .map = map,
+                    .fd = fd,
+                    .path = path,
+                    .tmp_path = tmp_path};
+  return RET_CODE_OK;
+}
+
+bool grow_mapping(InstsOut *out, size_t new_capacity) {
+  size_t old_size = insts_out_map_size(out->capacity);
+  size_t new_size = insts_out_map_size(new_capacity);
+
+  if (ftruncate(out->fd, new_size) != 0) goto fail;
+
+  // allocate the blocks up front, running out of space while writing a mapping raises SIGBUS;
+  // filesystems without fallocate only get the sparse reservation
+  if (fallocate(out->fd, 0, old_size, new_size - old_size) != 0 && errno != EOPNOTSUPP)
+    goto fail;
+
+  char *map = mremap(out->map, old_size, new_size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) goto fail;
+
+  out->map = map;
+  out->insts = (inst_ty *)(map + FILE_HEADER_SIZE);
+  return true;
+
+fail:
+  print_err("File error: Could not grow output file '%s' (%s)", out->tmp_path, strerror(errno));
+  return false;
+}
+
+bool insts_out_reserve(InstsOut *out, size_t capacity) {
+  if (capacity <= out->capacity) return true;
+  if (out->failed) return false;
+
+  size_t new_capacity = capacity * 2 < INSTS_OUT_MIN_CAPACITY ? INSTS_OUT_MIN_CAPACITY : capacity * 2;
+
+  if (out->map) {
+    if (!grow_mapping(out, new_capacity)) {
+      out->failed = true;
+      return false;
+    }
+  }
+  else {
+    inst_ty *insts = realloc(out->insts, new_capacity * sizeof(inst_ty));
+    if (!insts) {
+      print_err("Memory error: Could not allocate memory for instructions");
+      out->failed = true;
+      return false;
+    }
+    out->insts = insts;
+  }
+
+  out->capacity = new_capacity;
+  return true;
+}
+
+void insts_out_append_data(InstsOut *out, void *data, size_t data_size) {
+  assert(data_size % sizeof(inst_ty) == 0);
+
+  if (!insts_out_reserve(out, out->size + data_size / sizeof(inst_ty))) return;
+
+  memcpy(out->insts + out->size, data, data_size);
+  out->size += data_size / sizeof(inst_ty);
+}
+
+void insts_out_append(InstsOut *out, inst_ty inst) {
+  if (out->size < out->capacity)
+    out->insts[out->size++] = inst;
+  else
+    insts_out_append_data(out, &inst, sizeof(inst_ty));
+}
+
+int insts_out_publish(InstsOut *out) {
+  assert(out->map);
+
+  size_t file_size = insts_out_map_size(out->size);
+  size_t compressed_size;
+  int tmp_ret_code = RET_CODE_OK;
+
+  // compressed in place once it is known to pay off, the stream never gets ahead of the input
+  if (compress_insts(out->insts, out->size, NULL, &compressed_size) &&
+      compressed_size < out->size * sizeof(inst_ty)) {
+    compress_insts(out->insts, out->size, out->insts, &compressed_size);
+    out->map[FILE_SIG_SIZE] = FILE_FLAG_COMPRESSED;
+    file_size = FILE_HEADER_SIZE + compressed_size;
+  }
+
+  munmap(out->map, insts_out_map_size(out->capacity));
+
+  bool written = ftruncate(out->fd, file_size) == 0;
+  if (close(out->fd) != 0) written = false;
+
+  if (!written) {
+    print_err("File error: Could not write to file '%s' (%s)", out->tmp_path, strerror(errno));
+    tmp_ret_code = RET_CODE_ERR;
+  }
+  else if (rename(out->tmp_path, out->path) != 0) {
+    print_err("File error: Could not create output file '%s' (%s)", out->path, strerror(errno));
+    tmp_ret_code = RET_CODE_ERR;
+  }
+
+  if (tmp_ret_code != RET_CODE_OK) unlink(out->tmp_path);
+
+  free(out->tmp_path);
+  *out = (InstsOut){0};
+  return tmp_ret_code;
+}
+
+void insts_out_free(InstsOut *out) {
+  if (out->map) {
+    munmap(out->map, insts_out_map_size(out->capacity));
+    close(out->fd);
+    unlink(out->tmp_path);
+    free(out->tmp_path);
+  }
+  else
+    free(out->insts);
+
+  *out = (InstsOut){0};
+}
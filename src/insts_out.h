@@ -0,0 +1,34 @@
+#ifndef INSTS_OUT_H
+#define INSTS_OUT_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// growable buffer of encoded instructions, either on the heap (zero initialized) or a shared
+// mapping of the output file set up with `insts_out_map_file`
+typedef struct {
+  inst_ty *insts;
+  size_t size;
+  size_t capacity;
+
+  // set once growing failed, all further appends are dropped
+  bool failed;
+
+  // only for file backed buffers, `map` starts with the file header followed by `insts`
+  char *map;
+  int fd;
+  char *path;
+  char *tmp_path;
+} InstsOut;
+
+// instructions are encoded straight into a temporary file next to `path`
+int insts_out_map_file(InstsOut *out, char *path);
+bool insts_out_reserve(InstsOut *out, size_t capacity);
+void insts_out_append_data(InstsOut *out, void *data, size_t data_size);
+void insts_out_append(InstsOut *out, inst_ty inst);
+// trims the file to its final size and renames it to its path in one atomic step
+int insts_out_publish(InstsOut *out);
+// unpublished files are removed
+void insts_out_free(InstsOut *out);
+#endif  // INSTS_OUT_H
@@ -0,0 +1,358 @@
+#include "ir.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "vm.h"
+
+#define IR_MNEMONIC(inst) (inst_extract_bits(inst, FIELD_MNEMONIC, false))
+
+int ir_inst_words(inst_ty inst) { return IR_MNEMONIC(inst) == MNEMONIC_LOAD ? 3 : 1; }
+
+bool ir_is_cond_jump(inst_ty inst) {
+  switch (IR_MNEMONIC(inst)) {
+    case MNEMONIC_JMP_GREATER:
+    case MNEMONIC_JMP_LOWER:
+    case MNEMONIC_JMP_EQ:
+    case MNEMONIC_JMPZ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool ir_is_jump(inst_ty inst) { return IR_MNEMONIC(inst) == MNEMONIC_JMP || ir_is_cond_jump(inst); }
+
+bool ir_is_terminator(inst_ty inst) {
+  return IR_MNEMONIC(inst) == MNEMONIC_JMP || IR_MNEMONIC(inst) == MNEMONIC_EXIT;
+}
+
+bool ir_is_known_mnemonic(inst_ty inst) {
+  return IR_MNEMONIC(inst) < MNEMONIC_SPAWN || IR_MNEMONIC(inst) == MNEMONIC_FREAD ||
+         IR_MNEMONIC(inst) == MNEMONIC_FWRITE;
+}
+
+bool ir_has_side_effects(inst_ty inst) {
+  switch (IR_MNEMONIC(inst)) {
+    case MNEMONIC_FORK:
+    case MNEMONIC_HCALL:
+    case MNEMONIC_RECV:
+    case MNEMONIC_TRY_RECV:
+    case MNEMONIC_CAS:
+    case MNEMONIC_XADD:
+    case MNEMONIC_XCHG:
+    case MNEMONIC_ALOAD:
+    case MNEMONIC_JOIN:
+    case MNEMONIC_SPAWN:
+    case MNEMONIC_FREAD:
+    case MNEMONIC_FWRITE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+unsigned ir_inst_defs(inst_ty inst) {
+  switch (IR_MNEMONIC(inst)) {
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+    case MNEMONIC_OR:
+    case MNEMONIC_AND:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL:
+    case MNEMONIC_ROL:
+    case MNEMONIC_ROR:
+    case MNEMONIC_MULH:
+    case MNEMONIC_MULHU:
+    case MNEMONIC_DIVU:
+    case MNEMONIC_REMU:
+      return 1u << inst_extract_bits(inst, FIELD_BINOP_DST, false);
+    case MNEMONIC_MOV:
+      return 1u << inst_extract_bits(inst, FIELD_MOV_DST, false);
+    case MNEMONIC_LOAD:
+      return 1u << inst_extract_bits(inst, FIELD_LOAD_DST, false);
+    case MNEMONIC_INC:
+      return 1u << inst_extract_bits(inst, FIELD_INC_REG, false);
+    case MNEMONIC_DEC:
+      return 1u << inst_extract_bits(inst, FIELD_DEC_REG, false);
+    case MNEMONIC_NOT:
+      return 1u << inst_extract_bits(inst, FIELD_NOT_DST, false);
+    case MNEMONIC_POPCNT:
+    case MNEMONIC_CLZ:
+    case MNEMONIC_CTZ:
+    case MNEMONIC_BSWAP:
+      return 1u << inst_extract_bits(inst, FIELD_UNOP_DST, false);
+    case MNEMONIC_INB:
+    case MNEMONIC_INW:
+    case MNEMONIC_INL:
+    case MNEMONIC_INQ:
+      return 1u << inst_extract_bits(inst, FIELD_IN_DST, false) | IR_FLAGS_BIT;
+    case MNEMONIC_INLEN:
+      return 1u << inst_extract_bits(inst, FIELD_IN_DST, false);
+    case MNEMONIC_CMP:
+      return IR_FLAGS_BIT;
+    case MNEMONIC_VADD:
+    case MNEMONIC_VSUB:
+    case MNEMONIC_VAND:
+    case MNEMONIC_VOR:
+    case MNEMONIC_VXOR:
+    case MNEMONIC_VCMPEQ:
+    case MNEMONIC_VCMPGT:
+    case MNEMONIC_VSHUF:
+    case MNEMONIC_VSHL:
+    case MNEMONIC_VSHR:
+    case MNEMONIC_VBCST:
+    case MNEMONIC_VINS:
+      return IR_VREGS_BIT;
+    case MNEMONIC_VIN:
+      return IR_VREGS_BIT | IR_FLAGS_BIT;
+    case MNEMONIC_VEXT:
+      return 1u << inst_extract_bits(inst, FIELD_VEC_DST, false);
+    // the child runs the same code after `fork`, so the instruction itself uses no registers
+    case MNEMONIC_FORK:
+      return 1u << inst_extract_bits(inst, FIELD_FORK_DST, false);
+    // host functions may read and write any register
+    case MNEMONIC_HCALL:
+      return IR_ALL_REGS;
+    case MNEMONIC_RECV:
+    case MNEMONIC_TRY_RECV:
+      return 1u << inst_extract_bits(inst, FIELD_CHAN_REG, false) | IR_FLAGS_BIT;
+    case MNEMONIC_CAS:
+      return 1u << inst_extract_bits(inst, FIELD_ATOMIC_DST, false) | IR_FLAGS_BIT;
+    case MNEMONIC_XADD:
+    case MNEMONIC_XCHG:
+    case MNEMONIC_ALOAD:
+      return 1u << inst_extract_bits(inst, FIELD_ATOMIC_DST, false);
+    case MNEMONIC_JOIN:
+      return 1u << inst_extract_bits(inst, FIELD_JOIN_REG, false);
+    case MNEMONIC_FREAD:
+    case MNEMONIC_FWRITE:
+      return 1u << inst_extract_bits(inst, FIELD_IO_DST, false);
+    default:
+      return 0;
+  }
+}
+
+unsigned ir_inst_uses(inst_ty inst) {
+  switch (IR_MNEMONIC(inst)) {
+    case MNEMONIC_EXIT:
+      // registers are observable once the program exits
+      return IR_ALL_REGS;
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+    case MNEMONIC_OR:
+    case MNEMONIC_AND:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL:
+    case MNEMONIC_ROL:
+    case MNEMONIC_ROR:
+    case MNEMONIC_MULH:
+    case MNEMONIC_MULHU:
+    case MNEMONIC_DIVU:
+    case MNEMONIC_REMU: {
+      unsigned uses = 1u << inst_extract_bits(inst, FIELD_BINOP_OP1, false);
+      if (!inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false))
+        uses |= 1u << inst_extract_bits(inst, FIELD_BINOP_OP2, false);
+      return uses;
+    }
+    case MNEMONIC_MOV:
+      if (inst_extract_bits(inst, FIELD_MOV_IS_IMM, false)) return 0;
+      return 1u << inst_extract_bits(inst, FIELD_MOV_SRC, false);
+    case MNEMONIC_INC:
+      return 1u << inst_extract_bits(inst, FIELD_INC_REG, false);
+    case MNEMONIC_DEC:
+      return 1u << inst_extract_bits(inst, FIELD_DEC_REG, false);
+    case MNEMONIC_NOT:
+      return 1u << inst_extract_bits(inst, FIELD_NOT_SRC, false);
+    case MNEMONIC_POPCNT:
+    case MNEMONIC_CLZ:
+    case MNEMONIC_CTZ:
+    case MNEMONIC_BSWAP:
+      return 1u << inst_extract_bits(inst, FIELD_UNOP_SRC, false);
+    case MNEMONIC_CMP:
+      return 1u << inst_extract_bits(inst, FIELD_CMP_REG1, false) |
+             1u << inst_extract_bits(inst, FIELD_CMP_REG2, false);
+    case MNEMONIC_JMP_GREATER:
+    case MNEMONIC_JMP_LOWER:
+    case MNEMONIC_JMP_EQ:
+    case MNEMONIC_JMPZ:
+      return IR_FLAGS_BIT;
+    case MNEMONIC_OUT:
+    case MNEMONIC_OUTB:
+      return 1u << inst_extract_bits(inst, FIELD_OUT_REG, false);
+    // only `f_zero` is written, the other flags of an earlier `cmp` are still read after them
+    case MNEMONIC_INB:
+    case MNEMONIC_INW:
+    case MNEMONIC_INL:
+    case MNEMONIC_INQ:
+      return IR_FLAGS_BIT;
+    case MNEMONIC_VBCST:
+    case MNEMONIC_VINS:
+      return IR_VREGS_BIT | 1u << inst_extract_bits(inst, FIELD_VEC_OP1, false);
+    case MNEMONIC_VADD:
+    case MNEMONIC_VSUB:
+    case MNEMONIC_VAND:
+    case MNEMONIC_VOR:
+    case MNEMONIC_VXOR:
+    case MNEMONIC_VCMPEQ:
+    case MNEMONIC_VCMPGT:
+    case MNEMONIC_VSHUF:
+    case MNEMONIC_VSHL:
+    case MNEMONIC_VSHR:
+    case MNEMONIC_VEXT:
+    case MNEMONIC_VOUT:
+      return IR_VREGS_BIT;
+    // like `inb`, only `f_zero` is written
+    case MNEMONIC_VIN:
+      return IR_VREGS_BIT | IR_FLAGS_BIT;
+    case MNEMONIC_HCALL:
+      return IR_ALL_REGS;
+    case MNEMONIC_SEND:
+      return 1u << inst_extract_bits(inst, FIELD_CHAN_REG, false);
+    // only `f_zero` is written
+    case MNEMONIC_RECV:
+    case MNEMONIC_TRY_RECV:
+      return IR_FLAGS_BIT;
+    // only `f_eq` is written, the other flags of an earlier `cmp` are still read after it
+    case MNEMONIC_CAS:
+      return 1u << inst_extract_bits(inst, FIELD_ATOMIC_DST, false) |
+             1u << inst_extract_bits(inst, FIELD_ATOMIC_ADDR, false) |
+             1u << inst_extract_bits(inst, FIELD_ATOMIC_SRC, false) | IR_FLAGS_BIT;
+    case MNEMONIC_XADD:
+    case MNEMONIC_XCHG:
+    case MNEMONIC_ASTORE:
+      return 1u << inst_extract_bits(inst, FIELD_ATOMIC_ADDR, false) |
+             1u << inst_extract_bits(inst, FIELD_ATOMIC_SRC, false);
+    case MNEMONIC_ALOAD:
+      return 1u << inst_extract_bits(inst, FIELD_ATOMIC_ADDR, false);
+    case MNEMONIC_JOIN:
+      return 1u << inst_extract_bits(inst, FIELD_JOIN_REG, false);
+    case MNEMONIC_FREAD:
+    case MNEMONIC_FWRITE:
+      return 1u << inst_extract_bits(inst, FIELD_IO_ADDR, false) |
+             1u << inst_extract_bits(inst, FIELD_IO_LEN, false) |
+             1u << inst_extract_bits(inst, FIELD_IO_OFF, false);
+    default:
+      return 0;
+  }
+}
+
+// returns RET_CODE_NORET if the code can not be represented (unknown opcodes, jumps into the
+// middle of `load` or outside of the program), the caller should leave such code untouched
+int ir_decode(inst_ty *insts, size_t insts_count, IrProgram *ir_out) {
+  if (insts_count == 0) return RET_CODE_NORET;
+
+  IrProgram ir = {.insts = malloc(insts_count * sizeof(IrInst)), .count = 0};
+  // maps word offsets to instruction indices, SIZE_MAX for `load` payload words
+  size_t *word_to_inst = malloc((insts_count + 1) * sizeof(size_t));
+
+  if (!ir.insts || !word_to_inst) {
+    free(ir.insts);
+    free(word_to_inst);
+    print_err("Memory error: Could not allocate memory for the optimizer");
+    return RET_CODE_ERR;
+  }
+
+  size_t word = 0;
+  while (word < insts_count) {
+    inst_ty inst = insts[word];
+    int words = ir_inst_words(inst);
+
+    if (!ir_is_known_mnemonic(inst) || word + words > insts_count) goto not_representable;
+
+    IrInst *ir_inst = &ir.insts[ir.count];
+    *ir_inst = (IrInst){.inst = inst};
+    for (int i = 1; i < words; i++) {
+      ir_inst->payload[i - 1] = insts[word + i];
+      word_to_inst[word + i] = SIZE_MAX;
+    }
+
+    word_to_inst[word] = ir.count++;
+    word += words;
+  }
+  word_to_inst[insts_count] = ir.count;
+
+  word = 0;
+  for (size_t i = 0; i < ir.count; i++) {
+    IrInst *ir_inst = &ir.insts[i];
+
+    if (ir_is_jump(ir_inst->inst)) {
+      int64_t target_word = (int64_t)word + inst_extract_bits(ir_inst->inst, FIELD_JMP_OFF, true);
+      if (target_word < 0 || target_word > (int64_t)insts_count) goto not_representable;
+      if (word_to_inst[target_word] == SIZE_MAX) goto not_representable;
+      ir_inst->target = word_to_inst[target_word];
+    }
+
+    word += ir_inst_words(ir_inst->inst);
+  }
+
+  free(word_to_inst);
+  ir_mark_jump_targets(&ir);
+  *ir_out = ir;
+  return RET_CODE_OK;
+
+not_representable:
+  free(word_to_inst);
+  free(ir.insts);
+  return RET_CODE_NORET;
+}
+
+size_t ir_next_live(IrProgram *ir, size_t idx) {
+  while (idx < ir->count && ir->insts[idx].removed) idx++;
+  return idx;
+}
+
+void ir_mark_jump_targets(IrProgram *ir) {
+  for (size_t i = 0; i < ir->count; i++) ir->insts[i].is_jump_target = false;
+
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst *ir_inst = &ir->insts[i];
+    if (ir_inst->removed || !ir_is_jump(ir_inst->inst)) continue;
+
+    ir_inst->target = ir_next_live(ir, ir_inst->target);
+    if (ir_inst->target < ir->count) ir->insts[ir_inst->target].is_jump_target = true;
+  }
+}
+
+// removed instructions fall through to the next live one, so jumps to them are redirected there;
+// the encoded program is never larger than the decoded one, so it is written back in place
+void ir_encode(IrProgram *ir, InstsOut *insts_out) {
+  size_t *word_pos = malloc((ir->count + 1) * sizeof(size_t));
+  size_t word = 0;
+
+  for (size_t i = 0; i < ir->count; i++) {
+    word_pos[i] = word;
+    if (!ir->insts[i].removed) word += ir_inst_words(ir->insts[i].inst);
+  }
+  word_pos[ir->count] = word;
+
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst *ir_inst = &ir->insts[i];
+    if (ir_inst->removed) continue;
+
+    inst_ty inst = ir_inst->inst;
+    if (ir_is_jump(inst))
+      inst = inst_insert_bits(inst, FIELD_JMP_OFF,
+                              (int32_t)(word_pos[ir_inst->target] - word_pos[i]));
+
+    insts_out->insts[word_pos[i]] = inst;
+    for (int j = 1; j < ir_inst_words(inst); j++)
+      insts_out->insts[word_pos[i] + j] = ir_inst->payload[j - 1];
+  }
+
+  insts_out->size = word;
+  free(word_pos);
+}
+
+void ir_free(IrProgram *ir) {
+  free(ir->insts);
+  *ir = (IrProgram){0};
+}
@@ -0,0 +1,48 @@
+#ifndef IR_H
+#define IR_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "assembler.h"
+#include "vm.h"
+
+// pseudo register used in def/use masks for the cmp flags
+#define IR_FLAGS_BIT (1u << REGS_COUNT)
+// pseudo register for the whole vector register file, vector writes also use it since they only
+// replace one register
+#define IR_VREGS_BIT (1u << (REGS_COUNT + 1))
+#define IR_ALL_REGS ((1u << REGS_COUNT) - 1)
+
+// decoded instruction, jump offsets are replaced by absolute indices into `IrProgram.insts`
+typedef struct {
+  inst_ty inst;
+  inst_ty payload[2];  // trailing words of `load`
+  size_t target;       // only valid for jumps, may be equal to `IrProgram.count`
+  bool removed;
+  bool is_jump_target;
+} IrInst;
+
+typedef struct {
+  IrInst *insts;
+  size_t count;
+} IrProgram;
+
+int ir_decode(inst_ty *insts, size_t insts_count, IrProgram *ir_out);
+void ir_encode(IrProgram *ir, InstsOut *insts_out);
+void ir_free(IrProgram *ir);
+
+size_t ir_next_live(IrProgram *ir, size_t idx);
+void ir_mark_jump_targets(IrProgram *ir);
+
+int ir_inst_words(inst_ty inst);
+bool ir_is_known_mnemonic(inst_ty inst);
+// reads or changes state besides its registers (other contexts, shared memory, host state), so it
+// must not be removed or moved even if its results are dead
+bool ir_has_side_effects(inst_ty inst);
+bool ir_is_jump(inst_ty inst);
+bool ir_is_cond_jump(inst_ty inst);
+bool ir_is_terminator(inst_ty inst);
+unsigned ir_inst_defs(inst_ty inst);
+unsigned ir_inst_uses(inst_ty inst);
+#endif  // IR_H
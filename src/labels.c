@@ -0,0 +1,82 @@
+#include "labels.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "hash.h"
+
+#define LABEL_TABLE_MIN_SLOTS 64
+
+bool str_slice_eq(StrSlice s1, StrSlice s2) {
+  if (s1.last_char - s1.first_char != s2.last_char - s2.first_char) return false;
+
+  return memcmp(s1.first_char, s2.first_char, s1.last_char - s1.first_char + 1) == 0;
+}
+
+size_t label_slot(LabelTable *table, StrSlice name) {
+  size_t mask = table->slot_count - 1;
+  size_t slot = hash_bytes(name.first_char, name.last_char - name.first_char + 1, 0) & mask;
+
+  while (table->slots[slot] && !str_slice_eq(table->labels[table->slots[slot] - 1].name, name))
+    slot = (slot + 1) & mask;
+
+  return slot;
+}
+
+int label_table_rehash(LabelTable *table, size_t slot_count) {
+  size_t *slots = calloc(slot_count, sizeof(size_t));
+  ERR_IF(!slots, "Memory error: Could not allocate memory for labels");
+
+  free(table->slots);
+  table->slots = slots;
+  table->slot_count = slot_count;
+
+  for (size_t i = 0; i < table->count; i++)
+    table->slots[label_slot(table, table->labels[i].name)] = i + 1;
+
+  return RET_CODE_OK;
+}
+
+int label_table_add(LabelTable *table, StrSlice name, VmWord loc) {
+  // keep the load factor at or below one half
+  if ((table->count + 1) * 2 > table->slot_count) {
+    int tmp_ret_code;
+    size_t slot_count = table->slot_count ? table->slot_count * 2 : LABEL_TABLE_MIN_SLOTS;
+    if ((tmp_ret_code = label_table_rehash(table, slot_count)) != 0) return tmp_ret_code;
+  }
+
+  size_t slot = label_slot(table, name);
+  if (table->slots[slot]) return RET_CODE_OK;
+
+  if (table->count == table->capacity) {
+    size_t capacity = table->capacity ? table->capacity * 2 : LABEL_TABLE_MIN_SLOTS;
+    Label *labels = realloc(table->labels, capacity * sizeof(Label));
+    ERR_IF(!labels, "Memory error: Could not allocate memory for labels");
+    table->labels = labels;
+    table->capacity = capacity;
+  }
+
+  table->labels[table->count++] = (Label){.name = name, .loc = loc};
+  table->slots[slot] = table->count;
+  return RET_CODE_OK;
+}
+
+Label *label_table_lookup(LabelTable *table, StrSlice name) {
+  if (!table->count) return NULL;
+
+  size_t slot = label_slot(table, name);
+  return table->slots[slot] ? &table->labels[table->slots[slot] - 1] : NULL;
+}
+
+VmWord label_table_find(LabelTable *table, StrSlice name) {
+  Label *label = label_table_lookup(table, name);
+  return label ? label->loc : -1;
+}
+
+void label_table_free(LabelTable *table) {
+  free(table->labels);
+  free(table->slots);
+  *table = (LabelTable){0};
+}
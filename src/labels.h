@@ -0,0 +1,37 @@
+#ifndef LABELS_H
+#define LABELS_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+typedef struct {
+  char *first_char;
+  char *last_char;
+} StrSlice;
+
+typedef struct {
+  StrSlice name;
+  VmWord loc;
+} Label;
+
+// labels in definition order with a hash index over their names
+typedef struct {
+  Label *labels;
+  size_t count;
+  size_t capacity;
+  // label index + 1, 0 marks an empty slot
+  size_t *slots;
+  size_t slot_count;
+} LabelTable;
+
+bool str_slice_eq(StrSlice s1, StrSlice s2);
+
+// the first definition of a name wins, later ones are ignored
+int label_table_add(LabelTable *table, StrSlice name, VmWord loc);
+// NULL if the name is not defined, the pointer is valid until the next `label_table_add`
+Label *label_table_lookup(LabelTable *table, StrSlice name);
+// -1 if the label is not defined
+VmWord label_table_find(LabelTable *table, StrSlice name);
+void label_table_free(LabelTable *table);
+#endif  // LABELS_H
@@ -0,0 +1,381 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "error.h"
+#include "memo.h"
+#include "program.h"
+#include "threads.h"
+#include "tvm.h"
+#include "vm.h"
+
+_Static_assert(TVM_REGS_COUNT == REGS_COUNT, "register count mismatch");
+
+// spawns beyond this fail in the guest
+#define TVM_MAX_THREADS 1024
+
+// contexts reference the shared `Program` directly, so they stay valid once this handle is freed
+struct TvmProgram {
+  Program *program;
+};
+
+struct TvmCtx {
+  VmCtx vm;
+  Program *program;
+  int output_fd;
+  VmInput input;
+  VmHostFns host_fns;
+  VmWord *shared_mem;
+  size_t shared_words;
+  // copy of the shared memory a forked child got from its parent, NULL otherwise
+  VmWord *own_shared_mem;
+  int *files;
+  size_t file_count;
+  TvmMemo *memo;
+  TvmForkHandler fork_handler;
+  void *fork_data;
+  // set for forked children until their first run, which continues after the `fork`
+  bool resume;
+};
+
+struct TvmMemo {
+  Memo memo;
+};
+
+static _Thread_local const char *last_error = "";
+
+static TvmStatus fail(TvmStatus status, const char *msg) {
+  last_error = msg;
+  return status;
+}
+
+// captured diagnostics of the internal functions become the error message
+static TvmStatus fail_captured(TvmStatus status) {
+  err_capture_end();
+  last_error = err_captured();
+  return status;
+}
+
+// `hcall` would call a NULL function
+static bool host_fns_valid(const TvmHostFnEntry *host_fns, size_t host_fn_count) {
+  for (size_t i = 0; i < host_fn_count; i++)
+    if (!host_fns[i].fn) return false;
+  return true;
+}
+
+// the internal table has the same entries, `TvmHostFn` and `VmHostFn` are the same type
+static VmHostFnEntry *copy_host_fns(const TvmHostFnEntry *host_fns, size_t host_fn_count) {
+  VmHostFnEntry *fns = malloc((host_fn_count ? host_fn_count : 1) * sizeof(VmHostFnEntry));
+  if (!fns) return NULL;
+
+  for (size_t i = 0; i < host_fn_count; i++)
+    fns[i] = (VmHostFnEntry){.name = host_fns[i].name, .fn = host_fns[i].fn,
+                             .data = host_fns[i].data};
+  return fns;
+}
+
+TvmStatus tvm_assemble(const char *src, size_t src_len, int opt_level,
+                       TvmProgram **program_out) {
+  return tvm_assemble_with_host_fns(src, src_len, opt_level, NULL, 0, program_out);
+}
+
+TvmStatus tvm_assemble_with_host_fns(const char *src, size_t src_len, int opt_level,
+                                     const TvmHostFnEntry *host_fns, size_t host_fn_count,
+                                     TvmProgram **program_out) {
+  if (!src || !program_out || (!host_fns && host_fn_count))
+    return fail(TVM_ERR_ARG, "Invalid argument");
+  if (!host_fns_valid(host_fns, host_fn_count))
+    return fail(TVM_ERR_ARG, "Host function entry without a function");
+
+  TvmProgram *program = malloc(sizeof(TvmProgram));
+  // the assembler expects a null terminated source
+  char *src_copy = malloc(src_len + 1);
+  VmHostFns fns = {.fns = copy_host_fns(host_fns, host_fn_count), .count = host_fn_count};
+
+  if (!program || !src_copy || !fns.fns) {
+    free(program);
+    free(src_copy);
+    free((void *)fns.fns);
+    return fail(TVM_ERR_NOMEM, "Could not allocate memory for the program");
+  }
+
+  memcpy(src_copy, src, src_len);
+  src_copy[src_len] = '\0';
+
+  InstsOut insts = {0};
+  err_capture_begin();
+  int tmp_ret_code = assembler_compile("<memory>", src_copy, opt_level, &fns, &insts);
+  free(src_copy);
+  free((void *)fns.fns);
+
+  if (tmp_ret_code != 0) {
+    free(program);
+    return fail_captured(TVM_ERR_ASSEMBLE);
+  }
+
+  if (program_create(insts.insts, insts.size, &program->program) != 0) {
+    free(insts.insts);
+    free(program);
+    return fail_captured(TVM_ERR_NOMEM);
+  }
+  err_capture_end();
+
+  *program_out = program;
+  return TVM_OK;
+}
+
+TvmStatus tvm_load(const void *bin, size_t bin_len, TvmProgram **program_out) {
+  if (!bin || !program_out) return fail(TVM_ERR_ARG, "Invalid argument");
+
+  TvmProgram *program = malloc(sizeof(TvmProgram));
+  if (!program) return fail(TVM_ERR_NOMEM, "Could not allocate memory for the program");
+
+  inst_ty *insts;
+  long insts_count;
+
+  err_capture_begin();
+  if (load_insts("<memory>", (void *)bin, bin_len, &insts, &insts_count) != 0) {
+    free(program);
+    return fail_captured(TVM_ERR_FORMAT);
+  }
+
+  if (program_create(insts, insts_count, &program->program) != 0) {
+    free(insts);
+    free(program);
+    return fail_captured(TVM_ERR_NOMEM);
+  }
+  err_capture_end();
+
+  *program_out = program;
+  return TVM_OK;
+}
+
+const uint32_t *tvm_program_code(const TvmProgram *program, size_t *insts_count_out) {
+  *insts_count_out = program->program->insts_count;
+  return program->program->insts;
+}
+
+void tvm_program_free(TvmProgram *program) {
+  if (!program) return;
+  program_release(program->program);
+  free(program);
+}
+
+TvmStatus tvm_ctx_create(const TvmProgram *program, TvmCtx **ctx_out) {
+  if (!program || !ctx_out) return fail(TVM_ERR_ARG, "Invalid argument");
+
+  TvmCtx *ctx = malloc(sizeof(TvmCtx));
+  if (!ctx) return fail(TVM_ERR_NOMEM, "Could not allocate memory for the context");
+
+  *ctx = (TvmCtx){.program = program_retain(program->program), .output_fd = -1};
+  tvm_ctx_reset(ctx);
+  *ctx_out = ctx;
+  return TVM_OK;
+}
+
+// the child gets its own copies of the tables and the shared memory of the parent and shares
+// everything else
+static VmWord fork_child(VmCtx *vm, void *data) {
+  TvmCtx *parent = data;
+  TvmCtx *child = malloc(sizeof(TvmCtx));
+  VmHostFnEntry *fns = malloc((parent->host_fns.count ? parent->host_fns.count : 1) *
+                              sizeof(VmHostFnEntry));
+  int *files = malloc((parent->file_count ? parent->file_count : 1) * sizeof(int));
+  VmWord *shared_mem = vm_copy_shared_mem(vm);
+
+  if (!child || !fns || !files || !shared_mem) {
+    free(child);
+    free(fns);
+    free(files);
+    free(shared_mem);
+    return -1;
+  }
+
+  if (parent->host_fns.count)
+    memcpy(fns, parent->host_fns.fns, parent->host_fns.count * sizeof(VmHostFnEntry));
+  if (parent->file_count) memcpy(files, parent->files, parent->file_count * sizeof(int));
+
+  *child = *parent;
+  child->program = program_retain(parent->program);
+  child->host_fns.fns = fns;
+  child->files = files;
+  child->shared_mem = child->own_shared_mem = shared_mem;
+  child->resume = true;
+
+  vm_fork(vm, &child->vm);
+  child->vm.host_fns = &child->host_fns;
+  child->vm.files = files;
+  child->vm.shared_mem = shared_mem;
+  child->vm.fork_data = child;
+  child->vm.threads = NULL;
+
+  return parent->fork_handler(child, parent->fork_data);
+}
+
+void tvm_ctx_free(TvmCtx *ctx) {
+  if (!ctx) return;
+  vm_deinit_ctx(&ctx->vm);
+  program_release(ctx->program);
+  free((void *)ctx->host_fns.fns);
+  free(ctx->files);
+  free(ctx->own_shared_mem);
+  free(ctx);
+}
+
+void tvm_ctx_reset(TvmCtx *ctx) {
+  vm_deinit_ctx(&ctx->vm);
+  vm_init_ctx(&ctx->vm, ctx->program);
+  ctx->vm.out.fd = ctx->output_fd;
+  ctx->vm.in = ctx->input;
+  ctx->vm.host_fns = &ctx->host_fns;
+  ctx->vm.shared_mem = ctx->shared_mem;
+  ctx->vm.shared_words = ctx->shared_words;
+  ctx->vm.files = ctx->files;
+  ctx->vm.file_count = ctx->file_count;
+  ctx->vm.fork_handler = ctx->fork_handler ? fork_child : NULL;
+  ctx->vm.fork_data = ctx;
+}
+
+TvmStatus tvm_ctx_set_output_fd(TvmCtx *ctx, int fd) {
+  if (!ctx) return fail(TVM_ERR_ARG, "Invalid argument");
+  ctx->output_fd = fd < 0 ? -1 : fd;
+  ctx->vm.out.fd = ctx->output_fd;
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_set_reg(TvmCtx *ctx, int reg, int64_t val) {
+  if (!ctx || reg < 0 || reg >= REGS_COUNT) return fail(TVM_ERR_ARG, "Invalid register");
+  ctx->vm.regs[reg] = val;
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_get_reg(const TvmCtx *ctx, int reg, int64_t *val_out) {
+  if (!ctx || !val_out || reg < 0 || reg >= REGS_COUNT)
+    return fail(TVM_ERR_ARG, "Invalid register");
+  *val_out = ctx->vm.regs[reg];
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_run(TvmCtx *ctx, int *exit_code_out) {
+  if (!ctx) return fail(TVM_ERR_ARG, "Invalid argument");
+
+  VmWord regs[REGS_COUNT];
+  int exit_code = 0;
+
+  // forked children continue where the parent left them the first time
+  if (!ctx->resume) {
+    memcpy(regs, ctx->vm.regs, sizeof(regs));
+    tvm_ctx_reset(ctx);
+    memcpy(ctx->vm.regs, regs, sizeof(regs));
+  }
+  ctx->resume = false;
+
+  // every run has its own threads, their ids start at 1 again
+  VmThreads threads;
+  threads_init(&threads, TVM_MAX_THREADS);
+  threads.capture_errors = true;
+  ctx->vm.threads = &threads;
+
+  err_capture_begin();
+  int tmp_ret_code = memo_run(ctx->memo ? &ctx->memo->memo : NULL, &ctx->vm, &exit_code);
+  bool threads_failed = threads_free(&threads) != 0;
+  ctx->vm.threads = NULL;
+
+  if (tmp_ret_code != 0) return fail_captured(TVM_ERR_RUNTIME);
+  err_capture_end();
+  if (threads_failed) return fail(TVM_ERR_RUNTIME, "A spawned thread stopped on an error");
+
+  if (exit_code_out) *exit_code_out = exit_code;
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_set_host_fns(TvmCtx *ctx, const TvmHostFnEntry *host_fns,
+                               size_t host_fn_count) {
+  if (!ctx || (!host_fns && host_fn_count)) return fail(TVM_ERR_ARG, "Invalid argument");
+  if (!host_fns_valid(host_fns, host_fn_count))
+    return fail(TVM_ERR_ARG, "Host function entry without a function");
+
+  VmHostFnEntry *fns = copy_host_fns(host_fns, host_fn_count);
+  if (!fns) return fail(TVM_ERR_NOMEM, "Could not allocate memory for the host functions");
+
+  free((void *)ctx->host_fns.fns);
+  ctx->host_fns = (VmHostFns){.fns = fns, .count = host_fn_count};
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_set_input(TvmCtx *ctx, const void *data, size_t len) {
+  if (!ctx || (!data && len)) return fail(TVM_ERR_ARG, "Invalid argument");
+  ctx->input = (VmInput){.data = data, .size = len};
+  ctx->vm.in = ctx->input;
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_set_shared_memory(TvmCtx *ctx, int64_t *words, size_t word_count) {
+  if (!ctx || (!words && word_count)) return fail(TVM_ERR_ARG, "Invalid argument");
+  free(ctx->own_shared_mem);
+  ctx->own_shared_mem = NULL;
+  ctx->shared_mem = words;
+  ctx->shared_words = word_count;
+  ctx->vm.shared_mem = words;
+  ctx->vm.shared_words = word_count;
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_set_files(TvmCtx *ctx, const int *fds, size_t fd_count) {
+  if (!ctx || (!fds && fd_count)) return fail(TVM_ERR_ARG, "Invalid argument");
+  if (fd_count > 256) return fail(TVM_ERR_ARG, "More than 256 files");
+
+  int *files = malloc((fd_count ? fd_count : 1) * sizeof(int));
+  if (!files) return fail(TVM_ERR_NOMEM, "Could not allocate memory for the files");
+  if (fd_count) memcpy(files, fds, fd_count * sizeof(int));
+
+  free(ctx->files);
+  ctx->files = files;
+  ctx->file_count = fd_count;
+  ctx->vm.files = files;
+  ctx->vm.file_count = fd_count;
+  return TVM_OK;
+}
+
+TvmStatus tvm_ctx_set_fork_handler(TvmCtx *ctx, TvmForkHandler handler, void *data) {
+  if (!ctx) return fail(TVM_ERR_ARG, "Invalid argument");
+  ctx->fork_handler = handler;
+  ctx->fork_data = data;
+  ctx->vm.fork_handler = handler ? fork_child : NULL;
+  ctx->vm.fork_data = ctx;
+  return TVM_OK;
+}
+
+TvmStatus tvm_memo_create(size_t max_bytes, uint64_t min_insts, const char *dir,
+                          TvmMemo **memo_out) {
+  if (!memo_out) return fail(TVM_ERR_ARG, "Invalid argument");
+
+  TvmMemo *memo = malloc(sizeof(TvmMemo));
+  if (!memo) return fail(TVM_ERR_NOMEM, "Could not allocate memory for the memo");
+
+  err_capture_begin();
+  if (memo_init(&memo->memo, max_bytes, min_insts, dir) != 0) {
+    free(memo);
+    return fail_captured(TVM_ERR_NOMEM);
+  }
+  err_capture_end();
+
+  *memo_out = memo;
+  return TVM_OK;
+}
+
+void tvm_memo_free(TvmMemo *memo) {
+  if (!memo) return;
+  memo_free(&memo->memo);
+  free(memo);
+}
+
+TvmStatus tvm_ctx_set_memo(TvmCtx *ctx, TvmMemo *memo) {
+  if (!ctx) return fail(TVM_ERR_ARG, "Invalid argument");
+  ctx->memo = memo;
+  return TVM_OK;
+}
+
+const char *tvm_last_error(void) { return last_error; }
@@ -1,25 +1,88 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "assembler.h"
+#include "cache.h"
 #include "error.h"
+#include "executor.h"
+#include "input.h"
+#include "memo.h"
+#include "optimizer.h"
+#include "perf.h"
+#include "program.h"
+#include "threads.h"
+#include "trace.h"
+#include "tvm.h"
 #include "vm.h"
 
 enum Action {
   ACTION_COMPILE,
   ACTION_RUN,
+  ACTION_OPTIMIZE,
+  ACTION_RUN_ASM,
 };
 
+// words of shared memory for the atomics unless `-shared-size` says otherwise
+#define DEFAULT_SHARED_WORDS (1 << 16)
+// spawns beyond this fail in the guest
+#define MAX_THREADS 1024
+// memo entries are only kept for runs of at least this many instructions unless
+// `-memo-min-insts` says otherwise
+#define DEFAULT_MEMO_MIN_INSTS 1000000
+#define DEFAULT_MEMO_SIZE_MIB 64
+// every index `FIELD_IO_FILE` can hold
+#define MAX_FILES 256
+
+// `opt_level` until a `-O*` flag set it
+#define OPT_LEVEL_UNSET -1
+
 typedef struct {
   int action;
   char *input_file;
   char *output_file;
+  char *guest_input_file;
+  char *cache_dir;
+  int opt_level;
+  int output_fd;
+  char *trace_file;
+  size_t trace_size;
+  bool perf_stats;
+  char *plugin_file;
+  size_t shared_words;
+  char *memo_dir;
+  uint64_t memo_min_insts;
+  size_t memo_size;
+  // opened for `fread` and `fwrite` in this order
+  char **file_names;
+  size_t file_count;
+  // set up after parsing when there is a memo directory
+  Memo *memo;
+  // functions of the plugin, loaded after parsing
+  VmHostFns host_fns;
 } Args;
 
 int parse_cmd_args(int argc, char **argv, Args *args_out) {
-  Args args = {.action = ACTION_RUN, .input_file = NULL, .output_file = NULL};
+  Args args = {.action = ACTION_RUN,
+               .input_file = NULL,
+               .output_file = "out.tvm",
+               .opt_level = OPT_LEVEL_UNSET,
+               .guest_input_file = NULL,
+               .cache_dir = getenv("TVM_CACHE_DIR"),
+               .output_fd = STDOUT_FILENO,
+               .trace_file = NULL,
+               .trace_size = TRACE_DEFAULT_SIZE,
+               .perf_stats = false,
+               .shared_words = DEFAULT_SHARED_WORDS,
+               .memo_dir = getenv("TVM_MEMO_DIR"),
+               .memo_min_insts = DEFAULT_MEMO_MIN_INSTS,
+               .memo_size = (size_t)DEFAULT_MEMO_SIZE_MIB << 20};
   int i = 1;
   int positional_args_start = argc;
 
@@ -32,12 +95,132 @@ int parse_cmd_args(int argc, char **argv, Args *args_out) {
       i++;
     }
 
+    else if (strcmp(arg, "-r") == 0 || strcmp(arg, "-run-asm") == 0) {
+      args.action = ACTION_RUN_ASM;
+      i++;
+    }
+
+    else if (strcmp(arg, "-cache") == 0) {
+      ERR_IF(!has_next, "Args error: Expected cache directory after '%s'", arg);
+      args.cache_dir = argv[i + 1];
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-optimize") == 0) {
+      args.action = ACTION_OPTIMIZE;
+      i++;
+    }
+
+    else if (strcmp(arg, "-O") == 0 || strcmp(arg, "-O1") == 0) {
+      args.opt_level = 1;
+      i++;
+    }
+
+    else if (strcmp(arg, "-O2") == 0) {
+      args.opt_level = 2;
+      i++;
+    }
+
+    else if (strcmp(arg, "-O0") == 0) {
+      args.opt_level = 0;
+      i++;
+    }
+
     else if (strcmp(arg, "-o") == 0 || strcmp(arg, "-out") == 0 || strcmp(arg, "-output") == 0) {
       ERR_IF(!has_next, "Args error: Expected output file after '%s'", arg);
       args.output_file = argv[i + 1];
       i += 2;
     }
 
+    else if (strcmp(arg, "-input") == 0) {
+      ERR_IF(!has_next, "Args error: Expected guest input file after '%s'", arg);
+      args.guest_input_file = argv[i + 1];
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-output-fd") == 0) {
+      ERR_IF(!has_next, "Args error: Expected file descriptor after '%s'", arg);
+      char *fd_end;
+      long fd = strtol(argv[i + 1], &fd_end, 10);
+      ERR_IF(*fd_end || fd_end == argv[i + 1] || fd < 0 || fd > INT_MAX,
+             "Args error: Invalid file descriptor '%s'", argv[i + 1]);
+      args.output_fd = fd;
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-trace") == 0) {
+      ERR_IF(!has_next, "Args error: Expected trace file after '%s'", arg);
+      args.trace_file = argv[i + 1];
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-trace-size") == 0) {
+      ERR_IF(!has_next, "Args error: Expected trace buffer size in KiB after '%s'", arg);
+      char *size_end;
+      long size_kib = strtol(argv[i + 1], &size_end, 10);
+      ERR_IF(*size_end || size_end == argv[i + 1] || size_kib <= 0 || size_kib > INT_MAX,
+             "Args error: Invalid trace buffer size '%s'", argv[i + 1]);
+      args.trace_size = (size_t)size_kib << 10;
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-perf-stats") == 0 || strcmp(arg, "--perf-stats") == 0) {
+      args.perf_stats = true;
+      i++;
+    }
+
+    else if (strcmp(arg, "-plugin") == 0) {
+      ERR_IF(!has_next, "Args error: Expected plugin library after '%s'", arg);
+      args.plugin_file = argv[i + 1];
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-shared-size") == 0) {
+      ERR_IF(!has_next, "Args error: Expected shared memory size in words after '%s'", arg);
+      char *size_end;
+      long size = strtol(argv[i + 1], &size_end, 10);
+      ERR_IF(*size_end || size_end == argv[i + 1] || size < 0 || size > (1l << 32),
+             "Args error: Invalid shared memory size '%s'", argv[i + 1]);
+      args.shared_words = size;
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-memo") == 0) {
+      ERR_IF(!has_next, "Args error: Expected memo directory after '%s'", arg);
+      args.memo_dir = argv[i + 1];
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-memo-min-insts") == 0) {
+      ERR_IF(!has_next, "Args error: Expected instruction count after '%s'", arg);
+      char *count_end;
+      long long count = strtoll(argv[i + 1], &count_end, 10);
+      ERR_IF(*count_end || count_end == argv[i + 1] || count < 0,
+             "Args error: Invalid instruction count '%s'", argv[i + 1]);
+      args.memo_min_insts = count;
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-memo-size") == 0) {
+      ERR_IF(!has_next, "Args error: Expected memo size in MiB after '%s'", arg);
+      char *size_end;
+      long size_mib = strtol(argv[i + 1], &size_end, 10);
+      ERR_IF(*size_end || size_end == argv[i + 1] || size_mib <= 0 || size_mib > INT_MAX,
+             "Args error: Invalid memo size '%s'", argv[i + 1]);
+      args.memo_size = (size_t)size_mib << 20;
+      i += 2;
+    }
+
+    else if (strcmp(arg, "-file") == 0) {
+      ERR_IF(!has_next, "Args error: Expected guest file after '%s'", arg);
+      ERR_IF(args.file_count == MAX_FILES, "Args error: More than %d guest files", MAX_FILES);
+      char **file_names = realloc(args.file_names, (args.file_count + 1) * sizeof(char *));
+      ERR_IF(!file_names, "Memory error: Could not allocate memory for the guest files");
+      args.file_names = file_names;
+      args.file_names[args.file_count++] = argv[i + 1];
+      i += 2;
+    }
+
     else if (*arg == '-') {
       fprintf(stderr, "Args error: Unknown option '%s'\n", arg);
       return RET_CODE_ERR;
@@ -48,6 +231,9 @@ int parse_cmd_args(int argc, char **argv, Args *args_out) {
     }
   }
 
+  // `-optimize` is pointless without optimizing, everything else assembles unoptimized by default
+  if (args.opt_level == OPT_LEVEL_UNSET) args.opt_level = args.action == ACTION_OPTIMIZE ? 2 : 0;
+
   ERR_IF(positional_args_start == argc, "Args error: Expected input file");
   args.input_file = argv[positional_args_start++];
 
@@ -66,56 +252,252 @@ int tvm_compile(Args args) {
 
   InstsOut insts;
 
-  if ((tmp_ret_code = assembler_compile(args.input_file, file_contents, &insts)) != 0) {
+  // encoded directly into the mapped output file, which only appears once assembling succeeded
+  if ((tmp_ret_code = insts_out_map_file(&insts, args.output_file)) != 0) {
     free(file_contents);
     return tmp_ret_code;
   }
 
+  tmp_ret_code = assembler_compile(args.input_file, file_contents, args.opt_level, &args.host_fns,
+                                  &insts);
   free(file_contents);
 
-  FILE *file;
+  if (tmp_ret_code != 0) return tmp_ret_code;
+  return insts_out_publish(&insts);
+}
+
+int tvm_optimize(Args args) {
+  inst_ty *bin_contents;
+  long insts_size;
+  int tmp_ret_code;
 
-  if (args.output_file) {
-    file = fopen(args.output_file, "w+b");
-    ERR_IF(!file, "File error: Could not open or create output file '%s'", args.output_file);
+  if ((tmp_ret_code = read_file_insts(args.input_file, &bin_contents, &insts_size)) != 0)
+    return tmp_ret_code;
+
+  InstsOut insts = {.insts = bin_contents, .size = insts_size, .capacity = insts_size};
+
+  if ((tmp_ret_code = optimizer_run(&insts, args.opt_level)) == 0)
+    tmp_ret_code = write_insts_file(args.output_file, &insts);
+
+  free(insts.insts);
+  return tmp_ret_code;
+}
+
+// forks beyond this fail in the guest, so a forking loop can not exhaust the memory
+#define MAX_FORKS (1 << 16)
+
+// children of `fork` wait here and run once the parent stopped, one after another or together on
+// the executor
+typedef struct {
+  VmCtx ctx;
+  VmTask task;
+  // the shared memory as the parent left it at the `fork`
+  VmWord *shared_mem;
+} ForkChild;
+
+typedef struct {
+  ForkChild **children;
+  size_t count;
+  size_t capacity;
+  // children forked while the executor runs the others join them right away
+  VmExecutor *executor;
+} ForkQueue;
+
+VmWord queue_fork(VmCtx *ctx, void *data) {
+  ForkQueue *queue = data;
+  if (queue->count == MAX_FORKS) return -1;
+
+  if (queue->count == queue->capacity) {
+    size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+    ForkChild **children = realloc(queue->children, capacity * sizeof(ForkChild *));
+    if (!children) return -1;
+    queue->children = children;
+    queue->capacity = capacity;
   }
-  else {
-    file = fopen("out.tvm", "w+b");
-    ERR_IF(!file, "File error: Could not open or create output file 'out.tvm'");
-    args.output_file = "out.tvm";
+
+  ForkChild *child = malloc(sizeof(ForkChild));
+  if (!child) return -1;
+
+  child->shared_mem = vm_copy_shared_mem(ctx);
+  if (!child->shared_mem) {
+    free(child);
+    return -1;
   }
 
-  if (fwrite(FILE_SIG, 1, strlen(FILE_SIG), file) < strlen(FILE_SIG)) {
-    fclose(file);
-    print_err("File error: Could not write to file '%s'", args.output_file);
-    return RET_CODE_ERR;
+  vm_fork(ctx, &child->ctx);
+  child->ctx.shared_mem = child->shared_mem;
+  // the threads of the parent are gone when the child runs
+  child->ctx.threads = NULL;
+  child->task = (VmTask){.ctx = &child->ctx};
+  queue->children[queue->count++] = child;
+  if (queue->executor) executor_add(queue->executor, &child->task);
+  return queue->count;
+}
+
+// children may fork again, their children are appended to the queue; with an executor the children
+// run together and wait for their I/O without holding up the others
+int run_forks(ForkQueue *queue, VmExecutor *executor, bool run) {
+  int ret_code = RET_CODE_OK;
+
+  if (run && executor) {
+    queue->executor = executor;
+    for (size_t i = 0; i < queue->count; i++) executor_add(executor, &queue->children[i]->task);
+    if (executor_run(executor) != 0) ret_code = RET_CODE_ERR;
+    queue->executor = NULL;
   }
 
-  if (fwrite(insts.insts, 1, insts.size * sizeof(inst_ty), file) < insts.size * sizeof(inst_ty)) {
-    fclose(file);
-    print_err("File error: Could not write to file '%s'", args.output_file);
-    return RET_CODE_ERR;
+  for (size_t i = 0; i < queue->count; i++) {
+    ForkChild *child = queue->children[i];
+
+    if (run && !executor) child->task.ret_code = vm_run(&child->ctx, &child->task.program_ret_code);
+
+    if (run && child->task.ret_code == RET_CODE_OK)
+      printf("Fork %zu returned %d\n", i + 1, child->task.program_ret_code);
+    else if (run)
+      ret_code = RET_CODE_ERR;
+
+    vm_deinit_ctx(&child->ctx);
+    free(child->shared_mem);
+    free(child);
   }
 
-  fclose(file);
-  free(insts.insts);
+  free(queue->children);
+  *queue = (ForkQueue){0};
+  return ret_code;
+}
+
+// opened in the order of `-file`, they stay open until the run ended
+int open_guest_files(Args args, int **fds_out) {
+  int *fds = malloc((args.file_count ? args.file_count : 1) * sizeof(int));
+  ERR_IF(!fds, "Memory error: Could not allocate memory for the guest files");
+
+  for (size_t i = 0; i < args.file_count; i++) {
+    fds[i] = open(args.file_names[i], O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // read-only files can still be read
+    if (fds[i] < 0 && (errno == EACCES || errno == EROFS))
+      fds[i] = open(args.file_names[i], O_RDONLY | O_CLOEXEC);
+
+    if (fds[i] < 0) {
+      print_err("File error: Could not open guest file '%s' (%s)", args.file_names[i],
+                strerror(errno));
+      while (i--) close(fds[i]);
+      free(fds);
+      return RET_CODE_ERR;
+    }
+  }
 
+  *fds_out = fds;
   return RET_CODE_OK;
 }
 
-int tvm_run(Args args) {
-  uint32_t *bin_contents;
+void close_guest_files(Args args, int *fds) {
+  for (size_t i = 0; i < args.file_count; i++) close(fds[i]);
+  free(fds);
+}
+
+int run_program(Args args, Program *program) {
+  VmCtx ctx = {0};
+  VmInput input = {0};
+  VmTrace trace;
+  PerfCounters perf = {.group_fd = -1};
+  ForkQueue forks = {0};
+  VmThreads threads;
+  VmExecutor executor;
+  int *files;
+  int program_ret_code;
   int tmp_ret_code;
-  long insts_size;
 
-  if ((tmp_ret_code = read_file_insts(args.input_file, &bin_contents, &insts_size)) != 0)
+  VmWord *shared_mem = calloc(args.shared_words ? args.shared_words : 1, sizeof(VmWord));
+  ERR_IF(!shared_mem, "Memory error: Could not allocate %zu words of shared memory",
+         args.shared_words);
+
+  if (args.guest_input_file &&
+      (tmp_ret_code = input_map_file(args.guest_input_file, &input)) != 0) {
+    free(shared_mem);
     return tmp_ret_code;
+  }
 
-  VmCtx ctx = {0};
-  int program_ret_code;
+  if ((tmp_ret_code = open_guest_files(args, &files)) != 0) {
+    input_unmap(&input);
+    free(shared_mem);
+    return tmp_ret_code;
+  }
 
-  vm_init_ctx(&ctx, bin_contents, insts_size);
-  if ((tmp_ret_code = vm_run(&ctx, &program_ret_code)) != 0) return tmp_ret_code;
+  // only runs with files have I/O to wait for
+  if (args.file_count) executor_init(&executor, EXECUTOR_DEFAULT_ENTRIES);
+
+  threads_init(&threads, MAX_THREADS);
+
+  vm_init_ctx(&ctx, program);
+  ctx.in = input;
+  ctx.out.fd = args.output_fd;
+  ctx.fork_handler = queue_fork;
+  ctx.fork_data = &forks;
+  ctx.host_fns = &args.host_fns;
+  ctx.shared_mem = shared_mem;
+  ctx.shared_words = args.shared_words;
+  ctx.threads = &threads;
+  ctx.files = files;
+  ctx.file_count = args.file_count;
+
+  // the trace is dumped when the run ends, or from a signal handler if the process dies first
+  if (args.trace_file) {
+    if ((tmp_ret_code = trace_init(&trace, args.trace_file, args.trace_size)) != 0) {
+      vm_deinit_ctx(&ctx);
+      threads_free(&threads);
+      if (args.file_count) executor_free(&executor);
+      close_guest_files(args, files);
+      input_unmap(&input);
+      free(shared_mem);
+      return tmp_ret_code;
+    }
+    ctx.trace = &trace;
+    trace_dump_on_signal(&ctx);
+  }
+
+  // without counters the run goes on and only the guest instruction count is reported
+  if (args.perf_stats) {
+    ctx.count_insts = true;
+    perf_open(&perf);
+  }
+  perf_start(&perf);
+  // traced runs are replayed from a single stream, so they do their I/O without suspending
+  if (args.file_count && !args.trace_file) {
+    VmTask task = {.ctx = &ctx};
+    executor_add(&executor, &task);
+    tmp_ret_code = executor_run(&executor) != 0 ? RET_CODE_ERR : task.ret_code;
+    program_ret_code = task.program_ret_code;
+    ctx.executor = NULL;
+  }
+  else {
+    tmp_ret_code = memo_run(args.memo, &ctx, &program_ret_code);
+  }
+  perf_stop(&perf);
+
+  // threads the guest did not join still run to the end and write their output before the summary
+  if (threads_free(&threads) != 0) tmp_ret_code = RET_CODE_ERR;
+
+  if (args.perf_stats) {
+    perf_print(&perf, ctx.insts_executed);
+    perf_close(&perf);
+  }
+
+  if (args.trace_file) {
+    trace_dump_on_signal(NULL);
+    if (trace_dump(&ctx) != 0) tmp_ret_code = RET_CODE_ERR;
+    trace_free(&trace);
+  }
+
+  vm_deinit_ctx(&ctx);
+
+  if (tmp_ret_code != 0) {
+    run_forks(&forks, NULL, false);
+    if (args.file_count) executor_free(&executor);
+    close_guest_files(args, files);
+    input_unmap(&input);
+    free(shared_mem);
+    return tmp_ret_code;
+  }
 
   printf(
       "r0: %lld\nr1: %lld\nr2: %lld\nr3: %lld\nr4: %lld\nr5: %lld\nr6: %lld\nr7:"
@@ -124,16 +506,132 @@ int tvm_run(Args args) {
       ctx.regs[7]);
   printf("Program returned %d\n", program_ret_code);
 
-  free(bin_contents);
+  // the children share the input mapping and the files and write to the same fd after the summary
+  fflush(stdout);
+  tmp_ret_code = run_forks(&forks, args.file_count ? &executor : NULL, true);
+  if (args.file_count) executor_free(&executor);
+  close_guest_files(args, files);
+  input_unmap(&input);
+  free(shared_mem);
+
+  return tmp_ret_code != 0 ? tmp_ret_code : program_ret_code;
+}
+
+int tvm_run(Args args) {
+  uint32_t *bin_contents;
+  int tmp_ret_code;
+  long insts_size;
+  Program *program;
+
+  if ((tmp_ret_code = read_file_insts(args.input_file, &bin_contents, &insts_size)) != 0)
+    return tmp_ret_code;
+
+  if ((tmp_ret_code = program_create(bin_contents, insts_size, &program)) != 0) {
+    free(bin_contents);
+    return tmp_ret_code;
+  }
 
-  return program_ret_code;
+  tmp_ret_code = run_program(args, program);
+  program_release(program);
+  return tmp_ret_code;
+}
+
+// assembles into memory and runs, with a cache directory unchanged sources are not assembled again
+int tvm_run_asm(Args args) {
+  char *file_contents;
+  long file_size;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = read_file_sized(args.input_file, &file_contents, &file_size)) != 0)
+    return tmp_ret_code;
+
+  InstsOut insts = {0};
+  CacheKey key;
+  long cached_count;
+
+  if (args.cache_dir) {
+    key = cache_key(file_contents, file_size, args.opt_level, &args.host_fns);
+    if (cache_lookup(args.cache_dir, key, &insts.insts, &cached_count) == RET_CODE_OK) {
+      insts.size = insts.capacity = cached_count;
+      goto run;
+    }
+  }
+
+  tmp_ret_code = assembler_compile(args.input_file, file_contents, args.opt_level, &args.host_fns,
+                                  &insts);
+  if (tmp_ret_code != 0) {
+    free(file_contents);
+    return tmp_ret_code;
+  }
+
+  // a failed store is reported but the program still runs
+  if (args.cache_dir) cache_store(args.cache_dir, key, &insts);
+
+run:
+  free(file_contents);
+
+  Program *program;
+  if ((tmp_ret_code = program_create(insts.insts, insts.size, &program)) != 0) {
+    free(insts.insts);
+    return tmp_ret_code;
+  }
+
+  tmp_ret_code = run_program(args, program);
+  program_release(program);
+  return tmp_ret_code;
+}
+
+// the plugin stays loaded until the process exits
+int load_plugin(char *plugin_file, VmHostFns *host_fns_out) {
+  void *plugin = dlopen(plugin_file, RTLD_NOW | RTLD_LOCAL);
+  ERR_IF(!plugin, "Plugin error: Could not load '%s' (%s)", plugin_file, dlerror());
+
+  const TvmHostFnEntry *entries = dlsym(plugin, "tvm_host_fns");
+  if (!entries) {
+    dlclose(plugin);
+    print_err("Plugin error: '%s' does not export 'tvm_host_fns'", plugin_file);
+    return RET_CODE_ERR;
+  }
+
+  size_t count = 0;
+  for (; entries[count].name; count++) {
+    if (!entries[count].fn) {
+      // the name lives in the plugin
+      print_err("Plugin error: Host function '%s' of '%s' has no function", entries[count].name,
+                plugin_file);
+      dlclose(plugin);
+      return RET_CODE_ERR;
+    }
+  }
+
+  VmHostFnEntry *fns = malloc((count ? count : 1) * sizeof(VmHostFnEntry));
+  if (!fns) {
+    dlclose(plugin);
+    print_err("Memory error: Could not allocate memory for host functions");
+    return RET_CODE_ERR;
+  }
+
+  for (size_t i = 0; i < count; i++)
+    fns[i] = (VmHostFnEntry){.name = entries[i].name, .fn = entries[i].fn,
+                             .data = entries[i].data};
+
+  *host_fns_out = (VmHostFns){.fns = fns, .count = count};
+  return RET_CODE_OK;
 }
 
 int main(int argc, char **argv) {
-  Args args;
+  Args args = {0};
+  Memo memo;
   int tmp_ret_code = RET_CODE_OK;
 
   if ((tmp_ret_code = parse_cmd_args(argc, argv, &args)) != 0) goto exit;
+  if (args.plugin_file && (tmp_ret_code = load_plugin(args.plugin_file, &args.host_fns)) != 0)
+    goto exit;
+  if (args.memo_dir) {
+    if ((tmp_ret_code = memo_init(&memo, args.memo_size, args.memo_min_insts, args.memo_dir)) != 0)
+      goto exit;
+    args.memo = &memo;
+  }
 
   switch (args.action) {
     case ACTION_COMPILE:
@@ -142,8 +640,17 @@ int main(int argc, char **argv) {
     case ACTION_RUN:
       tmp_ret_code = tvm_run(args);
       break;
+    case ACTION_OPTIMIZE:
+      tmp_ret_code = tvm_optimize(args);
+      break;
+    case ACTION_RUN_ASM:
+      tmp_ret_code = tvm_run_asm(args);
+      break;
   }
 
 exit:
+  if (args.memo) memo_free(args.memo);
+  free((void *)args.host_fns.fns);
+  free(args.file_names);
   return tmp_ret_code;
 }
@@ -0,0 +1,420 @@
+#include "memo.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "hash.h"
+#include "ir.h"
+#include "output.h"
+#include "program.h"
+
+#define MEMO_PATH_MAX 4096
+#define MEMO_MAGIC "TVMMEMO"
+
+enum MemoFlag {
+  MEMO_F_ZERO = 1 << 0,
+  MEMO_F_GREATER = 1 << 1,
+  MEMO_F_SMALLER = 1 << 2,
+  MEMO_F_EQ = 1 << 3,
+};
+
+// everything a run changes besides the vector registers, which nothing outside the VM reads
+typedef struct {
+  VmWord regs[REGS_COUNT];
+  uint64_t ip_off;
+  uint64_t in_pos;
+  uint64_t insts_executed;
+  uint64_t output_len;
+  int32_t exit_code;
+  uint32_t flags;
+} MemoState;
+
+struct MemoEntry {
+  MemoKey key;
+  MemoEntry *next_in_bucket;
+  MemoEntry *newer;
+  MemoEntry *older;
+  MemoState state;
+  char output[];
+};
+
+// entries on disk, only read back by the same build of the VM
+typedef struct {
+  char magic[8];
+  uint64_t version;
+  MemoKey key;
+  MemoState state;
+} MemoFileHeader;
+
+int memo_init(Memo *memo, size_t max_bytes, uint64_t min_insts, const char *dir) {
+  *memo = (Memo){.bucket_count = 64, .max_bytes = max_bytes, .min_insts = min_insts};
+  memo->buckets = calloc(memo->bucket_count, sizeof(MemoEntry *));
+  memo->dir = dir ? strdup(dir) : NULL;
+
+  if (!memo->buckets || (dir && !memo->dir)) {
+    free(memo->buckets);
+    free(memo->dir);
+    print_err("Memory error: Could not allocate memory for the memo");
+    return RET_CODE_ERR;
+  }
+
+  pthread_mutex_init(&memo->lock, NULL);
+  return RET_CODE_OK;
+}
+
+void memo_free(Memo *memo) {
+  for (MemoEntry *entry = memo->newest, *older; entry; entry = older) {
+    older = entry->older;
+    free(entry);
+  }
+
+  free(memo->buckets);
+  free(memo->dir);
+  pthread_mutex_destroy(&memo->lock);
+  *memo = (Memo){0};
+}
+
+// a run that talks to anything but its registers, input and output could end differently
+bool memo_scan_deterministic(Program *program) {
+  for (size_t i = 0; i < program->insts_count; i += ir_inst_words(program->insts[i])) {
+    switch (inst_extract_bits(program->insts[i], FIELD_MNEMONIC, false)) {
+      case MNEMONIC_FORK:
+      case MNEMONIC_HCALL:
+      case MNEMONIC_SEND:
+      case MNEMONIC_RECV:
+      case MNEMONIC_TRY_RECV:
+      case MNEMONIC_CAS:
+      case MNEMONIC_XADD:
+      case MNEMONIC_XCHG:
+      case MNEMONIC_ALOAD:
+      case MNEMONIC_ASTORE:
+      case MNEMONIC_JOIN:
+      case MNEMONIC_SPAWN:
+      case MNEMONIC_FREAD:
+      case MNEMONIC_FWRITE:
+        return false;
+      default:
+        if (inst_extract_bits(program->insts[i], FIELD_MNEMONIC, false) > MNEMONIC_SPAWN)
+          return false;
+        break;
+    }
+  }
+
+  return true;
+}
+
+// the scan runs once per program, the result is cached there like its hash
+bool memo_deterministic(Program *program) {
+  int state = __atomic_load_n(&program->memo_state, __ATOMIC_RELAXED);
+  if (state != PROGRAM_MEMO_UNKNOWN) return state == PROGRAM_MEMO_ALLOWED;
+
+  bool deterministic = memo_scan_deterministic(program);
+  __atomic_store_n(&program->memo_state,
+                   deterministic ? PROGRAM_MEMO_ALLOWED : PROGRAM_MEMO_NEVER, __ATOMIC_RELAXED);
+  return deterministic;
+}
+
+uint32_t memo_flags(VmCtx *ctx) {
+  return ctx->f_zero * MEMO_F_ZERO | ctx->f_greater * MEMO_F_GREATER |
+         ctx->f_smaller * MEMO_F_SMALLER | ctx->f_eq * MEMO_F_EQ;
+}
+
+MemoKey memo_key(VmCtx *ctx) {
+  struct {
+    uint64_t program_hash;
+    uint64_t insts_count;
+    uint64_t input_hash;
+    uint64_t ip_off;
+    uint64_t flags;
+    VmWord regs[REGS_COUNT];
+    VmVec vregs[VREGS_COUNT];
+  } state;
+
+  // padding is hashed too
+  memset(&state, 0, sizeof(state));
+  state.program_hash = program_hash(ctx->program);
+  state.insts_count = ctx->program->insts_count;
+  if (ctx->in.data)
+    state.input_hash = hash_bytes(ctx->in.data + ctx->in.pos, ctx->in.size - ctx->in.pos, 0);
+  state.ip_off = ctx->ip - ctx->first_inst;
+  state.flags = memo_flags(ctx);
+  memcpy(state.regs, ctx->regs, sizeof(state.regs));
+  memcpy(state.vregs, ctx->vregs, sizeof(state.vregs));
+
+  uint64_t seed = hash_mix(MEMO_VERSION);
+  return (MemoKey){
+      {hash_bytes(&state, sizeof(state), seed), hash_bytes(&state, sizeof(state), ~seed)}};
+}
+
+bool memo_key_eq(MemoKey a, MemoKey b) {
+  return a.hash[0] == b.hash[0] && a.hash[1] == b.hash[1];
+}
+
+MemoEntry **memo_bucket(Memo *memo, MemoKey key) {
+  return &memo->buckets[key.hash[0] & (memo->bucket_count - 1)];
+}
+
+void memo_unlink(Memo *memo, MemoEntry *entry) {
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    memo->newest = entry->older;
+
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    memo->oldest = entry->newer;
+}
+
+void memo_push_newest(Memo *memo, MemoEntry *entry) {
+  entry->newer = NULL;
+  entry->older = memo->newest;
+  if (memo->newest)
+    memo->newest->newer = entry;
+  else
+    memo->oldest = entry;
+  memo->newest = entry;
+}
+
+void memo_evict(Memo *memo, MemoEntry *entry) {
+  MemoEntry **link = memo_bucket(memo, entry->key);
+  while (*link != entry) link = &(*link)->next_in_bucket;
+  *link = entry->next_in_bucket;
+
+  memo_unlink(memo, entry);
+  memo->bytes -= sizeof(MemoEntry) + entry->state.output_len;
+  memo->entry_count--;
+  free(entry);
+}
+
+// a table that can not grow just gets longer chains
+void memo_grow(Memo *memo) {
+  size_t bucket_count = memo->bucket_count * 2;
+  MemoEntry **buckets = calloc(bucket_count, sizeof(MemoEntry *));
+  if (!buckets) return;
+
+  for (size_t i = 0; i < memo->bucket_count; i++) {
+    for (MemoEntry *entry = memo->buckets[i], *next; entry; entry = next) {
+      next = entry->next_in_bucket;
+      MemoEntry **bucket = &buckets[entry->key.hash[0] & (bucket_count - 1)];
+      entry->next_in_bucket = *bucket;
+      *bucket = entry;
+    }
+  }
+
+  free(memo->buckets);
+  memo->buckets = buckets;
+  memo->bucket_count = bucket_count;
+}
+
+// entries bigger than the whole memo are only kept on disk
+void memo_insert(Memo *memo, MemoKey key, MemoState *state, const char *output) {
+  size_t size = sizeof(MemoEntry) + state->output_len;
+  if (size > memo->max_bytes) return;
+
+  MemoEntry *entry = malloc(size);
+  if (!entry) return;
+
+  *entry = (MemoEntry){.key = key, .state = *state};
+  memcpy(entry->output, output, state->output_len);
+
+  pthread_mutex_lock(&memo->lock);
+
+  // another thread may have finished the same run first
+  for (MemoEntry *other = *memo_bucket(memo, key); other; other = other->next_in_bucket) {
+    if (memo_key_eq(other->key, key)) {
+      pthread_mutex_unlock(&memo->lock);
+      free(entry);
+      return;
+    }
+  }
+
+  while (memo->bytes + size > memo->max_bytes) memo_evict(memo, memo->oldest);
+  if (memo->entry_count >= memo->bucket_count) memo_grow(memo);
+
+  MemoEntry **bucket = memo_bucket(memo, key);
+  entry->next_in_bucket = *bucket;
+  *bucket = entry;
+  memo_push_newest(memo, entry);
+  memo->bytes += size;
+  memo->entry_count++;
+
+  pthread_mutex_unlock(&memo->lock);
+}
+
+int memo_path(Memo *memo, MemoKey key, const char *suffix, char *path_out) {
+  int len = snprintf(path_out, MEMO_PATH_MAX, "%s/%016llx%016llx.memo%s", memo->dir,
+                     (unsigned long long)key.hash[0], (unsigned long long)key.hash[1], suffix);
+  ERR_IF(len >= MEMO_PATH_MAX, "Memo error: Path of memo directory '%s' is too long", memo->dir);
+  return RET_CODE_OK;
+}
+
+// the run stopped inside the program of `ctx` and read no more input than it has
+bool memo_state_valid(const VmCtx *ctx, const MemoState *state) {
+  return state->ip_off < (uint64_t)(ctx->insts_end - ctx->first_inst) &&
+         state->in_pos >= ctx->in.pos && state->in_pos <= ctx->in.size &&
+         !(state->flags & ~(MEMO_F_ZERO | MEMO_F_GREATER | MEMO_F_SMALLER | MEMO_F_EQ));
+}
+
+// missing or damaged entries are a miss, the run replaces them
+int memo_read_file(Memo *memo, MemoKey key, const VmCtx *ctx, MemoState *state_out,
+                   char **output_out) {
+  char path[MEMO_PATH_MAX];
+  MemoFileHeader header;
+
+  if (memo_path(memo, key, "", path) != 0) return RET_CODE_NORET;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) return RET_CODE_NORET;
+
+  bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+               memcmp(header.magic, MEMO_MAGIC, sizeof(MEMO_MAGIC)) == 0 &&
+               header.version == MEMO_VERSION && memo_key_eq(header.key, key) &&
+               header.state.output_len <= memo->max_bytes &&
+               memo_state_valid(ctx, &header.state);
+  char *output = valid ? malloc(header.state.output_len + 1) : NULL;
+
+  valid = output && fread(output, 1, header.state.output_len, file) == header.state.output_len &&
+          fgetc(file) == EOF;
+  fclose(file);
+
+  if (!valid) {
+    free(output);
+    return RET_CODE_NORET;
+  }
+
+  *state_out = header.state;
+  *output_out = output;
+  return RET_CODE_OK;
+}
+
+int memo_write_file(Memo *memo, MemoKey key, MemoState *state, const char *output) {
+  static unsigned long tmp_counter;
+  char path[MEMO_PATH_MAX];
+  char tmp_path[MEMO_PATH_MAX];
+  char tmp_suffix[64];
+  int tmp_ret_code;
+
+  ERR_IF(mkdir(memo->dir, 0777) != 0 && errno != EEXIST,
+         "Memo error: Could not create memo directory '%s' (%s)", memo->dir, strerror(errno));
+
+  // every writer has its own file, the rename makes the entry appear atomically
+  snprintf(tmp_suffix, sizeof(tmp_suffix), ".%ld.%lu.tmp", (long)getpid(),
+           __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED));
+  if ((tmp_ret_code = memo_path(memo, key, "", path)) != 0) return tmp_ret_code;
+  if ((tmp_ret_code = memo_path(memo, key, tmp_suffix, tmp_path)) != 0) return tmp_ret_code;
+
+  MemoFileHeader header = {.magic = MEMO_MAGIC, .version = MEMO_VERSION, .key = key,
+                           .state = *state};
+  FILE *file = fopen(tmp_path, "wb");
+  ERR_IF(!file, "Memo error: Could not create '%s' (%s)", tmp_path, strerror(errno));
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(output, 1, state->output_len, file) == state->output_len;
+  if (fclose(file) != 0 || !written || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    print_err("Memo error: Could not write memo entry '%s'", path);
+    return RET_CODE_ERR;
+  }
+
+  return RET_CODE_OK;
+}
+
+// the output is copied out, so the entry may be evicted right after
+int memo_lookup(Memo *memo, MemoKey key, const VmCtx *ctx, MemoState *state_out,
+                char **output_out) {
+  pthread_mutex_lock(&memo->lock);
+
+  for (MemoEntry *entry = *memo_bucket(memo, key); entry; entry = entry->next_in_bucket) {
+    if (!memo_key_eq(entry->key, key)) continue;
+
+    char *output = malloc(entry->state.output_len + 1);
+    if (!output) break;
+
+    memcpy(output, entry->output, entry->state.output_len);
+    memo_unlink(memo, entry);
+    memo_push_newest(memo, entry);
+    *state_out = entry->state;
+    *output_out = output;
+
+    pthread_mutex_unlock(&memo->lock);
+    return RET_CODE_OK;
+  }
+
+  pthread_mutex_unlock(&memo->lock);
+
+  if (!memo->dir || memo_read_file(memo, key, ctx, state_out, output_out) != RET_CODE_OK)
+    return RET_CODE_NORET;
+
+  memo_insert(memo, key, state_out, *output_out);
+  return RET_CODE_OK;
+}
+
+int memo_replay(VmCtx *ctx, MemoState *state, const char *output, int *program_ret_code_out) {
+  int tmp_ret_code;
+
+  memcpy(ctx->regs, state->regs, sizeof(ctx->regs));
+  ctx->ip = ctx->first_inst + state->ip_off;
+  ctx->in.pos = state->in_pos;
+  ctx->f_zero = state->flags & MEMO_F_ZERO;
+  ctx->f_greater = state->flags & MEMO_F_GREATER;
+  ctx->f_smaller = state->flags & MEMO_F_SMALLER;
+  ctx->f_eq = state->flags & MEMO_F_EQ;
+  ctx->insts_executed += state->insts_executed;
+  *program_ret_code_out = state->exit_code;
+
+  if (state->output_len &&
+      (tmp_ret_code = output_write(&ctx->out, output, state->output_len)) != 0)
+    return tmp_ret_code;
+  return output_flush(&ctx->out);
+}
+
+int memo_run(Memo *memo, VmCtx *ctx, int *program_ret_code_out) {
+  if (!memo || ctx->trace || !memo_deterministic(ctx->program))
+    return vm_run(ctx, program_ret_code_out);
+
+  MemoKey key = memo_key(ctx);
+  MemoState state;
+  char *output;
+
+  if (memo_lookup(memo, key, ctx, &state, &output) == RET_CODE_OK) {
+    int tmp_ret_code = memo_replay(ctx, &state, output, program_ret_code_out);
+    free(output);
+    return tmp_ret_code;
+  }
+
+  // the count decides whether the run was expensive enough to keep
+  OutputRecord record = {.max = memo->max_bytes};
+  bool count_insts = ctx->count_insts;
+  uint64_t insts_before = ctx->insts_executed;
+
+  ctx->count_insts = true;
+  ctx->out.record = &record;
+  int tmp_ret_code = vm_run(ctx, program_ret_code_out);
+  ctx->out.record = NULL;
+  ctx->count_insts = count_insts;
+
+  state = (MemoState){
+      .ip_off = ctx->ip - ctx->first_inst,
+      .in_pos = ctx->in.pos,
+      .insts_executed = ctx->insts_executed - insts_before,
+      .output_len = record.len,
+      .exit_code = *program_ret_code_out,
+      .flags = memo_flags(ctx),
+  };
+  memcpy(state.regs, ctx->regs, sizeof(state.regs));
+
+  if (tmp_ret_code == RET_CODE_OK && !record.overflow && state.insts_executed >= memo->min_insts) {
+    memo_insert(memo, key, &state, record.data ? record.data : "");
+    // a failed store is reported, the run itself succeeded
+    if (memo->dir) memo_write_file(memo, key, &state, record.data ? record.data : "");
+  }
+
+  free(record.data);
+  return tmp_ret_code;
+}
@@ -0,0 +1,45 @@
+#ifndef MEMO_H
+#define MEMO_H
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// bump when the VM changes what a program computes, so old entries on disk are ignored
+#define MEMO_VERSION 1
+
+typedef struct {
+  uint64_t hash[2];
+} MemoKey;
+
+typedef struct MemoEntry MemoEntry;
+
+// final state of deterministic runs keyed by the code, the initial registers and flags and the
+// unread input; safe to share between threads
+typedef struct {
+  pthread_mutex_t lock;
+  // chained hash table over the entries, which are also on a list from most to least recently used
+  MemoEntry **buckets;
+  size_t bucket_count;
+  MemoEntry *newest;
+  MemoEntry *oldest;
+  size_t entry_count;
+  // entries (with their output) are evicted once they need more memory than `max_bytes`
+  size_t bytes;
+  size_t max_bytes;
+  // cheaper runs are not worth a lookup
+  uint64_t min_insts;
+  // entries are also stored there when set and looked up there on a miss
+  char *dir;
+} Memo;
+
+int memo_init(Memo *memo, size_t max_bytes, uint64_t min_insts, const char *dir);
+void memo_free(Memo *memo);
+
+// like `vm_run`, but a run with the same key as a memoized one only gets its final registers,
+// flags, input position and output; only programs without instructions that talk to the host,
+// files, other contexts or shared memory take part
+int memo_run(Memo *memo, VmCtx *ctx, int *program_ret_code_out);
+#endif  // MEMO_H
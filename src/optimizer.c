@@ -0,0 +1,832 @@
+#include "optimizer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfg.h"
+#include "error.h"
+#include "ir.h"
+#include "vm.h"
+
+#define OPT_MNEMONIC(inst) (inst_extract_bits(inst, FIELD_MNEMONIC, false))
+
+#define MOV_IMM_MAX ((1 << (FIELD_MOV_IMM.bit_count - 1)) - 1)
+#define BINOP_IMM_MAX ((1 << (FIELD_BINOP_IMM.bit_count - 1)) - 1)
+
+inst_ty make_mov_imm(int dst_reg, VmWord imm) {
+  inst_ty inst = MNEMONIC_MOV;
+  inst = inst_insert_bits(inst, FIELD_MOV_DST, dst_reg);
+  inst = inst_insert_bits(inst, FIELD_MOV_IS_IMM, 1);
+  return inst_insert_bits(inst, FIELD_MOV_IMM, (int32_t)imm);
+}
+
+inst_ty make_mov_reg(int dst_reg, int src_reg) {
+  inst_ty inst = MNEMONIC_MOV;
+  inst = inst_insert_bits(inst, FIELD_MOV_DST, dst_reg);
+  return inst_insert_bits(inst, FIELD_MOV_SRC, src_reg);
+}
+
+// `delta` has to be encodable, see `add_delta_fits`
+inst_ty make_add_delta(int reg, VmWord delta) {
+  if (delta == 1) return inst_insert_bits(MNEMONIC_INC, FIELD_INC_REG, reg);
+  if (delta == -1) return inst_insert_bits(MNEMONIC_DEC, FIELD_DEC_REG, reg);
+
+  inst_ty inst = MNEMONIC_ADD;
+  inst = inst_insert_bits(inst, FIELD_BINOP_DST, reg);
+  inst = inst_insert_bits(inst, FIELD_BINOP_OP1, reg);
+  inst = inst_insert_bits(inst, FIELD_BINOP_IS_IMM, 1);
+  return inst_insert_bits(inst, FIELD_BINOP_IMM, (int32_t)delta);
+}
+
+bool add_delta_fits(VmWord delta) { return delta >= -BINOP_IMM_MAX && delta <= BINOP_IMM_MAX; }
+
+bool get_mov_imm(inst_ty inst, int *dst_reg_out, VmWord *imm_out) {
+  if (OPT_MNEMONIC(inst) != MNEMONIC_MOV || !inst_extract_bits(inst, FIELD_MOV_IS_IMM, false))
+    return false;
+
+  *dst_reg_out = inst_extract_bits(inst, FIELD_MOV_DST, false);
+  *imm_out = inst_extract_bits(inst, FIELD_MOV_IMM, true);
+  return true;
+}
+
+bool get_mov_reg(inst_ty inst, int *dst_reg_out, int *src_reg_out) {
+  if (OPT_MNEMONIC(inst) != MNEMONIC_MOV || inst_extract_bits(inst, FIELD_MOV_IS_IMM, false))
+    return false;
+
+  *dst_reg_out = inst_extract_bits(inst, FIELD_MOV_DST, false);
+  *src_reg_out = inst_extract_bits(inst, FIELD_MOV_SRC, false);
+  return true;
+}
+
+// `binop rX, rX, imm` where the destination is also the first operand
+bool get_binop_self_imm(inst_ty inst, int *reg_out, VmWord *imm_out) {
+  switch (OPT_MNEMONIC(inst)) {
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+    case MNEMONIC_OR:
+    case MNEMONIC_AND:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL:
+      break;
+    default:
+      return false;
+  }
+
+  int dst_reg = inst_extract_bits(inst, FIELD_BINOP_DST, false);
+  if (!inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false) ||
+      inst_extract_bits(inst, FIELD_BINOP_OP1, false) != dst_reg)
+    return false;
+
+  *reg_out = dst_reg;
+  *imm_out = inst_extract_bits(inst, FIELD_BINOP_IMM, true);
+  return true;
+}
+
+// `inc`, `dec` and `add`/`sub` of an immediate to the same register
+bool get_add_delta(inst_ty inst, int *reg_out, VmWord *delta_out) {
+  switch (OPT_MNEMONIC(inst)) {
+    case MNEMONIC_INC:
+      *reg_out = inst_extract_bits(inst, FIELD_INC_REG, false);
+      *delta_out = 1;
+      return true;
+    case MNEMONIC_DEC:
+      *reg_out = inst_extract_bits(inst, FIELD_DEC_REG, false);
+      *delta_out = -1;
+      return true;
+    case MNEMONIC_ADD:
+      return get_binop_self_imm(inst, reg_out, delta_out);
+    case MNEMONIC_SUB:
+      if (!get_binop_self_imm(inst, reg_out, delta_out)) return false;
+      *delta_out = -*delta_out;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// mirrors `handle_bin_op`, returns false for operations that are not safe to evaluate here
+bool fold_binop(int mnemonic, VmWord op1, VmWord op2, VmWord *res_out) {
+  switch (mnemonic) {
+    case MNEMONIC_ADD:
+      *res_out = (VmWord)((uint64_t)op1 + (uint64_t)op2);
+      return true;
+    case MNEMONIC_SUB:
+      *res_out = (VmWord)((uint64_t)op1 - (uint64_t)op2);
+      return true;
+    case MNEMONIC_MUL:
+      *res_out = (VmWord)((uint64_t)op1 * (uint64_t)op2);
+      return true;
+    case MNEMONIC_DIV:
+      if (op2 == 0 || (op1 == INT64_MIN && op2 == -1)) return false;
+      *res_out = op1 / op2;
+      return true;
+    case MNEMONIC_OR:
+      *res_out = op1 | op2;
+      return true;
+    case MNEMONIC_AND:
+      *res_out = op1 & op2;
+      return true;
+    case MNEMONIC_XOR:
+      *res_out = op1 ^ op2;
+      return true;
+    case MNEMONIC_SHR:
+      if (op2 < 0 || op2 > 63) return false;
+      *res_out = op1 >> op2;
+      return true;
+    case MNEMONIC_SHL:
+      if (op2 < 0 || op2 > 63) return false;
+      *res_out = (VmWord)((uint64_t)op1 << op2);
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_identity_binop(inst_ty inst) {
+  int reg;
+  VmWord imm;
+  if (!get_binop_self_imm(inst, &reg, &imm)) return false;
+
+  switch (OPT_MNEMONIC(inst)) {
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_OR:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL:
+      return imm == 0;
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+      return imm == 1;
+    case MNEMONIC_AND:
+      return imm == -1;
+    default:
+      return false;
+  }
+}
+
+// instructions whose only effect is writing a single register
+bool is_pure_reg_write(inst_ty inst) {
+  unsigned defs = ir_inst_defs(inst);
+  return defs && !(defs & (IR_FLAGS_BIT | IR_VREGS_BIT)) && !ir_is_jump(inst) &&
+         !ir_has_side_effects(inst);
+}
+
+void remove_inst(IrProgram *ir, size_t idx) {
+  IrInst *ir_inst = &ir->insts[idx];
+  ir_inst->removed = true;
+
+  // jumps to a removed instruction land on the next live one
+  if (ir_inst->is_jump_target) {
+    size_t next = ir_next_live(ir, idx + 1);
+    if (next < ir->count) ir->insts[next].is_jump_target = true;
+  }
+}
+
+bool thread_jumps(IrProgram *ir) {
+  bool changed = false;
+
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst *ir_inst = &ir->insts[i];
+    if (ir_inst->removed || !ir_is_jump(ir_inst->inst)) continue;
+
+    size_t target = ir_next_live(ir, ir_inst->target);
+    size_t hops = 0;
+
+    while (target < ir->count && OPT_MNEMONIC(ir->insts[target].inst) == MNEMONIC_JMP &&
+           hops <= ir->count) {
+      target = ir_next_live(ir, ir->insts[target].target);
+      hops++;
+    }
+
+    // a cycle of unconditional jumps, leave it as it is
+    if (hops > ir->count) continue;
+
+    if (target != ir_inst->target) {
+      ir_inst->target = target;
+      changed = true;
+    }
+
+    if (OPT_MNEMONIC(ir_inst->inst) == MNEMONIC_JMP && target < ir->count &&
+        OPT_MNEMONIC(ir->insts[target].inst) == MNEMONIC_EXIT) {
+      ir_inst->inst = ir->insts[target].inst;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+bool peephole_single(IrProgram *ir, size_t idx) {
+  IrInst *ir_inst = &ir->insts[idx];
+  int dst_reg, src_reg;
+
+  if (get_mov_reg(ir_inst->inst, &dst_reg, &src_reg) && dst_reg == src_reg) {
+    remove_inst(ir, idx);
+    return true;
+  }
+
+  if (is_identity_binop(ir_inst->inst)) {
+    remove_inst(ir, idx);
+    return true;
+  }
+
+  if (ir_is_jump(ir_inst->inst) &&
+      ir_next_live(ir, ir_inst->target) == ir_next_live(ir, idx + 1)) {
+    remove_inst(ir, idx);
+    return true;
+  }
+
+  return false;
+}
+
+// `second` is never a jump target, so it always executes right after `first`
+bool peephole_pair(IrProgram *ir, size_t first_idx, size_t second_idx) {
+  IrInst *first = &ir->insts[first_idx];
+  IrInst *second = &ir->insts[second_idx];
+  int first_reg, second_reg;
+  VmWord first_imm, second_imm, res;
+
+  // mov #rA, imm1
+  // add #rA, #rA, imm2 -> mov #rA, imm1 + imm2
+  if (get_mov_imm(first->inst, &first_reg, &first_imm)) {
+    bool folded = false;
+
+    if (get_add_delta(second->inst, &second_reg, &second_imm) && second_reg == first_reg) {
+      res = (VmWord)((uint64_t)first_imm + (uint64_t)second_imm);
+      folded = true;
+    }
+    else if (get_binop_self_imm(second->inst, &second_reg, &second_imm) &&
+             second_reg == first_reg) {
+      folded = fold_binop(OPT_MNEMONIC(second->inst), first_imm, second_imm, &res);
+    }
+
+    if (folded && res >= -MOV_IMM_MAX && res <= MOV_IMM_MAX) {
+      first->inst = make_mov_imm(first_reg, res);
+      remove_inst(ir, second_idx);
+      return true;
+    }
+  }
+
+  // inc #rA
+  // add #rA, #rA, 4 -> add #rA, #rA, 5
+  if (get_add_delta(first->inst, &first_reg, &first_imm) &&
+      get_add_delta(second->inst, &second_reg, &second_imm) && first_reg == second_reg) {
+    res = first_imm + second_imm;
+
+    if (res == 0) {
+      remove_inst(ir, second_idx);
+      remove_inst(ir, first_idx);
+      return true;
+    }
+
+    if (add_delta_fits(res)) {
+      first->inst = make_add_delta(first_reg, res);
+      remove_inst(ir, second_idx);
+      return true;
+    }
+  }
+
+  // the first write is overwritten before anyone could read it
+  unsigned first_defs = ir_inst_defs(first->inst);
+  if (is_pure_reg_write(first->inst) && (ir_inst_defs(second->inst) & first_defs) &&
+      !(ir_inst_uses(second->inst) & first_defs)) {
+    remove_inst(ir, first_idx);
+    return true;
+  }
+
+  // mov #rA, #rB
+  // mov #rC, #rA -> mov #rC, #rB (removed if #rC is #rB)
+  int first_src_reg, second_src_reg;
+  if (get_mov_reg(first->inst, &first_reg, &first_src_reg) &&
+      get_mov_reg(second->inst, &second_reg, &second_src_reg) && second_src_reg == first_reg) {
+    if (second_reg == first_src_reg)
+      remove_inst(ir, second_idx);
+    else
+      second->inst = make_mov_reg(second_reg, first_src_reg);
+    return true;
+  }
+
+  // mov #rA, imm
+  // mov #rC, #rA -> mov #rC, imm
+  if (get_mov_imm(first->inst, &first_reg, &first_imm) &&
+      get_mov_reg(second->inst, &second_reg, &second_src_reg) && second_src_reg == first_reg) {
+    second->inst = make_mov_imm(second_reg, first_imm);
+    return true;
+  }
+
+  return false;
+}
+
+// drops code following `jmp` or `exit` that no jump lands on
+bool remove_unreachable(IrProgram *ir) {
+  bool changed = false;
+  bool reachable = true;
+
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst *ir_inst = &ir->insts[i];
+    if (ir_inst->removed) continue;
+
+    if (ir_inst->is_jump_target) reachable = true;
+
+    if (!reachable) {
+      ir_inst->removed = true;
+      changed = true;
+      continue;
+    }
+
+    if (ir_is_terminator(ir_inst->inst)) reachable = false;
+  }
+
+  return changed;
+}
+
+bool run_peephole(IrProgram *ir) {
+  bool changed = false;
+
+  ir_mark_jump_targets(ir);
+  changed |= thread_jumps(ir);
+
+  ir_mark_jump_targets(ir);
+  changed |= remove_unreachable(ir);
+
+  ir_mark_jump_targets(ir);
+  for (size_t i = ir_next_live(ir, 0); i < ir->count; i = ir_next_live(ir, i + 1))
+    changed |= peephole_single(ir, i);
+
+  for (size_t i = ir_next_live(ir, 0); i < ir->count; i = ir_next_live(ir, i + 1)) {
+    size_t next = ir_next_live(ir, i + 1);
+    if (next >= ir->count || ir->insts[next].is_jump_target) continue;
+    changed |= peephole_pair(ir, i, next);
+  }
+
+  return changed;
+}
+
+bool global_remove_unreachable(IrProgram *ir, Cfg *cfg) {
+  bool changed = false;
+
+  for (size_t b = 0; b < cfg->count; b++) {
+    CfgBlock *block = &cfg->blocks[b];
+    if (block->reachable) continue;
+
+    for (size_t i = block->first; i <= block->last; i++) ir->insts[i].removed = true;
+    changed = true;
+  }
+
+  return changed;
+}
+
+bool global_remove_dead_stores(IrProgram *ir, Cfg *cfg) {
+  bool changed = false;
+
+  for (size_t b = 0; b < cfg->count; b++) {
+    CfgBlock *block = &cfg->blocks[b];
+    unsigned live = block->live_out;
+
+    for (size_t i = block->last + 1; i-- > block->first;) {
+      IrInst *ir_inst = &ir->insts[i];
+      if (ir_inst->removed) continue;
+
+      unsigned defs = ir_inst_defs(ir_inst->inst);
+      bool removable = is_pure_reg_write(ir_inst->inst) || defs == IR_FLAGS_BIT;
+
+      if (removable && !(defs & live)) {
+        remove_inst(ir, i);
+        changed = true;
+        continue;
+      }
+
+      live = (live & ~defs) | ir_inst_uses(ir_inst->inst);
+    }
+  }
+
+  return changed;
+}
+
+typedef struct {
+  CfgReachingDefs rd;
+  bool *def_is_const;
+  VmWord *def_vals;
+} ConstDefs;
+
+// true if every definition of `reg` reaching `set` assigns the same constant
+bool reg_const_value(ConstDefs *consts, uint64_t *set, int reg, VmWord *val_out) {
+  CfgReachingDefs *rd = &consts->rd;
+  uint64_t *reg_defs = &rd->reg_defs[reg * rd->words];
+  bool found = false;
+
+  for (size_t w = 0; w < rd->words; w++) {
+    uint64_t bits = set[w] & reg_defs[w];
+
+    while (bits) {
+      size_t def = w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+
+      if (!consts->def_is_const[def]) return false;
+      if (found && consts->def_vals[def] != *val_out) return false;
+
+      *val_out = consts->def_vals[def];
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+void update_const_def(ConstDefs *consts, IrInst *ir_inst, size_t def) {
+  int reg;
+  VmWord imm;
+
+  if (def == SIZE_MAX) return;
+
+  if (get_mov_imm(ir_inst->inst, &reg, &imm)) {
+    consts->def_is_const[def] = true;
+    consts->def_vals[def] = imm;
+  }
+  else if (OPT_MNEMONIC(ir_inst->inst) == MNEMONIC_LOAD) {
+    consts->def_is_const[def] = true;
+    consts->def_vals[def] = (VmWord)((uint64_t)ir_inst->payload[1] << 32 | ir_inst->payload[0]);
+  }
+  else
+    consts->def_is_const[def] = false;
+}
+
+bool is_commutative(int mnemonic) {
+  return mnemonic == MNEMONIC_ADD || mnemonic == MNEMONIC_MUL || mnemonic == MNEMONIC_OR ||
+         mnemonic == MNEMONIC_AND || mnemonic == MNEMONIC_XOR;
+}
+
+inst_ty make_binop_imm(int mnemonic, int dst_reg, int op1_reg, VmWord imm) {
+  inst_ty inst = mnemonic;
+  inst = inst_insert_bits(inst, FIELD_BINOP_DST, dst_reg);
+  inst = inst_insert_bits(inst, FIELD_BINOP_OP1, op1_reg);
+  inst = inst_insert_bits(inst, FIELD_BINOP_IS_IMM, 1);
+  return inst_insert_bits(inst, FIELD_BINOP_IMM, (int32_t)imm);
+}
+
+// rewrites register operands with a known constant value into immediate forms
+bool propagate_into_inst(ConstDefs *consts, uint64_t *set, IrInst *ir_inst) {
+  inst_ty inst = ir_inst->inst;
+  int mnemonic = OPT_MNEMONIC(inst);
+  VmWord val, res;
+
+  switch (mnemonic) {
+    case MNEMONIC_MOV: {
+      int dst_reg, src_reg;
+      if (!get_mov_reg(inst, &dst_reg, &src_reg)) return false;
+      if (!reg_const_value(consts, set, src_reg, &val) || val < -MOV_IMM_MAX || val > MOV_IMM_MAX)
+        return false;
+
+      ir_inst->inst = make_mov_imm(dst_reg, val);
+      return true;
+    }
+    case MNEMONIC_ADD:
+    case MNEMONIC_SUB:
+    case MNEMONIC_MUL:
+    case MNEMONIC_DIV:
+    case MNEMONIC_OR:
+    case MNEMONIC_AND:
+    case MNEMONIC_XOR:
+    case MNEMONIC_SHR:
+    case MNEMONIC_SHL: {
+      int dst_reg = inst_extract_bits(inst, FIELD_BINOP_DST, false);
+      int op1_reg = inst_extract_bits(inst, FIELD_BINOP_OP1, false);
+      bool is_imm = inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false);
+      VmWord op1_val, op2_val;
+      bool op1_const = reg_const_value(consts, set, op1_reg, &op1_val);
+      bool op2_const = is_imm;
+
+      if (is_imm)
+        op2_val = inst_extract_bits(inst, FIELD_BINOP_IMM, true);
+      else
+        op2_const =
+            reg_const_value(consts, set, inst_extract_bits(inst, FIELD_BINOP_OP2, false), &op2_val);
+
+      if (op1_const && op2_const && fold_binop(mnemonic, op1_val, op2_val, &res) &&
+          res >= -MOV_IMM_MAX && res <= MOV_IMM_MAX) {
+        ir_inst->inst = make_mov_imm(dst_reg, res);
+        return true;
+      }
+
+      if (is_imm) return false;
+
+      // a zero divisor has to stay a runtime error
+      if (op2_const && add_delta_fits(op2_val) && !(mnemonic == MNEMONIC_DIV && op2_val == 0)) {
+        ir_inst->inst = make_binop_imm(mnemonic, dst_reg, op1_reg, op2_val);
+        return true;
+      }
+
+      if (op1_const && is_commutative(mnemonic) && add_delta_fits(op1_val)) {
+        ir_inst->inst = make_binop_imm(mnemonic, dst_reg,
+                                       inst_extract_bits(inst, FIELD_BINOP_OP2, false), op1_val);
+        return true;
+      }
+
+      return false;
+    }
+    case MNEMONIC_INC:
+    case MNEMONIC_DEC: {
+      int reg;
+      VmWord delta;
+      get_add_delta(inst, &reg, &delta);
+      if (!reg_const_value(consts, set, reg, &val)) return false;
+
+      res = (VmWord)((uint64_t)val + (uint64_t)delta);
+      if (res < -MOV_IMM_MAX || res > MOV_IMM_MAX) return false;
+
+      ir_inst->inst = make_mov_imm(reg, res);
+      return true;
+    }
+    case MNEMONIC_NOT: {
+      int dst_reg = inst_extract_bits(inst, FIELD_NOT_DST, false);
+      if (!reg_const_value(consts, set, inst_extract_bits(inst, FIELD_NOT_SRC, false), &val))
+        return false;
+      if (~val < -MOV_IMM_MAX || ~val > MOV_IMM_MAX) return false;
+
+      ir_inst->inst = make_mov_imm(dst_reg, ~val);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// mirrors `handle_cond_jmp`
+bool eval_cond_jmp(int mnemonic, VmWord reg1_val, VmWord reg2_val) {
+  switch (mnemonic) {
+    case MNEMONIC_JMP_GREATER:
+      return reg1_val > reg2_val;
+    case MNEMONIC_JMP_LOWER:
+      return reg1_val < reg2_val;
+    case MNEMONIC_JMP_EQ:
+      return reg1_val == reg2_val;
+    case MNEMONIC_JMPZ:
+    default:
+      return !reg1_val || !reg2_val;
+  }
+}
+
+int global_propagate_constants(IrProgram *ir, Cfg *cfg, bool *changed_out) {
+  ConstDefs consts = {0};
+  int tmp_ret_code = cfg_compute_reaching_defs(ir, cfg, &consts.rd);
+
+  *changed_out = false;
+  if (tmp_ret_code == RET_CODE_NORET) return RET_CODE_OK;
+  if (tmp_ret_code != 0) return tmp_ret_code;
+
+  CfgReachingDefs *rd = &consts.rd;
+  consts.def_is_const = calloc(rd->def_count, sizeof(bool));
+  consts.def_vals = calloc(rd->def_count, sizeof(VmWord));
+  uint64_t *set = malloc(rd->words * sizeof(uint64_t));
+
+  if (!consts.def_is_const || !consts.def_vals || !set) {
+    free(consts.def_is_const);
+    free(consts.def_vals);
+    free(set);
+    cfg_free_reaching_defs(rd);
+    print_err("Memory error: Could not allocate memory for constant propagation");
+    return RET_CODE_ERR;
+  }
+
+  // register values at program entry are unknown, the embedder may set them
+  for (size_t def = REGS_COUNT; def < rd->def_count; def++)
+    update_const_def(&consts, &ir->insts[rd->def_insts[def]], def);
+
+  for (size_t r = 0; r < cfg->rpo_count; r++) {
+    size_t b = cfg->rpo[r];
+    CfgBlock *block = &cfg->blocks[b];
+    // flags of the last `cmp` in this block if both of its operands are constant
+    bool flags_known = false;
+    VmWord cmp_vals[2];
+
+    memcpy(set, &rd->block_in[b * rd->words], rd->words * sizeof(uint64_t));
+
+    for (size_t i = block->first; i <= block->last; i++) {
+      IrInst *ir_inst = &ir->insts[i];
+      if (ir_inst->removed) continue;
+
+      if (propagate_into_inst(&consts, set, ir_inst)) {
+        update_const_def(&consts, ir_inst, rd->inst_def[i]);
+        *changed_out = true;
+      }
+
+      if (OPT_MNEMONIC(ir_inst->inst) == MNEMONIC_CMP) {
+        flags_known =
+            reg_const_value(&consts, set, inst_extract_bits(ir_inst->inst, FIELD_CMP_REG1, false),
+                            &cmp_vals[0]) &&
+            reg_const_value(&consts, set, inst_extract_bits(ir_inst->inst, FIELD_CMP_REG2, false),
+                            &cmp_vals[1]);
+      }
+      else if (ir_is_cond_jump(ir_inst->inst) && flags_known) {
+        if (eval_cond_jmp(OPT_MNEMONIC(ir_inst->inst), cmp_vals[0], cmp_vals[1]))
+          ir_inst->inst = inst_insert_bits(ir_inst->inst, FIELD_MNEMONIC, MNEMONIC_JMP);
+        else
+          remove_inst(ir, i);
+        *changed_out = true;
+      }
+      // partial flag writes like `inb` leave flags that no longer match the `cmp`
+      else if (ir_inst_defs(ir_inst->inst) & IR_FLAGS_BIT) {
+        flags_known = false;
+      }
+
+      cfg_reaching_defs_step(rd, i, set);
+    }
+  }
+
+  free(consts.def_is_const);
+  free(consts.def_vals);
+  free(set);
+  cfg_free_reaching_defs(rd);
+  return RET_CODE_OK;
+}
+
+// moves `inst_idx` in front of the loop header `header_idx`, jumps from outside of the loop
+// enter through the moved instruction while the back edges keep targeting the header
+void hoist_inst(IrProgram *ir, Cfg *cfg, bool *in_loop, size_t inst_idx, size_t header_idx) {
+  for (size_t i = 0; i < ir->count; i++) {
+    IrInst *ir_inst = &ir->insts[i];
+    if (ir_inst->removed || !ir_is_jump(ir_inst->inst)) continue;
+
+    size_t target = ir_next_live(ir, ir_inst->target);
+    if (target == header_idx)
+      ir_inst->target = in_loop[cfg->inst_block[i]] ? header_idx + 1 : header_idx;
+    else if (target > header_idx && target < inst_idx)
+      ir_inst->target = target + 1;
+    else if (target == inst_idx)
+      ir_inst->target = inst_idx + 1;
+  }
+
+  IrInst hoisted = ir->insts[inst_idx];
+  memmove(&ir->insts[header_idx + 1], &ir->insts[header_idx],
+          (inst_idx - header_idx) * sizeof(IrInst));
+  ir->insts[header_idx] = hoisted;
+}
+
+bool hoist_from_loop(IrProgram *ir, Cfg *cfg, bool *in_loop, size_t header) {
+  CfgBlock *header_block = &cfg->blocks[header];
+  size_t header_idx = header_block->first;
+
+  // code in front of the header has to run only when the loop is entered
+  for (size_t i = header_idx; i-- > 0;) {
+    if (ir->insts[i].removed) continue;
+    if (in_loop[cfg->inst_block[i]] && !ir_is_terminator(ir->insts[i].inst)) return false;
+    break;
+  }
+
+  unsigned loop_defs = 0;
+  int def_counts[REGS_COUNT] = {0};
+
+  for (size_t b = 0; b < cfg->count; b++) {
+    if (!in_loop[b]) continue;
+    for (size_t i = cfg->blocks[b].first; i <= cfg->blocks[b].last; i++) {
+      if (ir->insts[i].removed) continue;
+      unsigned defs = ir_inst_defs(ir->insts[i].inst);
+      loop_defs |= defs;
+      if (defs & IR_ALL_REGS) def_counts[__builtin_ctz(defs)]++;
+    }
+  }
+
+  for (size_t b = 0; b < cfg->count; b++) {
+    if (!in_loop[b]) continue;
+
+    for (size_t i = cfg->blocks[b].first; i <= cfg->blocks[b].last; i++) {
+      inst_ty inst = ir->insts[i].inst;
+      unsigned defs = ir_inst_defs(inst);
+
+      if (ir->insts[i].removed || i <= header_idx) continue;
+      // `div` could trap on a path that never executed it, `inlen` depends on reads in the loop
+      if (!is_pure_reg_write(inst) || OPT_MNEMONIC(inst) == MNEMONIC_DIV ||
+          OPT_MNEMONIC(inst) == MNEMONIC_INLEN)
+        continue;
+      if ((ir_inst_uses(inst) & loop_defs) || def_counts[__builtin_ctz(defs)] != 1) continue;
+      if (defs & header_block->live_in) continue;
+
+      // the value must not escape the loop unless it is computed on every path out of it
+      bool escapes = false;
+      for (size_t eb = 0; eb < cfg->count && !escapes; eb++) {
+        if (!in_loop[eb]) continue;
+
+        for (int s = 0; s < cfg->blocks[eb].succ_count; s++) {
+          size_t succ = cfg->blocks[eb].succs[s];
+          if (succ == CFG_END || in_loop[succ]) continue;
+          if ((cfg->blocks[succ].live_in & defs) && !cfg_dominates(cfg, b, eb)) escapes = true;
+        }
+      }
+      if (escapes) continue;
+
+      hoist_inst(ir, cfg, in_loop, i, header_idx);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool global_hoist_invariants(IrProgram *ir, Cfg *cfg) {
+  bool *in_loop = malloc(cfg->count * sizeof(bool));
+  size_t *worklist = malloc(cfg->count * sizeof(size_t));
+  bool changed = false;
+
+  for (size_t header = 0; header < cfg->count && !changed; header++) {
+    CfgBlock *header_block = &cfg->blocks[header];
+    size_t worklist_size = 0;
+    bool has_back_edge = false;
+
+    if (!header_block->reachable) continue;
+    memset(in_loop, 0, cfg->count * sizeof(bool));
+    in_loop[header] = true;
+
+    // natural loop of all back edges into `header`
+    for (size_t p = 0; p < header_block->pred_count; p++) {
+      size_t pred = header_block->preds[p];
+      if (!cfg_dominates(cfg, header, pred)) continue;
+
+      has_back_edge = true;
+      if (!in_loop[pred]) {
+        in_loop[pred] = true;
+        worklist[worklist_size++] = pred;
+      }
+    }
+
+    while (worklist_size > 0) {
+      CfgBlock *block = &cfg->blocks[worklist[--worklist_size]];
+      for (size_t p = 0; p < block->pred_count; p++) {
+        size_t pred = block->preds[p];
+        if (in_loop[pred] || !cfg->blocks[pred].reachable) continue;
+        in_loop[pred] = true;
+        worklist[worklist_size++] = pred;
+      }
+    }
+
+    if (has_back_edge) changed = hoist_from_loop(ir, cfg, in_loop, header);
+  }
+
+  free(in_loop);
+  free(worklist);
+  return changed;
+}
+
+// runs one global pass on a fresh control flow graph, the caller repeats until nothing changes
+int run_global(IrProgram *ir, bool *changed_out) {
+  Cfg cfg;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = cfg_build(ir, &cfg)) != 0) return tmp_ret_code;
+
+  *changed_out = global_remove_unreachable(ir, &cfg);
+
+  if (!*changed_out) {
+    cfg_compute_liveness(ir, &cfg);
+    *changed_out = global_remove_dead_stores(ir, &cfg);
+  }
+
+  if (!*changed_out) {
+    if ((tmp_ret_code = global_propagate_constants(ir, &cfg, changed_out)) != 0) {
+      cfg_free(&cfg);
+      return tmp_ret_code;
+    }
+  }
+
+  if (!*changed_out) {
+    cfg_compute_dominators(&cfg);
+    *changed_out = global_hoist_invariants(ir, &cfg);
+  }
+
+  cfg_free(&cfg);
+  return RET_CODE_OK;
+}
+
+int optimizer_run(InstsOut *insts_out, int opt_level) {
+  if (opt_level <= 0) return RET_CODE_OK;
+
+  IrProgram ir;
+  int tmp_ret_code = ir_decode(insts_out->insts, insts_out->size, &ir);
+
+  // not something the optimizer understands, keep the code as it is
+  if (tmp_ret_code == RET_CODE_NORET) return RET_CODE_OK;
+  if (tmp_ret_code != 0) return tmp_ret_code;
+
+  for (;;) {
+    while (run_peephole(&ir))
+      ;
+
+    if (opt_level < 2) break;
+
+    bool changed;
+    if ((tmp_ret_code = run_global(&ir, &changed)) != 0) {
+      ir_free(&ir);
+      return tmp_ret_code;
+    }
+    if (!changed) break;
+  }
+
+  ir_encode(&ir, insts_out);
+  ir_free(&ir);
+  return RET_CODE_OK;
+}
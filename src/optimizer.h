@@ -0,0 +1,6 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+#include "assembler.h"
+
+int optimizer_run(InstsOut *insts_out, int opt_level);
+#endif  // OPTIMIZER_H
@@ -0,0 +1,125 @@
+#include "output.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "error.h"
+
+void output_init(VmOutput *out, int fd) { *out = (VmOutput){.fd = fd}; }
+
+void output_free(VmOutput *out) {
+  free(out->buf);
+  out->buf = NULL;
+  out->head = 0;
+  out->len = 0;
+}
+
+// one `writev` of the pending bytes, which may wrap around the end of the buffer
+int output_write_pending(VmOutput *out) {
+  struct iovec iov[2];
+  size_t first_len = OUTPUT_BUF_SIZE - out->head;
+  int iov_count = 1;
+
+  if (first_len >= out->len) first_len = out->len;
+  iov[0] = (struct iovec){.iov_base = out->buf + out->head, .iov_len = first_len};
+
+  if (first_len < out->len) {
+    iov[1] = (struct iovec){.iov_base = out->buf, .iov_len = out->len - first_len};
+    iov_count = 2;
+  }
+
+  ssize_t written = writev(out->fd, iov, iov_count);
+  if (written < 0) {
+    if (errno == EINTR) return RET_CODE_OK;
+    print_err("VM error: Could not write output to fd %d (%s)", out->fd, strerror(errno));
+    // the remaining output is dropped so the error is reported only once
+    out->fd = -1;
+    out->len = 0;
+    return RET_CODE_ERR;
+  }
+
+  out->head = (out->head + written) % OUTPUT_BUF_SIZE;
+  out->len -= written;
+  if (!out->len) out->head = 0;
+  return RET_CODE_OK;
+}
+
+int output_flush(VmOutput *out) {
+  while (out->len && out->fd >= 0) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = output_write_pending(out)) != 0) return tmp_ret_code;
+  }
+
+  return RET_CODE_OK;
+}
+
+void output_record(OutputRecord *record, const void *data, size_t size) {
+  if (record->overflow) return;
+
+  if (record->len + size > record->capacity) {
+    size_t capacity = record->capacity ? record->capacity : 256;
+    while (capacity < record->len + size) capacity *= 2;
+    char *grown = record->len + size <= record->max ? realloc(record->data, capacity) : NULL;
+
+    // the run just can not be memoized
+    if (!grown) {
+      record->overflow = true;
+      return;
+    }
+    record->data = grown;
+    record->capacity = capacity;
+  }
+
+  memcpy(record->data + record->len, data, size);
+  record->len += size;
+}
+
+// bypasses the ring for data that would never fit into it
+int output_write_direct(VmOutput *out, const char *data, size_t size) {
+  int tmp_ret_code;
+  if ((tmp_ret_code = output_flush(out)) != 0) return tmp_ret_code;
+
+  while (size) {
+    ssize_t written = write(out->fd, data, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written < 0) {
+      print_err("VM error: Could not write output to fd %d (%s)", out->fd, strerror(errno));
+      out->fd = -1;
+      return RET_CODE_ERR;
+    }
+
+    data += written;
+    size -= written;
+  }
+
+  return RET_CODE_OK;
+}
+
+int output_write(VmOutput *out, const void *data, size_t size) {
+  if (out->record) output_record(out->record, data, size);
+  if (out->fd < 0) return RET_CODE_OK;
+  if (size > OUTPUT_BUF_SIZE) return output_write_direct(out, data, size);
+
+  if (!out->buf) {
+    out->buf = malloc(OUTPUT_BUF_SIZE);
+    ERR_IF(!out->buf, "Memory error: Could not allocate the output buffer");
+  }
+
+  // partial writes leave the rest in place, new data is appended behind it
+  while (OUTPUT_BUF_SIZE - out->len < size) {
+    int tmp_ret_code;
+    if ((tmp_ret_code = output_write_pending(out)) != 0) return tmp_ret_code;
+  }
+
+  size_t tail = (out->head + out->len) % OUTPUT_BUF_SIZE;
+  size_t first_size = OUTPUT_BUF_SIZE - tail < size ? OUTPUT_BUF_SIZE - tail : size;
+
+  memcpy(out->buf + tail, data, first_size);
+  memcpy(out->buf, (const char *)data + first_size, size - first_size);
+  out->len += size;
+  return RET_CODE_OK;
+}
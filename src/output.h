@@ -0,0 +1,30 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OUTPUT_BUF_SIZE (1 << 16)
+
+// copy of the output of a run kept for the memo, see memo.h; stops growing at `max` bytes
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+  size_t max;
+  bool overflow;
+} OutputRecord;
+
+// ring buffer of guest output, written with `writev` once it fills up or on an explicit flush
+typedef struct {
+  char *buf;  // allocated on the first write
+  size_t head;
+  size_t len;
+  int fd;  // -1 discards the output
+  OutputRecord *record;  // NULL unless recording, also records discarded output
+} VmOutput;
+
+void output_init(VmOutput *out, int fd);
+void output_free(VmOutput *out);
+int output_write(VmOutput *out, const void *data, size_t size);
+int output_flush(VmOutput *out);
+#endif  // OUTPUT_H
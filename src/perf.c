@@ -0,0 +1,107 @@
+#include "perf.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "error.h"
+
+typedef struct {
+  uint32_t type;
+  uint64_t config;
+  char *name;
+} PerfCounterDesc;
+
+static const PerfCounterDesc perf_counter_descs[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+    [PERF_ICACHE_MISSES] = {PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_L1I | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+                            "L1-icache-misses"},
+};
+
+// no glibc wrapper exists
+int perf_event_open(struct perf_event_attr *attr, int group_fd) {
+  return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+int perf_open(PerfCounters *perf) {
+  *perf = (PerfCounters){.group_fd = -1};
+
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    // only user space is counted, which also works with a restrictive perf_event_paranoid
+    struct perf_event_attr attr = {.size = sizeof(attr),
+                                   .type = perf_counter_descs[i].type,
+                                   .config = perf_counter_descs[i].config,
+                                   .disabled = perf->group_fd < 0,
+                                   .exclude_kernel = 1,
+                                   .exclude_hv = 1,
+                                   .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                                                  PERF_FORMAT_TOTAL_TIME_RUNNING};
+
+    perf->fds[i] = perf_event_open(&attr, perf->group_fd);
+    if (perf->fds[i] < 0 && perf->group_fd < 0) perf->open_errno = errno;
+    if (perf->fds[i] >= 0 && perf->group_fd < 0) perf->group_fd = perf->fds[i];
+  }
+
+  return perf->group_fd < 0 ? RET_CODE_NORET : RET_CODE_OK;
+}
+
+void perf_close(PerfCounters *perf) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    if (perf->fds[i] >= 0) close(perf->fds[i]);
+  *perf = (PerfCounters){.group_fd = -1};
+}
+
+void perf_start(PerfCounters *perf) {
+  if (perf->group_fd < 0) return;
+  ioctl(perf->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(perf->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void perf_stop(PerfCounters *perf) {
+  if (perf->group_fd >= 0) ioctl(perf->group_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// scaled up if the kernel had to multiplex the group with other events
+bool perf_read(int fd, double *value_out) {
+  uint64_t values[3];  // value, time enabled, time running
+
+  if (fd < 0 || read(fd, values, sizeof(values)) != sizeof(values) || !values[2]) return false;
+
+  *value_out = (double)values[0] * values[1] / values[2];
+  return true;
+}
+
+void perf_print(PerfCounters *perf, uint64_t guest_insts) {
+  err_printf("perf: %llu guest instructions\n", (unsigned long long)guest_insts);
+
+  if (perf->group_fd < 0) {
+    err_printf("perf: hardware counters unavailable (%s)\n", strerror(perf->open_errno));
+    return;
+  }
+
+  double values[PERF_COUNTER_COUNT];
+  bool valid[PERF_COUNTER_COUNT];
+  double per_inst = guest_insts ? 1.0 / guest_insts : 0;
+
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    valid[i] = perf_read(perf->fds[i], &values[i]);
+
+    if (valid[i])
+      err_printf("perf: %-17s %15.0f  %8.3f per guest instruction\n", perf_counter_descs[i].name,
+                 values[i], values[i] * per_inst);
+    else
+      err_printf("perf: %-17s %15s\n", perf_counter_descs[i].name, "not supported");
+  }
+
+  if (valid[PERF_CYCLES] && valid[PERF_INSTRUCTIONS] && values[PERF_CYCLES] > 0)
+    err_printf("perf: %.3f host instructions per cycle\n",
+               values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+}
@@ -0,0 +1,29 @@
+#ifndef PERF_H
+#define PERF_H
+#include <stdbool.h>
+#include <stdint.h>
+
+enum PerfCounter {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_ICACHE_MISSES,
+  PERF_COUNTER_COUNT,
+};
+
+// host hardware counters of the calling thread, opened as one group so they count the same
+// interval; counters the host does not support stay closed
+typedef struct {
+  int fds[PERF_COUNTER_COUNT];  // -1 for unavailable counters
+  int group_fd;                 // first counter that could be opened
+  int open_errno;               // why the group leader could not be opened
+} PerfCounters;
+
+// returns RET_CODE_NORET if no counter is available, the run goes on without counters then
+int perf_open(PerfCounters *perf);
+void perf_close(PerfCounters *perf);
+void perf_start(PerfCounters *perf);
+void perf_stop(PerfCounters *perf);
+// writes the guest instruction count and the counters normalized per guest instruction to stderr
+void perf_print(PerfCounters *perf, uint64_t guest_insts);
+#endif  // PERF_H
@@ -0,0 +1,52 @@
+#include "program.h"
+
+#include <stdlib.h>
+
+#include "error.h"
+#include "hash.h"
+
+int program_create(inst_ty *insts, size_t insts_count, Program **program_out) {
+  Program *program = malloc(sizeof(Program));
+  ERR_IF(!program, "Memory error: Could not allocate memory for the program");
+
+  *program = (Program){.insts = insts, .insts_count = insts_count, .refs = 1};
+
+  int tmp_ret_code;
+  if ((tmp_ret_code = specialize_insts(insts, insts_count, &program->exec_insts,
+                                       &program->div_magics)) != 0) {
+    free(program);
+    return tmp_ret_code;
+  }
+  if (!program->exec_insts) program->exec_insts = insts;
+
+  *program_out = program;
+  return RET_CODE_OK;
+}
+
+Program *program_retain(Program *program) {
+  __atomic_fetch_add(&program->refs, 1, __ATOMIC_RELAXED);
+  return program;
+}
+
+void program_release(Program *program) {
+  if (!program) return;
+  // the acquire pairs with the releases of other threads dropping their references, so their
+  // reads of the code happen before it is freed
+  if (__atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  if (program->exec_insts != program->insts) free(program->exec_insts);
+  free(program->div_magics);
+  free(program->insts);
+  free(program);
+}
+
+// threads racing on the first call compute the same value, whichever store wins is fine
+uint64_t program_hash(Program *program) {
+  uint64_t hash = __atomic_load_n(&program->hash, __ATOMIC_RELAXED);
+  if (hash) return hash;
+
+  // 0 marks a hash not computed yet
+  hash = hash_bytes(program->insts, program->insts_count * sizeof(inst_ty), 0) | 1;
+  __atomic_store_n(&program->hash, hash, __ATOMIC_RELAXED);
+  return hash;
+}
@@ -0,0 +1,37 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "specialize.h"
+#include "vm.h"
+
+// code shared by any number of contexts on any number of threads, it is never written after
+// `program_create`, so running needs no locking; freed when the last reference is released
+struct Program {
+  inst_ty *insts;
+  size_t insts_count;
+  // what contexts run, `insts` with `div` and `mul` by immediates specialized, or `insts` itself
+  inst_ty *exec_insts;
+  DivMagic *div_magics;
+  size_t refs;    // only changed atomically
+  uint64_t hash;  // see `program_hash`, 0 until first requested
+  // whether runs can be memoized (see memo.c), 0 until first requested, then PROGRAM_MEMO_*
+  int memo_state;
+};
+
+enum {
+  PROGRAM_MEMO_UNKNOWN = 0,
+  PROGRAM_MEMO_NEVER,
+  PROGRAM_MEMO_ALLOWED,
+};
+
+// takes ownership of `insts` (allocated with malloc) on success, the program starts with one
+// reference; fails on a division by an immediate zero
+int program_create(inst_ty *insts, size_t insts_count, Program **program_out);
+Program *program_retain(Program *program);
+// NULL is ignored
+void program_release(Program *program);
+// hash of the code, computed once and then cached in the program
+uint64_t program_hash(Program *program);
+#endif  // PROGRAM_H
@@ -0,0 +1,115 @@
+#include "scan.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+const unsigned char char_classes[256] = {
+    ['\t'] = CC_SPACE,
+    ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE,
+    [' '] = CC_SPACE,
+    ['0' ... '9'] = CC_DIGIT | CC_HEX,
+    ['A' ... 'F'] = CC_IDENT_START | CC_HEX,
+    ['G' ... 'Z'] = CC_IDENT_START,
+    ['a' ... 'f'] = CC_IDENT_START | CC_HEX,
+    ['g' ... 'z'] = CC_IDENT_START,
+    ['_'] = CC_IDENT_START,
+};
+
+// the vector loops are only worth it for longer runs, the first bytes are checked one by one
+#define SCAN_SCALAR_PREFIX 4
+
+#ifdef SCAN_X86
+// bytes are compared as signed, so everything >= 0x80 falls outside of all ranges
+#define SSE2_IN_RANGE(_v, _lo, _hi)                             \
+  _mm_and_si128(_mm_cmpgt_epi8(_v, _mm_set1_epi8((_lo) - 1)), \
+                _mm_cmplt_epi8(_v, _mm_set1_epi8((_hi) + 1)))
+
+#define AVX2_IN_RANGE(_v, _lo, _hi)                                 \
+  _mm256_andnot_si256(_mm256_cmpgt_epi8(_v, _mm256_set1_epi8(_hi)), \
+                      _mm256_cmpgt_epi8(_v, _mm256_set1_epi8((_lo) - 1)))
+
+unsigned sse2_space_mask(__m128i v) {
+  __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+  return _mm_movemask_epi8(_mm_or_si128(space, SSE2_IN_RANGE(v, '\t', '\r')));
+}
+
+unsigned sse2_ident_mask(__m128i v) {
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i ident = _mm_or_si128(SSE2_IN_RANGE(lower, 'a', 'z'), SSE2_IN_RANGE(v, '0', '9'));
+  return _mm_movemask_epi8(_mm_or_si128(ident, _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+}
+
+__attribute__((target("avx2"))) char *avx2_scan_space(char *pos, char *end) {
+  for (; end - pos >= 32; pos += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i *)pos);
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                    AVX2_IN_RANGE(v, '\t', '\r'));
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(space);
+    if (other) return pos + __builtin_ctz(other);
+  }
+  return pos;
+}
+
+__attribute__((target("avx2"))) char *avx2_scan_ident(char *pos, char *end) {
+  for (; end - pos >= 32; pos += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i *)pos);
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i ident = _mm256_or_si256(AVX2_IN_RANGE(lower, 'a', 'z'), AVX2_IN_RANGE(v, '0', '9'));
+    ident = _mm256_or_si256(ident, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(ident);
+    if (other) return pos + __builtin_ctz(other);
+  }
+  return pos;
+}
+
+bool has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+char *scan_space(char *pos, char *end) {
+  for (int i = 0; i < SCAN_SCALAR_PREFIX; i++, pos++)
+    if (pos == end || !CHAR_IS(*pos, CC_SPACE)) return pos;
+
+#ifdef SCAN_X86
+  if (has_avx2()) pos = avx2_scan_space(pos, end);
+
+  for (; end - pos >= 16; pos += 16) {
+    unsigned other = ~sse2_space_mask(_mm_loadu_si128((__m128i *)pos)) & 0xffff;
+    if (other) return pos + __builtin_ctz(other);
+  }
+#endif
+
+  while (pos < end && CHAR_IS(*pos, CC_SPACE)) pos++;
+  return pos;
+}
+
+char *scan_ident(char *pos, char *end) {
+  for (int i = 0; i < SCAN_SCALAR_PREFIX; i++, pos++)
+    if (pos == end || !CHAR_IS(*pos, CC_IDENT)) return pos;
+
+#ifdef SCAN_X86
+  if (has_avx2()) pos = avx2_scan_ident(pos, end);
+
+  for (; end - pos >= 16; pos += 16) {
+    unsigned other = ~sse2_ident_mask(_mm_loadu_si128((__m128i *)pos)) & 0xffff;
+    if (other) return pos + __builtin_ctz(other);
+  }
+#endif
+
+  while (pos < end && CHAR_IS(*pos, CC_IDENT)) pos++;
+  return pos;
+}
+
+// libc `memchr` is already vectorized for the running CPU
+char *scan_line_end(char *pos, char *end) {
+  char *line_end = memchr(pos, '\n', end - pos);
+  return line_end ? line_end : end;
+}
@@ -0,0 +1,22 @@
+#ifndef SCAN_H
+#define SCAN_H
+#include <stdbool.h>
+
+// character classes of the assembler syntax, `isspace` and friends are locale dependent and slow
+enum CharClass {
+  CC_SPACE = 1 << 0,
+  CC_IDENT_START = 1 << 1,
+  CC_DIGIT = 1 << 2,
+  CC_HEX = 1 << 3,
+  CC_IDENT = CC_IDENT_START | CC_DIGIT,
+};
+
+extern const unsigned char char_classes[256];
+
+#define CHAR_IS(_c, _class) ((char_classes[(unsigned char)(_c)] & (_class)) != 0)
+
+// all scanners stop at `end` at the latest and return the first character not in the run
+char *scan_space(char *pos, char *end);
+char *scan_ident(char *pos, char *end);
+char *scan_line_end(char *pos, char *end);
+#endif  // SCAN_H
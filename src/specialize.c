@@ -0,0 +1,187 @@
+#include "specialize.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "ir.h"
+
+#define SPEC_MNEMONIC(inst) (inst_extract_bits(inst, FIELD_MNEMONIC, false))
+// what internal opcodes found in a loaded file become, the VM rejects it like any unknown opcode
+#define MNEMONIC_REJECTED 0xff
+
+typedef struct {
+  DivMagic *magics;
+  size_t count;
+  size_t capacity;
+} DivMagics;
+
+// Hacker's Delight 10-1 for 64-bit words, `d` is neither 0, 1, -1 nor a power of two in absolute
+// value
+DivMagic div_magic(VmWord d) {
+  const uint64_t two63 = (uint64_t)1 << 63;
+  uint64_t ad = d < 0 ? 0 - (uint64_t)d : (uint64_t)d;
+  uint64_t t = two63 + ((uint64_t)d >> 63);
+  uint64_t anc = t - 1 - t % ad;
+  uint64_t q1 = two63 / anc;
+  uint64_t r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad;
+  uint64_t r2 = two63 - q2 * ad;
+  uint64_t delta;
+  int p = 63;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  VmWord magic = (VmWord)(d < 0 ? 0 - (q2 + 1) : q2 + 1);
+  int add = 0;
+  if (d > 0 && magic < 0) add = 1;
+  if (d < 0 && magic > 0) add = -1;
+
+  return (DivMagic){.magic = magic, .shift = p - 64, .add = add};
+}
+
+// -1 if `val` is not a power of two
+int log2_exact(uint64_t val) { return val && !(val & (val - 1)) ? __builtin_ctzll(val) : -1; }
+
+inst_ty div_variant(int mnemonic, inst_ty div) {
+  inst_ty inst = mnemonic;
+  inst = inst_insert_bits(inst, FIELD_BINOP_DST, inst_extract_bits(div, FIELD_BINOP_DST, false));
+  return inst_insert_bits(inst, FIELD_BINOP_OP1, inst_extract_bits(div, FIELD_BINOP_OP1, false));
+}
+
+// `mov` of the first operand into the destination of `binop`
+inst_ty binop_copy_op1(inst_ty binop) {
+  inst_ty inst = MNEMONIC_MOV;
+  inst = inst_insert_bits(inst, FIELD_MOV_DST, inst_extract_bits(binop, FIELD_BINOP_DST, false));
+  return inst_insert_bits(inst, FIELD_MOV_SRC, inst_extract_bits(binop, FIELD_BINOP_OP1, false));
+}
+
+// `div` by -1 is left alone, it traps on the smallest word like the native division
+int specialize_div(inst_ty inst, VmWord divisor, DivMagics *magics, inst_ty *inst_out) {
+  uint64_t abs_divisor = divisor < 0 ? 0 - (uint64_t)divisor : (uint64_t)divisor;
+  int shift = log2_exact(abs_divisor);
+
+  if (divisor == 1) {
+    *inst_out = binop_copy_op1(inst);
+    return RET_CODE_OK;
+  }
+  if (divisor == -1) return RET_CODE_NORET;
+
+  if (shift > 0) {
+    inst_ty pow2 = div_variant(MNEMONIC_DIV_POW2, inst);
+    pow2 = inst_insert_bits(pow2, FIELD_DIV_SHIFT, shift);
+    *inst_out = inst_insert_bits(pow2, FIELD_DIV_NEG, divisor < 0);
+    return RET_CODE_OK;
+  }
+
+  if (magics->count == (size_t)1 << FIELD_DIV_MAGIC_IDX.bit_count) return RET_CODE_NORET;
+
+  if (magics->count == magics->capacity) {
+    size_t capacity = magics->capacity ? magics->capacity * 2 : 16;
+    DivMagic *grown = realloc(magics->magics, capacity * sizeof(DivMagic));
+    ERR_IF(!grown, "Memory error: Could not allocate memory for the program");
+    magics->magics = grown;
+    magics->capacity = capacity;
+  }
+
+  magics->magics[magics->count] = div_magic(divisor);
+  *inst_out = inst_insert_bits(div_variant(MNEMONIC_DIV_MAGIC, inst), FIELD_DIV_MAGIC_IDX,
+                               magics->count++);
+  return RET_CODE_OK;
+}
+
+// products wrap around, so a multiplication by 2^k is exactly a left shift
+int specialize_mul(inst_ty inst, VmWord factor, inst_ty *inst_out) {
+  int shift = factor > 0 ? log2_exact(factor) : -1;
+
+  if (factor == 0) {
+    inst_ty mov = MNEMONIC_MOV | 1u << FIELD_MOV_IS_IMM.start_bit;
+    *inst_out =
+        inst_insert_bits(mov, FIELD_MOV_DST, inst_extract_bits(inst, FIELD_BINOP_DST, false));
+    return RET_CODE_OK;
+  }
+  if (shift == 0) {
+    *inst_out = binop_copy_op1(inst);
+    return RET_CODE_OK;
+  }
+  if (shift < 0) return RET_CODE_NORET;
+
+  *inst_out = inst_insert_bits(inst_insert_bits(inst, FIELD_MNEMONIC, MNEMONIC_SHL),
+                               FIELD_BINOP_IMM, shift);
+  return RET_CODE_OK;
+}
+
+int specialize_insts(inst_ty *insts, size_t insts_count, inst_ty **exec_insts_out,
+                     DivMagic **div_magics_out) {
+  DivMagics magics = {0};
+  inst_ty *exec_insts = NULL;
+  int tmp_ret_code = RET_CODE_OK;
+
+  for (size_t i = 0; i < insts_count && tmp_ret_code == RET_CODE_OK;
+       i += ir_inst_words(insts[i])) {
+    inst_ty inst = insts[i];
+    inst_ty specialized = inst;
+    int mnemonic = SPEC_MNEMONIC(inst);
+    bool is_imm = inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false);
+    VmWord imm = inst_extract_bits(inst, FIELD_BINOP_IMM, true);
+
+    if (mnemonic == MNEMONIC_DIV_POW2 || mnemonic == MNEMONIC_DIV_MAGIC)
+      specialized = inst_insert_bits(inst, FIELD_MNEMONIC, MNEMONIC_REJECTED);
+    else if (mnemonic == MNEMONIC_DIV && is_imm) {
+      if (imm == 0) {
+        print_err("Load error: Division by zero in the instruction at word %zu", i);
+        tmp_ret_code = RET_CODE_ERR;
+        break;
+      }
+      tmp_ret_code = specialize_div(inst, imm, &magics, &specialized);
+    }
+    else if (mnemonic == MNEMONIC_MUL && is_imm)
+      tmp_ret_code = specialize_mul(inst, imm, &specialized);
+
+    // kept as it is
+    if (tmp_ret_code == RET_CODE_NORET) {
+      tmp_ret_code = RET_CODE_OK;
+      continue;
+    }
+    if (tmp_ret_code != RET_CODE_OK || specialized == inst) continue;
+
+    // most programs have nothing to rewrite and run their loaded code directly
+    if (!exec_insts) {
+      exec_insts = malloc(insts_count * sizeof(inst_ty));
+      if (!exec_insts) {
+        print_err("Memory error: Could not allocate memory for the program");
+        tmp_ret_code = RET_CODE_ERR;
+        break;
+      }
+      memcpy(exec_insts, insts, insts_count * sizeof(inst_ty));
+    }
+    exec_insts[i] = specialized;
+  }
+
+  if (tmp_ret_code != RET_CODE_OK) {
+    free(exec_insts);
+    free(magics.magics);
+    return tmp_ret_code;
+  }
+
+  *exec_insts_out = exec_insts;
+  *div_magics_out = magics.magics;
+  return RET_CODE_OK;
+}
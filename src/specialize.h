@@ -0,0 +1,22 @@
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+#include <stddef.h>
+
+#include "vm.h"
+
+// `div` by an immediate that is not a power of two runs as a multiplication with `magic` keeping
+// the high half, then `add` times the dividend is added and the sum shifted right by `shift`
+// (Granlund and Montgomery, "Division by Invariant Integers using Multiplication")
+typedef struct {
+  VmWord magic;
+  int shift;
+  int add;
+} DivMagic;
+
+// copies `insts` into `exec_insts_out` with `div` and `mul` by immediates rewritten into cheaper
+// instructions with the same result for every operand: powers of two become shifts, other
+// divisors `MNEMONIC_DIV_MAGIC` with an index into `div_magics_out`; both are NULL if there was
+// nothing to rewrite. A division by an immediate zero is an error.
+int specialize_insts(inst_ty *insts, size_t insts_count, inst_ty **exec_insts_out,
+                     DivMagic **div_magics_out);
+#endif  // SPECIALIZE_H
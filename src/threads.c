@@ -0,0 +1,107 @@
+#include "threads.h"
+
+#include <stdlib.h>
+
+#include "error.h"
+
+void threads_init(VmThreads *threads, size_t max_threads) {
+  *threads = (VmThreads){.max_threads = max_threads};
+  pthread_mutex_init(&threads->lock, NULL);
+}
+
+int threads_free(VmThreads *threads) {
+  int ret_code = RET_CODE_OK;
+
+  // running threads may still spawn, so the count is read again after every join
+  for (size_t i = 0;; i++) {
+    pthread_mutex_lock(&threads->lock);
+    VmThread *thread = i < threads->count ? threads->threads[i] : NULL;
+    bool joined = thread && thread->joined;
+    if (thread) thread->joined = true;
+    pthread_mutex_unlock(&threads->lock);
+
+    if (!thread) break;
+    if (!joined) pthread_join(thread->thread, NULL);
+    if (thread->ret_code != RET_CODE_OK) ret_code = RET_CODE_ERR;
+  }
+
+  for (size_t i = 0; i < threads->count; i++) {
+    vm_deinit_ctx(&threads->threads[i]->ctx);
+    free(threads->threads[i]);
+  }
+
+  free(threads->threads);
+  pthread_mutex_destroy(&threads->lock);
+  *threads = (VmThreads){0};
+  return ret_code;
+}
+
+static void *run_thread(void *arg) {
+  VmThread *thread = arg;
+
+  if (thread->capture_errors) err_capture_begin();
+  thread->ret_code = vm_run(&thread->ctx, &thread->program_ret_code);
+  if (thread->capture_errors) err_capture_end();
+  return NULL;
+}
+
+VmWord threads_spawn(VmThreads *threads, VmCtx *ctx, inst_ty *entry, int dst_reg) {
+  VmThread *thread = malloc(sizeof(VmThread));
+  if (!thread) return -1;
+
+  pthread_mutex_lock(&threads->lock);
+
+  if (threads->count == threads->max_threads) goto fail;
+
+  if (threads->count == threads->capacity) {
+    size_t capacity = threads->capacity ? threads->capacity * 2 : 16;
+    VmThread **grown = realloc(threads->threads, capacity * sizeof(VmThread *));
+    if (!grown) goto fail;
+    threads->threads = grown;
+    threads->capacity = capacity;
+  }
+
+  *thread = (VmThread){.capture_errors = threads->capture_errors};
+  vm_fork(ctx, &thread->ctx);
+  thread->ctx.ip = entry;
+  // fork handlers only serve the context they were set up for
+  thread->ctx.fork_handler = NULL;
+  thread->ctx.regs[dst_reg] = 0;
+  thread->ctx.f_zero = thread->ctx.f_greater = thread->ctx.f_smaller = thread->ctx.f_eq = false;
+
+  if (pthread_create(&thread->thread, NULL, run_thread, thread) != 0) {
+    vm_deinit_ctx(&thread->ctx);
+    goto fail;
+  }
+
+  threads->threads[threads->count++] = thread;
+  VmWord id = threads->count;
+  pthread_mutex_unlock(&threads->lock);
+  return id;
+
+fail:
+  pthread_mutex_unlock(&threads->lock);
+  free(thread);
+  return -1;
+}
+
+VmWord threads_join(VmThreads *threads, VmWord id) {
+  pthread_mutex_lock(&threads->lock);
+
+  VmThread *thread = id > 0 && (size_t)id <= threads->count ? threads->threads[id - 1] : NULL;
+  bool joinable = thread && !thread->joined;
+  if (joinable) thread->joined = true;
+
+  pthread_mutex_unlock(&threads->lock);
+
+  if (!joinable) return -1;
+
+  // a thread joining itself is left for `threads_free`
+  if (pthread_join(thread->thread, NULL) != 0) {
+    pthread_mutex_lock(&threads->lock);
+    thread->joined = false;
+    pthread_mutex_unlock(&threads->lock);
+    return -1;
+  }
+  return thread->ret_code == RET_CODE_OK ? thread->program_ret_code : -1;
+}
@@ -0,0 +1,40 @@
+#ifndef THREADS_H
+#define THREADS_H
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// a guest thread started by `spawn`, it never moves so its context can be handed to the thread
+typedef struct {
+  pthread_t thread;
+  VmCtx ctx;
+  int ret_code;
+  int program_ret_code;
+  bool joined;
+  bool capture_errors;
+} VmThread;
+
+// threads of one guest program, shared by all its contexts; ids are indices + 1
+struct VmThreads {
+  pthread_mutex_t lock;
+  VmThread **threads;
+  size_t count;
+  size_t capacity;
+  size_t max_threads;
+  // errors of the threads are dropped instead of written to stderr
+  bool capture_errors;
+};
+
+void threads_init(VmThreads *threads, size_t max_threads);
+// waits for every thread the guest did not join, RET_CODE_ERR if one of them failed
+int threads_free(VmThreads *threads);
+
+// starts a thread at `entry` with a copy of the registers of `ctx`, `dst_reg` cleared; returns the
+// id or -1 if the limit is reached or the thread could not be created
+VmWord threads_spawn(VmThreads *threads, VmCtx *ctx, inst_ty *entry, int dst_reg);
+// waits for the thread and returns its exit code, -1 if there is no such thread, it was already
+// joined or it stopped on an error
+VmWord threads_join(VmThreads *threads, VmWord id);
+#endif  // THREADS_H
@@ -0,0 +1,192 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "program.h"
+
+// at least two segments, so the ring keeps more than the segment being written
+#define TRACE_MIN_SEGMENTS 2
+
+static const int trace_signals[] = {SIGINT,  SIGTERM, SIGHUP, SIGSEGV,
+                                    SIGBUS, SIGFPE,  SIGILL, SIGABRT};
+#define TRACE_SIGNAL_COUNT (sizeof(trace_signals) / sizeof(trace_signals[0]))
+
+static VmCtx *volatile trace_signal_ctx;
+static struct sigaction trace_prev_actions[TRACE_SIGNAL_COUNT];
+
+int trace_init(VmTrace *trace, char *path, size_t size) {
+  size_t segment_count = size / TRACE_SEGMENT_SIZE;
+  if (segment_count < TRACE_MIN_SEGMENTS) segment_count = TRACE_MIN_SEGMENTS;
+
+  unsigned char *segments = calloc(segment_count, TRACE_SEGMENT_SIZE);
+  ERR_IF(!segments, "Memory error: Could not allocate memory for the trace buffer");
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    print_err("File error: Could not open or create trace file '%s' (%s)", path, strerror(errno));
+    free(segments);
+    return RET_CODE_ERR;
+  }
+
+  *trace = (VmTrace){.segments = segments, .segment_count = segment_count, .fd = fd};
+  return RET_CODE_OK;
+}
+
+void trace_free(VmTrace *trace) {
+  free(trace->segments);
+  if (trace->fd >= 0) close(trace->fd);
+  *trace = (VmTrace){.fd = -1};
+}
+
+TraceCheckpoint *trace_checkpoint(VmTrace *trace, size_t segment) {
+  return (TraceCheckpoint *)(trace->segments + segment * TRACE_SEGMENT_SIZE);
+}
+
+// `used` of the current segment is only brought up to date when it is closed or dumped
+void trace_update_used(VmTrace *trace) {
+  TraceCheckpoint *checkpoint = trace_checkpoint(trace, trace->curr);
+  checkpoint->used = trace->pos - (unsigned char *)(checkpoint + 1);
+}
+
+// the oldest segment is overwritten once the ring is full
+void trace_open_segment(VmCtx *ctx, inst_ty *ip) {
+  VmTrace *trace = ctx->trace;
+
+  if (trace->seq) {
+    trace_update_used(trace);
+    trace->curr = (trace->curr + 1) % trace->segment_count;
+  }
+
+  TraceCheckpoint *checkpoint = trace_checkpoint(trace, trace->curr);
+  *checkpoint = (TraceCheckpoint){.seq = ++trace->seq,
+                                  .ip = ip - ctx->first_inst,
+                                  .in_pos = ctx->in.pos,
+                                  .flags = (ctx->f_zero ? TRACE_FLAG_ZERO : 0) |
+                                           (ctx->f_greater ? TRACE_FLAG_GREATER : 0) |
+                                           (ctx->f_smaller ? TRACE_FLAG_SMALLER : 0) |
+                                           (ctx->f_eq ? TRACE_FLAG_EQ : 0)};
+  memcpy(checkpoint->regs, ctx->regs, sizeof(ctx->regs));
+  memcpy(checkpoint->vregs, ctx->vregs, sizeof(ctx->vregs));
+
+  trace->pos = (unsigned char *)(checkpoint + 1);
+  trace->segment_end = (unsigned char *)checkpoint + TRACE_SEGMENT_SIZE;
+  trace->run_first = ip;
+}
+
+// there is always room for one more record, `trace_branch` opens a new segment before running out
+void trace_write_record(VmTrace *trace, uint64_t record) {
+  unsigned char *pos = trace->pos;
+
+  while (record >= 0x80) {
+    *pos++ = record | 0x80;
+    record >>= 7;
+  }
+  *pos++ = record;
+
+  trace->pos = pos;
+}
+
+void trace_start(VmCtx *ctx) {
+  // hashed up front, so a dump from a signal handler only reads the cached value
+  program_hash(ctx->program);
+  trace_open_segment(ctx, ctx->ip);
+}
+
+// called before the jump to `target` is taken, jumps do not change registers or flags, so the
+// state is the one at `target`
+void trace_branch(VmCtx *ctx, inst_ty *src, inst_ty *target) {
+  VmTrace *trace = ctx->trace;
+
+  trace_write_record(trace, (uint64_t)(src - trace->run_first) << 1);
+  trace->run_first = target;
+
+  if (trace->segment_end - trace->pos < TRACE_MAX_RECORD_SIZE) trace_open_segment(ctx, target);
+}
+
+void trace_stop(VmCtx *ctx) {
+  VmTrace *trace = ctx->trace;
+
+  // an interrupted branch may have moved `run_first` past the instruction pointer already
+  uint64_t delta = ctx->ip > trace->run_first ? ctx->ip - trace->run_first : 0;
+  trace_write_record(trace, delta << 1 | TRACE_RECORD_STOP);
+}
+
+bool trace_write_all(int fd, const void *data, size_t size) {
+  const char *pos = data;
+
+  while (size) {
+    ssize_t written = write(fd, pos, size);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    pos += written;
+    size -= written;
+  }
+
+  return true;
+}
+
+int trace_dump(VmCtx *ctx) {
+  VmTrace *trace = ctx->trace;
+  size_t segment_count = trace->seq < trace->segment_count ? trace->seq : trace->segment_count;
+  TraceFileHeader header = {.version = TRACE_VERSION,
+                            .segment_size = TRACE_SEGMENT_SIZE,
+                            .segment_count = segment_count,
+                            .program_hash = program_hash(ctx->program),
+                            .insts_count = ctx->program->insts_count};
+  memcpy(header.sig, TRACE_SIG, TRACE_SIG_SIZE);
+  trace_update_used(trace);
+
+  bool ok = lseek(trace->fd, 0, SEEK_SET) == 0 && ftruncate(trace->fd, 0) == 0 &&
+            trace_write_all(trace->fd, &header, sizeof(header));
+
+  // the segment after the current one is the oldest once the ring wrapped
+  size_t oldest = trace->curr + 1 + trace->segment_count - segment_count;
+  for (size_t i = 0; i < segment_count && ok; i++) {
+    size_t segment = (oldest + i) % trace->segment_count;
+    ok = trace_write_all(trace->fd, trace_checkpoint(trace, segment), TRACE_SEGMENT_SIZE);
+  }
+
+  // `print_err` is not async-signal-safe
+  if (!ok) {
+    static const char msg[] = "File error: Could not write the trace file\n";
+    trace_write_all(STDERR_FILENO, msg, sizeof(msg) - 1);
+    return RET_CODE_ERR;
+  }
+
+  return RET_CODE_OK;
+}
+
+void trace_signal_handler(int sig) {
+  VmCtx *ctx = trace_signal_ctx;
+
+  if (ctx) {
+    trace_stop(ctx);
+    trace_dump(ctx);
+  }
+
+  // the handlers are installed with SA_RESETHAND, so this runs the default action
+  raise(sig);
+}
+
+void trace_dump_on_signal(VmCtx *ctx) {
+  if (!ctx) {
+    for (size_t i = 0; i < TRACE_SIGNAL_COUNT; i++)
+      sigaction(trace_signals[i], &trace_prev_actions[i], NULL);
+    trace_signal_ctx = NULL;
+    return;
+  }
+
+  struct sigaction action = {.sa_handler = trace_signal_handler, .sa_flags = SA_RESETHAND};
+  sigemptyset(&action.sa_mask);
+
+  trace_signal_ctx = ctx;
+  for (size_t i = 0; i < TRACE_SIGNAL_COUNT; i++)
+    sigaction(trace_signals[i], &action, &trace_prev_actions[i]);
+}
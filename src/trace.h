@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+#define TRACE_SIG "TVMTRACE"
+#define TRACE_SIG_SIZE 8
+#define TRACE_VERSION 2
+#define TRACE_SEGMENT_SIZE 4096
+#define TRACE_DEFAULT_SIZE (1 << 20)
+// a varint holding 64 bits
+#define TRACE_MAX_RECORD_SIZE 10
+
+// records are varints of `delta << 1 | TRACE_RECORD_STOP`, where `delta` counts the words
+// executed in a straight line from the previous jump target (or the checkpoint) up to the next
+// taken jump, or with the stop bit set up to the instruction the program stopped at; jump targets
+// are not recorded, they follow from the jump instruction
+#define TRACE_RECORD_STOP 1
+
+enum TraceFlag {
+  TRACE_FLAG_ZERO = 1 << 0,
+  TRACE_FLAG_GREATER = 1 << 1,
+  TRACE_FLAG_SMALLER = 1 << 2,
+  TRACE_FLAG_EQ = 1 << 3,
+};
+
+// every segment of the ring starts with a checkpoint of the state the records continue from
+typedef struct {
+  uint64_t seq;  // starts at 1, 0 for segments never written
+  uint64_t ip;   // word offset of the next instruction
+  VmWord regs[REGS_COUNT];
+  VmVec vregs[VREGS_COUNT];
+  uint64_t in_pos;
+  uint32_t used;  // bytes of records after the checkpoint
+  uint8_t flags;  // `TRACE_FLAG_*`
+  uint8_t reserved[3];
+} TraceCheckpoint;
+
+// followed by the written segments, oldest first
+typedef struct {
+  char sig[TRACE_SIG_SIZE];
+  uint32_t version;
+  uint32_t segment_size;
+  uint64_t segment_count;
+  uint64_t program_hash;
+  uint64_t insts_count;
+} TraceFileHeader;
+
+struct VmTrace {
+  unsigned char *segments;
+  size_t segment_count;
+  size_t curr;  // segment being written
+  uint64_t seq;
+  unsigned char *pos;  // next record byte in the current segment
+  unsigned char *segment_end;
+  // first instruction of the straight line run the next record ends
+  inst_ty *run_first;
+  int fd;  // dump file
+};
+
+// creates the dump file at `path` right away, so a crash can still write to it; the ring keeps
+// the last `size` bytes of the trace, rounded down to whole segments
+int trace_init(VmTrace *trace, char *path, size_t size);
+void trace_free(VmTrace *trace);
+
+void trace_start(VmCtx *ctx);
+void trace_branch(VmCtx *ctx, inst_ty *src, inst_ty *target);
+void trace_stop(VmCtx *ctx);
+
+// only uses async-signal-safe calls, so it is fine to call from a signal handler
+int trace_dump(VmCtx *ctx);
+// fatal and termination signals record where the program stopped and dump the trace of `ctx`
+// before the default action runs, NULL restores the previous handlers
+void trace_dump_on_signal(VmCtx *ctx);
+#endif  // TRACE_H
@@ -0,0 +1,107 @@
+#ifndef TVM_H
+#define TVM_H
+// public interface of libtvm, nothing here writes to stdout, stderr or the filesystem unless an
+// output fd is set with `tvm_ctx_set_output_fd` or a memo has a directory
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define TVM_API __attribute__((visibility("default")))
+#else
+#define TVM_API
+#endif
+
+#define TVM_REGS_COUNT 8
+
+typedef enum {
+  TVM_OK = 0,
+  TVM_ERR_ARG,       // invalid argument, e.g. a register out of range
+  TVM_ERR_NOMEM,     // allocation failure
+  TVM_ERR_ASSEMBLE,  // the source could not be assembled
+  TVM_ERR_FORMAT,    // the binary is not a valid tvm program
+  TVM_ERR_RUNTIME,   // the VM stopped on an error while running the program
+} TvmStatus;
+
+typedef struct TvmProgram TvmProgram;
+typedef struct TvmCtx TvmCtx;
+typedef struct TvmMemo TvmMemo;
+
+// called by `hcall`, arguments and results are the TVM_REGS_COUNT guest registers; a non-zero
+// return stops the program with TVM_ERR_RUNTIME
+typedef int (*TvmHostFn)(int64_t *regs, void *data);
+
+// `hcall name` and `hcall idx` call the entry with that name or index in the table; a command line
+// plugin exports a table named `tvm_host_fns` that ends with an entry without a name
+typedef struct {
+  const char *name;
+  TvmHostFn fn;
+  void *data;
+} TvmHostFnEntry;
+
+// called by `fork` with `child`, a new context with a copy of the registers, flags and shared memory
+// of the parent and the same program, input, output fd, host functions, files, memo and fork
+// handler; its first `tvm_ctx_run` continues after the `fork` with the destination register
+// cleared. The handler owns the child and frees it with `tvm_ctx_free`, it may run it right away or
+// later on any thread. Returns the id the parent gets, -1 for a refused fork
+typedef int64_t (*TvmForkHandler)(TvmCtx *child, void *data);
+
+// `opt_level` is 0, 1 (peephole) or 2 (dataflow), see `-O`
+TVM_API TvmStatus tvm_assemble(const char *src, size_t src_len, int opt_level,
+                               TvmProgram **program_out);
+// like `tvm_assemble`, `hcall name` is resolved to the index of `name` in `host_fns`
+TVM_API TvmStatus tvm_assemble_with_host_fns(const char *src, size_t src_len, int opt_level,
+                                             const TvmHostFnEntry *host_fns, size_t host_fn_count,
+                                             TvmProgram **program_out);
+// `bin` is the contents of a `.tvm` file including its signature
+TVM_API TvmStatus tvm_load(const void *bin, size_t bin_len, TvmProgram **program_out);
+// code of `program` without the file signature, stays valid until the program is freed
+TVM_API const uint32_t *tvm_program_code(const TvmProgram *program, size_t *insts_count_out);
+// contexts created from `program` keep its code alive, they may outlive it
+TVM_API void tvm_program_free(TvmProgram *program);
+
+// any number of contexts on any threads can share one program, the code is never copied
+TVM_API TvmStatus tvm_ctx_create(const TvmProgram *program, TvmCtx **ctx_out);
+TVM_API void tvm_ctx_free(TvmCtx *ctx);
+// clears registers and flags
+TVM_API void tvm_ctx_reset(TvmCtx *ctx);
+TVM_API TvmStatus tvm_ctx_set_reg(TvmCtx *ctx, int reg, int64_t val);
+TVM_API TvmStatus tvm_ctx_get_reg(const TvmCtx *ctx, int reg, int64_t *val_out);
+// destination of `out`/`outb`, written in batches and at the end of every run, a negative fd
+// (the default) discards the output
+TVM_API TvmStatus tvm_ctx_set_output_fd(TvmCtx *ctx, int fd);
+// input read by `inb`/`inw`/`inl`/`inq`, not copied, `data` has to outlive the runs using it;
+// every run starts reading at its beginning
+TVM_API TvmStatus tvm_ctx_set_input(TvmCtx *ctx, const void *data, size_t len);
+// functions `hcall` calls, the table is copied, `data` has to outlive the runs using it; every entry
+// needs a function
+TVM_API TvmStatus tvm_ctx_set_host_fns(TvmCtx *ctx, const TvmHostFnEntry *host_fns,
+                                       size_t host_fn_count);
+// words the atomics and spawned threads work on, not copied, `words` has to outlive the runs
+// using it; contexts may share it, forked children get a copy that is freed with them. Without it
+// every atomic stops the program with an error
+TVM_API TvmStatus tvm_ctx_set_shared_memory(TvmCtx *ctx, int64_t *words, size_t word_count);
+// file descriptors `fread` and `fwrite` use, the table is copied and the descriptors stay owned by
+// the caller; the I/O runs on the thread calling `tvm_ctx_run`
+TVM_API TvmStatus tvm_ctx_set_files(TvmCtx *ctx, const int *fds, size_t fd_count);
+// NULL (the default) fails every `fork` with -1
+TVM_API TvmStatus tvm_ctx_set_fork_handler(TvmCtx *ctx, TvmForkHandler handler, void *data);
+// runs the program from its first instruction with the current registers (forked children continue
+// after the `fork` the first time), threads it spawned are joined before it returns
+TVM_API TvmStatus tvm_ctx_run(TvmCtx *ctx, int *exit_code_out);
+
+// remembers the final registers, exit code and output of runs taking at least `min_insts`
+// instructions, keyed by the code, the registers the run started with and its input; a run with a
+// known key only gets the result. At most `max_bytes` are kept in memory, least recently used
+// first out. With `dir` (may be NULL) entries are also stored there as files and found again by
+// other processes. Programs using `fork`, `hcall`, channels, threads, atomics or files are always
+// run. A memo can be shared by any number of contexts on any threads.
+TVM_API TvmStatus tvm_memo_create(size_t max_bytes, uint64_t min_insts, const char *dir,
+                                  TvmMemo **memo_out);
+// contexts using it must not run any more
+TVM_API void tvm_memo_free(TvmMemo *memo);
+// NULL (the default) runs every program
+TVM_API TvmStatus tvm_ctx_set_memo(TvmCtx *ctx, TvmMemo *memo);
+
+// message of the last failed call on the calling thread
+TVM_API const char *tvm_last_error(void);
+#endif  // TVM_H
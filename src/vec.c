@@ -0,0 +1,274 @@
+#include "vec.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VEC_X86
+#include <immintrin.h>
+#endif
+
+enum VecIsa {
+  VEC_ISA_GENERIC,
+  VEC_ISA_SSE42,
+  VEC_ISA_AVX2,
+};
+
+static const char *vec_isa_names[] = {
+    [VEC_ISA_GENERIC] = "generic",
+    [VEC_ISA_SSE42] = "sse4.2",
+    [VEC_ISA_AVX2] = "avx2",
+};
+
+static pthread_once_t vec_once = PTHREAD_ONCE_INIT;
+static enum VecIsa vec_selected_isa;
+VecOpFn vec_op;
+
+uint64_t vec_get_lane(const VmVec *vec, int lane_shift, int idx) {
+  switch (lane_shift) {
+    case 0:
+      return vec->u8[idx];
+    case 1:
+      return vec->u16[idx];
+    case 2:
+      return vec->u32[idx];
+    default:
+      return vec->u64[idx];
+  }
+}
+
+void vec_set_lane(VmVec *vec, int lane_shift, int idx, uint64_t val) {
+  switch (lane_shift) {
+    case 0:
+      vec->u8[idx] = val;
+      break;
+    case 1:
+      vec->u16[idx] = val;
+      break;
+    case 2:
+      vec->u32[idx] = val;
+      break;
+    default:
+      vec->u64[idx] = val;
+      break;
+  }
+}
+
+// reference implementation, the SIMD versions have to produce the same bits
+void vec_op_generic(VmVec *dst, const VmVec *a, const VmVec *b, int op, int lane_shift,
+                    int amount) {
+  VmVec res;
+  int lane_bits = 8 << lane_shift;
+  int lanes = VEC_SIZE >> lane_shift;
+
+  if (op == VEC_OP_SHUF) {
+    for (int i = 0; i < VEC_SIZE; i++)
+      res.u8[i] = b->u8[i] & 0x80 ? 0 : a->u8[(i & 16) | (b->u8[i] & 15)];
+    *dst = res;
+    return;
+  }
+
+  for (int i = 0; i < lanes; i++) {
+    uint64_t x = vec_get_lane(a, lane_shift, i);
+    uint64_t y = vec_get_lane(b, lane_shift, i);
+    // sign extended copies for `cmpgt`
+    int64_t sx = (int64_t)(x << (64 - lane_bits)) >> (64 - lane_bits);
+    int64_t sy = (int64_t)(y << (64 - lane_bits)) >> (64 - lane_bits);
+    uint64_t val = 0;
+
+    switch (op) {
+      case VEC_OP_ADD:
+        val = x + y;
+        break;
+      case VEC_OP_SUB:
+        val = x - y;
+        break;
+      case VEC_OP_AND:
+        val = x & y;
+        break;
+      case VEC_OP_OR:
+        val = x | y;
+        break;
+      case VEC_OP_XOR:
+        val = x ^ y;
+        break;
+      case VEC_OP_CMPEQ:
+        val = x == y ? UINT64_MAX : 0;
+        break;
+      case VEC_OP_CMPGT:
+        val = sx > sy ? UINT64_MAX : 0;
+        break;
+      case VEC_OP_SHL:
+        val = amount < lane_bits ? x << amount : 0;
+        break;
+      case VEC_OP_SHR:
+        val = amount < lane_bits ? x >> amount : 0;
+        break;
+    }
+
+    vec_set_lane(&res, lane_shift, i, val);
+  }
+
+  *dst = res;
+}
+
+#ifdef VEC_X86
+// picks the intrinsic for the lane width, `name` is completed with 8, 16, 32 or 64
+#define VEC_BY_LANE(lane_shift, name, ...)                  \
+  ((lane_shift) == 0   ? name##8(__VA_ARGS__)               \
+   : (lane_shift) == 1 ? name##16(__VA_ARGS__)              \
+   : (lane_shift) == 2 ? name##32(__VA_ARGS__)              \
+                       : name##64(__VA_ARGS__))
+
+// SSE4.2 covers the 64-bit compares, SSSE3 (implied) the byte shuffle
+__attribute__((target("sse4.2"))) __m128i vec_op_sse42_half(__m128i x, __m128i y, int op,
+                                                            int lane_shift, int amount) {
+  __m128i count = _mm_cvtsi32_si128(amount);
+
+  switch (op) {
+    case VEC_OP_ADD:
+      return VEC_BY_LANE(lane_shift, _mm_add_epi, x, y);
+    case VEC_OP_SUB:
+      return VEC_BY_LANE(lane_shift, _mm_sub_epi, x, y);
+    case VEC_OP_AND:
+      return _mm_and_si128(x, y);
+    case VEC_OP_OR:
+      return _mm_or_si128(x, y);
+    case VEC_OP_XOR:
+      return _mm_xor_si128(x, y);
+    case VEC_OP_CMPEQ:
+      return VEC_BY_LANE(lane_shift, _mm_cmpeq_epi, x, y);
+    case VEC_OP_CMPGT:
+      return VEC_BY_LANE(lane_shift, _mm_cmpgt_epi, x, y);
+    case VEC_OP_SHUF:
+      return _mm_shuffle_epi8(x, y);
+    case VEC_OP_SHL:
+      // there are no byte shifts, the bits crossing into the next byte are masked off
+      if (lane_shift == 0)
+        return amount < 8 ? _mm_and_si128(_mm_sll_epi16(x, count),
+                                          _mm_set1_epi8((char)(0xff << amount)))
+                          : _mm_setzero_si128();
+      if (lane_shift == 1) return _mm_sll_epi16(x, count);
+      if (lane_shift == 2) return _mm_sll_epi32(x, count);
+      return _mm_sll_epi64(x, count);
+    case VEC_OP_SHR:
+    default:
+      if (lane_shift == 0)
+        return amount < 8 ? _mm_and_si128(_mm_srl_epi16(x, count), _mm_set1_epi8(0xff >> amount))
+                          : _mm_setzero_si128();
+      if (lane_shift == 1) return _mm_srl_epi16(x, count);
+      if (lane_shift == 2) return _mm_srl_epi32(x, count);
+      return _mm_srl_epi64(x, count);
+  }
+}
+
+__attribute__((target("sse4.2"))) void vec_op_sse42(VmVec *dst, const VmVec *a, const VmVec *b,
+                                                    int op, int lane_shift, int amount) {
+  __m128i lo = vec_op_sse42_half(_mm_loadu_si128((const __m128i *)a->u8),
+                                 _mm_loadu_si128((const __m128i *)b->u8), op, lane_shift, amount);
+  __m128i hi =
+      vec_op_sse42_half(_mm_loadu_si128((const __m128i *)(a->u8 + 16)),
+                        _mm_loadu_si128((const __m128i *)(b->u8 + 16)), op, lane_shift, amount);
+  _mm_storeu_si128((__m128i *)dst->u8, lo);
+  _mm_storeu_si128((__m128i *)(dst->u8 + 16), hi);
+}
+
+__attribute__((target("avx2"))) void vec_op_avx2(VmVec *dst, const VmVec *a, const VmVec *b,
+                                                 int op, int lane_shift, int amount) {
+  __m256i x = _mm256_loadu_si256((const __m256i *)a->u8);
+  __m256i y = _mm256_loadu_si256((const __m256i *)b->u8);
+  __m128i count = _mm_cvtsi32_si128(amount);
+  __m256i res;
+
+  switch (op) {
+    case VEC_OP_ADD:
+      res = VEC_BY_LANE(lane_shift, _mm256_add_epi, x, y);
+      break;
+    case VEC_OP_SUB:
+      res = VEC_BY_LANE(lane_shift, _mm256_sub_epi, x, y);
+      break;
+    case VEC_OP_AND:
+      res = _mm256_and_si256(x, y);
+      break;
+    case VEC_OP_OR:
+      res = _mm256_or_si256(x, y);
+      break;
+    case VEC_OP_XOR:
+      res = _mm256_xor_si256(x, y);
+      break;
+    case VEC_OP_CMPEQ:
+      res = VEC_BY_LANE(lane_shift, _mm256_cmpeq_epi, x, y);
+      break;
+    case VEC_OP_CMPGT:
+      res = VEC_BY_LANE(lane_shift, _mm256_cmpgt_epi, x, y);
+      break;
+    case VEC_OP_SHUF:
+      // shuffles within the 128-bit halves like `vec_op_generic`
+      res = _mm256_shuffle_epi8(x, y);
+      break;
+    case VEC_OP_SHL:
+      if (lane_shift == 0)
+        res = amount < 8 ? _mm256_and_si256(_mm256_sll_epi16(x, count),
+                                            _mm256_set1_epi8((char)(0xff << amount)))
+                         : _mm256_setzero_si256();
+      else if (lane_shift == 1)
+        res = _mm256_sll_epi16(x, count);
+      else if (lane_shift == 2)
+        res = _mm256_sll_epi32(x, count);
+      else
+        res = _mm256_sll_epi64(x, count);
+      break;
+    case VEC_OP_SHR:
+    default:
+      if (lane_shift == 0)
+        res = amount < 8 ? _mm256_and_si256(_mm256_srl_epi16(x, count),
+                                            _mm256_set1_epi8(0xff >> amount))
+                         : _mm256_setzero_si256();
+      else if (lane_shift == 1)
+        res = _mm256_srl_epi16(x, count);
+      else if (lane_shift == 2)
+        res = _mm256_srl_epi32(x, count);
+      else
+        res = _mm256_srl_epi64(x, count);
+      break;
+  }
+
+  _mm256_storeu_si256((__m256i *)dst->u8, res);
+}
+#endif
+
+void vec_select(void) {
+  enum VecIsa max_isa = VEC_ISA_AVX2;
+  char *env = getenv("TVM_VEC_ISA");
+
+  if (env) {
+    for (size_t i = 0; i < sizeof(vec_isa_names) / sizeof(vec_isa_names[0]); i++)
+      if (strcmp(env, vec_isa_names[i]) == 0) max_isa = i;
+  }
+
+  vec_selected_isa = VEC_ISA_GENERIC;
+  vec_op = vec_op_generic;
+
+#ifdef VEC_X86
+  __builtin_cpu_init();
+  if (max_isa >= VEC_ISA_AVX2 && __builtin_cpu_supports("avx2")) {
+    vec_selected_isa = VEC_ISA_AVX2;
+    vec_op = vec_op_avx2;
+  }
+  else if (max_isa >= VEC_ISA_SSE42 && __builtin_cpu_supports("sse4.2")) {
+    vec_selected_isa = VEC_ISA_SSE42;
+    vec_op = vec_op_sse42;
+  }
+#else
+  (void)max_isa;
+#endif
+}
+
+void vec_init(void) { pthread_once(&vec_once, vec_select); }
+
+const char *vec_isa(void) {
+  vec_init();
+  return vec_isa_names[vec_selected_isa];
+}
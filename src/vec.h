@@ -0,0 +1,45 @@
+#ifndef VEC_H
+#define VEC_H
+#include <stdint.h>
+
+#define VREGS_COUNT 8
+#define VEC_SIZE 32
+
+// 256-bit vector register, lanes are numbered from the lowest address like the host stores them
+typedef union {
+  uint8_t u8[VEC_SIZE];
+  uint16_t u16[VEC_SIZE / 2];
+  uint32_t u32[VEC_SIZE / 4];
+  uint64_t u64[VEC_SIZE / 8];
+} VmVec;
+
+enum VecOp {
+  VEC_OP_ADD,
+  VEC_OP_SUB,
+  VEC_OP_AND,
+  VEC_OP_OR,
+  VEC_OP_XOR,
+  // lanes become all ones if the comparison holds, `cmpgt` compares signed
+  VEC_OP_CMPEQ,
+  VEC_OP_CMPGT,
+  // bytes of `a` selected by the bytes of `b` within each 128-bit half, indices with the top bit
+  // set select 0
+  VEC_OP_SHUF,
+  // logical shifts of `a` by `amount`, lanes are cleared once `amount` reaches the lane width
+  VEC_OP_SHL,
+  VEC_OP_SHR,
+};
+
+// lanes are `1 << lane_shift` bytes wide, `dst` may alias the operands
+typedef void (*VecOpFn)(VmVec *dst, const VmVec *a, const VmVec *b, int op, int lane_shift,
+                        int amount);
+
+uint64_t vec_get_lane(const VmVec *vec, int lane_shift, int idx);
+void vec_set_lane(VmVec *vec, int lane_shift, int idx, uint64_t val);
+
+// picks the implementation for the host CPU (AVX2, SSE4.2 or plain C) the first time it is called,
+// `TVM_VEC_ISA=avx2|sse4.2|generic` caps the choice
+void vec_init(void);
+const char *vec_isa(void);
+extern VecOpFn vec_op;
+#endif  // VEC_H
@@ -3,8 +3,18 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "channel.h"
 #include "error.h"
+#include "executor.h"
+#include "output.h"
+#include "program.h"
+#include "specialize.h"
+#include "threads.h"
+#include "trace.h"
 
 #define INST_MNEMONIC(inst) (inst_extract_bits(inst, FIELD_MNEMONIC, false))
 
@@ -38,6 +48,37 @@ const InstField FIELD_COND_JMP_OFF = {8, 24};
 const InstField FIELD_NOT_DST = {8, 3};
 const InstField FIELD_NOT_SRC = {11, 3};
 
+const InstField FIELD_UNOP_DST = {8, 3};
+const InstField FIELD_UNOP_SRC = {11, 3};
+
+const InstField FIELD_VEC_DST = {8, 3};
+const InstField FIELD_VEC_OP1 = {11, 3};
+const InstField FIELD_VEC_OP2 = {14, 3};
+const InstField FIELD_VEC_LANE = {17, 2};
+const InstField FIELD_VEC_IMM = {19, 6};
+
+const InstField FIELD_FORK_DST = {8, 3};
+const InstField FIELD_HCALL_IDX = {8, 16};
+const InstField FIELD_CHAN_REG = {8, 3};
+const InstField FIELD_CHAN_IDX = {11, 8};
+const InstField FIELD_ATOMIC_DST = {8, 3};
+const InstField FIELD_ATOMIC_ADDR = {11, 3};
+const InstField FIELD_ATOMIC_SRC = {14, 3};
+const InstField FIELD_SPAWN_DST = {8, 3};
+const InstField FIELD_SPAWN_OFF = {11, 21};
+const InstField FIELD_JOIN_REG = {8, 3};
+const InstField FIELD_IO_DST = {8, 3};
+const InstField FIELD_IO_ADDR = {11, 3};
+const InstField FIELD_IO_LEN = {14, 3};
+const InstField FIELD_IO_OFF = {17, 3};
+const InstField FIELD_IO_FILE = {20, 8};
+const InstField FIELD_DIV_SHIFT = {14, 6};
+const InstField FIELD_DIV_NEG = {20, 1};
+const InstField FIELD_DIV_MAGIC_IDX = {14, 18};
+
+const InstField FIELD_OUT_REG = {8, 3};
+const InstField FIELD_IN_DST = {8, 3};
+
 int32_t inst_extract_bits(inst_ty inst, InstField field, bool signext) {
   int32_t mask = (1 << field.bit_count) - 1;
   int32_t extracted_bits = (inst >> field.start_bit) & mask;
@@ -48,6 +89,11 @@ int32_t inst_extract_bits(inst_ty inst, InstField field, bool signext) {
   return extracted_bits;
 }
 
+inst_ty inst_insert_bits(inst_ty inst, InstField field, int32_t value) {
+  inst_ty mask = (field.bit_count == 32 ? ~0u : (1u << field.bit_count) - 1) << field.start_bit;
+  return (inst & ~mask) | (((inst_ty)value << field.start_bit) & mask);
+}
+
 void handle_inc(VmCtx *ctx, inst_ty inst) {
   int reg = inst_extract_bits(inst, FIELD_INC_REG, false);
   ctx->regs[reg]++;
@@ -60,7 +106,7 @@ void handle_dec(VmCtx *ctx, inst_ty inst) {
 
 void handle_bin_op(VmCtx *ctx, inst_ty inst, char op) {
   int dst_reg = inst_extract_bits(inst, FIELD_BINOP_DST, false);
-  int op1_reg_val = ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP1, false)];
+  VmWord op1_reg_val = ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP1, false)];
   bool is_imm = inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false);
   VmWord op2_val = is_imm ? inst_extract_bits(inst, FIELD_BINOP_IMM, true)
                           : ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP2, false)];
@@ -98,6 +144,33 @@ void handle_bin_op(VmCtx *ctx, inst_ty inst, char op) {
   }
 }
 
+// negative dividends are biased by 2^k - 1 first, so the shift rounds towards zero like `div`
+void handle_div_pow2(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_BINOP_DST, false);
+  VmWord dividend = ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP1, false)];
+  int shift = inst_extract_bits(inst, FIELD_DIV_SHIFT, false);
+  uint64_t bias = (uint64_t)(dividend >> 63) >> (64 - shift);
+  VmWord quotient = (VmWord)((uint64_t)dividend + bias) >> shift;
+
+  ctx->regs[dst_reg] =
+      inst_extract_bits(inst, FIELD_DIV_NEG, false) ? (VmWord)(0 - (uint64_t)quotient) : quotient;
+}
+
+void handle_div_magic(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_BINOP_DST, false);
+  VmWord dividend = ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP1, false)];
+  const DivMagic *magic =
+      &ctx->program->div_magics[inst_extract_bits(inst, FIELD_DIV_MAGIC_IDX, false)];
+  uint64_t high = (uint64_t)(VmWord)(((__int128)magic->magic * dividend) >> 64);
+
+  if (magic->add > 0) high += (uint64_t)dividend;
+  if (magic->add < 0) high -= (uint64_t)dividend;
+
+  // rounds a negative quotient up towards zero
+  VmWord quotient = (VmWord)high >> magic->shift;
+  ctx->regs[dst_reg] = quotient + (VmWord)((uint64_t)quotient >> 63);
+}
+
 void handle_mov(VmCtx *ctx, inst_ty inst) {
   int dst_reg = inst_extract_bits(inst, FIELD_MOV_DST, false);
   int is_imm = inst_extract_bits(inst, FIELD_MOV_IS_IMM, false);
@@ -118,9 +191,7 @@ void handle_cmp(VmCtx *ctx, inst_ty inst) {
 
 int handle_load(VmCtx *ctx, inst_ty inst) {
   int dst_reg = inst_extract_bits(inst, FIELD_LOAD_DST, false);
-  inst_ty *first_invalid_inst = ctx->ip + ctx->insts_count;
-
-  if (ctx->ip - 2 >= first_invalid_inst) {
+  if (ctx->ip + 2 >= ctx->insts_end) {
     print_err("VM error: Instruction pointer went past last instruction");
     return RET_CODE_ERR;
   }
@@ -134,53 +205,342 @@ int handle_load(VmCtx *ctx, inst_ty inst) {
 
 void handle_not(VmCtx *ctx, inst_ty inst) {
   int dst_reg = inst_extract_bits(inst, FIELD_NOT_DST, false);
-  VmWord src_reg_val = inst_extract_bits(inst, FIELD_NOT_SRC, true);
+  VmWord src_reg_val = ctx->regs[inst_extract_bits(inst, FIELD_NOT_SRC, false)];
 
   ctx->regs[dst_reg] = ~src_reg_val;
 }
 
+// clz and ctz of 0 are 64, the builtins are undefined for 0
+void handle_bit_op(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_UNOP_DST, false);
+  uint64_t src_val = ctx->regs[inst_extract_bits(inst, FIELD_UNOP_SRC, false)];
+
+  switch (INST_MNEMONIC(inst)) {
+    default:
+      assert(false);
+    case MNEMONIC_POPCNT:
+      ctx->regs[dst_reg] = __builtin_popcountll(src_val);
+      break;
+    case MNEMONIC_CLZ:
+      ctx->regs[dst_reg] = src_val ? __builtin_clzll(src_val) : 64;
+      break;
+    case MNEMONIC_CTZ:
+      ctx->regs[dst_reg] = src_val ? __builtin_ctzll(src_val) : 64;
+      break;
+    case MNEMONIC_BSWAP:
+      ctx->regs[dst_reg] = __builtin_bswap64(src_val);
+      break;
+  }
+}
+
+// rotates use the amount modulo 64, unsigned division by 0 gives all ones and the remainder the
+// dividend, like RISC-V
+void handle_wide_op(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_BINOP_DST, false);
+  VmWord op1_reg_val = ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP1, false)];
+  bool is_imm = inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false);
+  VmWord op2_val = is_imm ? inst_extract_bits(inst, FIELD_BINOP_IMM, true)
+                          : ctx->regs[inst_extract_bits(inst, FIELD_BINOP_OP2, false)];
+  uint64_t op1 = op1_reg_val;
+  uint64_t op2 = op2_val;
+  unsigned shift = op2 & 63;
+
+  switch (INST_MNEMONIC(inst)) {
+    default:
+      assert(false);
+    case MNEMONIC_ROL:
+      ctx->regs[dst_reg] = (op1 << shift) | (op1 >> (-shift & 63));
+      break;
+    case MNEMONIC_ROR:
+      ctx->regs[dst_reg] = (op1 >> shift) | (op1 << (-shift & 63));
+      break;
+    case MNEMONIC_MULH:
+      ctx->regs[dst_reg] = ((__int128)op1_reg_val * op2_val) >> 64;
+      break;
+    case MNEMONIC_MULHU:
+      ctx->regs[dst_reg] = ((unsigned __int128)op1 * op2) >> 64;
+      break;
+    case MNEMONIC_DIVU:
+      ctx->regs[dst_reg] = op2 ? op1 / op2 : UINT64_MAX;
+      break;
+    case MNEMONIC_REMU:
+      ctx->regs[dst_reg] = op2 ? op1 % op2 : op1;
+      break;
+  }
+}
+
 int handle_jmp(VmCtx *ctx, inst_ty inst) {
   int32_t jmp_off = inst_extract_bits(inst, FIELD_JMP_OFF, true);
-  inst_ty *first_invalid_inst = ctx->ip + ctx->insts_count;
-
-  if (ctx->ip + jmp_off < ctx->first_inst || ctx->ip + jmp_off > first_invalid_inst) {
+  if (ctx->ip + jmp_off < ctx->first_inst || ctx->ip + jmp_off > ctx->insts_end) {
     print_err("VM error: Jump instruction points to an invalid location");
     return RET_CODE_ERR;
   }
 
+  if (ctx->trace) trace_branch(ctx, ctx->ip, ctx->ip + jmp_off);
   ctx->ip += jmp_off - 1;  // it will be incremented later
   return RET_CODE_OK;
 }
 
 int handle_cond_jmp(VmCtx *ctx, inst_ty inst) {
   int32_t jmp_off = inst_extract_bits(inst, FIELD_COND_JMP_OFF, true);
-  inst_ty *first_invalid_inst = ctx->ip + ctx->insts_count;
-
-  if (ctx->ip + jmp_off < ctx->first_inst || ctx->ip + jmp_off > first_invalid_inst) {
+  if (ctx->ip + jmp_off < ctx->first_inst || ctx->ip + jmp_off > ctx->insts_end) {
     print_err("VM error: Jump instruction points to an invalid location");
     return RET_CODE_ERR;
   }
 
+  bool taken;
   switch (INST_MNEMONIC(inst)) {
     default:
       assert(false);
     case MNEMONIC_JMP_GREATER:
-      if (ctx->f_greater) ctx->ip += jmp_off - 1;
+      taken = ctx->f_greater;
       break;
     case MNEMONIC_JMP_LOWER:
-      if (ctx->f_smaller) ctx->ip += jmp_off - 1;
+      taken = ctx->f_smaller;
       break;
     case MNEMONIC_JMP_EQ:
-      if (ctx->f_eq) ctx->ip += jmp_off - 1;
+      taken = ctx->f_eq;
       break;
     case MNEMONIC_JMPZ:
-      if (ctx->f_zero) ctx->ip += jmp_off - 1;
+      taken = ctx->f_zero;
+      break;
+  }
+
+  if (taken) {
+    if (ctx->trace) trace_branch(ctx, ctx->ip, ctx->ip + jmp_off);
+    ctx->ip += jmp_off - 1;
+  }
+
+  return RET_CODE_OK;
+}
+
+// `out` writes the register as a decimal line, `outb` only its low byte
+int handle_out(VmCtx *ctx, inst_ty inst) {
+  VmWord val = ctx->regs[inst_extract_bits(inst, FIELD_OUT_REG, false)];
+  char digits[24];
+  char *first = digits + sizeof(digits);
+  uint64_t abs_val = val < 0 ? -(uint64_t)val : (uint64_t)val;
+
+  *--first = '\n';
+  do {
+    *--first = '0' + abs_val % 10;
+    abs_val /= 10;
+  } while (abs_val);
+  if (val < 0) *--first = '-';
+
+  return output_write(&ctx->out, first, digits + sizeof(digits) - first);
+}
+
+int handle_outb(VmCtx *ctx, inst_ty inst) {
+  unsigned char byte = ctx->regs[inst_extract_bits(inst, FIELD_OUT_REG, false)];
+  return output_write(&ctx->out, &byte, 1);
+}
+
+// reads the next `size` bytes of input zero extended (little endian), at the end of the input
+// the register is cleared and the zero flag set instead
+void handle_in(VmCtx *ctx, inst_ty inst, size_t size) {
+  int dst_reg = inst_extract_bits(inst, FIELD_IN_DST, false);
+  VmInput *in = &ctx->in;
+
+  if (in->size - in->pos < size) {
+    ctx->regs[dst_reg] = 0;
+    ctx->f_zero = true;
+    return;
+  }
+
+  uint64_t val = 0;
+  memcpy(&val, in->data + in->pos, size);
+  in->pos += size;
+
+  ctx->regs[dst_reg] = val;
+  ctx->f_zero = false;
+}
+
+void handle_inlen(VmCtx *ctx, inst_ty inst) {
+  ctx->regs[inst_extract_bits(inst, FIELD_IN_DST, false)] = ctx->in.size - ctx->in.pos;
+}
+
+void handle_vec_op(VmCtx *ctx, inst_ty inst, int op) {
+  vec_op(&ctx->vregs[inst_extract_bits(inst, FIELD_VEC_DST, false)],
+         &ctx->vregs[inst_extract_bits(inst, FIELD_VEC_OP1, false)],
+         &ctx->vregs[inst_extract_bits(inst, FIELD_VEC_OP2, false)], op,
+         inst_extract_bits(inst, FIELD_VEC_LANE, false),
+         inst_extract_bits(inst, FIELD_VEC_IMM, false));
+}
+
+// `vbcst` fills every lane with the low bits of the scalar register, `vins` one of them
+void handle_vec_insert(VmCtx *ctx, inst_ty inst) {
+  VmVec *dst = &ctx->vregs[inst_extract_bits(inst, FIELD_VEC_DST, false)];
+  uint64_t val = ctx->regs[inst_extract_bits(inst, FIELD_VEC_OP1, false)];
+  int lane_shift = inst_extract_bits(inst, FIELD_VEC_LANE, false);
+  int lanes = VEC_SIZE >> lane_shift;
+
+  if (INST_MNEMONIC(inst) == MNEMONIC_VINS) {
+    vec_set_lane(dst, lane_shift, inst_extract_bits(inst, FIELD_VEC_IMM, false) & (lanes - 1), val);
+    return;
+  }
+
+  for (int i = 0; i < lanes; i++) vec_set_lane(dst, lane_shift, i, val);
+}
+
+// the lane is zero extended
+void handle_vec_extract(VmCtx *ctx, inst_ty inst) {
+  VmVec *src = &ctx->vregs[inst_extract_bits(inst, FIELD_VEC_OP1, false)];
+  int lane_shift = inst_extract_bits(inst, FIELD_VEC_LANE, false);
+  int idx = inst_extract_bits(inst, FIELD_VEC_IMM, false) & ((VEC_SIZE >> lane_shift) - 1);
+
+  ctx->regs[inst_extract_bits(inst, FIELD_VEC_DST, false)] = vec_get_lane(src, lane_shift, idx);
+}
+
+// like `handle_in` with 32 bytes
+void handle_vec_in(VmCtx *ctx, inst_ty inst) {
+  VmVec *dst = &ctx->vregs[inst_extract_bits(inst, FIELD_VEC_DST, false)];
+  VmInput *in = &ctx->in;
+
+  if (in->size - in->pos < VEC_SIZE) {
+    *dst = (VmVec){0};
+    ctx->f_zero = true;
+    return;
+  }
+
+  memcpy(dst, in->data + in->pos, VEC_SIZE);
+  in->pos += VEC_SIZE;
+  ctx->f_zero = false;
+}
+
+int handle_vec_out(VmCtx *ctx, inst_ty inst) {
+  return output_write(&ctx->out, &ctx->vregs[inst_extract_bits(inst, FIELD_VEC_DST, false)],
+                      VEC_SIZE);
+}
+
+void handle_fork(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_FORK_DST, false);
+  VmWord child_id = -1;
+
+  if (ctx->fork_handler) {
+    ctx->regs[dst_reg] = 0;
+    ctx->ip++;
+    child_id = ctx->fork_handler(ctx, ctx->fork_data);
+    ctx->ip--;
+  }
+
+  ctx->regs[dst_reg] = child_id < 0 ? -1 : child_id;
+}
+
+int handle_hcall(VmCtx *ctx, inst_ty inst) {
+  int idx = inst_extract_bits(inst, FIELD_HCALL_IDX, false);
+
+  ERR_IF(!ctx->host_fns || (size_t)idx >= ctx->host_fns->count,
+         "VM error: No host function with index %d for 'hcall'", idx);
+
+  const VmHostFnEntry *entry = &ctx->host_fns->fns[idx];
+  ERR_IF(entry->fn(ctx->regs, entry->data) != 0, "VM error: Host function '%s' failed",
+         entry->name ? entry->name : "?");
+  return RET_CODE_OK;
+}
+
+// `recv` and `try_recv` clear the register and set the zero flag if nothing was received, `recv`
+// only once the channel is closed
+int handle_channel(VmCtx *ctx, inst_ty inst) {
+  int idx = inst_extract_bits(inst, FIELD_CHAN_IDX, false);
+  VmWord *reg = &ctx->regs[inst_extract_bits(inst, FIELD_CHAN_REG, false)];
+  bool received;
+
+  ERR_IF((size_t)idx >= ctx->channel_count, "VM error: No channel with index %d", idx);
+
+  switch (INST_MNEMONIC(inst)) {
+    case MNEMONIC_SEND:
+      channel_send(ctx->channels[idx], *reg);
+      return RET_CODE_OK;
+    case MNEMONIC_RECV:
+      received = channel_recv(ctx->channels[idx], reg);
+      break;
+    default:
+      received = channel_try_recv(ctx->channels[idx], reg);
+      break;
+  }
+
+  if (!received) *reg = 0;
+  ctx->f_zero = !received;
+  return RET_CODE_OK;
+}
+
+// all atomics are sequentially consistent except `aload` (acquire) and `astore` (release)
+int handle_atomic(VmCtx *ctx, inst_ty inst) {
+  VmWord *dst = &ctx->regs[inst_extract_bits(inst, FIELD_ATOMIC_DST, false)];
+  VmWord addr = ctx->regs[inst_extract_bits(inst, FIELD_ATOMIC_ADDR, false)];
+  VmWord src = ctx->regs[inst_extract_bits(inst, FIELD_ATOMIC_SRC, false)];
+
+  ERR_IF(addr < 0 || (size_t)addr >= ctx->shared_words,
+         "VM error: Shared memory address %lld out of range", (long long)addr);
+  VmWord *word = &ctx->shared_mem[addr];
+
+  switch (INST_MNEMONIC(inst)) {
+    case MNEMONIC_CAS:
+      // the expected value is replaced by the old one either way
+      ctx->f_eq = __atomic_compare_exchange_n(word, dst, src, false, __ATOMIC_SEQ_CST,
+                                              __ATOMIC_SEQ_CST);
+      break;
+    case MNEMONIC_XADD:
+      *dst = __atomic_fetch_add(word, src, __ATOMIC_SEQ_CST);
+      break;
+    case MNEMONIC_XCHG:
+      *dst = __atomic_exchange_n(word, src, __ATOMIC_SEQ_CST);
+      break;
+    case MNEMONIC_ALOAD:
+      *dst = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+      break;
+    default:
+      __atomic_store_n(word, src, __ATOMIC_RELEASE);
       break;
   }
 
   return RET_CODE_OK;
 }
 
+int handle_spawn(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_SPAWN_DST, false);
+  int32_t off = inst_extract_bits(inst, FIELD_SPAWN_OFF, true);
+  ERR_IF(ctx->ip + off < ctx->first_inst || ctx->ip + off > ctx->insts_end,
+         "VM error: Spawn instruction points to an invalid location");
+
+  ctx->regs[dst_reg] = -1;
+  if (ctx->threads) ctx->regs[dst_reg] = threads_spawn(ctx->threads, ctx, ctx->ip + off, dst_reg);
+  return RET_CODE_OK;
+}
+
+void handle_join(VmCtx *ctx, inst_ty inst) {
+  VmWord *reg = &ctx->regs[inst_extract_bits(inst, FIELD_JOIN_REG, false)];
+  *reg = ctx->threads ? threads_join(ctx->threads, *reg) : -1;
+}
+
+// reads and writes may transfer fewer bytes than asked for, at most VM_IO_MAX_LEN at once
+#define VM_IO_MAX_LEN (1 << 30)
+
+int handle_file_io(VmCtx *ctx, inst_ty inst) {
+  int dst_reg = inst_extract_bits(inst, FIELD_IO_DST, false);
+  VmWord addr = ctx->regs[inst_extract_bits(inst, FIELD_IO_ADDR, false)];
+  VmWord len = ctx->regs[inst_extract_bits(inst, FIELD_IO_LEN, false)];
+  int file = inst_extract_bits(inst, FIELD_IO_FILE, false);
+
+  ERR_IF((size_t)file >= ctx->file_count, "VM error: No file with index %d", file);
+  ERR_IF(len < 0, "VM error: Negative I/O length %lld", (long long)len);
+  ERR_IF(addr < 0 || (size_t)addr > ctx->shared_words ||
+             (uint64_t)len > (ctx->shared_words - addr) * sizeof(VmWord),
+         "VM error: I/O of %lld bytes at shared memory address %lld out of range", (long long)len,
+         (long long)addr);
+
+  VmIoRequest req = {.write = INST_MNEMONIC(inst) == MNEMONIC_FWRITE,
+                     .fd = ctx->files[file],
+                     .buf = ctx->shared_mem + addr,
+                     .len = len < VM_IO_MAX_LEN ? len : VM_IO_MAX_LEN,
+                     .off = ctx->regs[inst_extract_bits(inst, FIELD_IO_OFF, false)]};
+
+  if (ctx->executor) return executor_submit(ctx->executor, ctx, &req, dst_reg);
+  ctx->regs[dst_reg] = executor_io_sync(&req);
+  return RET_CODE_OK;
+}
+
 void handle_exit(inst_ty inst, int *program_ret_code_out) {
   *program_ret_code_out = inst_extract_bits(inst, FIELD_EXIT_CODE, false);
 }
@@ -204,6 +564,12 @@ int execute_instruction(VmCtx *ctx, int *program_ret_code_out) {
     case MNEMONIC_DIV:
       handle_bin_op(ctx, inst, '/');
       break;
+    case MNEMONIC_DIV_POW2:
+      handle_div_pow2(ctx, inst);
+      break;
+    case MNEMONIC_DIV_MAGIC:
+      handle_div_magic(ctx, inst);
+      break;
     case MNEMONIC_OR:
       handle_bin_op(ctx, inst, '|');
       break;
@@ -252,6 +618,133 @@ int execute_instruction(VmCtx *ctx, int *program_ret_code_out) {
       if ((tmp_ret_code = handle_cond_jmp(ctx, inst)) != 0) return tmp_ret_code;
       break;
     }
+    case MNEMONIC_OUT: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_out(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_OUTB: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_outb(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_FLUSH: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = output_flush(&ctx->out)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_INB:
+      handle_in(ctx, inst, 1);
+      break;
+    case MNEMONIC_INW:
+      handle_in(ctx, inst, 2);
+      break;
+    case MNEMONIC_INL:
+      handle_in(ctx, inst, 4);
+      break;
+    case MNEMONIC_INQ:
+      handle_in(ctx, inst, 8);
+      break;
+    case MNEMONIC_INLEN:
+      handle_inlen(ctx, inst);
+      break;
+    case MNEMONIC_POPCNT:
+    case MNEMONIC_CLZ:
+    case MNEMONIC_CTZ:
+    case MNEMONIC_BSWAP:
+      handle_bit_op(ctx, inst);
+      break;
+    case MNEMONIC_ROL:
+    case MNEMONIC_ROR:
+    case MNEMONIC_MULH:
+    case MNEMONIC_MULHU:
+    case MNEMONIC_DIVU:
+    case MNEMONIC_REMU:
+      handle_wide_op(ctx, inst);
+      break;
+    case MNEMONIC_VADD:
+      handle_vec_op(ctx, inst, VEC_OP_ADD);
+      break;
+    case MNEMONIC_VSUB:
+      handle_vec_op(ctx, inst, VEC_OP_SUB);
+      break;
+    case MNEMONIC_VAND:
+      handle_vec_op(ctx, inst, VEC_OP_AND);
+      break;
+    case MNEMONIC_VOR:
+      handle_vec_op(ctx, inst, VEC_OP_OR);
+      break;
+    case MNEMONIC_VXOR:
+      handle_vec_op(ctx, inst, VEC_OP_XOR);
+      break;
+    case MNEMONIC_VCMPEQ:
+      handle_vec_op(ctx, inst, VEC_OP_CMPEQ);
+      break;
+    case MNEMONIC_VCMPGT:
+      handle_vec_op(ctx, inst, VEC_OP_CMPGT);
+      break;
+    case MNEMONIC_VSHUF:
+      handle_vec_op(ctx, inst, VEC_OP_SHUF);
+      break;
+    case MNEMONIC_VSHL:
+      handle_vec_op(ctx, inst, VEC_OP_SHL);
+      break;
+    case MNEMONIC_VSHR:
+      handle_vec_op(ctx, inst, VEC_OP_SHR);
+      break;
+    case MNEMONIC_VBCST:
+    case MNEMONIC_VINS:
+      handle_vec_insert(ctx, inst);
+      break;
+    case MNEMONIC_VEXT:
+      handle_vec_extract(ctx, inst);
+      break;
+    case MNEMONIC_VIN:
+      handle_vec_in(ctx, inst);
+      break;
+    case MNEMONIC_VOUT: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_vec_out(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_FORK:
+      handle_fork(ctx, inst);
+      break;
+    case MNEMONIC_HCALL: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_hcall(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_SEND:
+    case MNEMONIC_RECV:
+    case MNEMONIC_TRY_RECV: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_channel(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_CAS:
+    case MNEMONIC_XADD:
+    case MNEMONIC_XCHG:
+    case MNEMONIC_ALOAD:
+    case MNEMONIC_ASTORE: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_atomic(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_FENCE:
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      break;
+    case MNEMONIC_JOIN:
+      handle_join(ctx, inst);
+      break;
+    case MNEMONIC_SPAWN: {
+      int tmp_ret_code;
+      if ((tmp_ret_code = handle_spawn(ctx, inst)) != 0) return tmp_ret_code;
+      break;
+    }
+    case MNEMONIC_FREAD:
+    case MNEMONIC_FWRITE:
+      return handle_file_io(ctx, inst);
     default:
       print_err("VM error: Unknown mnemonic with opcode %d", INST_MNEMONIC(inst));
       return RET_CODE_ERR;
@@ -260,23 +753,88 @@ int execute_instruction(VmCtx *ctx, int *program_ret_code_out) {
   return RET_CODE_OK;
 }
 
-void vm_init_ctx(VmCtx *ctx, inst_ty *insts, size_t insts_count) {
+void vm_init_ctx(VmCtx *ctx, Program *program) {
   *ctx = (VmCtx){0};
-  ctx->first_inst = insts;
-  ctx->insts_count = insts_count;
-  ctx->ip = insts;
+  ctx->program = program_retain(program);
+  ctx->first_inst = program->exec_insts;
+  ctx->insts_end = program->exec_insts + program->insts_count;
+  ctx->ip = program->exec_insts;
+  output_init(&ctx->out, STDOUT_FILENO);
+  vec_init();
+}
+
+void vm_deinit_ctx(VmCtx *ctx) {
+  output_free(&ctx->out);
+  program_release(ctx->program);
+  ctx->program = NULL;
+}
+
+void vm_fork(VmCtx *ctx, VmCtx *child_out) {
+  *child_out = *ctx;
+  program_retain(ctx->program);
+  // pending output stays with the parent
+  output_init(&child_out->out, ctx->out.fd);
+  child_out->trace = NULL;
+  child_out->insts_executed = 0;
+  // only an executor the child is added to may suspend it
+  child_out->executor = NULL;
+}
+
+VmWord *vm_copy_shared_mem(const VmCtx *ctx) {
+  VmWord *copy = malloc((ctx->shared_words ? ctx->shared_words : 1) * sizeof(VmWord));
+  if (!copy) return NULL;
+
+  // spawned threads may still write while the region is copied
+  for (size_t i = 0; i < ctx->shared_words; i++)
+    copy[i] = __atomic_load_n(&ctx->shared_mem[i], __ATOMIC_RELAXED);
+  return copy;
+}
+
+int vm_step(VmCtx *ctx, int *program_ret_code_out) {
+  int tmp_ret_code = execute_instruction(ctx, program_ret_code_out);
+  if (tmp_ret_code == RET_CODE_OK || tmp_ret_code == RET_CODE_SUSPENDED) ctx->ip++;
+  return tmp_ret_code;
 }
 
 int vm_run(VmCtx *ctx, int *program_ret_code_out) {
-  inst_ty *first_invalid_inst = ctx->ip + ctx->insts_count;
+  inst_ty *first_invalid_inst = ctx->insts_end;
 
-  while (ctx->ip < first_invalid_inst) {
-    int tmp_ret_code = execute_instruction(ctx, program_ret_code_out);
-    if (tmp_ret_code == RET_CODE_ERR) return RET_CODE_ERR;
-    if (tmp_ret_code == RET_CODE_NORET) break;
+  int tmp_ret_code = RET_CODE_OK;
+
+  if (ctx->trace) trace_start(ctx);
+
+  // counting has its own loop, the increment alone costs the default loop a few percent
+  if (ctx->count_insts) {
+    uint64_t insts_executed = 0;
+
+    while (ctx->ip < first_invalid_inst) {
+      insts_executed++;
+      tmp_ret_code = execute_instruction(ctx, program_ret_code_out);
+      if (tmp_ret_code != RET_CODE_OK) break;
+      ctx->ip++;
+    }
+
+    ctx->insts_executed += insts_executed;
+  }
+  else {
+    while (ctx->ip < first_invalid_inst) {
+      tmp_ret_code = execute_instruction(ctx, program_ret_code_out);
+      if (tmp_ret_code != RET_CODE_OK) break;
+      ctx->ip++;
+    }
+  }
+
+  if (ctx->trace) trace_stop(ctx);
+
+  // the output is flushed once the context stopped for good
+  if (tmp_ret_code == RET_CODE_SUSPENDED) {
     ctx->ip++;
+    return RET_CODE_SUSPENDED;
   }
 
+  // pending output is written even if the program failed
+  if (output_flush(&ctx->out) != 0 || tmp_ret_code == RET_CODE_ERR) return RET_CODE_ERR;
+
   ERR_IF(ctx->ip >= first_invalid_inst,
          "VM error: Instruction pointer went past last instruction (probably forgot to exit)");
   return RET_CODE_OK;
@@ -4,10 +4,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "input.h"
+#include "output.h"
+#include "vec.h"
+
 #define FILE_SIG_SIZE 3
 #define FILE_SIG "TVM"
+// signature followed by a flags byte, which keeps the instructions of mapped files aligned;
+// files with just the signature are still loaded
+#define FILE_HEADER_SIZE 4
+// the instructions are stored in the 16-bit stream format of compress.h
+#define FILE_FLAG_COMPRESSED 1
 
-#define STACK_SIZE 2048
 #define REGS_COUNT 8
 
 typedef uint32_t inst_ty;
@@ -42,21 +50,132 @@ enum Mnemonic {
   MNEMONIC_SHR,
   MNEMONIC_SHL,
   MNEMONIC_NOT,
+  MNEMONIC_OUT,
+  MNEMONIC_OUTB,
+  MNEMONIC_FLUSH,
+  MNEMONIC_INB,
+  MNEMONIC_INW,
+  MNEMONIC_INL,
+  MNEMONIC_INQ,
+  MNEMONIC_INLEN,
+  MNEMONIC_POPCNT,
+  MNEMONIC_CLZ,
+  MNEMONIC_CTZ,
+  MNEMONIC_BSWAP,
+  MNEMONIC_ROL,
+  MNEMONIC_ROR,
+  MNEMONIC_MULH,
+  MNEMONIC_MULHU,
+  MNEMONIC_DIVU,
+  MNEMONIC_REMU,
+  MNEMONIC_VADD,
+  MNEMONIC_VSUB,
+  MNEMONIC_VAND,
+  MNEMONIC_VOR,
+  MNEMONIC_VXOR,
+  MNEMONIC_VCMPEQ,
+  MNEMONIC_VCMPGT,
+  MNEMONIC_VSHUF,
+  MNEMONIC_VSHL,
+  MNEMONIC_VSHR,
+  MNEMONIC_VBCST,
+  MNEMONIC_VINS,
+  MNEMONIC_VEXT,
+  MNEMONIC_VIN,
+  MNEMONIC_VOUT,
+  MNEMONIC_FORK,
+  MNEMONIC_HCALL,
+  MNEMONIC_SEND,
+  MNEMONIC_RECV,
+  MNEMONIC_TRY_RECV,
+  MNEMONIC_CAS,
+  MNEMONIC_XADD,
+  MNEMONIC_XCHG,
+  MNEMONIC_ALOAD,
+  MNEMONIC_ASTORE,
+  MNEMONIC_FENCE,
+  MNEMONIC_JOIN,
+  // the optimizer does not know about code only reachable from `spawn`, so it stays unknown to
+  // ir.h
+  MNEMONIC_SPAWN,
+  MNEMONIC_FREAD,
+  MNEMONIC_FWRITE,
+  // never in files, only in the code contexts execute after loading (see specialize.h)
+  MNEMONIC_DIV_POW2,
+  MNEMONIC_DIV_MAGIC,
 };
 
+// shared code, see program.h
+typedef struct Program Program;
+// execution trace, see trace.h
+typedef struct VmTrace VmTrace;
+// queue between contexts, see channel.h
+typedef struct VmChannel VmChannel;
+// guest threads, see threads.h
+typedef struct VmThreads VmThreads;
+// runs contexts while others wait for their I/O, see executor.h
+typedef struct VmExecutor VmExecutor;
+
+typedef struct VmCtx VmCtx;
+
+// host function for `hcall`, takes its arguments from and leaves its results in the guest
+// registers; a non-zero return stops the program with an error
+typedef int (*VmHostFn)(VmWord *regs, void *data);
+
 typedef struct {
-  VmWord stack[STACK_SIZE];
+  const char *name;  // what the assembler resolves `hcall name` against
+  VmHostFn fn;
+  void *data;
+} VmHostFnEntry;
+
+// `hcall idx` calls `fns[idx]`
+typedef struct {
+  const VmHostFnEntry *fns;
+  size_t count;
+} VmHostFns;
+
+// runs for `fork` with `ctx` in the state the child starts from (after the instruction, with
+// the destination register cleared), returns the id the parent gets or -1 if there is no child
+typedef VmWord (*VmForkHandler)(VmCtx *ctx, void *data);
+
+// the only guest memory besides the registers is shared, so copying a context is cheap
+struct VmCtx {
   VmWord regs[REGS_COUNT];
+  VmVec vregs[VREGS_COUNT];
+  Program *program;  // holds a reference
+  // code of `program`, kept here for the dispatch loop
   inst_ty *first_inst;
-  size_t insts_count;
+  inst_ty *insts_end;
   inst_ty *ip;
-  VmWord *sp;
 
   bool f_zero : 1;
   bool f_greater : 1;
   bool f_smaller : 1;
   bool f_eq : 1;
-} VmCtx;
+
+  VmInput in;
+  VmOutput out;
+  VmTrace *trace;  // NULL unless tracing
+  // `insts_executed` is only maintained with `count_insts` set
+  bool count_insts;
+  uint64_t insts_executed;
+  VmForkHandler fork_handler;  // NULL fails every `fork`, always NULL in spawned threads
+  void *fork_data;
+  const VmHostFns *host_fns;  // NULL fails every `hcall`, forks share it
+  // `send`, `recv` and `try_recv` take an index into `channels`
+  VmChannel **channels;
+  size_t channel_count;
+  // word addresses of the atomics index `shared_mem`, spawned threads share both
+  VmWord *shared_mem;
+  size_t shared_words;
+  VmThreads *threads;  // NULL fails every `spawn`
+  // `fread` and `fwrite` take an index into `files`, the file descriptors stay open
+  const int *files;
+  size_t file_count;
+  // set while an executor runs the context, `fread` and `fwrite` then suspend it instead of
+  // blocking; NULL (always in spawned threads) does the I/O on the running thread
+  VmExecutor *executor;
+};
 
 extern const InstField FIELD_MNEMONIC;
 extern const InstField FIELD_EXIT_CODE;
@@ -85,6 +204,63 @@ extern const InstField FIELD_COND_JMP_OFF;
 extern const InstField FIELD_NOT_DST;
 extern const InstField FIELD_NOT_SRC;
 
-void vm_init_ctx(VmCtx *ctx, inst_ty *insts, size_t insts_count);
+// popcnt, clz, ctz and bswap
+extern const InstField FIELD_UNOP_DST;
+extern const InstField FIELD_UNOP_SRC;
+
+// vector instructions, `vbcst`, `vins` and `vext` put the scalar register in `OP1` (`DST` for
+// `vext`), `IMM` is the shift amount or lane index
+extern const InstField FIELD_VEC_DST;
+extern const InstField FIELD_VEC_OP1;
+extern const InstField FIELD_VEC_OP2;
+extern const InstField FIELD_VEC_LANE;  // log2 of the lane width in bytes
+extern const InstField FIELD_VEC_IMM;
+
+extern const InstField FIELD_FORK_DST;
+extern const InstField FIELD_HCALL_IDX;
+// the register is the source of `send` and the destination of `recv` and `try_recv`
+extern const InstField FIELD_CHAN_REG;
+extern const InstField FIELD_CHAN_IDX;
+// `cas`, `xadd` and `xchg` take all three registers, `aload` `DST` and `ADDR`, `astore` `ADDR`
+// and `SRC`; `cas` puts the new value in `SRC`
+extern const InstField FIELD_ATOMIC_DST;
+extern const InstField FIELD_ATOMIC_ADDR;
+extern const InstField FIELD_ATOMIC_SRC;
+extern const InstField FIELD_SPAWN_DST;
+extern const InstField FIELD_SPAWN_OFF;
+extern const InstField FIELD_JOIN_REG;
+// `fread` and `fwrite` move `LEN` bytes between shared memory from the word address in `ADDR` and
+// the file at `FILE` (at `OFF`, the file position if negative), `DST` gets the byte count or -errno
+extern const InstField FIELD_IO_DST;
+extern const InstField FIELD_IO_ADDR;
+extern const InstField FIELD_IO_LEN;
+extern const InstField FIELD_IO_OFF;
+extern const InstField FIELD_IO_FILE;
+// the specialized divisions share `DST` and `OP1` with the binops, `div` by -2^k sets `NEG`
+extern const InstField FIELD_DIV_SHIFT;
+extern const InstField FIELD_DIV_NEG;
+extern const InstField FIELD_DIV_MAGIC_IDX;
+
+extern const InstField FIELD_OUT_REG;
+extern const InstField FIELD_IN_DST;
+
+int32_t inst_extract_bits(inst_ty inst, InstField field, bool signext);
+inst_ty inst_insert_bits(inst_ty inst, InstField field, int32_t value);
+
+// guest output goes to stdout, change `ctx->out.fd` before running to redirect or discard it;
+// the input is empty until `ctx->in` is set
+void vm_init_ctx(VmCtx *ctx, Program *program);
+void vm_deinit_ctx(VmCtx *ctx);
+// the child continues from the current state of `ctx` and shares its program, input data and shared
+// memory, it starts with empty output and without a trace or executor; free it with `vm_deinit_ctx`
+void vm_fork(VmCtx *ctx, VmCtx *child_out);
+// the shared memory of `ctx` as it is now, for the child of a `fork` that must not see later writes
+// of the parent (spawned threads share the region instead); malloc'd, NULL if it could not be
+VmWord *vm_copy_shared_mem(const VmCtx *ctx);
+// RET_CODE_SUSPENDED (only with an executor) leaves `ctx` after the instruction that waits, the
+// next call continues from there
 int vm_run(VmCtx *ctx, int *program_ret_code_out);
+// executes the instruction at `ctx->ip` without checking it is in the program, RET_CODE_NORET once
+// the program exits
+int vm_step(VmCtx *ctx, int *program_ret_code_out);
 #endif  // VM_H
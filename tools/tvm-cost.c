@@ -0,0 +1,711 @@
+// static worst case instruction counts of a program, computed without running it; loops are
+// bounded by counters that start at a constant, change by a constant step and are compared against
+// a constant, every other loop is reported as unbounded
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "cfg.h"
+#include "error.h"
+#include "ir.h"
+#include "vm.h"
+
+#define COST_UNBOUNDED UINT64_MAX
+#define NO_LOOP SIZE_MAX
+// constant values tried per register at a loop entry, more make the loop unknown
+#define MAX_CONST_VALUES 16
+
+typedef struct {
+  bool unknown_regs;
+  bool has_limit;
+  uint64_t limit;
+  char *program_file;
+} Args;
+
+// natural loop of all back edges into `header`
+typedef struct {
+  size_t header;
+  bool *in_loop;  // per block
+  size_t size;
+  size_t parent;  // innermost enclosing loop
+  int depth;
+  bool irreducible;
+
+  uint64_t trips;  // executions of the header
+  uint64_t iter_cost;
+  uint64_t cost;
+  const char *reason;  // why the trip count is unknown
+} Loop;
+
+typedef struct {
+  IrProgram ir;
+  Cfg cfg;
+  CfgReachingDefs rd;
+  bool has_rd;
+  bool unknown_regs;
+
+  Loop *loops;  // inner loops first
+  size_t loop_count;
+  size_t *block_loop;  // innermost loop of every block
+  bool irreducible;
+} Analysis;
+
+// exit condition of a loop test on the counter value
+enum Pred {
+  PRED_ALWAYS,
+  PRED_NEVER,
+  PRED_EQ,
+  PRED_NE,
+  PRED_GT,
+  PRED_GE,
+  PRED_LT,
+  PRED_LE,
+};
+
+int parse_cmd_args(int argc, char **argv, Args *args_out) {
+  Args args = {0};
+  int i = 1;
+
+  for (; i < argc && *argv[i] == '-'; i++) {
+    char *arg = argv[i];
+
+    if (strcmp(arg, "-unknown-regs") == 0)
+      args.unknown_regs = true;
+    else if (strcmp(arg, "-limit") == 0) {
+      ERR_IF(i + 1 == argc, "Args error: Expected instruction count after '%s'", arg);
+      char *limit_end;
+      args.limit = strtoull(argv[++i], &limit_end, 10);
+      ERR_IF(*limit_end || limit_end == argv[i] || *argv[i] == '-',
+             "Args error: Invalid instruction count '%s'", argv[i]);
+      args.has_limit = true;
+    }
+    else {
+      print_err("Args error: Unknown option '%s'", arg);
+      return RET_CODE_ERR;
+    }
+  }
+
+  ERR_IF(argc - i != 1, "Usage: tvm-cost [-unknown-regs] [-limit <instructions>] <program.tvm>");
+  args.program_file = argv[i];
+
+  *args_out = args;
+  return RET_CODE_OK;
+}
+
+uint64_t cost_add(uint64_t a, uint64_t b) {
+  uint64_t sum;
+  return __builtin_add_overflow(a, b, &sum) ? COST_UNBOUNDED : sum;
+}
+
+uint64_t cost_mul(uint64_t a, uint64_t b) {
+  uint64_t product;
+  return __builtin_mul_overflow(a, b, &product) ? COST_UNBOUNDED : product;
+}
+
+bool in_region(Analysis *an, size_t region, size_t block) {
+  if (block == CFG_END) return false;
+  return region == NO_LOOP ? an->cfg.blocks[block].reachable : an->loops[region].in_loop[block];
+}
+
+// loop directly nested in `region` that contains `block`, NO_LOOP if the block belongs to the
+// region itself
+size_t child_loop(Analysis *an, size_t region, size_t block) {
+  size_t loop = an->block_loop[block];
+  if (loop == region) return NO_LOOP;
+
+  while (an->loops[loop].parent != region) loop = an->loops[loop].parent;
+  return loop;
+}
+
+uint64_t node_cost(Analysis *an, size_t region, size_t block) {
+  size_t child = child_loop(an, region, block);
+  if (child != NO_LOOP) return an->loops[child].cost;
+
+  uint64_t cost = 0;
+  for (size_t i = an->cfg.blocks[block].first; i <= an->cfg.blocks[block].last; i++)
+    if (!an->ir.insts[i].removed) cost++;
+  return cost;
+}
+
+void relax_edge(Analysis *an, size_t region, uint64_t *dist, size_t from, size_t to) {
+  if (!in_region(an, region, to)) return;
+  // back edges end an iteration
+  if (region != NO_LOOP && to == an->loops[region].header) return;
+
+  size_t child = child_loop(an, region, to);
+  size_t node = child == NO_LOOP ? to : an->loops[child].header;
+  uint64_t dist_to = cost_add(dist[from], node_cost(an, region, node));
+  if (dist_to > dist[node]) dist[node] = dist_to;
+}
+
+// longest path through the region without back edges, inner loops count with their total cost;
+// the reverse post order is a topological order of the region since it is reducible
+uint64_t region_cost(Analysis *an, size_t region, uint64_t *dist) {
+  Cfg *cfg = &an->cfg;
+  size_t start = region == NO_LOOP ? cfg->rpo[0] : an->loops[region].header;
+  size_t start_child = child_loop(an, region, start);
+  uint64_t worst = 0;
+
+  memset(dist, 0, cfg->count * sizeof(uint64_t));
+  if (start_child != NO_LOOP) start = an->loops[start_child].header;
+  dist[start] = node_cost(an, region, start);
+
+  for (size_t r = 0; r < cfg->rpo_count; r++) {
+    size_t b = cfg->rpo[r];
+    // every node costs at least one instruction, so 0 means unreached
+    if (!in_region(an, region, b) || !dist[b]) continue;
+    if (dist[b] > worst) worst = dist[b];
+
+    size_t child = child_loop(an, region, b);
+    if (child == NO_LOOP) {
+      for (int i = 0; i < cfg->blocks[b].succ_count; i++)
+        relax_edge(an, region, dist, b, cfg->blocks[b].succs[i]);
+      continue;
+    }
+
+    // exits of the inner loop
+    Loop *loop = &an->loops[child];
+    for (size_t lb = 0; lb < cfg->count; lb++) {
+      if (!loop->in_loop[lb]) continue;
+      for (int i = 0; i < cfg->blocks[lb].succ_count; i++) {
+        size_t succ = cfg->blocks[lb].succs[i];
+        if (succ == CFG_END || !loop->in_loop[succ]) relax_edge(an, region, dist, b, succ);
+      }
+    }
+  }
+
+  return worst;
+}
+
+bool dominates_latches(Analysis *an, Loop *loop, size_t block) {
+  CfgBlock *header = &an->cfg.blocks[loop->header];
+
+  for (size_t p = 0; p < header->pred_count; p++)
+    if (loop->in_loop[header->preds[p]] && !cfg_dominates(&an->cfg, block, header->preds[p]))
+      return false;
+  return true;
+}
+
+// constant values `reg` can have when the loop is entered from outside, false if any is unknown
+bool entry_values(Analysis *an, Loop *loop, int reg, int64_t *values, int *count_out) {
+  if (!an->has_rd) return false;
+
+  CfgReachingDefs *rd = &an->rd;
+  uint64_t *set = malloc(rd->words * sizeof(uint64_t));
+  bool known = set != NULL;
+  int count = 0;
+
+  if (known)
+    cfg_reaching_defs_at(&an->ir, &an->cfg, rd, an->cfg.blocks[loop->header].first, set);
+
+  for (size_t def = 0; known && def < rd->def_count; def++) {
+    if (rd->def_regs[def] != reg || !(set[def / 64] & 1ull << (def % 64))) continue;
+
+    size_t inst_idx = rd->def_insts[def];
+    int64_t value = 0;
+
+    // registers start cleared unless an embedder sets them
+    if (inst_idx == CFG_ENTRY_DEF)
+      known = !an->unknown_regs;
+    else {
+      IrInst *ir_inst = &an->ir.insts[inst_idx];
+      int mnemonic = inst_extract_bits(ir_inst->inst, FIELD_MNEMONIC, false);
+
+      if (loop->in_loop[an->cfg.inst_block[inst_idx]]) continue;
+
+      if (mnemonic == MNEMONIC_MOV && inst_extract_bits(ir_inst->inst, FIELD_MOV_IS_IMM, false))
+        value = inst_extract_bits(ir_inst->inst, FIELD_MOV_IMM, true);
+      else if (mnemonic == MNEMONIC_LOAD)
+        value = (int64_t)((uint64_t)ir_inst->payload[1] << 32 | ir_inst->payload[0]);
+      else
+        known = false;
+    }
+
+    bool seen = false;
+    for (int i = 0; i < count; i++) seen |= values[i] == value;
+    if (!seen && count == MAX_CONST_VALUES) known = false;
+    if (known && !seen) values[count++] = value;
+  }
+
+  free(set);
+  *count_out = count;
+  return known && count > 0;
+}
+
+// the only write to `reg` in the loop if it adds a constant once per iteration, SIZE_MAX otherwise
+size_t counter_update(Analysis *an, Loop *loop, int reg, int64_t *step_out) {
+  size_t update = SIZE_MAX;
+
+  for (size_t i = 0; i < an->ir.count; i++) {
+    if (an->ir.insts[i].removed || !loop->in_loop[an->cfg.inst_block[i]]) continue;
+    if (!(ir_inst_defs(an->ir.insts[i].inst) & 1u << reg)) continue;
+    if (update != SIZE_MAX) return SIZE_MAX;
+    update = i;
+  }
+  if (update == SIZE_MAX) return SIZE_MAX;
+
+  size_t block = an->cfg.inst_block[update];
+  if (an->block_loop[block] != (size_t)(loop - an->loops) || !dominates_latches(an, loop, block))
+    return SIZE_MAX;
+
+  inst_ty inst = an->ir.insts[update].inst;
+  int mnemonic = inst_extract_bits(inst, FIELD_MNEMONIC, false);
+  int64_t step = 0;
+
+  if (mnemonic == MNEMONIC_INC)
+    step = 1;
+  else if (mnemonic == MNEMONIC_DEC)
+    step = -1;
+  else if ((mnemonic == MNEMONIC_ADD || mnemonic == MNEMONIC_SUB) &&
+           inst_extract_bits(inst, FIELD_BINOP_OP1, false) == reg &&
+           inst_extract_bits(inst, FIELD_BINOP_IS_IMM, false)) {
+    step = inst_extract_bits(inst, FIELD_BINOP_IMM, true);
+    if (mnemonic == MNEMONIC_SUB) step = -step;
+  }
+
+  if (step == 0) return SIZE_MAX;
+  *step_out = step;
+  return update;
+}
+
+// iterations before `pred(v0 + step * k, c)` first holds, false if the counter wraps around first
+bool exit_iteration(__int128 v0, __int128 step, __int128 c, int pred, uint64_t *k_out) {
+  __int128 k;
+
+  if (pred == PRED_GE) {
+    pred = PRED_GT;
+    c--;
+  }
+  else if (pred == PRED_LE) {
+    pred = PRED_LT;
+    c++;
+  }
+
+  switch (pred) {
+    case PRED_ALWAYS:
+      k = 0;
+      break;
+    case PRED_EQ:
+      if ((c - v0) % step != 0 || (c - v0) / step < 0) return false;
+      k = (c - v0) / step;
+      break;
+    case PRED_NE:
+      k = v0 != c ? 0 : 1;
+      break;
+    case PRED_GT:
+      if (v0 > c) k = 0;
+      else if (step < 0) return false;
+      else k = (c - v0) / step + 1;
+      break;
+    case PRED_LT:
+      if (v0 < c) k = 0;
+      else if (step > 0) return false;
+      else k = (v0 - c) / -step + 1;
+      break;
+    default:
+      return false;
+  }
+
+  __int128 last = v0 + step * k;
+  if (pred != PRED_NE && (last > INT64_MAX || last < INT64_MIN)) return false;
+
+  *k_out = k;
+  return true;
+}
+
+// exit condition of `jump` after `cmp`, with the counter as first (`counter_first`) or second
+// operand; `jz` is taken if either operand is 0
+int exit_pred(int jump, bool same_reg, bool counter_first, bool exit_on_taken, int64_t bound,
+              int64_t *pred_const_out) {
+  int pred;
+  *pred_const_out = bound;
+
+  switch (jump) {
+    case MNEMONIC_JMP_EQ:
+      pred = same_reg ? PRED_ALWAYS : PRED_EQ;
+      break;
+    case MNEMONIC_JMP_GREATER:
+      pred = same_reg ? PRED_NEVER : counter_first ? PRED_GT : PRED_LT;
+      break;
+    case MNEMONIC_JMP_LOWER:
+      pred = same_reg ? PRED_NEVER : counter_first ? PRED_LT : PRED_GT;
+      break;
+    case MNEMONIC_JMPZ:
+    default:
+      pred = !same_reg && bound == 0 ? PRED_ALWAYS : PRED_EQ;
+      *pred_const_out = 0;
+      break;
+  }
+
+  if (exit_on_taken) return pred;
+
+  static const int negated[] = {
+      [PRED_ALWAYS] = PRED_NEVER, [PRED_NEVER] = PRED_ALWAYS, [PRED_EQ] = PRED_NE,
+      [PRED_NE] = PRED_EQ,        [PRED_GT] = PRED_LE,        [PRED_GE] = PRED_LT,
+      [PRED_LT] = PRED_GE,        [PRED_LE] = PRED_GT,
+  };
+  return negated[pred];
+}
+
+size_t jump_block(Analysis *an, size_t inst_idx) {
+  return inst_idx < an->ir.count ? an->cfg.inst_block[inst_idx] : CFG_END;
+}
+
+// header executions bounded by one test that runs every iteration, COST_UNBOUNDED if it bounds
+// nothing; `reason_out` is updated with the furthest the analysis got
+uint64_t test_trips(Analysis *an, Loop *loop, size_t block, const char **reason_out) {
+  IrInst *jump = &an->ir.insts[an->cfg.blocks[block].last];
+  if (!ir_is_cond_jump(jump->inst)) return COST_UNBOUNDED;
+
+  bool taken_exits = !in_region(an, loop - an->loops, jump_block(an, jump->target));
+  size_t fallthrough = ir_next_live(&an->ir, an->cfg.blocks[block].last + 1);
+  bool fall_exits = !in_region(an, loop - an->loops, jump_block(an, fallthrough));
+  if (!taken_exits && !fall_exits) return COST_UNBOUNDED;
+  // every iteration leaves the loop here
+  if (taken_exits && fall_exits) return 1;
+
+  // the flags come from the last instruction in the block that sets them
+  size_t cmp_idx = SIZE_MAX;
+  for (size_t i = an->cfg.blocks[block].first; i < an->cfg.blocks[block].last; i++)
+    if (!an->ir.insts[i].removed && ir_inst_defs(an->ir.insts[i].inst) & IR_FLAGS_BIT) cmp_idx = i;
+  if (cmp_idx == SIZE_MAX) return COST_UNBOUNDED;
+
+  inst_ty cmp = an->ir.insts[cmp_idx].inst;
+  if (inst_extract_bits(cmp, FIELD_MNEMONIC, false) != MNEMONIC_CMP) return COST_UNBOUNDED;
+
+  int regs[2] = {inst_extract_bits(cmp, FIELD_CMP_REG1, false),
+                 inst_extract_bits(cmp, FIELD_CMP_REG2, false)};
+
+  for (int op = 0; op < 2; op++) {
+    int counter = regs[op];
+    int bound_reg = regs[1 - op];
+    bool same_reg = counter == bound_reg;
+    int64_t step;
+    size_t update = counter_update(an, loop, counter, &step);
+    if (update == SIZE_MAX) continue;
+
+    // the bound may not change inside the loop
+    bool bound_written = false;
+    for (size_t i = 0; i < an->ir.count && !same_reg && !bound_written; i++)
+      bound_written = !an->ir.insts[i].removed && loop->in_loop[an->cfg.inst_block[i]] &&
+                      ir_inst_defs(an->ir.insts[i].inst) & 1u << bound_reg;
+    if (bound_written) continue;
+
+    int64_t starts[MAX_CONST_VALUES];
+    int64_t bounds[MAX_CONST_VALUES] = {0};
+    int start_count;
+    int bound_count = 1;
+
+    if (!entry_values(an, loop, counter, starts, &start_count)) {
+      *reason_out = "counter start unknown";
+      continue;
+    }
+    if (!same_reg && !entry_values(an, loop, bound_reg, bounds, &bound_count)) {
+      *reason_out = "bound unknown";
+      continue;
+    }
+
+    // the counter is compared after the update if the update runs first in the iteration
+    size_t update_block = an->cfg.inst_block[update];
+    bool updated_first = update_block == block ? update < cmp_idx
+                                               : cfg_dominates(&an->cfg, update_block, block);
+    uint64_t trips = 0;
+    bool bounded = true;
+
+    for (int s = 0; s < start_count && bounded; s++) {
+      for (int b = 0; b < bound_count && bounded; b++) {
+        int64_t start = updated_first ? (int64_t)((uint64_t)starts[s] + step) : starts[s];
+        int64_t pred_const;
+        int pred = exit_pred(inst_extract_bits(jump->inst, FIELD_MNEMONIC, false), same_reg,
+                             op == 0, taken_exits, bounds[b], &pred_const);
+        uint64_t k;
+
+        bounded = exit_iteration(start, step, pred_const, pred, &k);
+        if (bounded && cost_add(k, 1) > trips) trips = cost_add(k, 1);
+      }
+    }
+
+    if (bounded) return trips;
+    *reason_out = "counter never reaches the exit";
+  }
+
+  return COST_UNBOUNDED;
+}
+
+void loop_trips(Analysis *an, Loop *loop) {
+  Cfg *cfg = &an->cfg;
+  bool exits = false;
+
+  loop->trips = COST_UNBOUNDED;
+  loop->reason = "no counted exit";
+
+  for (size_t b = 0; b < cfg->count && !exits; b++) {
+    if (!loop->in_loop[b]) continue;
+    exits = cfg->blocks[b].succ_count == 0;
+    for (int i = 0; i < cfg->blocks[b].succ_count; i++)
+      exits |= !in_region(an, loop - an->loops, cfg->blocks[b].succs[i]);
+  }
+
+  if (!exits) {
+    loop->reason = "never exits";
+    return;
+  }
+
+  // tests in inner loops or on optional paths may run any number of times per iteration
+  for (size_t b = 0; b < cfg->count; b++) {
+    if (an->block_loop[b] != (size_t)(loop - an->loops) || !dominates_latches(an, loop, b))
+      continue;
+
+    uint64_t trips = test_trips(an, loop, b, &loop->reason);
+    if (trips < loop->trips) loop->trips = trips;
+  }
+}
+
+int compare_loop_size(const void *a, const void *b) {
+  size_t size_a = ((const Loop *)a)->size;
+  size_t size_b = ((const Loop *)b)->size;
+  return size_a < size_b ? -1 : size_a > size_b;
+}
+
+int find_loops(Analysis *an) {
+  Cfg *cfg = &an->cfg;
+  size_t *worklist = malloc((cfg->count + 1) * sizeof(size_t));
+  an->loops = malloc((cfg->count + 1) * sizeof(Loop));
+  an->block_loop = malloc((cfg->count + 1) * sizeof(size_t));
+
+  if (!worklist || !an->loops || !an->block_loop) {
+    free(worklist);
+    print_err("Memory error: Could not allocate memory for the loops");
+    return RET_CODE_ERR;
+  }
+
+  for (size_t header = 0; header < cfg->count; header++) {
+    CfgBlock *header_block = &cfg->blocks[header];
+    size_t worklist_size = 0;
+    if (!header_block->reachable) continue;
+
+    for (size_t p = 0; p < header_block->pred_count; p++)
+      if (cfg_dominates(cfg, header, header_block->preds[p]))
+        worklist[worklist_size++] = header_block->preds[p];
+    if (worklist_size == 0) continue;
+
+    Loop *loop = &an->loops[an->loop_count];
+    *loop = (Loop){.header = header, .in_loop = calloc(cfg->count, sizeof(bool))};
+    if (!loop->in_loop) {
+      free(worklist);
+      print_err("Memory error: Could not allocate memory for the loops");
+      return RET_CODE_ERR;
+    }
+
+    an->loop_count++;
+    loop->in_loop[header] = true;
+    loop->size = 1;
+
+    while (worklist_size > 0) {
+      size_t b = worklist[--worklist_size];
+      if (loop->in_loop[b]) continue;
+      loop->in_loop[b] = true;
+      loop->size++;
+
+      for (size_t p = 0; p < cfg->blocks[b].pred_count; p++) {
+        size_t pred = cfg->blocks[b].preds[p];
+        if (!loop->in_loop[pred] && cfg->blocks[pred].reachable) worklist[worklist_size++] = pred;
+      }
+    }
+  }
+  free(worklist);
+
+  // natural loops with different headers are nested or disjoint, so the first larger loop
+  // containing a header is its parent
+  qsort(an->loops, an->loop_count, sizeof(Loop), compare_loop_size);
+
+  for (size_t b = 0; b < cfg->count; b++) an->block_loop[b] = NO_LOOP;
+
+  for (size_t l = 0; l < an->loop_count; l++) {
+    Loop *loop = &an->loops[l];
+    loop->parent = NO_LOOP;
+
+    for (size_t outer = l + 1; outer < an->loop_count && loop->parent == NO_LOOP; outer++)
+      if (an->loops[outer].in_loop[loop->header]) loop->parent = outer;
+
+    for (size_t b = 0; b < cfg->count; b++)
+      if (loop->in_loop[b] && an->block_loop[b] == NO_LOOP) an->block_loop[b] = l;
+  }
+
+  for (size_t l = an->loop_count; l-- > 0;)
+    if (an->loops[l].parent != NO_LOOP)
+      an->loops[l].depth = an->loops[an->loops[l].parent].depth + 1;
+
+  // retreating edges into blocks that do not dominate their source enter a cycle in the middle,
+  // the regions containing them have no bound
+  for (size_t r = 0; r < cfg->rpo_count; r++) {
+    CfgBlock *block = &cfg->blocks[cfg->rpo[r]];
+
+    for (int i = 0; i < block->succ_count; i++) {
+      size_t succ = block->succs[i];
+      if (succ == CFG_END || cfg->blocks[succ].rpo_idx > r) continue;
+      if (cfg_dominates(cfg, succ, cfg->rpo[r])) continue;
+
+      an->irreducible = true;
+      for (size_t l = 0; l < an->loop_count; l++)
+        if (an->loops[l].in_loop[succ] && an->loops[l].in_loop[cfg->rpo[r]])
+          an->loops[l].irreducible = true;
+    }
+  }
+
+  return RET_CODE_OK;
+}
+
+// word range of the loop in the program file
+void loop_words(Analysis *an, size_t *inst_word, Loop *loop, size_t *first_out, size_t *last_out) {
+  *first_out = SIZE_MAX;
+  *last_out = 0;
+
+  for (size_t b = 0; b < an->cfg.count; b++) {
+    if (!loop->in_loop[b]) continue;
+    CfgBlock *block = &an->cfg.blocks[b];
+    size_t last = inst_word[block->last] + ir_inst_words(an->ir.insts[block->last].inst) - 1;
+
+    if (inst_word[block->first] < *first_out) *first_out = inst_word[block->first];
+    if (last > *last_out) *last_out = last;
+  }
+}
+
+int compare_words(const void *a, const void *b) {
+  size_t word_a = *(const size_t *)a;
+  size_t word_b = *(const size_t *)b;
+  return word_a < word_b ? -1 : word_a > word_b;
+}
+
+void print_report(Analysis *an, uint64_t program_cost) {
+  size_t *inst_word = malloc((an->ir.count + 1) * sizeof(size_t));
+  // first word and loop index of every loop, sorted by position
+  size_t *order = malloc((an->loop_count * 2 + 1) * sizeof(size_t));
+  size_t word = 0;
+  bool forks = false;
+
+  if (!inst_word || !order) {
+    free(inst_word);
+    free(order);
+    return;
+  }
+
+  for (size_t i = 0; i < an->ir.count; i++) {
+    inst_word[i] = word;
+    word += ir_inst_words(an->ir.insts[i].inst);
+    forks |= inst_extract_bits(an->ir.insts[i].inst, FIELD_MNEMONIC, false) == MNEMONIC_FORK;
+  }
+
+  for (size_t l = 0; l < an->loop_count; l++) {
+    size_t last;
+    loop_words(an, inst_word, &an->loops[l], &order[l * 2], &last);
+    order[l * 2 + 1] = l;
+  }
+  qsort(order, an->loop_count, sizeof(size_t) * 2, compare_words);
+
+  for (size_t i = 0; i < an->loop_count; i++) {
+    Loop *loop = &an->loops[order[i * 2 + 1]];
+    size_t first, last;
+    loop_words(an, inst_word, loop, &first, &last);
+    printf("loop %zu-%zu depth %d: ", first, last, loop->depth);
+
+    if (loop->cost != COST_UNBOUNDED)
+      printf("%llu iterations x %llu = %llu instructions\n", (unsigned long long)loop->trips,
+             (unsigned long long)loop->iter_cost, (unsigned long long)loop->cost);
+    else if (loop->irreducible)
+      printf("unbounded (irreducible control flow)\n");
+    else if (loop->trips == COST_UNBOUNDED)
+      printf("unbounded (%s)\n", loop->reason);
+    else if (loop->iter_cost == COST_UNBOUNDED)
+      printf("%llu iterations of an unbounded body\n", (unsigned long long)loop->trips);
+    else
+      printf("more than 2^64 instructions\n");
+  }
+
+  if (program_cost == COST_UNBOUNDED)
+    printf("program: unbounded%s\n", an->irreducible ? " (irreducible control flow)" : "");
+  else
+    printf("program: %llu instructions at most\n", (unsigned long long)program_cost);
+  // a child continues one of the parent's paths, so it is bounded by the same count
+  if (forks) printf("program forks, every child runs at most as many instructions\n");
+
+  free(inst_word);
+  free(order);
+}
+
+void free_analysis(Analysis *an) {
+  for (size_t l = 0; l < an->loop_count; l++) free(an->loops[l].in_loop);
+  free(an->loops);
+  free(an->block_loop);
+  if (an->has_rd) cfg_free_reaching_defs(&an->rd);
+  cfg_free(&an->cfg);
+  ir_free(&an->ir);
+}
+
+int analyze(Args *args, inst_ty *insts, size_t insts_count) {
+  Analysis an = {.unknown_regs = args->unknown_regs};
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = ir_decode(insts, insts_count, &an.ir)) != 0) {
+    ERR_IF(tmp_ret_code == RET_CODE_NORET, "Cost error: The program has no basic block structure");
+    return tmp_ret_code;
+  }
+  if ((tmp_ret_code = cfg_build(&an.ir, &an.cfg)) != 0) {
+    ir_free(&an.ir);
+    return tmp_ret_code;
+  }
+  cfg_compute_dominators(&an.cfg);
+
+  // too large programs skip the reaching definitions, their counters stay unknown
+  tmp_ret_code = cfg_compute_reaching_defs(&an.ir, &an.cfg, &an.rd);
+  an.has_rd = tmp_ret_code == RET_CODE_OK;
+  if (tmp_ret_code == RET_CODE_NORET) tmp_ret_code = RET_CODE_OK;
+
+  uint64_t *dist = malloc((an.cfg.count + 1) * sizeof(uint64_t));
+  if (tmp_ret_code == RET_CODE_OK && !dist) {
+    print_err("Memory error: Could not allocate memory for the cost analysis");
+    tmp_ret_code = RET_CODE_ERR;
+  }
+  if (tmp_ret_code == RET_CODE_OK) tmp_ret_code = find_loops(&an);
+
+  uint64_t program_cost = COST_UNBOUNDED;
+  if (tmp_ret_code == RET_CODE_OK) {
+    for (size_t l = 0; l < an.loop_count; l++) {
+      Loop *loop = &an.loops[l];
+      loop_trips(&an, loop);
+      loop->iter_cost = loop->irreducible ? COST_UNBOUNDED : region_cost(&an, l, dist);
+      loop->cost = loop->irreducible ? COST_UNBOUNDED : cost_mul(loop->trips, loop->iter_cost);
+    }
+
+    if (!an.irreducible) program_cost = region_cost(&an, NO_LOOP, dist);
+    print_report(&an, program_cost);
+  }
+
+  if (tmp_ret_code == RET_CODE_OK && args->has_limit && program_cost > args->limit) {
+    print_err("Cost error: The program may run more than %llu instructions",
+              (unsigned long long)args->limit);
+    tmp_ret_code = RET_CODE_ERR;
+  }
+
+  free(dist);
+  free_analysis(&an);
+  return tmp_ret_code;
+}
+
+int main(int argc, char **argv) {
+  Args args;
+  inst_ty *insts;
+  long insts_count;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = parse_cmd_args(argc, argv, &args)) != 0) return tmp_ret_code;
+  if ((tmp_ret_code = read_file_insts(args.program_file, &insts, &insts_count)) != 0)
+    return tmp_ret_code;
+
+  tmp_ret_code = analyze(&args, insts, insts_count);
+  free(insts);
+  return tmp_ret_code;
+}
@@ -0,0 +1,217 @@
+// runs several programs at once, each on its own thread, connected by the channels they name in
+// `send`, `recv` and `try_recv`
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "channel.h"
+#include "error.h"
+#include "input.h"
+#include "ir.h"
+#include "program.h"
+#include "vm.h"
+
+// every index `FIELD_CHAN_IDX` can hold
+#define MAX_CHANNELS 256
+#define DEFAULT_CAPACITY 1024
+
+enum ChannelUse {
+  USE_SEND = 1 << 0,
+  USE_RECV = 1 << 1,
+};
+
+typedef struct {
+  char **program_files;
+  size_t program_count;
+  size_t capacity;
+  char *guest_input_file;
+} Args;
+
+typedef struct {
+  VmCtx ctx;
+  unsigned char uses[MAX_CHANNELS];
+  int ret_code;
+  int program_ret_code;
+} Stage;
+
+int parse_cmd_args(int argc, char **argv, Args *args_out) {
+  Args args = {.capacity = DEFAULT_CAPACITY};
+  int i = 1;
+
+  for (; i < argc && *argv[i] == '-'; i++) {
+    char *arg = argv[i];
+
+    if (strcmp(arg, "-capacity") == 0) {
+      ERR_IF(i + 1 == argc, "Args error: Expected channel capacity after '%s'", arg);
+      char *capacity_end;
+      long capacity = strtol(argv[++i], &capacity_end, 10);
+      ERR_IF(*capacity_end || capacity_end == argv[i] || capacity <= 0 || capacity > (1l << 30),
+             "Args error: Invalid channel capacity '%s'", argv[i]);
+      args.capacity = capacity;
+    }
+    else if (strcmp(arg, "-input") == 0) {
+      ERR_IF(i + 1 == argc, "Args error: Expected guest input file after '%s'", arg);
+      args.guest_input_file = argv[++i];
+    }
+    else {
+      print_err("Args error: Unknown option '%s'", arg);
+      return RET_CODE_ERR;
+    }
+  }
+
+  ERR_IF(i == argc, "Usage: tvm-pipe [-capacity <n>] [-input <file>] <program.tvm>...");
+  args.program_files = argv + i;
+  args.program_count = argc - i;
+
+  *args_out = args;
+  return RET_CODE_OK;
+}
+
+// the channels a program can use are known from its code, so every channel knows how many
+// producers and consumers to wait for before it counts as closed
+void scan_channels(Program *program, unsigned char *uses) {
+  for (size_t i = 0; i < program->insts_count; i += ir_inst_words(program->insts[i])) {
+    inst_ty inst = program->insts[i];
+    int idx = inst_extract_bits(inst, FIELD_CHAN_IDX, false);
+
+    switch (inst_extract_bits(inst, FIELD_MNEMONIC, false)) {
+      case MNEMONIC_SEND:
+        uses[idx] |= USE_SEND;
+        break;
+      case MNEMONIC_RECV:
+      case MNEMONIC_TRY_RECV:
+        uses[idx] |= USE_RECV;
+        break;
+    }
+  }
+}
+
+void leave_channels(Stage *stage) {
+  for (size_t i = 0; i < stage->ctx.channel_count; i++) {
+    if (stage->uses[i] & USE_SEND) channel_leave_producer(stage->ctx.channels[i]);
+    if (stage->uses[i] & USE_RECV) channel_leave_consumer(stage->ctx.channels[i]);
+  }
+}
+
+void *run_stage(void *arg) {
+  Stage *stage = arg;
+
+  stage->ret_code = vm_run(&stage->ctx, &stage->program_ret_code);
+  // receivers waiting for a stopped program are released, even if it failed
+  leave_channels(stage);
+  return NULL;
+}
+
+int load_program(char *path, Program **program_out) {
+  inst_ty *insts;
+  long insts_count;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = read_file_insts(path, &insts, &insts_count)) != 0) return tmp_ret_code;
+  if ((tmp_ret_code = program_create(insts, insts_count, program_out)) != 0) free(insts);
+  return tmp_ret_code;
+}
+
+int run_pipeline(Args args, Stage *stages, VmChannel **channels) {
+  VmInput input = {0};
+  size_t channel_count = 0;
+  int tmp_ret_code = RET_CODE_OK;
+
+  if (args.guest_input_file &&
+      (tmp_ret_code = input_map_file(args.guest_input_file, &input)) != 0)
+    return tmp_ret_code;
+
+  for (size_t i = 0; i < args.program_count && tmp_ret_code == RET_CODE_OK; i++) {
+    Program *program;
+
+    if ((tmp_ret_code = load_program(args.program_files[i], &program)) != 0) break;
+    scan_channels(program, stages[i].uses);
+    vm_init_ctx(&stages[i].ctx, program);
+    program_release(program);
+
+    stages[i].ctx.in = input;
+    for (size_t j = 0; j < MAX_CHANNELS; j++)
+      if (stages[i].uses[j] && j >= channel_count) channel_count = j + 1;
+  }
+
+  for (size_t i = 0; i < channel_count && tmp_ret_code == RET_CODE_OK; i++) {
+    int producers = 0;
+    int consumers = 0;
+
+    for (size_t j = 0; j < args.program_count; j++) {
+      producers += (stages[j].uses[i] & USE_SEND) != 0;
+      consumers += (stages[j].uses[i] & USE_RECV) != 0;
+    }
+    tmp_ret_code = channel_create(args.capacity, producers, consumers, &channels[i]);
+  }
+
+  if (tmp_ret_code != RET_CODE_OK) {
+    input_unmap(&input);
+    return tmp_ret_code;
+  }
+
+  pthread_t *threads = calloc(args.program_count, sizeof(pthread_t));
+  bool *started = calloc(args.program_count, sizeof(bool));
+
+  for (size_t i = 0; i < args.program_count && threads && started; i++) {
+    stages[i].ctx.channels = channels;
+    stages[i].ctx.channel_count = channel_count;
+    started[i] = pthread_create(&threads[i], NULL, run_stage, &stages[i]) == 0;
+  }
+
+  for (size_t i = 0; i < args.program_count; i++) {
+    if (started && started[i]) {
+      pthread_join(threads[i], NULL);
+      continue;
+    }
+
+    // the other programs may still wait for this one
+    print_err("Thread error: Could not start '%s'", args.program_files[i]);
+    stages[i].ret_code = RET_CODE_ERR;
+    leave_channels(&stages[i]);
+  }
+
+  // the programs flushed their own output when they stopped
+  for (size_t i = 0; i < args.program_count; i++) {
+    if (stages[i].ret_code == RET_CODE_OK)
+      printf("Program %zu (%s) returned %d\n", i, args.program_files[i],
+             stages[i].program_ret_code);
+    else
+      tmp_ret_code = RET_CODE_ERR;
+  }
+
+  free(threads);
+  free(started);
+  input_unmap(&input);
+  return tmp_ret_code;
+}
+
+int main(int argc, char **argv) {
+  Args args;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = parse_cmd_args(argc, argv, &args)) != 0) return tmp_ret_code;
+
+  Stage *stages = calloc(args.program_count, sizeof(Stage));
+  VmChannel **channels = calloc(MAX_CHANNELS, sizeof(VmChannel *));
+
+  if (!stages || !channels) {
+    print_err("Memory error: Could not allocate memory for the programs");
+    tmp_ret_code = RET_CODE_ERR;
+  }
+  else
+    tmp_ret_code = run_pipeline(args, stages, channels);
+
+  for (size_t i = 0; stages && i < args.program_count; i++)
+    if (stages[i].ctx.program) vm_deinit_ctx(&stages[i].ctx);
+  for (int i = 0; channels && i < MAX_CHANNELS; i++) channel_free(channels[i]);
+
+  free(stages);
+  free(channels);
+  return tmp_ret_code;
+}
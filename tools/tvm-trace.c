@@ -0,0 +1,394 @@
+// offline analyzer for the traces `tvm -trace` writes
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "cfg.h"
+#include "error.h"
+#include "input.h"
+#include "ir.h"
+#include "program.h"
+#include "trace.h"
+#include "vm.h"
+
+typedef struct {
+  bool print_path;
+  bool print_blocks;
+  bool replay;
+  char *guest_input_file;
+  char *program_file;
+  char *trace_file;
+} Args;
+
+// straight line run of instructions, `last` is the taken jump or the instruction the program
+// stopped at (`insts_count` if it ran past the end); word offsets
+typedef struct {
+  size_t first;
+  size_t last;
+} TraceRun;
+
+typedef struct {
+  TraceCheckpoint *checkpoints;
+  // index of the first run after each checkpoint
+  size_t *checkpoint_runs;
+  size_t checkpoint_count;
+
+  TraceRun *runs;
+  size_t run_count;
+  size_t run_capacity;
+
+  // the last run ends where the program stopped, otherwise the process was killed mid jump
+  bool stopped;
+} Trace;
+
+int parse_cmd_args(int argc, char **argv, Args *args_out) {
+  Args args = {0};
+  int i = 1;
+
+  for (; i < argc && *argv[i] == '-'; i++) {
+    char *arg = argv[i];
+
+    if (strcmp(arg, "-path") == 0)
+      args.print_path = true;
+    else if (strcmp(arg, "-blocks") == 0)
+      args.print_blocks = true;
+    else if (strcmp(arg, "-regs") == 0)
+      args.replay = true;
+    else if (strcmp(arg, "-input") == 0) {
+      ERR_IF(i + 1 == argc, "Args error: Expected guest input file after '%s'", arg);
+      args.guest_input_file = argv[++i];
+    }
+    else {
+      print_err("Args error: Unknown option '%s'", arg);
+      return RET_CODE_ERR;
+    }
+  }
+
+  ERR_IF(argc - i != 2, "Usage: tvm-trace [-path] [-blocks] [-regs] [-input <file>] <program.tvm> "
+                        "<trace>");
+  args.program_file = argv[i];
+  args.trace_file = argv[i + 1];
+
+  // block hit counts are the default report
+  if (!args.print_path && !args.replay) args.print_blocks = true;
+
+  *args_out = args;
+  return RET_CODE_OK;
+}
+
+int add_run(Trace *trace, size_t first, size_t last) {
+  if (trace->run_count == trace->run_capacity) {
+    size_t capacity = trace->run_capacity ? trace->run_capacity * 2 : 1024;
+    TraceRun *runs = realloc(trace->runs, capacity * sizeof(TraceRun));
+    ERR_IF(!runs, "Memory error: Could not allocate memory for the trace");
+    trace->runs = runs;
+    trace->run_capacity = capacity;
+  }
+
+  trace->runs[trace->run_count++] = (TraceRun){.first = first, .last = last};
+  return RET_CODE_OK;
+}
+
+// turns the records back into runs, every jump is checked against the program
+int decode_segment(Trace *trace, TraceCheckpoint *checkpoint, inst_ty *insts, size_t insts_count,
+                   size_t *run_first) {
+  unsigned char *pos = (unsigned char *)(checkpoint + 1);
+  unsigned char *end = pos + checkpoint->used;
+
+  while (pos < end) {
+    uint64_t record = 0;
+    int shift = 0;
+
+    do {
+      ERR_IF(pos == end || shift > 63, "Trace error: Truncated record in segment %llu",
+             (unsigned long long)checkpoint->seq);
+      record |= (uint64_t)(*pos & 0x7f) << shift;
+      shift += 7;
+    } while (*pos++ & 0x80);
+
+    ERR_IF(trace->stopped, "Trace error: Records after the program stopped");
+
+    uint64_t delta = record >> 1;
+    ERR_IF(delta > insts_count - *run_first, "Trace error: Run past the end of the program");
+    size_t last = *run_first + delta;
+    int tmp_ret_code;
+
+    if ((tmp_ret_code = add_run(trace, *run_first, last)) != 0) return tmp_ret_code;
+
+    if (record & TRACE_RECORD_STOP) {
+      trace->stopped = true;
+      continue;
+    }
+
+    ERR_IF(last == insts_count || !ir_is_jump(insts[last]),
+           "Trace error: No jump at word %zu, the trace does not belong to the program", last);
+    *run_first = last + inst_extract_bits(insts[last], FIELD_JMP_OFF, true);
+  }
+
+  return RET_CODE_OK;
+}
+
+int decode_trace(char *bytes, long size, Program *program, Trace *trace_out) {
+  inst_ty *insts = program->insts;
+  size_t insts_count = program->insts_count;
+  TraceFileHeader header;
+  Trace trace = {0};
+
+  ERR_IF((size_t)size < sizeof(header), "Trace error: File too small");
+  memcpy(&header, bytes, sizeof(header));
+
+  ERR_IF(memcmp(header.sig, TRACE_SIG, TRACE_SIG_SIZE) != 0, "Trace error: Not a tvm trace");
+  ERR_IF(header.version != TRACE_VERSION || header.segment_size != TRACE_SEGMENT_SIZE,
+         "Trace error: Unsupported trace version %u", header.version);
+  ERR_IF((size - sizeof(header)) / TRACE_SEGMENT_SIZE != header.segment_count ||
+             (size - sizeof(header)) % TRACE_SEGMENT_SIZE,
+         "Trace error: Truncated trace");
+  ERR_IF(header.insts_count != insts_count ||
+             header.program_hash != program_hash(program),
+         "Trace error: The trace was recorded for a different program");
+
+  trace.checkpoints = malloc((header.segment_count + 1) * sizeof(TraceCheckpoint));
+  trace.checkpoint_runs = malloc((header.segment_count + 1) * sizeof(size_t));
+  if (!trace.checkpoints || !trace.checkpoint_runs) {
+    print_err("Memory error: Could not allocate memory for the trace");
+    goto err;
+  }
+
+  size_t run_first = 0;
+  for (size_t i = 0; i < header.segment_count; i++) {
+    TraceCheckpoint *checkpoint =
+        (TraceCheckpoint *)(bytes + sizeof(header) + i * TRACE_SEGMENT_SIZE);
+
+    if (checkpoint->used > TRACE_SEGMENT_SIZE - sizeof(TraceCheckpoint) ||
+        checkpoint->ip > insts_count) {
+      print_err("Trace error: Corrupted checkpoint %llu", (unsigned long long)checkpoint->seq);
+      goto err;
+    }
+
+    // segments after the oldest one continue exactly where the previous one ended
+    if (i && (checkpoint->seq != trace.checkpoints[i - 1].seq + 1 || checkpoint->ip != run_first)) {
+      print_err("Trace error: Checkpoint %llu does not continue the previous segment",
+                (unsigned long long)checkpoint->seq);
+      goto err;
+    }
+
+    run_first = checkpoint->ip;
+    trace.checkpoints[i] = *checkpoint;
+    trace.checkpoint_runs[i] = trace.run_count;
+    trace.checkpoint_count++;
+
+    if (decode_segment(&trace, checkpoint, insts, insts_count, &run_first) != 0) goto err;
+  }
+
+  *trace_out = trace;
+  return RET_CODE_OK;
+
+err:
+  free(trace.checkpoints);
+  free(trace.checkpoint_runs);
+  free(trace.runs);
+  return RET_CODE_ERR;
+}
+
+void free_trace(Trace *trace) {
+  free(trace->checkpoints);
+  free(trace->checkpoint_runs);
+  free(trace->runs);
+}
+
+void print_path(Trace *trace) {
+  for (size_t i = 0; i < trace->run_count; i++) {
+    TraceRun *run = &trace->runs[i];
+    bool is_stop = trace->stopped && i + 1 == trace->run_count;
+    printf("%zu-%zu%s\n", run->first, run->last, is_stop ? " stop" : "");
+  }
+}
+
+// hit counts per instruction from the runs with a difference array, the first instruction of a
+// block counts the times the block was entered
+int print_blocks(Trace *trace, inst_ty *insts, size_t insts_count) {
+  IrProgram ir;
+  Cfg cfg;
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = ir_decode(insts, insts_count, &ir)) != 0) {
+    ERR_IF(tmp_ret_code == RET_CODE_NORET, "Trace error: The program has no basic block structure");
+    return tmp_ret_code;
+  }
+
+  size_t *word_inst = malloc((insts_count + 1) * sizeof(size_t));
+  size_t *inst_word = malloc((ir.count + 1) * sizeof(size_t));
+  int64_t *hits = calloc(ir.count + 1, sizeof(int64_t));
+
+  if (!word_inst || !inst_word || !hits || cfg_build(&ir, &cfg) != 0) {
+    free(word_inst);
+    free(inst_word);
+    free(hits);
+    ir_free(&ir);
+    print_err("Memory error: Could not allocate memory for the block counts");
+    return RET_CODE_ERR;
+  }
+
+  size_t word = 0;
+  for (size_t i = 0; i < ir.count; i++) {
+    inst_word[i] = word;
+    for (int j = 0; j < ir_inst_words(ir.insts[i].inst); j++) word_inst[word + j] = i;
+    word += ir_inst_words(ir.insts[i].inst);
+  }
+  inst_word[ir.count] = insts_count;
+  word_inst[insts_count] = ir.count;
+
+  for (size_t i = 0; i < trace->run_count; i++) {
+    hits[word_inst[trace->runs[i].first]]++;
+    // running past the end stops after the last instruction
+    hits[trace->runs[i].last == insts_count ? ir.count : word_inst[trace->runs[i].last] + 1]--;
+  }
+
+  uint64_t executed = 0;
+  for (size_t i = 0; i < ir.count; i++) {
+    if (i) hits[i] += hits[i - 1];
+    executed += hits[i];
+  }
+
+  printf("segments: %zu, runs: %zu, instructions: %llu%s\n", trace->checkpoint_count,
+         trace->run_count, (unsigned long long)executed,
+         trace->stopped ? "" : " (interrupted, no stop record)");
+
+  for (size_t b = 0; b < cfg.count; b++) {
+    CfgBlock *block = &cfg.blocks[b];
+    if (!hits[block->first]) continue;
+
+    size_t last_word = inst_word[block->last] + ir_inst_words(ir.insts[block->last].inst) - 1;
+    printf("block %zu-%zu: %lld\n", inst_word[block->first], last_word,
+           (long long)hits[block->first]);
+  }
+
+  cfg_free(&cfg);
+  free(word_inst);
+  free(inst_word);
+  free(hits);
+  ir_free(&ir);
+  return RET_CODE_OK;
+}
+
+// runs the program again from the oldest checkpoint along the recorded path, the registers of
+// every later checkpoint have to match, guest input is only available with `-input`
+int replay(Trace *trace, Program *program, VmInput input) {
+  // the context runs the specialized copy of the code
+  inst_ty *insts = program->exec_insts;
+  VmCtx ctx;
+  int program_ret_code;
+  size_t checkpoint = 0;
+  size_t mismatches = 0;
+  int tmp_ret_code = RET_CODE_OK;
+
+  vm_init_ctx(&ctx, program);
+  ctx.out.fd = -1;
+  ctx.in = input;
+
+  for (size_t i = 0; i < trace->run_count && tmp_ret_code == RET_CODE_OK; i++) {
+    TraceRun *run = &trace->runs[i];
+
+    if (checkpoint < trace->checkpoint_count && trace->checkpoint_runs[checkpoint] == i) {
+      TraceCheckpoint *cp = &trace->checkpoints[checkpoint++];
+
+      if (checkpoint == 1) {
+        memcpy(ctx.regs, cp->regs, sizeof(ctx.regs));
+        memcpy(ctx.vregs, cp->vregs, sizeof(ctx.vregs));
+        ctx.f_zero = cp->flags & TRACE_FLAG_ZERO;
+        ctx.f_greater = cp->flags & TRACE_FLAG_GREATER;
+        ctx.f_smaller = cp->flags & TRACE_FLAG_SMALLER;
+        ctx.f_eq = cp->flags & TRACE_FLAG_EQ;
+        ctx.in.pos = cp->in_pos <= ctx.in.size ? cp->in_pos : ctx.in.size;
+      }
+      else if (memcmp(ctx.regs, cp->regs, sizeof(ctx.regs)) != 0 ||
+               memcmp(ctx.vregs, cp->vregs, sizeof(ctx.vregs)) != 0) {
+        printf("checkpoint %llu: registers differ from the replay\n", (unsigned long long)cp->seq);
+        memcpy(ctx.regs, cp->regs, sizeof(ctx.regs));
+        memcpy(ctx.vregs, cp->vregs, sizeof(ctx.vregs));
+        mismatches++;
+      }
+    }
+
+    ctx.ip = insts + run->first;
+    bool is_stop = trace->stopped && i + 1 == trace->run_count;
+
+    while (tmp_ret_code == RET_CODE_OK && (size_t)(ctx.ip - insts) < run->last) {
+      inst_ty *prev_ip = ctx.ip;
+      tmp_ret_code = vm_step(&ctx, &program_ret_code);
+
+      if (tmp_ret_code == RET_CODE_OK && ctx.ip != prev_ip + ir_inst_words(*prev_ip)) {
+        printf("replay diverged from the trace at word %zu\n", (size_t)(prev_ip - insts));
+        tmp_ret_code = RET_CODE_ERR;
+      }
+    }
+
+    // the program stopped before it could execute the last instruction of the run
+    if (tmp_ret_code == RET_CODE_OK && !is_stop) tmp_ret_code = vm_step(&ctx, &program_ret_code);
+
+    if (tmp_ret_code == RET_CODE_OK && !is_stop && i + 1 < trace->run_count &&
+        (size_t)(ctx.ip - insts) != trace->runs[i + 1].first) {
+      printf("replay diverged from the trace at word %zu\n", run->last);
+      tmp_ret_code = RET_CODE_ERR;
+    }
+  }
+
+  vm_deinit_ctx(&ctx);
+  if (tmp_ret_code == RET_CODE_NORET) {
+    print_err("Trace error: The program exited before the end of the trace");
+    return RET_CODE_ERR;
+  }
+  if (tmp_ret_code != 0) return tmp_ret_code;
+
+  printf("replayed %zu runs, %zu of %zu checkpoints differed\n", trace->run_count, mismatches,
+         trace->checkpoint_count);
+  for (int i = 0; i < REGS_COUNT; i++) printf("r%d: %lld\n", i, (long long)ctx.regs[i]);
+  return RET_CODE_OK;
+}
+
+int main(int argc, char **argv) {
+  Args args;
+  inst_ty *insts;
+  long insts_count;
+  Program *program;
+  char *trace_bytes;
+  long trace_size;
+  Trace trace;
+  VmInput input = {0};
+  int tmp_ret_code;
+
+  if ((tmp_ret_code = parse_cmd_args(argc, argv, &args)) != 0) return tmp_ret_code;
+  if ((tmp_ret_code = read_file_insts(args.program_file, &insts, &insts_count)) != 0)
+    return tmp_ret_code;
+  if ((tmp_ret_code = program_create(insts, insts_count, &program)) != 0) {
+    free(insts);
+    return tmp_ret_code;
+  }
+
+  if ((tmp_ret_code = read_file_sized(args.trace_file, &trace_bytes, &trace_size)) != 0) {
+    program_release(program);
+    return tmp_ret_code;
+  }
+
+  tmp_ret_code = decode_trace(trace_bytes, trace_size, program, &trace);
+  free(trace_bytes);
+  if (tmp_ret_code != 0) {
+    program_release(program);
+    return tmp_ret_code;
+  }
+
+  if (args.guest_input_file) tmp_ret_code = input_map_file(args.guest_input_file, &input);
+
+  if (tmp_ret_code == RET_CODE_OK && args.print_path) print_path(&trace);
+  if (tmp_ret_code == RET_CODE_OK && args.print_blocks)
+    tmp_ret_code = print_blocks(&trace, insts, insts_count);
+  if (tmp_ret_code == RET_CODE_OK && args.replay) tmp_ret_code = replay(&trace, program, input);
+
+  input_unmap(&input);
+  free_trace(&trace);
+  program_release(program);
+  return tmp_ret_code;
+}